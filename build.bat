@@ -1 +1,2 @@
 cl /EHsc /Ox /openmp /Igetopt shiv.cpp clipper.cpp getopt/getopt.c
+if "%1"=="bench" cl /EHsc /Ox /openmp /Igetopt /Feshiv-bench.exe shiv_bench.cpp clipper.cpp getopt/getopt.c
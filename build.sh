@@ -10,5 +10,8 @@ CXXFLAGS="-O2 -std=gnu++11 -Wall -Wextra -fopenmp -flto $CXXFLAGS"
 LDFLAGS="-lm $LDFLAGS"
 
 $CXX -o shiv $CXXFLAGS $LDFLAGS $CPPFLAGS shiv.cpp clipper.cpp || fail $?
+if [ "$1" = "bench" ]; then
+	$CXX -o shiv-bench $CXXFLAGS $LDFLAGS $CPPFLAGS shiv_bench.cpp clipper.cpp || fail $?
+fi
 
 echo ">> Build successful"
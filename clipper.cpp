@@ -47,6 +47,8 @@
 #include <cstdlib>
 #include <ostream>
 #include <functional>
+#include <new>
+#include <atomic>
 
 namespace ClipperLib {
 
@@ -59,6 +61,9 @@ enum Direction { dRightToLeft, dLeftToRight };
 static int const Unassigned = -1;  //edge not currently 'owning' a solution
 static int const Skip = -2;        //edge that would otherwise close a path
 
+static std::atomic<unsigned long long> ClipperExecutes(0);
+static std::atomic<unsigned long long> OffsetExecutes(0);
+
 #define HORIZONTAL (-1.0E+40)
 #define TOLERANCE (1.0e-20)
 #define NEAR_ZERO(val) (((val) > -TOLERANCE) && ((val) < TOLERANCE))
@@ -130,6 +135,132 @@ struct LocMinSorter
   }
 };
 
+//------------------------------------------------------------------------------
+// MemoryArena methods ...
+//------------------------------------------------------------------------------
+
+static size_t const ArenaAlign = 16;
+static size_t const ArenaBlockSize = 64 * 1024;
+static int const ArenaMaxCachedBlocks = 32; //per thread
+
+struct ArenaBlock {
+  ArenaBlock *Next;
+  size_t      Size;
+};
+
+static size_t const ArenaHeaderSize =
+  (sizeof(ArenaBlock) + ArenaAlign - 1) & ~(ArenaAlign - 1);
+
+class ArenaBlockCache
+{
+public:
+  ArenaBlockCache(): m_Head(0), m_Count(0) {}
+  ~ArenaBlockCache()
+  {
+    while (m_Head)
+    {
+      ArenaBlock *b = m_Head;
+      m_Head = b->Next;
+      std::free(b);
+    }
+  }
+  ArenaBlock* Get()
+  {
+    if (m_Head)
+    {
+      ArenaBlock *b = m_Head;
+      m_Head = b->Next;
+      --m_Count;
+      return b;
+    }
+    return NewBlock(ArenaBlockSize);
+  }
+  void Put(ArenaBlock *b)
+  {
+    if (b->Size != ArenaBlockSize || m_Count >= ArenaMaxCachedBlocks)
+    {
+      std::free(b);
+      return;
+    }
+    b->Next = m_Head;
+    m_Head = b;
+    ++m_Count;
+  }
+  static ArenaBlock* NewBlock(size_t size)
+  {
+    ArenaBlock *b = static_cast<ArenaBlock*>(std::malloc(size));
+    if (!b) throw std::bad_alloc();
+    b->Size = size;
+    return b;
+  }
+private:
+  ArenaBlock *m_Head;
+  int         m_Count;
+};
+
+static thread_local ArenaBlockCache arenaBlockCache;
+//------------------------------------------------------------------------------
+
+void* MemoryArena::Alloc(size_t size)
+{
+  size = (size + ArenaAlign - 1) & ~(ArenaAlign - 1);
+  if (size > (size_t)(m_End - m_Pos))
+  {
+    if (size > ArenaBlockSize - ArenaHeaderSize)
+    {
+      //oversized requests get a block of their own. It goes in behind the
+      //current block so that the rest of the current block can still be used.
+      ArenaBlock *b = ArenaBlockCache::NewBlock(ArenaHeaderSize + size);
+      if (m_Blocks)
+      {
+        b->Next = m_Blocks->Next;
+        m_Blocks->Next = b;
+      }
+      else
+      {
+        b->Next = 0;
+        m_Blocks = b;
+      }
+      return reinterpret_cast<char*>(b) + ArenaHeaderSize;
+    }
+    ArenaBlock *b = arenaBlockCache.Get();
+    b->Next = m_Blocks;
+    m_Blocks = b;
+    m_Pos = reinterpret_cast<char*>(b) + ArenaHeaderSize;
+    m_End = reinterpret_cast<char*>(b) + b->Size;
+  }
+  void *result = m_Pos;
+  m_Pos += size;
+  return result;
+}
+//------------------------------------------------------------------------------
+
+void MemoryArena::Reset()
+{
+  while (m_Blocks)
+  {
+    ArenaBlock *b = m_Blocks;
+    m_Blocks = b->Next;
+    arenaBlockCache.Put(b);
+  }
+  m_Pos = m_End = 0;
+}
+//------------------------------------------------------------------------------
+
+template <typename T>
+inline T* ArenaNew(MemoryArena &arena)
+{
+  return new (arena.Alloc(sizeof(T))) T;
+}
+//------------------------------------------------------------------------------
+
+template <typename T>
+inline T* ArenaNewArray(MemoryArena &arena, size_t n)
+{
+  T *result = static_cast<T*>(arena.Alloc(n * sizeof(T)));
+  for (size_t i = 0; i < n; ++i) new (&result[i]) T;
+  return result;
+}
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 
@@ -388,6 +519,18 @@ bool Orientation(const Path &poly)
 }
 //------------------------------------------------------------------------------
 
+unsigned long long ClipperExecuteCount()
+{
+  return ClipperExecutes.load(std::memory_order_relaxed);
+}
+//------------------------------------------------------------------------------
+
+unsigned long long OffsetExecuteCount()
+{
+  return OffsetExecutes.load(std::memory_order_relaxed);
+}
+//------------------------------------------------------------------------------
+
 double Area(const Path &poly)
 {
   int size = (int)poly.size();
@@ -703,19 +846,6 @@ void ReversePolyPtLinks(OutPt *pp)
 }
 //------------------------------------------------------------------------------
 
-void DisposeOutPts(OutPt*& pp)
-{
-  if (pp == 0) return;
-    pp->Prev->Next = 0;
-  while( pp )
-  {
-    OutPt *tmpPp = pp;
-    pp = pp->Next;
-    delete tmpPp;
-  }
-}
-//------------------------------------------------------------------------------
-
 inline void InitEdge(TEdge* e, TEdge* eNext, TEdge* ePrev, const IntPoint& Pt)
 {
   std::memset(e, 0, sizeof(TEdge));
@@ -1057,28 +1187,21 @@ bool ClipperBase::AddPath(const Path &pg, PolyType PolyTyp, bool Closed)
   while (highI > 0 && (pg[highI] == pg[highI -1])) --highI;
   if ((Closed && highI < 2) || (!Closed && highI < 1)) return false;
 
-  //create a new edge array ...
-  TEdge *edges = new TEdge [highI +1];
+  //create a new edge array. It lives in m_EdgeArena until Clear(), even if
+  //the path is rejected below ...
+  TEdge *edges = ArenaNewArray<TEdge>(m_EdgeArena, highI +1);
 
   bool IsFlat = true;
   //1. Basic (first) edge initialization ...
-  try
-  {
-    edges[1].Curr = pg[1];
-    RangeTest(pg[0], m_UseFullRange);
-    RangeTest(pg[highI], m_UseFullRange);
-    InitEdge(&edges[0], &edges[1], &edges[highI], pg[0]);
-    InitEdge(&edges[highI], &edges[0], &edges[highI-1], pg[highI]);
-    for (int i = highI - 1; i >= 1; --i)
-    {
-      RangeTest(pg[i], m_UseFullRange);
-      InitEdge(&edges[i], &edges[i+1], &edges[i-1], pg[i]);
-    }
-  }
-  catch(...)
-  {
-    delete [] edges;
-    throw; //range test fails
+  edges[1].Curr = pg[1];
+  RangeTest(pg[0], m_UseFullRange);
+  RangeTest(pg[highI], m_UseFullRange);
+  InitEdge(&edges[0], &edges[1], &edges[highI], pg[0]);
+  InitEdge(&edges[highI], &edges[0], &edges[highI-1], pg[highI]);
+  for (int i = highI - 1; i >= 1; --i)
+  {
+    RangeTest(pg[i], m_UseFullRange);
+    InitEdge(&edges[i], &edges[i+1], &edges[i-1], pg[i]);
   }
   TEdge *eStart = &edges[0];
 
@@ -1117,10 +1240,7 @@ bool ClipperBase::AddPath(const Path &pg, PolyType PolyTyp, bool Closed)
   }
 
   if ((!Closed && (E == E->Next)) || (Closed && (E->Prev == E->Next)))
-  {
-    delete [] edges;
     return false;
-  }
 
   if (!Closed)
   { 
@@ -1144,11 +1264,7 @@ bool ClipperBase::AddPath(const Path &pg, PolyType PolyTyp, bool Closed)
   //to LocalMinima list to avoid endless loops etc ...
   if (IsFlat) 
   {
-    if (Closed) 
-    {
-      delete [] edges;
-      return false;
-    }
+    if (Closed) return false;
     E->Prev->OutIdx = Skip;
     MinimaList::value_type locMin;
     locMin.Y = E->Bot.Y;
@@ -1164,11 +1280,9 @@ bool ClipperBase::AddPath(const Path &pg, PolyType PolyTyp, bool Closed)
       E = E->Next;
     }
     m_MinimaList.push_back(locMin);
-    m_edges.push_back(edges);
 	  return true;
   }
 
-  m_edges.push_back(edges);
   bool leftBoundIsForward;
   TEdge* EMin = 0;
 
@@ -1233,12 +1347,7 @@ bool ClipperBase::AddPaths(const Paths &ppg, PolyType PolyTyp, bool Closed)
 void ClipperBase::Clear()
 {
   DisposeLocalMinimaList();
-  for (EdgeList::size_type i = 0; i < m_edges.size(); ++i)
-  {
-    TEdge* edges = m_edges[i];
-    delete [] edges;
-  }
-  m_edges.clear();
+  m_EdgeArena.Reset();
   m_UseFullRange = false;
   m_HasOpenPaths = false;
 }
@@ -1349,18 +1458,9 @@ bool ClipperBase::PopScanbeam(cInt &Y)
 //------------------------------------------------------------------------------
 
 void ClipperBase::DisposeAllOutRecs(){
-  for (PolyOutList::size_type i = 0; i < m_PolyOuts.size(); ++i)
-    DisposeOutRec(i);
+  //OutRecs, OutPts, Joins and IntersectNodes all live in m_OutArena ...
   m_PolyOuts.clear();
-}
-//------------------------------------------------------------------------------
-
-void ClipperBase::DisposeOutRec(PolyOutList::size_type index)
-{
-  OutRec *outRec = m_PolyOuts[index];
-  if (outRec->Pts) DisposeOutPts(outRec->Pts);
-  delete outRec;
-  m_PolyOuts[index] = 0;
+  m_OutArena.Reset();
 }
 //------------------------------------------------------------------------------
 
@@ -1379,7 +1479,7 @@ void ClipperBase::DeleteFromAEL(TEdge *e)
 
 OutRec* ClipperBase::CreateOutRec()
 {
-  OutRec* result = new OutRec;
+  OutRec* result = ArenaNew<OutRec>(m_OutArena);
   result->IsHole = false;
   result->IsOpen = false;
   result->FirstLeft = 0;
@@ -1560,6 +1660,7 @@ void Clipper::FixHoleLinkage(OutRec &outrec)
 bool Clipper::ExecuteInternal()
 {
   bool succeeded = true;
+  ClipperExecutes.fetch_add(1, std::memory_order_relaxed);
   try {
     Reset();
     m_Maxima = MaximaList();
@@ -1941,7 +2042,7 @@ void Clipper::CopyAELToSEL()
 
 void Clipper::AddJoin(OutPt *op1, OutPt *op2, const IntPoint OffPt)
 {
-  Join* j = new Join;
+  Join* j = ArenaNew<Join>(m_OutArena);
   j->OutPt1 = op1;
   j->OutPt2 = op2;
   j->OffPt = OffPt;
@@ -1951,23 +2052,19 @@ void Clipper::AddJoin(OutPt *op1, OutPt *op2, const IntPoint OffPt)
 
 void Clipper::ClearJoins()
 {
-  for (JoinList::size_type i = 0; i < m_Joins.size(); i++)
-    delete m_Joins[i];
   m_Joins.resize(0);
 }
 //------------------------------------------------------------------------------
 
 void Clipper::ClearGhostJoins()
 {
-  for (JoinList::size_type i = 0; i < m_GhostJoins.size(); i++)
-    delete m_GhostJoins[i];
   m_GhostJoins.resize(0);
 }
 //------------------------------------------------------------------------------
 
 void Clipper::AddGhostJoin(OutPt *op, const IntPoint OffPt)
 {
-  Join* j = new Join;
+  Join* j = ArenaNew<Join>(m_OutArena);
   j->OutPt1 = op;
   j->OutPt2 = 0;
   j->OffPt = OffPt;
@@ -2466,7 +2563,7 @@ OutPt* Clipper::AddOutPt(TEdge *e, const IntPoint &pt)
   {
     OutRec *outRec = CreateOutRec();
     outRec->IsOpen = (e->WindDelta == 0);
-    OutPt* newOp = new OutPt;
+    OutPt* newOp = ArenaNew<OutPt>(m_OutArena);
     outRec->Pts = newOp;
     newOp->Idx = outRec->Idx;
     newOp->Pt = pt;
@@ -2486,7 +2583,7 @@ OutPt* Clipper::AddOutPt(TEdge *e, const IntPoint &pt)
 	if (ToFront && (pt == op->Pt)) return op;
     else if (!ToFront && (pt == op->Prev->Pt)) return op->Prev;
 
-    OutPt* newOp = new OutPt;
+    OutPt* newOp = ArenaNew<OutPt>(m_OutArena);
     newOp->Idx = outRec->Idx;
     newOp->Pt = pt;
     newOp->Next = op;
@@ -2847,8 +2944,6 @@ bool Clipper::ProcessIntersections(const cInt topY)
 
 void Clipper::DisposeIntersectNodes()
 {
-  for (size_t i = 0; i < m_IntersectList.size(); ++i )
-    delete m_IntersectList[i];
   m_IntersectList.clear();
 }
 //------------------------------------------------------------------------------
@@ -2882,7 +2977,7 @@ void Clipper::BuildIntersectList(const cInt topY)
       {
         IntersectPoint(*e, *eNext, Pt);
         if (Pt.Y < topY) Pt = IntPoint(TopX(*e, topY), topY);
-        IntersectNode * newNode = new IntersectNode;
+        IntersectNode * newNode = ArenaNew<IntersectNode>(m_OutArena);
         newNode->Edge1 = e;
         newNode->Edge2 = eNext;
         newNode->Pt = Pt;
@@ -2912,7 +3007,6 @@ void Clipper::ProcessIntersectList()
       IntersectEdges( iNode->Edge1, iNode->Edge2, iNode->Pt);
       SwapPositionsInAEL( iNode->Edge1 , iNode->Edge2 );
     }
-    delete iNode;
   }
   m_IntersectList.clear();
 }
@@ -3126,14 +3220,12 @@ void Clipper::FixupOutPolyline(OutRec &outrec)
       OutPt *tmpPP = pp->Prev;
       tmpPP->Next = pp->Next;
       pp->Next->Prev = tmpPP;
-      delete pp;
       pp = tmpPP;
     }
   }
 
   if (pp == pp->Prev)
   {
-    DisposeOutPts(pp);
     outrec.Pts = 0;
     return;
   }
@@ -3153,7 +3245,6 @@ void Clipper::FixupOutPolygon(OutRec &outrec)
     {
         if (pp->Prev == pp || pp->Prev == pp->Next)
         {
-            DisposeOutPts(pp);
             outrec.Pts = 0;
             return;
         }
@@ -3164,11 +3255,9 @@ void Clipper::FixupOutPolygon(OutRec &outrec)
             (!preserveCol || !Pt2IsBetweenPt1AndPt3(pp->Prev->Pt, pp->Pt, pp->Next->Pt))))
         {
             lastOK = 0;
-            OutPt *tmp = pp;
             pp->Prev->Next = pp->Next;
             pp->Next->Prev = pp->Prev;
             pp = pp->Prev;
-            delete tmp;
         }
         else if (pp == lastOK) break;
         else
@@ -3345,9 +3434,9 @@ void Clipper::InsertEdgeIntoAEL(TEdge *edge, TEdge* startEdge)
 }
 //----------------------------------------------------------------------
 
-OutPt* DupOutPt(OutPt* outPt, bool InsertAfter)
+OutPt* DupOutPt(OutPt* outPt, bool InsertAfter, MemoryArena &arena)
 {
-  OutPt* result = new OutPt;
+  OutPt* result = ArenaNew<OutPt>(arena);
   result->Pt = outPt->Pt;
   result->Idx = outPt->Idx;
   if (InsertAfter)
@@ -3369,7 +3458,7 @@ OutPt* DupOutPt(OutPt* outPt, bool InsertAfter)
 //------------------------------------------------------------------------------
 
 bool JoinHorz(OutPt* op1, OutPt* op1b, OutPt* op2, OutPt* op2b,
-  const IntPoint Pt, bool DiscardLeft)
+  const IntPoint Pt, bool DiscardLeft, MemoryArena &arena)
 {
   Direction Dir1 = (op1->Pt.X > op1b->Pt.X ? dRightToLeft : dLeftToRight);
   Direction Dir2 = (op2->Pt.X > op2b->Pt.X ? dRightToLeft : dLeftToRight);
@@ -3386,12 +3475,12 @@ bool JoinHorz(OutPt* op1, OutPt* op1b, OutPt* op2, OutPt* op2b,
       op1->Next->Pt.X >= op1->Pt.X && op1->Next->Pt.Y == Pt.Y)  
         op1 = op1->Next;
     if (DiscardLeft && (op1->Pt.X != Pt.X)) op1 = op1->Next;
-    op1b = DupOutPt(op1, !DiscardLeft);
+    op1b = DupOutPt(op1, !DiscardLeft, arena);
     if (op1b->Pt != Pt) 
     {
       op1 = op1b;
       op1->Pt = Pt;
-      op1b = DupOutPt(op1, !DiscardLeft);
+      op1b = DupOutPt(op1, !DiscardLeft, arena);
     }
   } 
   else
@@ -3400,12 +3489,12 @@ bool JoinHorz(OutPt* op1, OutPt* op1b, OutPt* op2, OutPt* op2b,
       op1->Next->Pt.X <= op1->Pt.X && op1->Next->Pt.Y == Pt.Y) 
         op1 = op1->Next;
     if (!DiscardLeft && (op1->Pt.X != Pt.X)) op1 = op1->Next;
-    op1b = DupOutPt(op1, DiscardLeft);
+    op1b = DupOutPt(op1, DiscardLeft, arena);
     if (op1b->Pt != Pt)
     {
       op1 = op1b;
       op1->Pt = Pt;
-      op1b = DupOutPt(op1, DiscardLeft);
+      op1b = DupOutPt(op1, DiscardLeft, arena);
     }
   }
 
@@ -3415,12 +3504,12 @@ bool JoinHorz(OutPt* op1, OutPt* op1b, OutPt* op2, OutPt* op2b,
       op2->Next->Pt.X >= op2->Pt.X && op2->Next->Pt.Y == Pt.Y)
         op2 = op2->Next;
     if (DiscardLeft && (op2->Pt.X != Pt.X)) op2 = op2->Next;
-    op2b = DupOutPt(op2, !DiscardLeft);
+    op2b = DupOutPt(op2, !DiscardLeft, arena);
     if (op2b->Pt != Pt)
     {
       op2 = op2b;
       op2->Pt = Pt;
-      op2b = DupOutPt(op2, !DiscardLeft);
+      op2b = DupOutPt(op2, !DiscardLeft, arena);
     };
   } else
   {
@@ -3428,12 +3517,12 @@ bool JoinHorz(OutPt* op1, OutPt* op1b, OutPt* op2, OutPt* op2b,
       op2->Next->Pt.X <= op2->Pt.X && op2->Next->Pt.Y == Pt.Y) 
         op2 = op2->Next;
     if (!DiscardLeft && (op2->Pt.X != Pt.X)) op2 = op2->Next;
-    op2b = DupOutPt(op2, DiscardLeft);
+    op2b = DupOutPt(op2, DiscardLeft, arena);
     if (op2b->Pt != Pt)
     {
       op2 = op2b;
       op2->Pt = Pt;
-      op2b = DupOutPt(op2, DiscardLeft);
+      op2b = DupOutPt(op2, DiscardLeft, arena);
     };
   };
 
@@ -3485,8 +3574,8 @@ bool Clipper::JoinPoints(Join *j, OutRec* outRec1, OutRec* outRec2)
     if (reverse1 == reverse2) return false;
     if (reverse1)
     {
-      op1b = DupOutPt(op1, false);
-      op2b = DupOutPt(op2, true);
+      op1b = DupOutPt(op1, false, m_OutArena);
+      op2b = DupOutPt(op2, true, m_OutArena);
       op1->Prev = op2;
       op2->Next = op1;
       op1b->Next = op2b;
@@ -3496,8 +3585,8 @@ bool Clipper::JoinPoints(Join *j, OutRec* outRec1, OutRec* outRec2)
       return true;
     } else
     {
-      op1b = DupOutPt(op1, true);
-      op2b = DupOutPt(op2, false);
+      op1b = DupOutPt(op1, true, m_OutArena);
+      op2b = DupOutPt(op2, false, m_OutArena);
       op1->Next = op2;
       op2->Prev = op1;
       op1b->Prev = op2b;
@@ -3553,7 +3642,7 @@ bool Clipper::JoinPoints(Join *j, OutRec* outRec1, OutRec* outRec2)
       Pt = op2b->Pt; DiscardLeftSide = (op2b->Pt.X > op2->Pt.X);
     }
     j->OutPt1 = op1; j->OutPt2 = op2;
-    return JoinHorz(op1, op1b, op2, op2b, Pt, DiscardLeftSide);
+    return JoinHorz(op1, op1b, op2, op2b, Pt, DiscardLeftSide, m_OutArena);
   } else
   {
     //nb: For non-horizontal joins ...
@@ -3589,8 +3678,8 @@ bool Clipper::JoinPoints(Join *j, OutRec* outRec1, OutRec* outRec2)
 
     if (Reverse1)
     {
-      op1b = DupOutPt(op1, false);
-      op2b = DupOutPt(op2, true);
+      op1b = DupOutPt(op1, false, m_OutArena);
+      op2b = DupOutPt(op2, true, m_OutArena);
       op1->Prev = op2;
       op2->Next = op1;
       op1b->Next = op2b;
@@ -3600,8 +3689,8 @@ bool Clipper::JoinPoints(Join *j, OutRec* outRec1, OutRec* outRec2)
       return true;
     } else
     {
-      op1b = DupOutPt(op1, true);
-      op2b = DupOutPt(op2, false);
+      op1b = DupOutPt(op1, true, m_OutArena);
+      op2b = DupOutPt(op2, false, m_OutArena);
       op1->Next = op2;
       op2->Prev = op1;
       op1b->Prev = op2b;
@@ -3957,6 +4046,7 @@ void ClipperOffset::Execute(PolyTree& solution, double delta)
 
 void ClipperOffset::DoOffset(double delta)
 {
+  OffsetExecutes.fetch_add(1, std::memory_order_relaxed);
   m_destPolys.clear();
   m_delta = delta;
 
@@ -174,6 +174,11 @@ bool Orientation(const Path &poly);
 double Area(const Path &poly);
 int PointInPolygon(const IntPoint &pt, const Path &path);
 
+//Number of clipping and offsetting operations run so far by all threads
+//(including the ones run internally by offsets and simplification)
+unsigned long long ClipperExecuteCount();
+unsigned long long OffsetExecuteCount();
+
 void SimplifyPolygon(const Path &in_poly, Paths &out_polys, PolyFillType fillType = pftEvenOdd);
 void SimplifyPolygons(const Paths &in_polys, Paths &out_polys, PolyFillType fillType = pftEvenOdd);
 void SimplifyPolygons(Paths &polys, PolyFillType fillType = pftEvenOdd);
@@ -206,14 +211,34 @@ struct LocalMinimum;
 struct OutPt;
 struct OutRec;
 struct Join;
+struct ArenaBlock;
 
 typedef std::vector < OutRec* > PolyOutList;
-typedef std::vector < TEdge* > EdgeList;
 typedef std::vector < Join* > JoinList;
 typedef std::vector < IntersectNode* > IntersectList;
 
 //------------------------------------------------------------------------------
 
+//MemoryArena: a bump allocator for the internal nodes (TEdge, OutRec, OutPt,
+//Join and IntersectNode) of a Clipper object. Nodes are never freed one at a
+//time; the whole arena is released by Reset(). Blocks are recycled through a
+//per-thread cache, so threads don't contend for the heap.
+class MemoryArena
+{
+public:
+  MemoryArena(): m_Blocks(0), m_Pos(0), m_End(0) {};
+  ~MemoryArena() { Reset(); };
+  void* Alloc(size_t size);
+  void Reset();
+private:
+  ArenaBlock *m_Blocks;
+  char       *m_Pos;
+  char       *m_End;
+  MemoryArena(const MemoryArena&);
+  MemoryArena& operator =(const MemoryArena&);
+};
+//------------------------------------------------------------------------------
+
 //ClipperBase is the ancestor to the Clipper class. It should not be
 //instantiated directly. This class simply abstracts the conversion of sets of
 //polygon coordinates into edge objects that are stored in a LocalMinima list.
@@ -239,7 +264,6 @@ protected:
   bool PopLocalMinima(cInt Y, const LocalMinimum *&locMin);
   OutRec* CreateOutRec();
   void DisposeAllOutRecs();
-  void DisposeOutRec(PolyOutList::size_type index);
   void SwapPositionsInAEL(TEdge *edge1, TEdge *edge2);
   void DeleteFromAEL(TEdge *e);
   void UpdateEdgeIntoAEL(TEdge *&e);
@@ -249,11 +273,12 @@ protected:
   MinimaList           m_MinimaList;
 
   bool              m_UseFullRange;
-  EdgeList          m_edges;
   bool              m_PreserveCollinear;
   bool              m_HasOpenPaths;
   PolyOutList       m_PolyOuts;
   TEdge           *m_ActiveEdges;
+  MemoryArena       m_EdgeArena; //edges, released by Clear()
+  MemoryArena       m_OutArena;  //output nodes, released after each Execute()
 
   typedef std::priority_queue<cInt> ScanbeamList;
   ScanbeamList     m_Scanbeam;
@@ -22,12 +22,27 @@
 #include <cmath>
 #include <climits>
 #include <limits>
+#include <type_traits>
 #include <chrono>
+#include <ctime>
 #include <algorithm>
 #include <iostream>
-#include <sstream>
-#include <iomanip>
+#include <string>
+#include <queue>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <getopt.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -54,7 +69,7 @@ typedef double fl_t;
 #define CINT_TO_FL_T(x) (((fl_t) (x)) / config.scale_constant)
 #define FL_T_TO_INTPOINT(x, y)  ClipperLib::IntPoint(FL_T_TO_CINT(x), FL_T_TO_CINT(y))
 #define INTPOINT_TO_FL_T(point) CINT_TO_FL_T((point).X), CINT_TO_FL_T((point).Y)
-#define FREE_VECTOR(v) decltype(v)().swap(v)  /* Force memory used by vector to be freed */
+#define FREE_VECTOR(v) std::remove_reference<decltype(v)>::type().swap(v)  /* Force memory used by vector to be freed */
 
 #if SHIV_DEBUG
 #define DEBUG(...) fprintf(stderr, "DEBUG: " __VA_ARGS__)
@@ -64,17 +79,20 @@ typedef double fl_t;
 
 static const char e_nomem[] = "fatal: No memory\n";
 static const char usage_string[] =
-	"usage: shiv [-hp] [-o output_path] [-c config_path] [-S setting=value]\n"
-	"            [-l layer_height] [-w extrusion_width] [-t tolerance]\n"
-	"            [-s scale_factor] [-d infill_density] [-n shells]\n"
-	"            [-r roof_thickness] [-f floor_thickness] [-b brim_width]\n"
-	"            [-C coarseness] [-x x_translate] [-y y_translate]\n"
-	"            [-z z_chop] binary_stl_file\n"
+	"usage: shiv [-hp] [-o output_path] [-j stats_path] [-c config_path]\n"
+	"            [-S setting=value] [-l layer_height] [-w extrusion_width]\n"
+	"            [-t tolerance] [-s scale_factor] [-d infill_density]\n"
+	"            [-n shells] [-r roof_thickness] [-f floor_thickness]\n"
+	"            [-b brim_width] [-C coarseness] [-x x_translate]\n"
+	"            [-y y_translate] [-z z_chop] binary_stl_file\n"
+	"       shiv -M -o output_path partial_output...\n"
 	"\n"
 	"flags:\n"
 	"  -h                    show this help\n"
 	"  -p                    print configuration\n"
+	"  -M                    merge partial outputs (see start_layer and end_layer)\n"
 	"  -o output_path        output gcode path\n"
+	"  -j stats_path         write a JSON performance report to stats_path\n"
 	"  -c config_path        configuration file path\n"
 	"  -S setting=value      set setting to value\n"
 	"  -l layer_height       layer height\n"
@@ -107,6 +125,10 @@ struct at_layer_gcode {
 	char *value;
 };
 
+struct copy_offset {
+	fl_t x, y;
+};
+
 /* default config */
 #define DEFAULT_COOL_ON_STR  "M106 S{cool_value}"
 #define DEFAULT_COOL_OFF_STR "M107"
@@ -182,6 +204,7 @@ static struct {
 	fl_t edge_overlap             = 0.5;        /* Allowable edge path overlap in units of extrusion_width */
 	bool comb                     = true;       /* Avoid crossing boundaries */
 	bool strict_shell_order       = false;      /* Always do insets in order within an island */
+	bool optimize_island_order    = false;      /* Plan each layer's islands in the order of a travel tour over the island centers, improved with 2-opt and Or-opt moves. If false, the nearest remaining island is always planned next. */
 	bool align_seams              = true;       /* Align seams to the lower left corner */
 	bool align_interior_seams     = true;       /* Align interior seams to the lower left corner if 'align_seams' is also true. If false, only exterior seams are aligned. */
 	bool simplify_insets          = true;       /* Do simplify_path() operation on all insets (only the initial outline is simplified if this is false) */
@@ -191,6 +214,7 @@ static struct {
 	bool outside_first            = false;      /* Prefer exterior shells */
 	bool iron_top_surface         = false;      /* Run the nozzle over exposed top surfaces a second time */
 	bool separate_z_travel        = false;      /* Generate a separate z travel move instead of moving all axes together */
+	fl_t arc_fit_tolerance        = 0.0;        /* Replace runs of extrusion moves that lie within this distance of a circular arc with G2/G3 moves. Set to zero to disable. */
 	bool preserve_layer_offset    = false;      /* Preserve layer offset when placing the object on the build plate. Useful for certain multi-part prints. */
 	bool combine_all              = false;      /* Orients all outlines counter-clockwise. This can be used to fix certain broken models, but it also fills holes. */
 	ClipperLib::PolyFillType poly_fill_type = ClipperLib::pftNonZero;  /* Set poly fill type for union. Sometimes ClipperLib::pftEvenOdd is useful for broken models with self-intersections and/or incorrect normals. */
@@ -201,6 +225,7 @@ static struct {
 	fl_t fill_threshold           = 0.25;       /* Infill and inset gap fill is removed when it would be narrower than 'extrusion_width' * 'fill_threshold' */
 	fl_t infill_smooth_threshold  = 2.0;        /* Solid infill lines are converted to a smooth curve when the region being filled is narrower than 'extrusion_width' * 'infill_smooth_threshold' */
 	fl_t min_sparse_infill_len    = 1.0;        /* Minimum length for sparse infill lines */
+	bool connect_sparse_infill    = false;      /* Connect sparse infill lines by extruding along the infill boundary between them instead of traveling */
 	fl_t infill_overlap           = 0.05;       /* Overlap between infill and shells in units of 'extrusion_width' */
 	fl_t iron_flow_multiplier     = 0.1;        /* Flow adjustment (relative to normal flow) for top surface ironing */
 	fl_t iron_density             = 2.0;        /* Density of passes for top surface ironing */
@@ -221,6 +246,10 @@ static struct {
 	fl_t support_flow_mult        = 0.75;       /* Flow rate is multiplied by this value for the support structure. Smaller values will generate a weaker support structure, but it will be easier to remove. The default works well for PLA, but should be increased for materials that have trouble bridging (like PETG). */
 	fl_t min_layer_time           = 8.0;        /* Slow down if the estimated layer time is less than this value */
 	fl_t min_feed_rate            = 10.0;
+	fl_t acceleration             = 0.0;        /* Printer acceleration (in units/s^2) used to estimate layer and print times. Set to zero to estimate at the programmed feed rates. */
+	fl_t jerk                     = 10.0;       /* Largest instant change in speed (in units/s) at a corner, used with 'acceleration' */
+	fl_t max_z_feed_rate          = 0.0;        /* Z axis speed limit used with 'acceleration'. Zero means no limit. */
+	fl_t max_e_feed_rate          = 0.0;        /* Extruder speed limit used with 'acceleration'. Zero means no limit. */
 	fl_t brim_width               = 0.0;
 	int brim_lines;
 	fl_t brim_adhesion_factor     = 0.5;        /* How stuck to the object the brim is. 0 is just touching and 1 is packed as tightly as normal shells. */
@@ -234,9 +263,15 @@ static struct {
 	int raft_interface_layers     = 1;          /* Number of solid interface layers. */
 	fl_t material_density         = 0.00125;    /* Material density in <arbitrary mass unit> / <input/output unit>^3. The default is correct for PLA and millimeter input/output units */
 	fl_t material_cost            = 0.01499;    /* Material cost in <arbitrary currency> / <arbitrary mass unit>. The arbitrary mass unit must be the same as used in material_density */
+	fl_t memory_budget            = 0.0;        /* Approximate memory budget (in MiB) for slicing. If non-zero, the object is sliced and written in bands of layers so that memory use does not grow with its height. The mesh and the regions that need support are held for the whole object and are not counted. */
+	int copies                    = 1;          /* Number of copies to print. The object is sliced once and each layer is placed once per copy during planning. */
+	fl_t copy_spacing             = 5.0;        /* Gap between the footprints (including brim, raft and support) of adjacent copies when they are arranged automatically */
+	int start_layer               = 0;          /* First layer to write. Other layers are only sliced as far as the written layers depend on them. */
+	int end_layer                 = -1;         /* Layer after the last layer to write, or -1 for the top of the object. Setting either option writes a partial output for merging with -M. */
 
 	std::vector<struct user_var> user_vars;     /* User-set variables */
 	std::vector<struct at_layer_gcode> at_layer;
+	std::vector<struct copy_offset> copy_offsets;  /* Explicit copy positions relative to the object. Overrides 'copies'. */
 
 	/* internal stuff */
 	fl_t xy_extra                 = 0.0;        /* Extra xy size (brim, raft, extra_offset, support_xy_expansion, etc...). */
@@ -342,6 +377,7 @@ static const struct setting settings[] = {
 	SETTING(edge_overlap,              SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       1.0      } }, true,  true),
 	SETTING(comb,                      SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(strict_shell_order,        SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
+	SETTING(optimize_island_order,     SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(align_seams,               SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(align_interior_seams,      SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(simplify_insets,           SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
@@ -351,6 +387,7 @@ static const struct setting settings[] = {
 	SETTING(outside_first,             SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(iron_top_surface,          SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(separate_z_travel,         SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
+	SETTING(arc_fit_tolerance,         SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
 	SETTING(preserve_layer_offset,     SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(combine_all,               SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(poly_fill_type,            SETTING_TYPE_POLY_FILL_TYPE, false, false, { .i = { 0,         0        } }, false, false),
@@ -361,6 +398,7 @@ static const struct setting settings[] = {
 	SETTING(fill_threshold,            SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
 	SETTING(infill_smooth_threshold,   SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       4.0      } }, true,  true),
 	SETTING(min_sparse_infill_len,     SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(connect_sparse_infill,     SETTING_TYPE_BOOL,           false, false, { .i = { 0,         0        } }, false, false),
 	SETTING(infill_overlap,            SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       0.5      } }, true,  true),
 	SETTING(iron_flow_multiplier,      SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       1.0      } }, true,  true),
 	SETTING(iron_density,              SETTING_TYPE_FL_T,           false, false, { .f = { 1.0,       FL_T_INF } }, true,  false),
@@ -381,6 +419,10 @@ static const struct setting settings[] = {
 	SETTING(support_flow_mult,         SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       1.0      } }, false, true),
 	SETTING(min_layer_time,            SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
 	SETTING(min_feed_rate,             SETTING_TYPE_FL_T,           false, true,  { .f = { 0.0,       FL_T_INF } }, false, false),
+	SETTING(acceleration,              SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(jerk,                      SETTING_TYPE_FL_T,           false, true,  { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(max_z_feed_rate,           SETTING_TYPE_FL_T,           false, true,  { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(max_e_feed_rate,           SETTING_TYPE_FL_T,           false, true,  { .f = { 0.0,       FL_T_INF } }, true,  false),
 	SETTING(brim_width,                SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
 	SETTING(brim_lines,                SETTING_TYPE_INT,            true,  false, { .i = { 0,         0        } }, false, false),
 	SETTING(brim_adhesion_factor,      SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       1.0      } }, true,  true),
@@ -394,6 +436,11 @@ static const struct setting settings[] = {
 	SETTING(raft_interface_layers,     SETTING_TYPE_INT,            false, false, { .i = { 0,         INT_MAX  } }, true,  true),
 	SETTING(material_density,          SETTING_TYPE_FL_T,           false, false, { .f = { 0,         FL_T_INF } }, true,  false),
 	SETTING(material_cost,             SETTING_TYPE_FL_T,           false, false, { .f = { 0,         FL_T_INF } }, true,  false),
+	SETTING(memory_budget,             SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(copies,                    SETTING_TYPE_INT,            false, false, { .i = { 1,         INT_MAX  } }, true,  true),
+	SETTING(copy_spacing,              SETTING_TYPE_FL_T,           false, false, { .f = { 0.0,       FL_T_INF } }, true,  false),
+	SETTING(start_layer,               SETTING_TYPE_INT,            false, false, { .i = { 0,         INT_MAX  } }, true,  true),
+	SETTING(end_layer,                 SETTING_TYPE_INT,            false, false, { .i = { -1,        INT_MAX  } }, true,  true),
 };
 
 struct vertex {
@@ -401,15 +448,35 @@ struct vertex {
 };
 
 struct triangle {
-	struct vertex v[3];
+	int v[3];  /* Indices into object.v. Edge k runs from v[k] to v[(k + 1) % 3]. */
+};
+
+/* The triangles grouped by the first layer they cross, so the triangles crossing a band of layers can be found
+   without looking at every triangle */
+struct triangle_bins {
+	std::vector<int> t;             /* Triangles in order of the first layer they cross, then by index */
+	std::vector<ssize_t> start;     /* Index in 't' of the first triangle of each layer, plus the end of 't' */
+	std::vector<ssize_t> reach;     /* Lowest first layer of the triangles that cross each layer */
+};
+
+/* Parallel lines at one angle and spacing. Line i is at offset move * i from the origin, so the lines covering
+   any box within the table's range can be taken from it without recomputing the rotation or the offsets. */
+struct line_fill_table {
+	fl_t angle, density;  /* Lookup key */
+	fl_t sin_angle, cos_angle, sin_neg_angle, cos_neg_angle, move;
+	ssize_t start;                   /* Index of the first line in the table */
+	std::vector<fl_t> sin_y, cos_y;  /* sin_angle * y and cos_angle * y for each line */
 };
 
 struct object {
-	ssize_t n, n_slices;
+	ssize_t n, n_v, n_slices;
 	struct vertex c;
 	fl_t h, w, d;
+	struct vertex *v;  /* Welded vertices */
 	struct triangle *t;
+	int *adj;          /* Adjacent half-edge (3 * triangle + edge) across each triangle edge, or -1 if there isn't exactly one */
 	struct slice *slices;
+	struct triangle_bins bins;  /* Built by bin_triangles() when the layers are sliced in bands */
 
 	ClipperLib::Paths solid_infill_patterns[2];
 	std::vector<ClipperLib::Paths> brim;
@@ -417,6 +484,8 @@ struct object {
 	ClipperLib::Paths support_pattern;
 	ClipperLib::Paths support_interface_pattern;
 	ClipperLib::Paths raft_base_layer_pattern;
+	std::vector<struct line_fill_table> infill_tables;  /* Built by generate_infill_patterns() */
+	std::vector<ClipperLib::IntPoint> copies;  /* Offset of each copy, or empty if only the object itself is printed */
 };
 
 struct segment_list {
@@ -426,12 +495,71 @@ struct segment_list {
 struct segment {
 	struct segment *next, *prev;
 	fl_t x[2], y[2];
+	int t;        /* Triangle the segment came from */
+	char e[2];    /* Triangle edge each endpoint lies on */
+};
+
+/* Spatial hash over segment endpoints. Entries are stored as (segment index * 2 + endpoint)
+   and are sorted by segment index within each bucket. */
+struct segment_grid {
+	fl_t inv_cell_size;
+	size_t mask;
+	std::vector<size_t> bucket_start;
+	std::vector<ssize_t> entries;
+};
+
+/* Uniform grid over open two-point paths for nearest line queries. Each line is stored in every cell that it
+   passes through. Lines are removed lazily: dead entries are dropped from a cell the next time it is searched. */
+struct line_grid {
+	ClipperLib::cInt x0, y0, cell_size;
+	ssize_t w, h;
+	std::vector<size_t> cell_start, cell_end;  /* The live entries of cell i are entries[cell_start[i]..cell_end[i]) */
+	std::vector<size_t> entries;
+	std::vector<bool> removed;
 };
 
 struct cint_rect {
 	ClipperLib::cInt x0, y0, x1, y1;
 };
 
+/* Uniform grid over the edges of a set of closed paths for crossing and point in polygon tests. Edge j of path i
+   goes from point j to point j + 1 (wrapping around) and has the id path_start[i] + j. Each edge is stored in every
+   cell that it passes through. Built on first use. */
+struct edge_grid {
+	bool built;
+	ClipperLib::cInt x0, y0, x1, y1, cell_size;
+	ssize_t w, h;
+	std::vector<size_t> cell_start;  /* The edges of cell i are entries[cell_start[i]..cell_start[i + 1]) */
+	std::vector<size_t> entries;
+	std::vector<size_t> path_start;
+	std::vector<bool> orientation;   /* ClipperLib::Orientation() of each path */
+	mutable std::vector<size_t> cells, candidates, visited;  /* Scratch space for queries. visited[e] is the last query that saw edge e. */
+	mutable size_t query;
+};
+
+/* Clip polygon edge for clip_lines(). 'bot' is the endpoint with the larger y coordinate, as in ClipperLib. */
+struct line_clip_edge {
+	ClipperLib::IntPoint p0, p1;  /* Endpoints in path order */
+	ClipperLib::IntPoint bot, top;
+	fl_t dx;
+};
+
+struct line_crossing {
+	size_t line;
+	ClipperLib::cInt t;  /* Position along the line (unnormalized) */
+	ClipperLib::IntPoint p;
+	int wind;
+};
+
+/* Navigation graph for combing. The nodes are the vertices of the comb paths where the free space is reflex, since
+   a shortest path only bends at those. Visibility between nodes is tested during the search (see find_comb_path()). */
+struct comb_graph {
+	bool built;
+	struct edge_grid bound_grid;
+	std::vector<ClipperLib::IntPoint> nodes;
+	std::vector<ClipperLib::IntPoint> node_prev, node_next;  /* Neighbors of each node on its comb path */
+};
+
 struct island {
 	ClipperLib::Paths *insets;
 	ClipperLib::Paths *inset_gaps;
@@ -447,13 +575,26 @@ struct island {
 	ClipperLib::Paths exposed_surface;
 	ClipperLib::Paths constraining_edge; /* Slightly inset from infill_insets. Used to determine whether infill lines should be connected. */
 	ClipperLib::Paths iron_paths;        /* Paths to follow for top surface ironing */
+	mutable struct comb_graph comb_graph;  /* Built from boundaries and comb_paths on first use (a cache, so it may change during planning) */
+	mutable struct edge_grid outer_boundary_grid, exposed_surface_grid;
 	struct cint_rect box;  /* bounding box */
+	size_t outline_hash;   /* Hash of insets[0] as generated by generate_outlines() */
+	ssize_t inset_src_slice, inset_src_island;  /* Island the insets were copied from (this island if they were generated) */
+	std::vector<size_t> seam_rotations;  /* How far align_seams() rotated each path of insets[0] */
+};
+
+/* Island or layer key for finding repeated geometry across layers */
+struct layer_key {
+	size_t hash;
+	ssize_t slice, island;
 };
 
 struct g_move {
 	ClipperLib::cInt x, y, z;  /* x, y, and z are in scaled units */
 	fl_t e, feed_rate, len;    /* e, feed_rate, and len are in unscaled units */
 	bool scalable, is_closed_path;
+	int arc;                   /* 0 for a linear move, or 2 (G2, clockwise) or 3 (G3, counter-clockwise) for an arc */
+	ClipperLib::cInt cx, cy;   /* Center of an arc */
 };
 
 struct slice {
@@ -461,8 +602,7 @@ struct slice {
 	struct segment *s;
 	std::vector<struct island> islands;
 	std::vector<struct g_move> moves;
-	ClipperLib::PolyTree layer_support_map;
-	ClipperLib::Paths *support_map_clipped_paths;
+	ClipperLib::Paths layer_support_map;  /* Regions that need support starting at this layer */
 	ClipperLib::Paths support_map;
 	ClipperLib::Paths support_boundaries;
 	ClipperLib::Paths support_interface_clip;
@@ -470,8 +610,10 @@ struct slice {
 	ClipperLib::Paths support_interface_lines;
 	ClipperLib::Paths last_boundaries, last_comb_paths;
 	ClipperLib::Paths printed_outer_boundaries, printed_outer_comb_paths;
-	std::ostringstream gcode;
+	struct comb_graph last_comb_graph, printed_outer_comb_graph;
+	std::string gcode;
 	fl_t layer_time;
+	ssize_t open_outlines;  /* Number of outlines that could not be closed */
 };
 
 struct machine {
@@ -480,6 +622,52 @@ struct machine {
 	bool is_retracted, is_hopped, is_wiped, force_retract;
 };
 
+/* Per-layer stages timed for the performance report */
+enum layer_stage {
+	LAYER_STAGE_OUTLINES,
+	LAYER_STAGE_INSETS,
+	LAYER_STAGE_INFILL,
+	LAYER_STAGE_SUPPORT,
+	LAYER_STAGE_PLAN,
+	LAYER_STAGE_FORMAT,
+	LAYER_STAGE_WRITE,
+	LAYER_STAGE_COUNT,
+};
+
+static const char *layer_stage_names[LAYER_STAGE_COUNT] = { "outlines", "insets", "infill", "support", "planning", "formatting", "writing" };
+
+struct stage_stats {
+	const char *name;
+	size_t runs;
+	double wall, cpu;  /* seconds */
+	unsigned long long clipper_executes, offset_executes;
+};
+
+struct layer_stats {
+	double wall[LAYER_STAGE_COUNT], cpu[LAYER_STAGE_COUNT];  /* summed over every thread that worked on the layer */
+	ssize_t segments, islands, vertices, moves, retracts, bytes;
+};
+
+struct stage_timer {
+	double wall, cpu;
+	unsigned long long clipper_executes, offset_executes;
+};
+
+struct layer_timer {
+	double wall, cpu;
+};
+
+static struct {
+	bool enabled;
+	struct stage_timer total;
+	ssize_t triangles;
+	long int bytes;
+	std::vector<struct stage_stats> stages;  /* in the order they first ran */
+	std::vector<struct layer_stats> layers;
+} perf;
+
+static bool show_progress = true;  /* Print the progress messages of build_object_topology() and find_object_segments() */
+
 static void die(const char *s, int r)
 {
 	fputs(s, stderr);
@@ -683,6 +871,22 @@ static int set_config_setting(const char *key, const char *value, int n, const c
 		g.layer = atoi(s);
 		config.at_layer.push_back(g);
 	}
+	else if (strcmp(key, "copy_offset") == 0) {
+		char *endptr;
+		struct copy_offset c;
+		c.x = strtod(value, &endptr);
+		if (endptr != value && *endptr == ',') {
+			const char *y_str = endptr + 1;
+			c.y = strtod(y_str, &endptr);
+			if (endptr != y_str && *endptr == '\0') {
+				config.copy_offsets.push_back(c);
+				return 0;
+			}
+		}
+		if (path) fprintf(stderr, "error: line %d in %s: invalid copy offset (expected x,y): %s\n", n, path, value);
+		else      fprintf(stderr, "error: invalid copy offset (expected x,y): %s\n", value);
+		return 1;
+	}
 	else {
 		if (path) fprintf(stderr, "error: line %d in %s: invalid setting: %s\n", n, path, key);
 		else      fprintf(stderr, "error: invalid setting: %s\n", key);
@@ -821,14 +1025,370 @@ static int read_config(const char *path)
 	return 0;
 }
 
+#define STL_HEADER_SIZE  84  /* 80 byte header plus 32-bit facet count */
+#define STL_FACET_SIZE   50  /* normal, 3 vertices (12 floats) and 16-bit attribute */
+#define STL_READ_FACETS  8192  /* Number of facets per fread() in read_stl_facets_buffered() */
+#define STL_MAX_FACETS   (INT_MAX / 3)  /* Half-edges are indexed with an int */
+
+/* Open addressing hash table used to merge identical vertices while loading */
+struct vertex_welder {
+	int *table;
+	size_t mask;
+	ssize_t v_len;  /* Allocated length of object.v */
+};
+
+static size_t hash_vertex(const float *p)
+{
+	unsigned int bits[3];
+	memcpy(bits, p, sizeof(bits));
+	const unsigned long long h = bits[0] * 0x9e3779b97f4a7c15ULL ^ bits[1] * 0xc2b2ae3d27d4eb4fULL ^ bits[2] * 0x165667b19e3779f9ULL;
+	return (size_t) (h ^ (h >> 29));
+}
+
+static void init_vertex_welder(struct vertex_welder *w, struct object *o)
+{
+	size_t size = 1024;
+	while (size < (size_t) o->n)  /* a closed mesh has about n / 2 vertices */
+		size <<= 1;
+	w->table = (int *) malloc(size * sizeof(int));
+	w->v_len = o->n / 2 + 16;
+	o->v = (struct vertex *) malloc(w->v_len * sizeof(struct vertex));
+	if (!w->table || !o->v)
+		die(e_nomem, 2);
+	memset(w->table, -1, size * sizeof(int));
+	w->mask = size - 1;
+	o->n_v = 0;
+}
+
+static void grow_vertex_welder(struct vertex_welder *w, const struct object *o)
+{
+	const size_t size = (w->mask + 1) << 1;
+	free(w->table);
+	w->table = (int *) malloc(size * sizeof(int));
+	if (!w->table)
+		die(e_nomem, 2);
+	memset(w->table, -1, size * sizeof(int));
+	w->mask = size - 1;
+	for (ssize_t i = 0; i < o->n_v; ++i) {
+		const float p[3] = { (float) o->v[i].x, (float) o->v[i].y, (float) o->v[i].z };
+		size_t h = hash_vertex(p) & w->mask;
+		while (w->table[h] >= 0)
+			h = (h + 1) & w->mask;
+		w->table[h] = (int) i;
+	}
+}
+
+static int weld_vertex(struct vertex_welder *w, struct object *o, float *p)
+{
+	for (int k = 0; k < 3; ++k)
+		if (p[k] == 0.0f) p[k] = 0.0f;  /* so -0 and +0 hash the same */
+	size_t h = hash_vertex(p) & w->mask;
+	for (; w->table[h] >= 0; h = (h + 1) & w->mask) {
+		const struct vertex *v = &o->v[w->table[h]];
+		if (v->x == (fl_t) p[0] && v->y == (fl_t) p[1] && v->z == (fl_t) p[2])
+			return w->table[h];
+	}
+	if (o->n_v >= w->v_len) {
+		w->v_len <<= 1;
+		o->v = (struct vertex *) realloc(o->v, w->v_len * sizeof(struct vertex));
+		if (!o->v)
+			die(e_nomem, 2);
+	}
+	o->v[o->n_v].x = (fl_t) p[0];
+	o->v[o->n_v].y = (fl_t) p[1];
+	o->v[o->n_v].z = (fl_t) p[2];
+	w->table[h] = (int) o->n_v;
+	if ((size_t) ++o->n_v * 2 > w->mask + 1)
+		grow_vertex_welder(w, o);
+	return (int) o->n_v - 1;
+}
+
+static void finish_vertex_welder(struct vertex_welder *w, struct object *o)
+{
+	free(w->table);
+	if (o->n_v > 0)
+		o->v = (struct vertex *) realloc(o->v, o->n_v * sizeof(struct vertex));
+}
+
+/* Note: 'facets' does not need to be aligned */
+static void weld_stl_facets(struct vertex_welder *w, struct object *o, struct triangle *t, const char *facets, ssize_t n)
+{
+	for (ssize_t i = 0; i < n; ++i) {
+		float stl_vert[9];
+		memcpy(stl_vert, &facets[i * STL_FACET_SIZE + 12], sizeof(stl_vert));  /* skip the normal */
+		for (int k = 0; k < 3; ++k)
+			t[i].v[k] = weld_vertex(w, o, &stl_vert[k * 3]);
+	}
+}
+
+#define WELD_CHUNK_SIZE  16384  /* Facets welded together by one thread */
+#define WELD_PARTITIONS  64     /* Hash partitions the welded chunks are merged in. Must be a power of two. */
+
+/* Like weld_vertex(), but into a chunk's own vertex list 'v' (three floats per vertex) */
+static int weld_chunk_vertex(std::vector<int> &table, std::vector<float> &v, float *p)
+{
+	for (int k = 0; k < 3; ++k)
+		if (p[k] == 0.0f) p[k] = 0.0f;  /* so -0 and +0 hash the same */
+	size_t mask = table.size() - 1, h = hash_vertex(p) & mask;
+	for (; table[h] >= 0; h = (h + 1) & mask) {
+		const float *q = &v[table[h] * 3];
+		if (q[0] == p[0] && q[1] == p[1] && q[2] == p[2])
+			return table[h];
+	}
+	const int n_v = (int) (v.size() / 3);
+	v.insert(v.end(), p, p + 3);
+	table[h] = n_v;
+	if ((size_t) (n_v + 1) * 2 > table.size()) {
+		table.assign(table.size() * 2, -1);
+		mask = table.size() - 1;
+		for (int i = 0; i <= n_v; ++i) {
+			for (h = hash_vertex(&v[i * 3]) & mask; table[h] >= 0; h = (h + 1) & mask);
+			table[h] = i;
+		}
+	}
+	return n_v;
+}
+
+/* Same result as weld_stl_facets(), but welds in parallel. Each chunk of facets is welded on its own first. The
+   vertices of all chunks are then sorted into partitions by hash, so identical vertices from different chunks land
+   in the same partition, and each partition is merged on its own. Vertices are still numbered in order of first
+   use, and the number of chunks and partitions is fixed, so the result does not depend on the number of threads.
+   Needs every facet in memory. */
+static void weld_stl_facets_parallel(struct object *o, const char *facets)
+{
+	const ssize_t n_chunks = (o->n + WELD_CHUNK_SIZE - 1) / WELD_CHUNK_SIZE;
+	std::vector<std::vector<float>> chunk_v(n_chunks);  /* Vertices welded within each chunk */
+	std::vector<size_t> first(n_chunks + 1, 0);          /* Index in 'lv' of the first vertex of each chunk */
+	std::vector<size_t> count(n_chunks * WELD_PARTITIONS, 0), start(n_chunks * WELD_PARTITIONS + 1);
+	ssize_t c;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (c = 0; c < n_chunks; ++c) {
+		const ssize_t begin = c * WELD_CHUNK_SIZE, end = MINIMUM(begin + WELD_CHUNK_SIZE, o->n);
+		std::vector<int> table(WELD_CHUNK_SIZE * 2, -1);  /* a closed mesh has about n / 2 vertices */
+		chunk_v[c].reserve(WELD_CHUNK_SIZE * 3 / 2);
+		for (ssize_t i = begin; i < end; ++i) {
+			float stl_vert[9];
+			memcpy(stl_vert, &facets[i * STL_FACET_SIZE + 12], sizeof(stl_vert));  /* skip the normal */
+			for (int k = 0; k < 3; ++k)
+				o->t[i].v[k] = weld_chunk_vertex(table, chunk_v[c], &stl_vert[k * 3]);
+		}
+		for (size_t j = 0; j < chunk_v[c].size(); j += 3)
+			++count[c * WELD_PARTITIONS + (hash_vertex(&chunk_v[c][j]) & (WELD_PARTITIONS - 1))];
+		first[c + 1] = chunk_v[c].size() / 3;
+	}
+	for (c = 0; c < n_chunks; ++c)
+		first[c + 1] += first[c];
+	/* Vertices of partition k from chunk c go at start[k * n_chunks + c] in 'order' */
+	for (size_t k = 0, sum = 0; k < WELD_PARTITIONS; ++k) {
+		for (ssize_t ch = 0; ch < n_chunks; ++ch) {
+			start[k * n_chunks + ch] = sum;
+			sum += count[ch * WELD_PARTITIONS + k];
+		}
+	}
+	start[n_chunks * WELD_PARTITIONS] = first[n_chunks];
+
+	std::vector<float> lv(first[n_chunks] * 3);  /* Vertices of all chunks, in chunk order */
+	std::vector<int> order(first[n_chunks]);     /* Indices into 'lv' sorted by partition, in order within each partition */
+	std::vector<int> ref(first[n_chunks]);       /* First vertex in 'lv' with the same position */
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (c = 0; c < n_chunks; ++c) {
+		size_t next[WELD_PARTITIONS];
+		for (size_t k = 0; k < WELD_PARTITIONS; ++k)
+			next[k] = start[k * n_chunks + c];
+		for (size_t j = 0; j < chunk_v[c].size() / 3; ++j) {
+			const float *p = &chunk_v[c][j * 3];
+			memcpy(&lv[(first[c] + j) * 3], p, 3 * sizeof(float));
+			order[next[hash_vertex(p) & (WELD_PARTITIONS - 1)]++] = (int) (first[c] + j);
+		}
+		std::vector<float>().swap(chunk_v[c]);
+	}
+	ssize_t k;
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (k = 0; k < WELD_PARTITIONS; ++k) {
+		const size_t begin = start[k * n_chunks], end = start[(k + 1) * n_chunks];
+		size_t size = 16;
+		while (size < (end - begin) * 2)
+			size <<= 1;
+		std::vector<int> table(size, -1);
+		for (size_t i = begin; i < end; ++i) {
+			const float *p = &lv[order[i] * 3];
+			size_t h = (hash_vertex(p) / WELD_PARTITIONS) & (size - 1);
+			for (; table[h] >= 0; h = (h + 1) & (size - 1)) {
+				const float *q = &lv[table[h] * 3];
+				if (q[0] == p[0] && q[1] == p[1] && q[2] == p[2])
+					break;
+			}
+			if (table[h] < 0)
+				table[h] = order[i];
+			ref[order[i]] = table[h];
+		}
+	}
+
+	/* Number the vertices in order of first use. 'ref' then holds -1 - (index in object.v). */
+	std::vector<ssize_t> n_new(n_chunks + 1, 0);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (c = 0; c < n_chunks; ++c)
+		for (size_t f = first[c]; f < first[c + 1]; ++f)
+			if (ref[f] == (int) f)
+				++n_new[c + 1];
+	for (c = 0; c < n_chunks; ++c)
+		n_new[c + 1] += n_new[c];
+	o->n_v = n_new[n_chunks];
+	o->v = (struct vertex *) malloc(MAXIMUM(o->n_v, 1) * sizeof(struct vertex));
+	if (!o->v)
+		die(e_nomem, 2);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (c = 0; c < n_chunks; ++c) {
+		ssize_t id = n_new[c];
+		for (size_t f = first[c]; f < first[c + 1]; ++f) {
+			if (ref[f] == (int) f) {
+				o->v[id].x = (fl_t) lv[f * 3];
+				o->v[id].y = (fl_t) lv[f * 3 + 1];
+				o->v[id].z = (fl_t) lv[f * 3 + 2];
+				ref[f] = (int) (-1 - id++);
+			}
+		}
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (c = 0; c < (ssize_t) ref.size(); ++c)
+		if (ref[c] >= 0)
+			ref[c] = ref[ref[c]];
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (c = 0; c < n_chunks; ++c) {
+		const ssize_t begin = c * WELD_CHUNK_SIZE, end = MINIMUM(begin + WELD_CHUNK_SIZE, o->n);
+		for (ssize_t i = begin; i < end; ++i)
+			for (int k = 0; k < 3; ++k)
+				o->t[i].v[k] = -1 - ref[first[c] + o->t[i].v[k]];
+	}
+}
+
+static void find_object_bounds(struct object *o)
+{
+	struct bounds { fl_t top, bottom, left, right, front, back; };
+	const ssize_t chunk_size = 65536;
+	const ssize_t n_chunks = (o->n_v + chunk_size - 1) / chunk_size;
+	struct bounds total = {}, *chunk_bounds;
+	if (o->n_v < 1)
+		goto done;
+	chunk_bounds = (struct bounds *) calloc(n_chunks, sizeof(struct bounds));
+	if (!chunk_bounds)
+		die(e_nomem, 2);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (ssize_t c = 0; c < n_chunks; ++c) {
+		const ssize_t end = MINIMUM((c + 1) * chunk_size, o->n_v);
+		const struct vertex *v0 = &o->v[c * chunk_size];
+		struct bounds b = { v0->z, v0->z, v0->x, v0->x, v0->y, v0->y };
+		for (ssize_t i = c * chunk_size; i < end; ++i) {
+			const struct vertex *v = &o->v[i];
+			if (v->z > b.top)     b.top = v->z;
+			if (v->z < b.bottom)  b.bottom = v->z;
+			if (v->x > b.right)   b.right = v->x;
+			if (v->x < b.left)    b.left = v->x;
+			if (v->y > b.back)    b.back = v->y;
+			if (v->y < b.front)   b.front = v->y;
+		}
+		chunk_bounds[c] = b;
+	}
+	total = chunk_bounds[0];
+	for (ssize_t c = 1; c < n_chunks; ++c) {
+		total.top = MAXIMUM(total.top, chunk_bounds[c].top);
+		total.bottom = MINIMUM(total.bottom, chunk_bounds[c].bottom);
+		total.right = MAXIMUM(total.right, chunk_bounds[c].right);
+		total.left = MINIMUM(total.left, chunk_bounds[c].left);
+		total.back = MAXIMUM(total.back, chunk_bounds[c].back);
+		total.front = MINIMUM(total.front, chunk_bounds[c].front);
+	}
+	free(chunk_bounds);
+
+	done:
+	o->h = total.top - total.bottom;
+	o->w = total.right - total.left;
+	o->d = total.back - total.front;
+	o->c.x = total.right - o->w / 2.0;
+	o->c.y = total.back - o->d / 2.0;
+	o->c.z = total.top - o->h / 2.0;
+}
+
+/* Fallback for pipes and other files that can't be mapped */
+static int read_stl_facets_buffered(struct object *o, FILE *f)
+{
+	struct vertex_welder w;
+	char header[STL_HEADER_SIZE], *buf;
+	if (fread(header, 1, STL_HEADER_SIZE, f) != STL_HEADER_SIZE)
+		return 2;
+	o->n = 0;
+	memcpy(&o->n, &header[80], 4);
+	if (o->n > STL_MAX_FACETS)
+		return 3;
+	o->t = (struct triangle *) malloc(o->n * sizeof(struct triangle));
+	buf = (char *) malloc(STL_FACET_SIZE * STL_READ_FACETS);
+	if ((!o->t && o->n > 0) || !buf)
+		die(e_nomem, 2);
+	init_vertex_welder(&w, o);
+	for (ssize_t i = 0; i < o->n; i += STL_READ_FACETS) {
+		const ssize_t n = MINIMUM(o->n - i, STL_READ_FACETS);
+		if (fread(buf, STL_FACET_SIZE, n, f) != (size_t) n) {
+			finish_vertex_welder(&w, o);
+			free(buf);
+			free(o->t);
+			free(o->v);
+			return 2;
+		}
+		weld_stl_facets(&w, o, &o->t[i], buf, n);
+	}
+	finish_vertex_welder(&w, o);
+	free(buf);
+	return 0;
+}
+
+#ifndef _WIN32
+/* Returns -1 if the file can't be mapped */
+static int read_stl_facets_mapped(struct object *o, int fd)
+{
+	struct stat st;
+	const char *map;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < STL_HEADER_SIZE)
+		return -1;
+	map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+	o->n = 0;
+	memcpy(&o->n, &map[80], 4);
+	if (o->n > STL_MAX_FACETS || st.st_size < STL_HEADER_SIZE + o->n * STL_FACET_SIZE) {
+		munmap((void *) map, st.st_size);
+		return (o->n > STL_MAX_FACETS) ? 3 : 2;
+	}
+	o->t = (struct triangle *) malloc(o->n * sizeof(struct triangle));
+	if (!o->t && o->n > 0)
+		die(e_nomem, 2);
+	weld_stl_facets_parallel(o, &map[STL_HEADER_SIZE]);
+	munmap((void *) map, st.st_size);
+	return 0;
+}
+#endif
+
+/* Returns 1 on open failure (errno is set), 2 on short read and 3 if there are too many facets */
 static int read_binary_stl(struct object *o, const char *path)
 {
-	ssize_t i;
-	int k, p;
-	bool first = true;
-	fl_t top = 0, bottom = 0, left = 0, right = 0, front = 0, back = 0;
-	char header[80];
-	float stl_poly[13];
+	int ret = -1;
 	FILE *f;
 
 	if (strcmp(path, "-") == 0)
@@ -837,56 +1397,103 @@ static int read_binary_stl(struct object *o, const char *path)
 		f = fopen(path, "rb");
 	if (!f)
 		return 1;
-	if (fread(header, 1, 80, f) != 80)
-		goto read_fail;
-	o->n = 0;
-	if (fread(&o->n, 4, 1, f) != 1)
-		goto read_fail;
-	o->t = (struct triangle *) calloc(o->n, sizeof(struct triangle));
-	if (!o->t)
+#ifndef _WIN32
+	if (f != stdin)
+		ret = read_stl_facets_mapped(o, fileno(f));
+#endif
+	if (ret < 0)
+		ret = read_stl_facets_buffered(o, f);
+	fclose(f);
+	if (ret == 0)
+		find_object_bounds(o);
+	return ret;
+}
+
+/* Build half-edge adjacency. Returns the number of open, non-manifold and inconsistently oriented edges. */
+static void build_mesh_topology(struct object *o, ssize_t *r_open, ssize_t *r_non_manifold, ssize_t *r_flipped)
+{
+	ssize_t n_open = 0, n_non_manifold = 0, n_flipped = 0;
+	/* Vertex -> triangle incidence lists */
+	int *vt_start = (int *) calloc(o->n_v + 1, sizeof(int));
+	int *vt = (int *) malloc(o->n * 3 * sizeof(int));
+	o->adj = (int *) malloc(o->n * 3 * sizeof(int));
+	if (!vt_start || (o->n > 0 && (!vt || !o->adj)))
 		die(e_nomem, 2);
-	for (i = 0; i < o->n; ++i) {
-		if (fread(stl_poly, 50, 1, f) != 1)  /* Each polygon entry is 50 bytes */
-			goto read_fail;
-		p = 3;
-		for (k = 0; k < 3; ++k) {
-			o->t[i].v[k].x = (fl_t) stl_poly[p++];
-			o->t[i].v[k].y = (fl_t) stl_poly[p++];
-			o->t[i].v[k].z = (fl_t) stl_poly[p++];
-			if (first || o->t[i].v[k].z > top)     top = o->t[i].v[k].z;
-			if (first || o->t[i].v[k].z < bottom)  bottom = o->t[i].v[k].z;
-			if (first || o->t[i].v[k].x > right)   right = o->t[i].v[k].x;
-			if (first || o->t[i].v[k].x < left)    left = o->t[i].v[k].x;
-			if (first || o->t[i].v[k].y > back)    back = o->t[i].v[k].y;
-			if (first || o->t[i].v[k].y < front)   front = o->t[i].v[k].y;
-			first = false;
+	for (ssize_t i = 0; i < o->n; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			const int v = o->t[i].v[k];
+			if (k > 0 && (v == o->t[i].v[0] || (k == 2 && v == o->t[i].v[1])))
+				continue;  /* Don't list degenerate triangles twice */
+			++vt_start[v + 1];
 		}
 	}
-	fclose(f);
-	o->h = top - bottom;
-	o->w = right - left;
-	o->d = back - front;
-	o->c.x = right - o->w / 2.0;
-	o->c.y = back - o->d / 2.0;
-	o->c.z = top - o->h / 2.0;
-	return 0;
+	for (ssize_t i = 1; i <= o->n_v; ++i)
+		vt_start[i] += vt_start[i - 1];
+	for (ssize_t i = 0; i < o->n; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			const int v = o->t[i].v[k];
+			if (k > 0 && (v == o->t[i].v[0] || (k == 2 && v == o->t[i].v[1])))
+				continue;  /* Don't list degenerate triangles twice */
+			vt[vt_start[v]++] = (int) i;
+		}
+	}
+	for (ssize_t i = o->n_v; i > 0; --i)  /* vt_start[i] now holds the end of list i, so shift back */
+		vt_start[i] = vt_start[i - 1];
+	vt_start[0] = 0;
 
-	read_fail:
-	fclose(f);
-	free(o->t);
-	return 2;
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) reduction(+:n_open,n_non_manifold,n_flipped)
+#endif
+	for (ssize_t i = 0; i < o->n; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			const int a = o->t[i].v[k], b = o->t[i].v[(k == 2) ? 0 : k + 1];
+			int match = -1, n_matches = 0;
+			bool same_dir = false, is_lowest = true;
+			o->adj[i * 3 + k] = -1;
+			if (a == b)
+				continue;  /* Degenerate edge */
+			for (int j = vt_start[a]; j < vt_start[a + 1]; ++j) {
+				if (vt[j] == i)
+					continue;
+				const struct triangle *t = &o->t[vt[j]];
+				if (t->v[0] != b && t->v[1] != b && t->v[2] != b)
+					continue;
+				for (int e = 0, ne = 1; e < 3; ++e, ne = (ne == 2) ? 0 : ne + 1) {
+					const int ea = t->v[e], eb = t->v[ne];
+					if ((ea == a && eb == b) || (ea == b && eb == a)) {
+						match = vt[j] * 3 + e;
+						same_dir = (ea == a);
+						is_lowest = is_lowest && (vt[j] > i);
+						++n_matches;
+					}
+				}
+			}
+			if (n_matches == 1) {
+				o->adj[i * 3 + k] = match;
+				if (same_dir && is_lowest)
+					++n_flipped;
+			}
+			else if (n_matches == 0)
+				++n_open;
+			else if (is_lowest)
+				++n_non_manifold;
+		}
+	}
+	free(vt_start);
+	free(vt);
+	*r_open = n_open;
+	*r_non_manifold = n_non_manifold;
+	*r_flipped = n_flipped;
 }
 
 static void translate_object(struct object *o, fl_t x, fl_t y, fl_t z)
 {
 	if (x == 0.0 && y == 0.0 && z == 0.0)
 		return;
-	for (ssize_t i = 0; i < o->n; ++i) {
-		for (int k = 0; k < 3; ++k) {
-			o->t[i].v[k].x += x;
-			o->t[i].v[k].y += y;
-			o->t[i].v[k].z += z;
-		}
+	for (ssize_t i = 0; i < o->n_v; ++i) {
+		o->v[i].x += x;
+		o->v[i].y += y;
+		o->v[i].z += z;
 	}
 	o->c.x += x;
 	o->c.y += y;
@@ -897,12 +1504,10 @@ static void scale_object(struct object *o, fl_t x_ratio, fl_t y_ratio, fl_t z_ra
 {
 	if (x_ratio == 1.0 && y_ratio == 1.0 && z_ratio == 1.0)
 		return;
-	for (ssize_t i = 0; i < o->n; ++i) {
-		for (int k = 0; k < 3; ++k) {
-			o->t[i].v[k].x *= x_ratio;
-			o->t[i].v[k].y *= y_ratio;
-			o->t[i].v[k].z *= z_ratio;
-		}
+	for (ssize_t i = 0; i < o->n_v; ++i) {
+		o->v[i].x *= x_ratio;
+		o->v[i].y *= y_ratio;
+		o->v[i].z *= z_ratio;
 	}
 	o->h *= z_ratio;
 	o->w *= x_ratio;
@@ -921,60 +1526,198 @@ static void project2d(struct segment *seg, const struct vertex *v0, const struct
 	seg->y[1] = v0->y + (v2->y - v0->y) * (z - v0->z) / (v2->z - v0->z);
 }
 
-static void find_segments(struct slice *slices, const struct triangle *t)
+static void find_layer_range(const struct object *o, const struct triangle *t, ssize_t *start, ssize_t *end)
 {
-	fl_t min_z, max_z, z;
-	ssize_t start, end, i;
-	struct segment *s;
+	const fl_t z0 = o->v[t->v[0]].z, z1 = o->v[t->v[1]].z, z2 = o->v[t->v[2]].z;
+	fl_t min_z, max_z;
 
-	max_z = MAXIMUM(t->v[0].z, t->v[1].z);
-	max_z = MAXIMUM(max_z, t->v[2].z);
+	max_z = MAXIMUM(z0, z1);
+	max_z = MAXIMUM(max_z, z2);
 	max_z = MAXIMUM(0, max_z);  /* Chop off negative z values */
 
-	min_z = MINIMUM(t->v[0].z, t->v[1].z);
-	min_z = MINIMUM(min_z, t->v[2].z);
+	min_z = MINIMUM(z0, z1);
+	min_z = MINIMUM(min_z, z2);
 	min_z = MAXIMUM(0, min_z);  /* Chop off negative z values */
 
-	start = (ssize_t) floor(min_z / config.layer_height + (0.4999));
-	end = (ssize_t) floor(max_z / config.layer_height + (0.5001));
+	*start = (ssize_t) floor(min_z / config.layer_height + (0.4999));
+	*end = (ssize_t) floor(max_z / config.layer_height + (0.5001));
+	*end = MINIMUM(*end, o->n_slices);
+}
 
-	for (i = start; i < end; ++i) {
-		z = ((fl_t) i) * config.layer_height + config.layer_height / 2;
-		if (slices[i].n_seg >= slices[i].s_len) {
-			if (slices[i].s_len == 0) {
-				slices[i].s_len = 1024;
-				slices[i].s = (struct segment *) malloc(sizeof(struct segment) * slices[i].s_len);
-				if (!slices[i].s)
-					die(e_nomem, 2);
-			}
-			else {
-				slices[i].s_len = slices[i].s_len << 1;
-				slices[i].s = (struct segment *) realloc(slices[i].s, sizeof(struct segment) * slices[i].s_len);
-				if (!slices[i].s)
-					die(e_nomem, 2);
-			}
+#define SET_SEGMENT_EDGES(s, e0, e1) do { (s)->e[0] = (e0); (s)->e[1] = (e1); } while (0)
+
+/* Returns false if the triangle does not generate a segment at the given z */
+static bool find_segment(struct segment *s, const struct object *o, ssize_t t_idx, fl_t z)
+{
+	const struct triangle *t = &o->t[t_idx];
+	const struct vertex *v[3] = { &o->v[t->v[0]], &o->v[t->v[1]], &o->v[t->v[2]] };
+	/* Intersection code ported from CuraEngine slicer.cpp (Copyright (C) 2013 David Braam) */
+	if (v[0]->z < z && v[1]->z >= z && v[2]->z >= z) {
+		project2d(s, v[0], v[2], v[1], z);
+		SET_SEGMENT_EDGES(s, 2, 0);
+	}
+	else if (v[0]->z > z && v[1]->z < z && v[2]->z < z) {
+		project2d(s, v[0], v[1], v[2], z);
+		SET_SEGMENT_EDGES(s, 0, 2);
+	}
+
+	else if (v[1]->z < z && v[0]->z >= z && v[2]->z >= z) {
+		project2d(s, v[1], v[0], v[2], z);
+		SET_SEGMENT_EDGES(s, 0, 1);
+	}
+	else if (v[1]->z > z && v[0]->z < z && v[2]->z < z) {
+		project2d(s, v[1], v[2], v[0], z);
+		SET_SEGMENT_EDGES(s, 1, 0);
+	}
+
+	else if (v[2]->z < z && v[1]->z >= z && v[0]->z >= z) {
+		project2d(s, v[2], v[1], v[0], z);
+		SET_SEGMENT_EDGES(s, 1, 2);
+	}
+	else if (v[2]->z > z && v[1]->z < z && v[0]->z < z) {
+		project2d(s, v[2], v[0], v[1], z);
+		SET_SEGMENT_EDGES(s, 2, 1);
+	}
+	else
+		return false;
+	s->t = (int) t_idx;
+	return (s->x[0] != s->x[1] || s->y[0] != s->y[1]);  /* Ignore zero-length segments */
+}
+
+#define SEGMENT_CHUNK_MIN_SIZE 4096
+#define SEGMENT_MAX_CHUNKS     256
+
+/* Find the segments for layers [start, end) from the 'n_tris' triangles in 'tris' (in ascending order), or from
+   every triangle if 'tris' is NULL. The triangles are split into a fixed number of chunks (independent of the
+   thread count) so segments end up in the same order as they would if the triangles were processed serially. */
+static void find_segments(struct object *o, const int *tris, ssize_t n_tris, ssize_t start, ssize_t end)
+{
+	const ssize_t n_chunks = MINIMUM((n_tris + SEGMENT_CHUNK_MIN_SIZE - 1) / SEGMENT_CHUNK_MIN_SIZE, SEGMENT_MAX_CHUNKS);
+	const ssize_t n_layers = end - start;
+	if (n_chunks < 1 || n_layers < 1)
+		return;
+	const ssize_t chunk_size = (n_tris + n_chunks - 1) / n_chunks;
+	/* Both arrays are indexed as [chunk * n_layers + layer - start] */
+	ssize_t *chunk_start = (ssize_t *) calloc(n_chunks * n_layers, sizeof(ssize_t));
+	ssize_t *chunk_count = (ssize_t *) calloc(n_chunks * n_layers, sizeof(ssize_t));
+	if (!chunk_start || !chunk_count)
+		die(e_nomem, 2);
+
+	/* Count the maximum number of segments each chunk can generate in each layer */
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t c = 0; c < n_chunks; ++c) {
+		ssize_t *count = &chunk_count[c * n_layers];
+		const ssize_t t_end = MINIMUM((c + 1) * chunk_size, n_tris);
+		for (ssize_t j = c * chunk_size; j < t_end; ++j) {
+			const ssize_t i = (tris) ? tris[j] : j;
+			ssize_t t_start, t_stop;
+			find_layer_range(o, &o->t[i], &t_start, &t_stop);
+			for (ssize_t k = MAXIMUM(t_start, start); k < MINIMUM(t_stop, end); ++k)
+				++count[k - start];
+		}
+	}
+
+	/* Give each chunk its own region of each layer's segment array */
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for (ssize_t k = start; k < end; ++k) {
+		ssize_t total = 0;
+		for (ssize_t c = 0; c < n_chunks; ++c) {
+			chunk_start[c * n_layers + k - start] = total;
+			total += chunk_count[c * n_layers + k - start];
+			chunk_count[c * n_layers + k - start] = 0;
+		}
+		o->slices[k].s_len = total;
+		if (total > 0) {
+			o->slices[k].s = (struct segment *) malloc(sizeof(struct segment) * total);
+			if (!o->slices[k].s)
+				die(e_nomem, 2);
 		}
-		s = &slices[i].s[slices[i].n_seg];
+	}
 
-		/* Intersection code ported from CuraEngine slicer.cpp (Copyright (C) 2013 David Braam) */
-		if (t->v[0].z < z && t->v[1].z >= z && t->v[2].z >= z)
-			project2d(s, &t->v[0], &t->v[2], &t->v[1], z);
-		else if (t->v[0].z > z && t->v[1].z < z && t->v[2].z < z)
-			project2d(s, &t->v[0], &t->v[1], &t->v[2], z);
+	/* Find segments */
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t c = 0; c < n_chunks; ++c) {
+		const ssize_t *start_idx = &chunk_start[c * n_layers];
+		ssize_t *count = &chunk_count[c * n_layers];
+		const ssize_t t_end = MINIMUM((c + 1) * chunk_size, n_tris);
+		for (ssize_t j = c * chunk_size; j < t_end; ++j) {
+			const ssize_t i = (tris) ? tris[j] : j;
+			ssize_t t_start, t_stop;
+			find_layer_range(o, &o->t[i], &t_start, &t_stop);
+			for (ssize_t k = MAXIMUM(t_start, start); k < MINIMUM(t_stop, end); ++k) {
+				const fl_t z = ((fl_t) k) * config.layer_height + config.layer_height / 2;
+				if (find_segment(&o->slices[k].s[start_idx[k - start] + count[k - start]], o, i, z))
+					++count[k - start];
+			}
+		}
+	}
 
-		else if (t->v[1].z < z && t->v[0].z >= z && t->v[2].z >= z)
-			project2d(s, &t->v[1], &t->v[0], &t->v[2], z);
-		else if (t->v[1].z > z && t->v[0].z < z && t->v[2].z < z)
-			project2d(s, &t->v[1], &t->v[2], &t->v[0], z);
+	/* Close the gaps left by triangles that did not generate a segment */
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t k = start; k < end; ++k) {
+		struct slice *slice = &o->slices[k];
+		slice->n_seg = 0;
+		for (ssize_t c = 0; c < n_chunks; ++c) {
+			const ssize_t seg_start = chunk_start[c * n_layers + k - start], count = chunk_count[c * n_layers + k - start];
+			if (seg_start != slice->n_seg && count > 0)
+				memmove(&slice->s[slice->n_seg], &slice->s[seg_start], sizeof(struct segment) * count);
+			slice->n_seg += count;
+		}
+		if (perf.enabled)
+			perf.layers[k].segments = slice->n_seg;
+	}
+	free(chunk_start);
+	free(chunk_count);
+}
 
-		else if (t->v[2].z < z && t->v[1].z >= z && t->v[0].z >= z)
-			project2d(s, &t->v[2], &t->v[1], &t->v[0], z);
-		else if (t->v[2].z > z && t->v[1].z < z && t->v[0].z < z)
-			project2d(s, &t->v[2], &t->v[0], &t->v[1], z);
-		else
-			continue;
-		if (s->x[0] != s->x[1] || s->y[0] != s->y[1]) /* Ignore zero-length segments */
-			++slices[i].n_seg;
+/* Group the triangles by the first layer they cross and set each layer's s_len to the number of triangles that cross
+   it, which is the most segments it can have. This is much cheaper than finding the segments, and lets the layers be
+   split into bands before any segments exist. */
+static void bin_triangles(struct object *o)
+{
+	struct triangle_bins *bins = &o->bins;
+	std::vector<ssize_t> delta(o->n_slices + 1, 0);
+	bins->start.assign(o->n_slices + 1, 0);
+	bins->reach.resize(o->n_slices);
+	for (ssize_t k = 0; k < o->n_slices; ++k)
+		bins->reach[k] = k;
+	ssize_t i, k;
+	for (i = 0; i < o->n; ++i) {
+		ssize_t start, end;
+		find_layer_range(o, &o->t[i], &start, &end);
+		if (start < end) {
+			++delta[start];
+			--delta[end];
+			++bins->start[start + 1];
+			/* Use 'reach' to hold the lowest first layer of the triangles ending at each layer for now */
+			bins->reach[end - 1] = MINIMUM(bins->reach[end - 1], start);
+		}
+	}
+	ssize_t count = 0, lowest = o->n_slices;
+	for (k = o->n_slices - 1; k >= 0; --k) {
+		lowest = MINIMUM(lowest, bins->reach[k]);
+		bins->reach[k] = lowest;
+	}
+	for (k = 0; k < o->n_slices; ++k) {
+		count += delta[k];
+		o->slices[k].s_len = count;
+		bins->start[k + 1] += bins->start[k];
+	}
+	std::vector<ssize_t> next(bins->start.begin(), bins->start.end() - 1);
+	bins->t.resize(bins->start[o->n_slices]);
+	for (i = 0; i < o->n; ++i) {
+		ssize_t start, end;
+		find_layer_range(o, &o->t[i], &start, &end);
+		if (start < end)
+			bins->t[next[start]++] = (int) i;
 	}
 }
 
@@ -1097,70 +1840,193 @@ static void simplify_paths(ClipperLib::Paths &paths, const fl_t epsilon)
 		simplify_path(p, epsilon);
 }
 
-static void generate_outlines(struct slice *slice, ssize_t slice_index)
+static size_t segment_grid_bucket(const struct segment_grid *g, fl_t x, fl_t y, int dx, int dy)
 {
-	struct segment_list iseg = { NULL, NULL }, oseg = { NULL, NULL };
-	const fl_t tolerance_sq = config.tolerance * config.tolerance;
-	ClipperLib::Paths outlines;
+	const unsigned long long cx = (unsigned long long) ((long long) floor(x * g->inv_cell_size) + dx);
+	const unsigned long long cy = (unsigned long long) ((long long) floor(y * g->inv_cell_size) + dy);
+	return (size_t) ((cx * 0x9e3779b97f4a7c15ULL) ^ (cy * 0xc2b2ae3d27d4eb4fULL)) & g->mask;
+}
 
+static void build_segment_grid(struct segment_grid *g, const struct slice *slice)
+{
+	size_t n_buckets = 1;
+	while (n_buckets < (size_t) slice->n_seg * 2)
+		n_buckets <<= 1;
+	/* The cells are larger than the tolerance so an endpoint within tolerance of
+	   another is never more than one cell away (even with rounding error) */
+	g->inv_cell_size = 1.0 / MAXIMUM(config.tolerance * 2.0, 1.0 / config.scale_constant);
+	g->mask = n_buckets - 1;
+	g->bucket_start.assign(n_buckets + 1, 0);
+	g->entries.resize(slice->n_seg * 2);
 	for (ssize_t i = 0; i < slice->n_seg; ++i)
-		LIST_ADD_TAIL(&iseg, &slice->s[i]);
-
-	while (iseg.head) {
-		ssize_t segment_count = 0, flip_count = 0;
-		/* ssize_t inexact_count = 0; */
-		/* Add first segment to the polygon */
-		struct segment *s = iseg.head;
-		LIST_REMOVE_HEAD(&iseg);
-		LIST_ADD_HEAD(&oseg, s);
-
-		next_segment:
-		++segment_count;
-		bool flip_points = false;
-		fl_t best_dist = FL_T_INF;
-		struct segment *best = NULL, *begin = oseg.head, *end = oseg.tail;
+		for (int k = 0; k < 2; ++k)
+			++g->bucket_start[segment_grid_bucket(g, slice->s[i].x[k], slice->s[i].y[k], 0, 0) + 1];
+	for (size_t i = 1; i <= n_buckets; ++i)
+		g->bucket_start[i] += g->bucket_start[i - 1];
+	std::vector<size_t> pos(g->bucket_start.begin(), g->bucket_start.end() - 1);
+	for (ssize_t i = 0; i < slice->n_seg; ++i)
+		for (int k = 0; k < 2; ++k)
+			g->entries[pos[segment_grid_bucket(g, slice->s[i].x[k], slice->s[i].y[k], 0, 0)]++] = i * 2 + k;
+}
 
-		/* Check whether the polygon is closed */
-		if (begin != end) {
-			if (begin->x[0] == end->x[1] && begin->y[0] == end->y[1])
-				goto add_poly;
+/* Returns the remaining segment with the lowest index that has an endpoint exactly at (x, y) */
+static struct segment * find_connected_segment(const struct segment_grid *g, struct slice *slice, const std::vector<bool> &linked, fl_t x, fl_t y, bool *r_flip)
+{
+	const size_t b = segment_grid_bucket(g, x, y, 0, 0);
+	for (size_t i = g->bucket_start[b]; i < g->bucket_start[b + 1]; ++i) {
+		const ssize_t idx = g->entries[i] >> 1;
+		const int k = g->entries[i] & 1;
+		struct segment *s = &slice->s[idx];
+		if (!linked[idx] && s->x[k] == x && s->y[k] == y) {
+			*r_flip = (k == 1);
+			return s;
 		}
+	}
+	return NULL;
+}
 
-		/* Link up connected segments */
-		LIST_FOREACH(&iseg, s) {
-			if (s->x[0] == end->x[1] && s->y[0] == end->y[1]) {
-				LIST_REMOVE(&iseg, s);
-				LIST_ADD_TAIL(&oseg, s);
-				goto next_segment;
-			}
-			if (s->x[1] == end->x[1] && s->y[1] == end->y[1]) {
-				DEBUG("flipped segment %zd at layer %zd\n", segment_count, slice_index + 1);
-				++flip_count;
-				/* Flip point order */
-				fl_t t = s->x[0];
-				s->x[0] = s->x[1];
-				s->x[1] = t;
-				t = s->y[0];
-				s->y[0] = s->y[1];
-				s->y[1] = t;
-
-				LIST_REMOVE(&iseg, s);
-				LIST_ADD_TAIL(&oseg, s);
-				goto next_segment;
+/* Returns the nearest remaining segment if it is within tolerance, or NULL otherwise. Ties go to the lowest index. */
+static struct segment * find_nearest_segment_within_tolerance(const struct segment_grid *g, struct slice *slice, const std::vector<bool> &linked, fl_t x, fl_t y, fl_t tolerance_sq, fl_t *r_dist, bool *r_flip)
+{
+	struct segment *best = NULL;
+	fl_t best_dist = FL_T_INF;
+	bool flip_points = false;
+	for (int dy = -1; dy <= 1; ++dy) {
+		for (int dx = -1; dx <= 1; ++dx) {
+			const size_t b = segment_grid_bucket(g, x, y, dx, dy);
+			for (size_t i = g->bucket_start[b]; i < g->bucket_start[b + 1]; ++i) {
+				const ssize_t idx = g->entries[i] >> 1;
+				struct segment *s = &slice->s[idx];
+				if (linked[idx])
+					continue;
+				fl_t dist0 = (s->x[0] - x) * (s->x[0] - x) + (s->y[0] - y) * (s->y[0] - y);
+				fl_t dist1 = (s->x[1] - x) * (s->x[1] - x) + (s->y[1] - y) * (s->y[1] - y);
+				fl_t dist = MINIMUM(dist0, dist1);
+				if (dist < best_dist || (dist == best_dist && s < best)) {
+					flip_points = (dist1 < dist0);
+					best_dist = dist;
+					best = s;
+				}
 			}
 		}
+	}
+	if (!best || best_dist > tolerance_sq)
+		return NULL;
+	*r_dist = best_dist;
+	*r_flip = flip_points;
+	return best;
+}
 
-		/* Find closest segment if none are connected exactly */
-		LIST_FOREACH(&iseg, s) {
-			fl_t dist0 = (s->x[0] - end->x[1]) * (s->x[0] - end->x[1]) + (s->y[0] - end->y[1]) * (s->y[0] - end->y[1]);
-			fl_t dist1 = (s->x[1] - end->x[1]) * (s->x[1] - end->x[1]) + (s->y[1] - end->y[1]) * (s->y[1] - end->y[1]);
-			fl_t dist = MINIMUM(dist0, dist1);
-			if (dist < best_dist) {
-				flip_points = (dist1 < dist0);
-				best_dist = dist;
-				best = s;
-			}
+static size_t hash_paths(const ClipperLib::Paths &paths)
+{
+	unsigned long long h = paths.size();
+	for (const ClipperLib::Path &p : paths) {
+		h = (h ^ p.size()) * 0x9e3779b97f4a7c15ULL;
+		for (const ClipperLib::IntPoint &pt : p)
+			h = (h ^ (unsigned long long) pt.X * 0xc2b2ae3d27d4eb4fULL ^ (unsigned long long) pt.Y * 0x165667b19e3779f9ULL) * 0x9e3779b97f4a7c15ULL;
+	}
+	return (size_t) (h ^ (h >> 29));
+}
+
+static void flip_segment(struct segment *s)
+{
+	std::swap(s->x[0], s->x[1]);
+	std::swap(s->y[0], s->y[1]);
+	std::swap(s->e[0], s->e[1]);
+}
+
+static size_t hash_triangle_index(int t, size_t mask)
+{
+	return (size_t) (((unsigned long long) t * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+/* Open addressing hash table from triangle index to segment index. There is at most one segment per triangle in each layer. */
+static void build_triangle_map(std::vector<ssize_t> &map, const struct slice *slice)
+{
+	size_t size = 16;
+	while (size < (size_t) slice->n_seg * 2)
+		size <<= 1;
+	map.assign(size, -1);
+	for (ssize_t i = 0; i < slice->n_seg; ++i) {
+		size_t h = hash_triangle_index(slice->s[i].t, size - 1);
+		while (map[h] >= 0)
+			h = (h + 1) & (size - 1);
+		map[h] = i;
+	}
+}
+
+/* Returns the segment generated by the triangle on the other side of the edge the end of 's' lies on, or NULL if there isn't one */
+static struct segment * find_adjacent_segment(const std::vector<ssize_t> &map, struct slice *slice, const int *adj, const struct segment *s, bool *r_flip)
+{
+	const int he = adj[s->t * 3 + s->e[1]];
+	if (he < 0)
+		return NULL;
+	const int t = he / 3, e = he % 3;
+	const size_t mask = map.size() - 1;
+	for (size_t h = hash_triangle_index(t, mask); map[h] >= 0; h = (h + 1) & mask) {
+		struct segment *r = &slice->s[map[h]];
+		if (r->t == t) {
+			if (r->e[0] != e && r->e[1] != e)
+				return NULL;
+			*r_flip = (r->e[1] == e);
+			return r;
 		}
+	}
+	return NULL;
+}
+
+static void generate_outlines(struct slice *slice, const int *adj, ssize_t slice_index)
+{
+	struct segment_list iseg = { NULL, NULL }, oseg = { NULL, NULL };
+	const fl_t tolerance_sq = config.tolerance * config.tolerance;
+	ClipperLib::Paths outlines;
+	struct segment_grid grid;
+	std::vector<ssize_t> triangle_map;
+	std::vector<bool> linked(slice->n_seg, false);
+
+	/* The grid is only needed where the mesh topology is broken, so it is built on first use */
+	grid.mask = 0;
+	build_triangle_map(triangle_map, slice);
+	for (ssize_t i = 0; i < slice->n_seg; ++i)
+		LIST_ADD_TAIL(&iseg, &slice->s[i]);
+
+	while (iseg.head) {
+		ssize_t segment_count = 0, flip_count = 0;
+		/* ssize_t inexact_count = 0; */
+		/* Add first segment to the polygon */
+		struct segment *s = iseg.head;
+		LIST_REMOVE_HEAD(&iseg);
+		LIST_ADD_HEAD(&oseg, s);
+		linked[s - slice->s] = true;
+
+		next_segment:
+		++segment_count;
+		bool flip_points = false;
+		fl_t best_dist = FL_T_INF;
+		struct segment *best = NULL, *begin = oseg.head, *end = oseg.tail;
+
+		/* Check whether the polygon is closed */
+		if (begin != end) {
+			if (begin->x[0] == end->x[1] && begin->y[0] == end->y[1])
+				goto add_poly;
+		}
+
+		/* Follow the mesh topology */
+		s = find_adjacent_segment(triangle_map, slice, adj, end, &flip_points);
+		if (s && s == begin && !flip_points && begin != end)
+			goto add_poly;
+		if (s && !linked[s - slice->s])
+			goto link_segment;
+
+		/* Link up connected segments */
+		if (grid.mask == 0)
+			build_segment_grid(&grid, slice);
+		s = find_connected_segment(&grid, slice, linked, end->x[1], end->y[1], &flip_points);
+		if (s)
+			goto link_segment;
+
+		/* Find closest segment if none are connected exactly */
+		best = find_nearest_segment_within_tolerance(&grid, slice, linked, end->x[1], end->y[1], tolerance_sq, &best_dist, &flip_points);
 
 		/* Check whether the polygon is closed (within tolerance_sq and less than best_dist) */
 		if (begin != end) {
@@ -1170,29 +2036,30 @@ static void generate_outlines(struct slice *slice, ssize_t slice_index)
 		}
 
 		/* Connect nearest segment (within tolerance_sq) */
-		if (best && best_dist <= tolerance_sq) {
+		if (best) {
 			s = best;
-			if (flip_points) {
-				DEBUG("flipped segment %zd at layer %zd\n", segment_count, slice_index + 1);
-				++flip_count;
-				fl_t t = s->x[0];
-				s->x[0] = s->x[1];
-				s->x[1] = t;
-				t = s->y[0];
-				s->y[0] = s->y[1];
-				s->y[1] = t;
-			}
-			LIST_REMOVE(&iseg, s);
-			LIST_ADD_TAIL(&oseg, s);
 			/* ++inexact_count; */
-			goto next_segment;
+			goto link_segment;
 		}
 
 		/* If there are any segments left and more than one output segment, there is probably a hole in the mesh */
-		if (iseg.head && oseg.head != oseg.tail)
-			fprintf(stderr, "warning: there is (probably) a hole in the mesh at layer %zd (best_dist = %f)\n", slice_index + 1, sqrt(best_dist));
+		if (iseg.head && oseg.head != oseg.tail) {
+			DEBUG("there is (probably) a hole in the mesh at layer %zd\n", slice_index + 1);
+			++slice->open_outlines;
+		}
 		goto next_poly;
 
+		link_segment:
+		if (flip_points) {
+			DEBUG("flipped segment %zd at layer %zd\n", segment_count, slice_index + 1);
+			++flip_count;
+			flip_segment(s);
+		}
+		LIST_REMOVE(&iseg, s);
+		LIST_ADD_TAIL(&oseg, s);
+		linked[s - slice->s] = true;
+		goto next_segment;
+
 		add_poly:
 		if (oseg.head) {
 			ClipperLib::Path poly;
@@ -1244,8 +2111,10 @@ static void generate_outlines(struct slice *slice, ssize_t slice_index)
 	if (config.simplify_insets && SIMPLIFY_EPSILON > 0.0)
 		for (struct island &island : slice->islands)
 			simplify_paths(island.insets[0], SIMPLIFY_EPSILON);
-	for (struct island &island : slice->islands)
+	for (struct island &island : slice->islands) {
 		find_bounding_box(&island);
+		island.outline_hash = hash_paths(island.insets[0]);
+	}
 }
 
 static void remove_overlap(ClipperLib::Paths &src, ClipperLib::Paths &dest, fl_t ratio)
@@ -1288,121 +2157,439 @@ static void do_offset_square(ClipperLib::Paths &src, ClipperLib::Paths &dest, fl
 		co.Execute(dest, FL_T_TO_CINT(dist));
 }
 
+/* Rotate closed paths so they start at the lower left corner. If 'rotations' is not NULL, it is set to how far each
+   path was rotated. */
+static void align_seams(ClipperLib::Paths &paths, std::vector<size_t> *rotations)
+{
+	if (rotations)
+		rotations->assign(paths.size(), 0);
+	for (size_t k = 0; k < paths.size(); ++k) {
+		ClipperLib::Path &p = paths[k];
+		if (p.size() >= 3) {
+			fl_t lowest = FL_T_INF;
+			auto best = p.begin();
+			for (auto it = best; it != p.end(); ++it) {
+				fl_t v = it->X + it->Y;
+				if (v < lowest) {
+					best = it;
+					lowest = v;
+				}
+			}
+			if (rotations)
+				(*rotations)[k] = best - p.begin();
+			std::rotate(p.begin(), best, p.end());
+		}
+	}
+}
+
+/* Undo align_seams() given the rotations it returned */
+static void unalign_seams(ClipperLib::Paths &paths, const std::vector<size_t> &rotations)
+{
+	for (size_t k = 0; k < paths.size() && k < rotations.size(); ++k)
+		std::rotate(paths[k].begin(), paths[k].end() - rotations[k], paths[k].end());
+}
+
 #define BOUND_OFFSET (config.extrusion_width / 8.0)
 #define BOUND_SIMPLIFY_EPSILON (BOUND_OFFSET / 2.0 * config.scale_constant)
-static void generate_insets(struct slice *slice)
+static void generate_insets(struct island *island)
 {
-	for (struct island &island : slice->islands) {
-		if (config.shells > 0) {
-			for (int i = 1; i < config.shells; ++i) {
-				do_offset(island.insets[i - 1], island.insets[i], -config.extrusion_width, 1.0);
-				if (config.simplify_insets && SIMPLIFY_EPSILON > 0.0)
-					simplify_paths(island.insets[i], SIMPLIFY_EPSILON);
-				if (island.insets[i].size() == 0)  /* break if nothing is being generated */
-					goto done;
-			}
-			do_offset(island.insets[config.shells - 1], island.infill_insets, (0.5 - config.infill_overlap) * -config.extrusion_width, 0.0);
-			if (SIMPLIFY_EPSILON > 0.0)
-				simplify_paths(island.infill_insets, SIMPLIFY_EPSILON);
-		}
-		else {
-			/* The offset distance here is not *technically* correct, but I'm not sure one can expect high dimensional accuracy when only printing infill anyway... */
-			island.infill_insets = island.insets[0];
+	if (config.shells > 0) {
+		for (int i = 1; i < config.shells; ++i) {
+			do_offset(island->insets[i - 1], island->insets[i], -config.extrusion_width, 1.0);
+			if (config.simplify_insets && SIMPLIFY_EPSILON > 0.0)
+				simplify_paths(island->insets[i], SIMPLIFY_EPSILON);
+			if (island->insets[i].size() == 0)  /* break if nothing is being generated */
+				goto done;
 		}
+		do_offset(island->insets[config.shells - 1], island->infill_insets, (0.5 - config.infill_overlap) * -config.extrusion_width, 0.0);
+		if (SIMPLIFY_EPSILON > 0.0)
+			simplify_paths(island->infill_insets, SIMPLIFY_EPSILON);
+	}
+	else {
+		/* The offset distance here is not *technically* correct, but I'm not sure one can expect high dimensional accuracy when only printing infill anyway... */
+		island->infill_insets = island->insets[0];
+	}
 
-		done:
-		do_offset(island.insets[0], island.boundaries, BOUND_OFFSET, 0.0);
-		simplify_paths(island.boundaries, BOUND_SIMPLIFY_EPSILON);
-		if (config.solid_infill_clip_offset > 0.0)
-			do_offset(island.infill_insets, island.solid_infill_clip, config.solid_infill_clip_offset, 0.0);
-		else
-			island.solid_infill_clip = island.infill_insets;
-		if (config.comb || config.generate_support) {
-			do_offset(island.insets[0], island.outer_boundaries, 0.5 * config.edge_width - config.edge_offset, 0.0);
-			simplify_paths(island.outer_boundaries, BOUND_SIMPLIFY_EPSILON);
-		}
-		if (config.comb) {
-			island.comb_paths = island.insets[0];
-			do_offset(island.outer_boundaries, island.outer_comb_paths, BOUND_OFFSET, 0.0);
-			simplify_paths(island.outer_comb_paths, BOUND_SIMPLIFY_EPSILON);
-		}
-		if (config.shells > 1 && config.fill_inset_gaps) {
-			ClipperLib::ClipperOffset co(config.offset_miter_limit, config.offset_arc_tolerance);
-			ClipperLib::Paths hole;
-			island.inset_gaps = new ClipperLib::Paths[config.shells - 1]();
-			if (!island.inset_gaps)
-				die(e_nomem, 2);
-			for (int i = 0; i < config.shells - 1 && island.insets[i].size() > 0; ++i) {
-				co.AddPaths(island.insets[i], config.inset_join_type, ClipperLib::etClosedPolygon);
-				hole = island.insets[i + 1];
-				ClipperLib::ReversePaths(hole);
-				co.AddPaths(hole, config.inset_join_type, ClipperLib::etClosedPolygon);
-				if (config.fill_threshold > 0.0) {
-					co.Execute(island.inset_gaps[i], FL_T_TO_CINT((0.5 + config.fill_threshold / 2.0) * -config.extrusion_width));
-					co.Clear();
-					co.AddPaths(island.inset_gaps[i], config.outset_join_type, ClipperLib::etClosedPolygon);
-					co.Execute(island.inset_gaps[i], FL_T_TO_CINT((config.infill_overlap + config.fill_threshold / 2.0) * config.extrusion_width));
-				}
-				else {
-					co.Execute(island.inset_gaps[i], FL_T_TO_CINT((0.5 - config.infill_overlap) * -config.extrusion_width));
-				}
+	done:
+	do_offset(island->insets[0], island->boundaries, BOUND_OFFSET, 0.0);
+	simplify_paths(island->boundaries, BOUND_SIMPLIFY_EPSILON);
+	if (config.solid_infill_clip_offset > 0.0)
+		do_offset(island->infill_insets, island->solid_infill_clip, config.solid_infill_clip_offset, 0.0);
+	else
+		island->solid_infill_clip = island->infill_insets;
+	if (config.comb || config.generate_support) {
+		do_offset(island->insets[0], island->outer_boundaries, 0.5 * config.edge_width - config.edge_offset, 0.0);
+		simplify_paths(island->outer_boundaries, BOUND_SIMPLIFY_EPSILON);
+	}
+	if (config.comb) {
+		island->comb_paths = island->insets[0];
+		do_offset(island->outer_boundaries, island->outer_comb_paths, BOUND_OFFSET, 0.0);
+		simplify_paths(island->outer_comb_paths, BOUND_SIMPLIFY_EPSILON);
+	}
+	if (config.shells > 1 && config.fill_inset_gaps) {
+		ClipperLib::ClipperOffset co(config.offset_miter_limit, config.offset_arc_tolerance);
+		ClipperLib::Paths hole;
+		island->inset_gaps = new ClipperLib::Paths[config.shells - 1]();
+		if (!island->inset_gaps)
+			die(e_nomem, 2);
+		for (int i = 0; i < config.shells - 1 && island->insets[i].size() > 0; ++i) {
+			co.AddPaths(island->insets[i], config.inset_join_type, ClipperLib::etClosedPolygon);
+			hole = island->insets[i + 1];
+			ClipperLib::ReversePaths(hole);
+			co.AddPaths(hole, config.inset_join_type, ClipperLib::etClosedPolygon);
+			if (config.fill_threshold > 0.0) {
+				co.Execute(island->inset_gaps[i], FL_T_TO_CINT((0.5 + config.fill_threshold / 2.0) * -config.extrusion_width));
 				co.Clear();
+				co.AddPaths(island->inset_gaps[i], config.outset_join_type, ClipperLib::etClosedPolygon);
+				co.Execute(island->inset_gaps[i], FL_T_TO_CINT((config.infill_overlap + config.fill_threshold / 2.0) * config.extrusion_width));
 			}
-		}
-		do_offset(island.infill_insets, island.constraining_edge, -BOUND_OFFSET, 0.0);
-		if (config.align_seams) {
-			for (int i = 0; i < ((config.align_interior_seams) ? config.shells : 1); ++i) {
-				for (ClipperLib::Path &p : island.insets[i]) {
-					if (p.size() >= 3) {
-						fl_t lowest = FL_T_INF;
-						auto best = p.begin();
-						for (auto it = best; it != p.end(); ++it) {
-							fl_t v = it->X + it->Y;
-							if (v < lowest) {
-								best = it;
-								lowest = v;
-							}
-						}
-						std::rotate(p.begin(), best, p.end());
-					}
-				}
+			else {
+				co.Execute(island->inset_gaps[i], FL_T_TO_CINT((0.5 - config.infill_overlap) * -config.extrusion_width));
 			}
+			co.Clear();
 		}
 	}
+	do_offset(island->infill_insets, island->constraining_edge, -BOUND_OFFSET, 0.0);
+	if (config.align_seams)
+		for (int i = 0; i < ((config.align_interior_seams) ? config.shells : 1); ++i)
+			align_seams(island->insets[i], (i == 0) ? &island->seam_rotations : NULL);
 }
 
-/* FIXME (maybe?): This function uses (0,0) as the origin. Perhaps the object center would be a better choice. */
-static void generate_line_fill_at_angle(ClipperLib::Paths &p, fl_t x0, fl_t y0, fl_t x1, fl_t y1, fl_t density, fl_t angle)
+static void copy_insets(struct island *island, const struct island *src)
+{
+	for (int i = 0; i < ((config.shells > 1) ? config.shells : 1); ++i)
+		island->insets[i] = src->insets[i];
+	if (config.shells > 1 && src->inset_gaps) {
+		island->inset_gaps = new ClipperLib::Paths[config.shells - 1]();
+		if (!island->inset_gaps)
+			die(e_nomem, 2);
+		for (int i = 0; i < config.shells - 1; ++i)
+			island->inset_gaps[i] = src->inset_gaps[i];
+	}
+	island->seam_rotations = src->seam_rotations;
+	island->infill_insets = src->infill_insets;
+	island->boundaries = src->boundaries;
+	island->comb_paths = src->comb_paths;
+	island->outer_boundaries = src->outer_boundaries;
+	island->outer_comb_paths = src->outer_comb_paths;
+	island->solid_infill_clip = src->solid_infill_clip;
+	island->constraining_edge = src->constraining_edge;
+}
+
+/* Find the range of line indices and the extent along the lines needed to cover the box (x0, y0)-(x1, y1) */
+static void get_line_fill_range(const struct line_fill_table *t, fl_t x0, fl_t y0, fl_t x1, fl_t y1, ssize_t *start, ssize_t *end, fl_t *min_x, fl_t *max_x)
 {
-	const fl_t sin_angle = sin(angle), cos_angle = cos(angle);
-	const fl_t sin_neg_angle = sin(-angle), cos_neg_angle = cos(-angle);
-	const fl_t move = config.extrusion_width / density;
 	/* compute rotated bounding box (all 4 corners) */
 	/* upper left */
-	const fl_t c0_x = x0 * cos_neg_angle - y0 * sin_neg_angle;
-	const fl_t c0_y = x0 * sin_neg_angle + y0 * cos_neg_angle;
+	const fl_t c0_x = x0 * t->cos_neg_angle - y0 * t->sin_neg_angle;
+	const fl_t c0_y = x0 * t->sin_neg_angle + y0 * t->cos_neg_angle;
 	/* lower left */
-	const fl_t c1_x = x0 * cos_neg_angle - y1 * sin_neg_angle;
-	const fl_t c1_y = x0 * sin_neg_angle + y1 * cos_neg_angle;
+	const fl_t c1_x = x0 * t->cos_neg_angle - y1 * t->sin_neg_angle;
+	const fl_t c1_y = x0 * t->sin_neg_angle + y1 * t->cos_neg_angle;
 	/* lower right */
-	const fl_t c2_x = x1 * cos_neg_angle - y1 * sin_neg_angle;
-	const fl_t c2_y = x1 * sin_neg_angle + y1 * cos_neg_angle;
+	const fl_t c2_x = x1 * t->cos_neg_angle - y1 * t->sin_neg_angle;
+	const fl_t c2_y = x1 * t->sin_neg_angle + y1 * t->cos_neg_angle;
 	/* upper right */
-	const fl_t c3_x = x1 * cos_neg_angle - y0 * sin_neg_angle;
-	const fl_t c3_y = x1 * sin_neg_angle + y0 * cos_neg_angle;
+	const fl_t c3_x = x1 * t->cos_neg_angle - y0 * t->sin_neg_angle;
+	const fl_t c3_y = x1 * t->sin_neg_angle + y0 * t->cos_neg_angle;
 	/* find start and end indices */
-	const ssize_t start = lround(floor(MINIMUM_4(c0_y, c1_y, c2_y, c3_y) / move));
-	const ssize_t end = lround(ceil(MAXIMUM_4(c0_y, c1_y, c2_y, c3_y) / move));
-	const fl_t min_x = MINIMUM_4(c0_x, c1_x, c2_x, c3_x);
-	const fl_t max_x = MAXIMUM_4(c0_x, c1_x, c2_x, c3_x);
+	*start = lround(floor(MINIMUM_4(c0_y, c1_y, c2_y, c3_y) / t->move));
+	*end = lround(ceil(MAXIMUM_4(c0_y, c1_y, c2_y, c3_y) / t->move));
+	*min_x = MINIMUM_4(c0_x, c1_x, c2_x, c3_x);
+	*max_x = MAXIMUM_4(c0_x, c1_x, c2_x, c3_x);
+}
+
+/* FIXME (maybe?): This function uses (0,0) as the origin. Perhaps the object center would be a better choice. */
+static void init_line_fill_table(struct line_fill_table *t, fl_t x0, fl_t y0, fl_t x1, fl_t y1, fl_t density, fl_t angle)
+{
+	ssize_t end;
+	fl_t min_x, max_x;
+	t->angle = angle;
+	t->density = density;
+	t->sin_angle = sin(angle);
+	t->cos_angle = cos(angle);
+	t->sin_neg_angle = sin(-angle);
+	t->cos_neg_angle = cos(-angle);
+	t->move = config.extrusion_width / density;
+	get_line_fill_range(t, x0, y0, x1, y1, &t->start, &end, &min_x, &max_x);
+	t->sin_y.clear();
+	t->cos_y.clear();
+	for (ssize_t i = t->start; i <= end; ++i) {
+		const fl_t y = t->move * i;
+		t->sin_y.push_back(t->sin_angle * y);
+		t->cos_y.push_back(t->cos_angle * y);
+	}
+}
+
+/* Append the lines of 't' that cover the box (x0, y0)-(x1, y1) to 'p'. Lines outside of the table are computed. */
+static void append_line_fill(ClipperLib::Paths &p, const struct line_fill_table *t, fl_t x0, fl_t y0, fl_t x1, fl_t y1)
+{
+	ssize_t start, end;
+	fl_t min_x, max_x;
+	get_line_fill_range(t, x0, y0, x1, y1, &start, &end, &min_x, &max_x);
+	const ssize_t t_end = t->start + (ssize_t) t->sin_y.size();
+	p.reserve(p.size() + MAXIMUM(end - start + 1, 0));
 	for (ssize_t i = start; i <= end; ++i) {
-		ClipperLib::Path line(2);
-		const fl_t y = move * i;
-		line[0].X = FL_T_TO_CINT(cos_angle * min_x - sin_angle * y);
-		line[0].Y = FL_T_TO_CINT(sin_angle * min_x + cos_angle * y);
-		line[1].X = FL_T_TO_CINT(cos_angle * max_x - sin_angle * y);
-		line[1].Y = FL_T_TO_CINT(sin_angle * max_x + cos_angle * y);
-		p.push_back(line);
+		fl_t sin_y, cos_y;
+		if (i >= t->start && i < t_end) {
+			sin_y = t->sin_y[i - t->start];
+			cos_y = t->cos_y[i - t->start];
+		}
+		else {
+			const fl_t y = t->move * i;
+			sin_y = t->sin_angle * y;
+			cos_y = t->cos_angle * y;
+		}
+		p.emplace_back(2);
+		ClipperLib::Path &line = p.back();
+		line[0].X = FL_T_TO_CINT(t->cos_angle * min_x - sin_y);
+		line[0].Y = FL_T_TO_CINT(t->sin_angle * min_x + cos_y);
+		line[1].X = FL_T_TO_CINT(t->cos_angle * max_x - sin_y);
+		line[1].Y = FL_T_TO_CINT(t->sin_angle * max_x + cos_y);
+	}
+}
+
+static void generate_line_fill_at_angle(ClipperLib::Paths &p, fl_t x0, fl_t y0, fl_t x1, fl_t y1, fl_t density, fl_t angle)
+{
+	struct line_fill_table t;
+	init_line_fill_table(&t, x0, y0, x1, y1, density, angle);
+	append_line_fill(p, &t, x0, y0, x1, y1);
+}
+
+/* Scanline clipping of line fills against closed polygons. This produces the same segments, in the same order, as
+   a ClipperLib intersection of the lines (as open subject paths) with the polygons using pftNonZero followed by
+   OpenPathsFromPolyTree(), but without building a PolyTree. The intersection points are computed the same way
+   ClipperLib::IntersectPoint() computes them. */
+#define LINE_CLIP_HORIZONTAL (-1.0E+40)
+
+static ClipperLib::cInt clipper_round(fl_t v)
+{
+	return (v < 0.0) ? (ClipperLib::cInt) (v - 0.5) : (ClipperLib::cInt) (v + 0.5);
+}
+
+static void init_line_clip_edge(struct line_clip_edge *e, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+{
+	e->p0 = p0;
+	e->p1 = p1;
+	e->bot = (p0.Y >= p1.Y) ? p0 : p1;
+	e->top = (p0.Y >= p1.Y) ? p1 : p0;
+	const ClipperLib::cInt dy = e->top.Y - e->bot.Y;
+	e->dx = (dy == 0) ? LINE_CLIP_HORIZONTAL : (fl_t) (e->top.X - e->bot.X) / dy;
+}
+
+static ClipperLib::cInt line_clip_edge_x(const struct line_clip_edge *e, ClipperLib::cInt y)
+{
+	return (y == e->top.Y) ? e->top.X : e->bot.X + clipper_round(e->dx * (y - e->bot.Y));
+}
+
+/* 'e1' must be the edge with the smaller dx (the left edge below the intersection) */
+static ClipperLib::IntPoint intersect_line_clip_edges(const struct line_clip_edge *e1, const struct line_clip_edge *e2)
+{
+	ClipperLib::IntPoint ip;
+	if (e1->dx == LINE_CLIP_HORIZONTAL) {
+		ip.Y = e1->bot.Y;
+		ip.X = line_clip_edge_x(e2, ip.Y);
+		return ip;
+	}
+	else if (e1->dx == 0.0) {
+		ip.X = e1->bot.X;
+		ip.Y = clipper_round(ip.X / e2->dx + (e2->bot.Y - e2->bot.X / e2->dx));
+	}
+	else if (e2->dx == 0.0) {
+		ip.X = e2->bot.X;
+		ip.Y = clipper_round(ip.X / e1->dx + (e1->bot.Y - e1->bot.X / e1->dx));
+	}
+	else {
+		const fl_t b1 = e1->bot.X - e1->bot.Y * e1->dx, b2 = e2->bot.X - e2->bot.Y * e2->dx;
+		const fl_t q = (b2 - b1) / (e1->dx - e2->dx);
+		ip.Y = clipper_round(q);
+		ip.X = (fabs(e1->dx) < fabs(e2->dx)) ? clipper_round(e1->dx * q + b1) : clipper_round(e2->dx * q + b2);
+	}
+	if (ip.Y < e1->top.Y || ip.Y < e2->top.Y) {
+		ip.Y = MAXIMUM(e1->top.Y, e2->top.Y);
+		ip.X = (fabs(e1->dx) < fabs(e2->dx)) ? line_clip_edge_x(e1, ip.Y) : line_clip_edge_x(e2, ip.Y);
+	}
+	return ip;
+}
+
+static void add_line_clip_paths(std::vector<struct line_clip_edge> &edges, const ClipperLib::Paths &paths)
+{
+	for (const ClipperLib::Path &p : paths) {
+		size_t n = p.size();
+		while (n > 1 && p[n - 1] == p[0])
+			--n;
+		if (n < 3)
+			continue;
+		for (size_t i = 0; i < n; ++i) {
+			const ClipperLib::IntPoint &p0 = p[i], &p1 = p[(i + 1 < n) ? i + 1 : 0];
+			if (p0 != p1) {
+				struct line_clip_edge e;
+				init_line_clip_edge(&e, p0, p1);
+				edges.push_back(e);
+			}
+		}
+	}
+}
+
+/* Find the crossings of the parallel lines starting at lines[start]. 'offsets' holds the (increasing) offset of each
+   line along the normal of (ux, uy). */
+static void find_line_crossings(const ClipperLib::Paths &lines, size_t start, const std::vector<fl_t> &offsets, fl_t ux, fl_t uy, fl_t margin, const std::vector<struct line_clip_edge> &edges, std::vector<struct line_crossing> &crossings)
+{
+	for (const struct line_clip_edge &e : edges) {
+		const fl_t d0 = e.p0.Y * ux - e.p0.X * uy, d1 = e.p1.Y * ux - e.p1.X * uy;
+		const fl_t hi = MAXIMUM(d0, d1) + margin;
+		for (size_t i = std::lower_bound(offsets.begin(), offsets.end(), MINIMUM(d0, d1) - margin) - offsets.begin(); i < offsets.size() && offsets[i] <= hi; ++i) {
+			const ClipperLib::IntPoint &a = lines[start + i][0], &b = lines[start + i][1];
+			const ClipperLib::cInt vx = b.X - a.X, vy = b.Y - a.Y;
+			const ClipperLib::cInt s0 = vx * (e.p0.Y - a.Y) - vy * (e.p0.X - a.X);
+			const ClipperLib::cInt s1 = vx * (e.p1.Y - a.Y) - vy * (e.p1.X - a.X);
+			if ((s0 > 0) == (s1 > 0))
+				continue;
+			struct line_clip_edge le;
+			init_line_clip_edge(&le, a, b);
+			struct line_crossing c;
+			c.line = start + i;
+			c.p = (le.dx < e.dx) ? intersect_line_clip_edges(&le, &e) : intersect_line_clip_edges(&e, &le);
+			c.t = (c.p.X - a.X) * vx + (c.p.Y - a.Y) * vy;
+			c.wind = (s0 > 0) ? -1 : 1;
+			crossings.push_back(c);
+		}
+	}
+}
+
+/* Returns the endpoint that ClipperLib reaches first when scanning (largest y, then smallest x). Segments of
+   horizontal lines are reversed and keep the order of the line they came from. */
+static ClipperLib::IntPoint clipped_line_sort_key(const ClipperLib::Path &p)
+{
+	if (p[0].Y == p[1].Y)
+		return ClipperLib::IntPoint((p[0].X > p[1].X) ? p[0].X : -p[0].X, p[0].Y);
+	return (p[0].Y > p[1].Y) ? p[0] : p[1];
+}
+
+static void clip_lines(const ClipperLib::Paths &lines, const std::vector<struct line_clip_edge> &edges, ClipperLib::Paths &dest)
+{
+	std::vector<struct line_crossing> crossings;
+	std::vector<fl_t> offsets;
+	dest.clear();
+	/* Split the lines into sets of parallel lines with increasing offsets and find the crossings of each set */
+	for (size_t start = 0, end; start < lines.size(); start = end) {
+		const fl_t vx = lines[start][1].X - lines[start][0].X, vy = lines[start][1].Y - lines[start][0].Y;
+		const fl_t len = sqrt(vx * vx + vy * vy);
+		if (len == 0.0) {
+			end = start + 1;
+			continue;
+		}
+		const fl_t ux = vx / len, uy = vy / len;
+		fl_t margin = 2.0;
+		offsets.clear();
+		for (end = start; end < lines.size(); ++end) {
+			const ClipperLib::IntPoint &a = lines[end][0], &b = lines[end][1];
+			const fl_t d0 = a.Y * ux - a.X * uy, d1 = b.Y * ux - b.X * uy;
+			if ((b.X - a.X) * ux + (b.Y - a.Y) * uy <= 0.0 || fabs(d1 - d0) > len * 1e-3 || (offsets.size() > 0 && d0 <= offsets.back()))
+				break;
+			margin = MAXIMUM(margin, fabs(d1 - d0) + 2.0);
+			offsets.push_back(d0);
+		}
+		find_line_crossings(lines, start, offsets, ux, uy, margin, edges, crossings);
+	}
+	std::sort(crossings.begin(), crossings.end(),
+		[](const struct line_crossing &a, const struct line_crossing &b) { return (a.line != b.line) ? a.line < b.line : a.t < b.t; });
+	/* Walk each line and emit the segments with a non-zero winding number */
+	for (size_t k = 0; k < crossings.size();) {
+		const size_t line = crossings[k].line;
+		const ClipperLib::IntPoint &a = lines[line][0], &b = lines[line][1];
+		const ClipperLib::cInt len = (b.X - a.X) * (b.X - a.X) + (b.Y - a.Y) * (b.Y - a.Y);
+		const struct line_crossing *seg_start = NULL;
+		size_t prev = dest.size();  /* Last segment emitted for this line */
+		int wind = 0;
+		for (; k < crossings.size() && crossings[k].line == line; ++k) {
+			const struct line_crossing *c = &crossings[k];
+			if (wind == 0)
+				seg_start = c;
+			wind += c->wind;
+			if (wind == 0 && c->t > 0 && seg_start->t < len) {
+				ClipperLib::Path seg(2);
+				seg[0] = (seg_start->t < 0) ? a : seg_start->p;
+				seg[1] = (c->t > len) ? b : c->p;
+				if (seg[0] != seg[1]) {
+					/* ClipperLib joins segments that touch (where the line passes through a vertex) */
+					if (prev < dest.size() && dest[prev][(a.Y == b.Y) ? 0 : 1] == seg[0])
+						dest[prev][(a.Y == b.Y) ? 0 : 1] = seg[1];
+					else {
+						if (a.Y == b.Y)
+							std::swap(seg[0], seg[1]);
+						prev = dest.size();
+						dest.push_back(seg);
+					}
+				}
+			}
+		}
+	}
+	std::stable_sort(dest.begin(), dest.end(), [](const ClipperLib::Path &a, const ClipperLib::Path &b) {
+		const ClipperLib::IntPoint ka = clipped_line_sort_key(a), kb = clipped_line_sort_key(b);
+		return (ka.Y != kb.Y) ? ka.Y > kb.Y : ka.X < kb.X;
+	});
+}
+
+static void clip_lines(const ClipperLib::Paths &lines, const ClipperLib::Paths &clip, ClipperLib::Paths &dest)
+{
+	std::vector<struct line_clip_edge> edges;
+	add_line_clip_paths(edges, clip);
+	clip_lines(lines, edges, dest);
+}
+
+/* The infill angle repeats every 2 layers (every 6 for triangle2). Layers that are a multiple of this apart get
+   bitwise identical infill lines, so their infill may be copied (see find_infill_sources()). */
+static ssize_t get_infill_period(void)
+{
+	return (config.infill_pattern == FILL_PATTERN_TRIANGLE2) ? 6 : 2;
+}
+
+/* Get the angle and density of each set of lines in a fill pattern. The angle is computed from the layer's phase in
+   the pattern's period rather than from slice_index itself, so that it does not drift with slice_index and the
+   tables built for one period cover every layer. */
+static int get_infill_line_sets(fl_t density, fl_t angle, fill_pattern pattern, ssize_t slice_index, fl_t *set_density, fl_t *set_angle)
+{
+	const fl_t angle_rad = angle / 180.0 * M_PI;
+	switch (pattern) {
+	case FILL_PATTERN_GRID:
+		set_density[0] = set_density[1] = density / 2.0;
+		set_angle[0] = angle_rad;
+		set_angle[1] = angle_rad + M_PI_2;
+		return 2;
+	case FILL_PATTERN_TRIANGLE:
+		set_density[0] = set_density[1] = set_density[2] = density / 3.0;
+		set_angle[0] = angle_rad;
+		set_angle[1] = angle_rad + M_PI / 3.0;
+		set_angle[2] = angle_rad + 2.0 * M_PI / 3.0;
+		return 3;
+	case FILL_PATTERN_TRIANGLE2:
+		set_density[0] = density;
+		set_angle[0] = angle_rad + (fl_t) (slice_index % 6) * M_PI / 3.0;
+		return 1;
+	case FILL_PATTERN_RECTILINEAR:
+	default:
+		set_density[0] = density;
+		set_angle[0] = angle_rad + (fl_t) (slice_index % 2) * M_PI / 2.0;
+		return 1;
+	}
+}
+
+static void add_infill_tables(struct object *o, fl_t x0, fl_t y0, fl_t x1, fl_t y1, fl_t density, fl_t angle, fill_pattern pattern)
+{
+	fl_t set_density[3], set_angle[3];
+	for (ssize_t phase = 0; phase < 6; ++phase) {
+		const int n = get_infill_line_sets(density, angle, pattern, phase, set_density, set_angle);
+		for (int i = 0; i < n; ++i) {
+			bool found = false;
+			for (const struct line_fill_table &t : o->infill_tables)
+				if (t.angle == set_angle[i] && t.density == set_density[i])
+					found = true;
+			if (!found) {
+				o->infill_tables.emplace_back();
+				init_line_fill_table(&o->infill_tables.back(), x0, y0, x1, y1, set_density[i], set_angle[i]);
+			}
+		}
 	}
 }
 
@@ -1412,40 +2599,52 @@ static void generate_infill_patterns(struct object *o)
 	const fl_t x_len_2 = (o->w + config.xy_extra) / 2.0, y_len_2 = (o->d + config.xy_extra) / 2.0;
 	const fl_t x0 = o->c.x - x_len_2, y0 = o->c.y - y_len_2, x1 = o->c.x + x_len_2, y1 = o->c.y + y_len_2;
 	const fl_t solid_infill_angle_rad = config.solid_infill_angle / 180.0 * M_PI;
+	/* The raft is shared by every copy, so its patterns must cover all of them */
+	fl_t rx0 = x0, ry0 = y0, rx1 = x1, ry1 = y1;
+	for (size_t i = 0; i < o->copies.size(); ++i) {
+		const fl_t cx = CINT_TO_FL_T(o->copies[i].X), cy = CINT_TO_FL_T(o->copies[i].Y);
+		rx0 = (i == 0) ? x0 + cx : MINIMUM(rx0, x0 + cx);
+		ry0 = (i == 0) ? y0 + cy : MINIMUM(ry0, y0 + cy);
+		rx1 = (i == 0) ? x1 + cx : MAXIMUM(rx1, x1 + cx);
+		ry1 = (i == 0) ? y1 + cy : MAXIMUM(ry1, y1 + cy);
+	}
 
 	if (config.generate_raft || (config.generate_support && config.solid_support_base)) {
 		/* generate_line_fill_at_angle(o->solid_infill_patterns[0], x0, y0, x1, y1, 1.0, solid_infill_angle_rad); */  /* The raft and support code only uses solid_infill_patterns[1] */
-		generate_line_fill_at_angle(o->solid_infill_patterns[1], x0, y0, x1, y1, 1.0, solid_infill_angle_rad + M_PI_2);
+		generate_line_fill_at_angle(o->solid_infill_patterns[1], rx0, ry0, rx1, ry1, 1.0, solid_infill_angle_rad + M_PI_2);
 	}
 	if (config.generate_support) {  /* +- 45deg from solid infill angle */
 		generate_line_fill_at_angle(o->support_pattern, x0, y0, x1, y1, config.support_density, solid_infill_angle_rad - M_PI_4);
 		generate_line_fill_at_angle(o->support_interface_pattern, x0, y0, x1, y1, config.interface_density, solid_infill_angle_rad + M_PI_4);
 	}
 	if (config.generate_raft)
-		generate_line_fill_at_angle(o->raft_base_layer_pattern, x0, y0, x1, y1, (config.extrusion_width / config.raft_base_layer_width) * config.raft_base_layer_density, solid_infill_angle_rad);
+		generate_line_fill_at_angle(o->raft_base_layer_pattern, rx0, ry0, rx1, ry1, (config.extrusion_width / config.raft_base_layer_width) * config.raft_base_layer_density, solid_infill_angle_rad);
+	o->infill_tables.clear();
+	add_infill_tables(o, x0, y0, x1, y1, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR);
+	if (config.infill_density > 0.0 && config.infill_density < 1.0)
+		add_infill_tables(o, x0, y0, x1, y1, config.infill_density, config.sparse_infill_angle, config.infill_pattern);
+	if (config.iron_top_surface && config.roof_layers > 0)
+		add_infill_tables(o, x0, y0, x1, y1, config.iron_density, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR);
 }
 
-static void generate_infill_for_box(ClipperLib::Paths &p, const struct cint_rect &box, fl_t density, fl_t angle, fill_pattern pattern, ssize_t slice_index)
+static void generate_infill_for_box(const struct object *o, ClipperLib::Paths &p, const struct cint_rect &box, fl_t density, fl_t angle, fill_pattern pattern, ssize_t slice_index)
 {
 	if (density > 0.0) {
-		const fl_t angle_rad = angle / 180.0 * M_PI;
+		fl_t set_density[3], set_angle[3];
 		const fl_t x0 = CINT_TO_FL_T(box.x0), y0 = CINT_TO_FL_T(box.y0), x1 = CINT_TO_FL_T(box.x1), y1 = CINT_TO_FL_T(box.y1);
-		switch (pattern) {
-		case FILL_PATTERN_GRID:
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density / 2.0, angle_rad);
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density / 2.0, angle_rad + M_PI_2);
-			break;
-		case FILL_PATTERN_TRIANGLE:
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density / 3.0, angle_rad);
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density / 3.0, angle_rad + M_PI / 3.0);
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density / 3.0, angle_rad + 2.0 * M_PI / 3.0);
-			break;
-		case FILL_PATTERN_TRIANGLE2:
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density, angle_rad + (fl_t) slice_index * M_PI / 3.0);
-			break;
-		case FILL_PATTERN_RECTILINEAR:
-		default:
-			generate_line_fill_at_angle(p, x0, y0, x1, y1, density, angle_rad + (fl_t) slice_index * M_PI / 2.0);
+		const int n = get_infill_line_sets(density, angle, pattern, slice_index, set_density, set_angle);
+		for (int i = 0; i < n; ++i) {
+			const struct line_fill_table *table = NULL;
+			for (const struct line_fill_table &t : o->infill_tables) {
+				if (t.angle == set_angle[i] && t.density == set_density[i]) {
+					table = &t;
+					break;
+				}
+			}
+			if (table)
+				append_line_fill(p, table, x0, y0, x1, y1);
+			else
+				generate_line_fill_at_angle(p, x0, y0, x1, y1, set_density[i], set_angle[i]);
 		}
 	}
 }
@@ -1457,7 +2656,7 @@ static void generate_infill(struct object *o, ssize_t slice_index)
 	for (struct island &island : o->slices[slice_index].islands) {
 		ClipperLib::Clipper c;
 		ClipperLib::ClipperOffset co(config.offset_miter_limit, config.offset_arc_tolerance);  /* for building island.solid_infill_boundaries */
-		ClipperLib::PolyTree s;
+		std::vector<struct line_clip_edge> clip_edges;  /* for clipping solid infill lines */
 		ClipperLib::Paths s_tmp;
 		ClipperLib::Paths solid_infill_pattern, sparse_infill_pattern;
 		if (config.roof_layers > 0) {
@@ -1489,36 +2688,29 @@ static void generate_infill(struct object *o, ssize_t slice_index)
 				if (iron_areas.size() > 0) {
 					remove_overlap(iron_areas, iron_areas, 1.0);
 					ClipperLib::Paths iron_pattern;
-					generate_infill_for_box(iron_pattern, island.box, config.iron_density, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index + 1);
-					c.AddPaths(iron_pattern, ClipperLib::ptSubject, false);
-					c.AddPaths(iron_areas, ClipperLib::ptClip, true);
-					c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-					c.Clear();
-					ClipperLib::OpenPathsFromPolyTree(s, island.iron_paths);
-					s.Clear();
+					generate_infill_for_box(o, iron_pattern, island.box, config.iron_density, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index + 1);
+					clip_lines(iron_pattern, iron_areas, island.iron_paths);
 				}
 			}
 		}
 		if (config.infill_density == 1.0 || slice_index < config.floor_layers || slice_index + config.roof_layers >= o->n_slices) {
 			if (config.fill_threshold > 0.0) {
 				remove_overlap(island.infill_insets, s_tmp, config.fill_threshold);
-				c.AddPaths(s_tmp, ClipperLib::ptClip, true);
+				add_line_clip_paths(clip_edges, s_tmp);
 				co.AddPaths(s_tmp, config.outset_join_type, ClipperLib::etClosedPolygon);
 			}
 			else {
-				c.AddPaths(island.infill_insets, ClipperLib::ptClip, true);
+				add_line_clip_paths(clip_edges, island.infill_insets);
 				co.AddPaths(island.infill_insets, config.outset_join_type, ClipperLib::etClosedPolygon);
 			}
-			generate_infill_for_box(solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
-			c.AddPaths(solid_infill_pattern, ClipperLib::ptSubject, false);
+			generate_infill_for_box(o, solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
 			if (config.fill_inset_gaps) {
 				for (int i = 0; i < config.shells - 1; ++i) {
-					c.AddPaths(island.inset_gaps[i], ClipperLib::ptClip, true);
+					add_line_clip_paths(clip_edges, island.inset_gaps[i]);
 					co.AddPaths(island.inset_gaps[i], config.outset_join_type, ClipperLib::etClosedPolygon);
 				}
 			}
-			c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-			ClipperLib::OpenPathsFromPolyTree(s, island.solid_infill);
+			clip_lines(solid_infill_pattern, clip_edges, island.solid_infill);
 			co.Execute(island.solid_infill_boundaries, FL_T_TO_CINT(BOUND_OFFSET));
 			simplify_paths(island.solid_infill_boundaries, BOUND_SIMPLIFY_EPSILON);
 		}
@@ -1548,19 +2740,16 @@ static void generate_infill(struct object *o, ssize_t slice_index)
 				c.Execute(ClipperLib::ctIntersection, s_tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
 				c.Clear();
 			}
-			generate_infill_for_box(solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
-			c.AddPaths(solid_infill_pattern, ClipperLib::ptSubject, false);
-			c.AddPaths(s_tmp, ClipperLib::ptClip, true);
+			generate_infill_for_box(o, solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
+			add_line_clip_paths(clip_edges, s_tmp);
 			co.AddPaths(s_tmp, config.outset_join_type, ClipperLib::etClosedPolygon);
 			if (config.fill_inset_gaps) {
 				for (int i = 0; i < config.shells - 1; ++i) {
-					c.AddPaths(island.inset_gaps[i], ClipperLib::ptClip, true);
+					add_line_clip_paths(clip_edges, island.inset_gaps[i]);
 					co.AddPaths(island.inset_gaps[i], config.outset_join_type, ClipperLib::etClosedPolygon);
 				}
 			}
-			c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-			c.Clear();
-			ClipperLib::OpenPathsFromPolyTree(s, island.solid_infill);
+			clip_lines(solid_infill_pattern, clip_edges, island.solid_infill);
 			co.Execute(island.solid_infill_boundaries, FL_T_TO_CINT(BOUND_OFFSET));
 			simplify_paths(island.solid_infill_boundaries, BOUND_SIMPLIFY_EPSILON);
 
@@ -1571,36 +2760,24 @@ static void generate_infill(struct object *o, ssize_t slice_index)
 				c.Clear();
 				if (config.fill_threshold > 0.0)
 					remove_overlap(s_tmp, s_tmp, config.fill_threshold);
-				generate_infill_for_box(sparse_infill_pattern, island.box, config.infill_density, config.sparse_infill_angle, config.infill_pattern, slice_index);
-				c.AddPaths(sparse_infill_pattern, ClipperLib::ptSubject, false);
-				c.AddPaths(s_tmp, ClipperLib::ptClip, true);
-				c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-				ClipperLib::OpenPathsFromPolyTree(s, island.sparse_infill);
+				generate_infill_for_box(o, sparse_infill_pattern, island.box, config.infill_density, config.sparse_infill_angle, config.infill_pattern, slice_index);
+				clip_lines(sparse_infill_pattern, s_tmp, island.sparse_infill);
 			}
 		}
 		else {
 			if (config.infill_density > 0.0) {
-				if (config.fill_threshold > 0.0) {
+				if (config.fill_threshold > 0.0)
 					remove_overlap(island.infill_insets, s_tmp, config.fill_threshold);
-					c.AddPaths(s_tmp, ClipperLib::ptClip, true);
-				}
-				else
-					c.AddPaths(island.infill_insets, ClipperLib::ptClip, true);
-				generate_infill_for_box(sparse_infill_pattern, island.box, config.infill_density, config.sparse_infill_angle, config.infill_pattern, slice_index);
-				c.AddPaths(sparse_infill_pattern, ClipperLib::ptSubject, false);
-				c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-				ClipperLib::OpenPathsFromPolyTree(s, island.sparse_infill);
+				generate_infill_for_box(o, sparse_infill_pattern, island.box, config.infill_density, config.sparse_infill_angle, config.infill_pattern, slice_index);
+				clip_lines(sparse_infill_pattern, (config.fill_threshold > 0.0) ? s_tmp : island.infill_insets, island.sparse_infill);
 			}
 			if (config.fill_inset_gaps) {
-				c.Clear();
-				generate_infill_for_box(solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
-				c.AddPaths(solid_infill_pattern, ClipperLib::ptSubject, false);
+				generate_infill_for_box(o, solid_infill_pattern, island.box, 1.0, config.solid_infill_angle, FILL_PATTERN_RECTILINEAR, slice_index);
 				for (int i = 0; i < config.shells - 1; ++i) {
-					c.AddPaths(island.inset_gaps[i], ClipperLib::ptClip, true);
+					add_line_clip_paths(clip_edges, island.inset_gaps[i]);
 					co.AddPaths(island.inset_gaps[i], config.outset_join_type, ClipperLib::etClosedPolygon);
 				}
-				c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-				ClipperLib::OpenPathsFromPolyTree(s, island.solid_infill);
+				clip_lines(solid_infill_pattern, clip_edges, island.solid_infill);
 				co.Execute(island.solid_infill_boundaries, FL_T_TO_CINT(BOUND_OFFSET));
 				simplify_paths(island.solid_infill_boundaries, BOUND_SIMPLIFY_EPSILON);
 			}
@@ -1617,6 +2794,19 @@ static void generate_infill(struct object *o, ssize_t slice_index)
 	}
 }
 
+static void copy_infill(struct slice *slice, const struct slice *src)
+{
+	for (size_t i = 0; i < slice->islands.size(); ++i) {
+		struct island *island = &slice->islands[i];
+		const struct island *src_island = &src->islands[i];
+		island->exposed_surface = src_island->exposed_surface;
+		island->iron_paths = src_island->iron_paths;
+		island->solid_infill = src_island->solid_infill;
+		island->solid_infill_boundaries = src_island->solid_infill_boundaries;
+		island->sparse_infill = src_island->sparse_infill;
+	}
+}
+
 static void generate_layer_support_map(struct object *o, ssize_t slice_index)
 {
 	if (slice_index < config.support_vert_margin + 1)
@@ -1646,83 +2836,291 @@ static void generate_support_boundaries(struct slice *slice)
 	simplify_paths(slice->support_boundaries, BOUND_SIMPLIFY_EPSILON);
 }
 
-static void extend_support_downward(struct object *o, const ClipperLib::PolyNode *n, ssize_t slice_index)
+/* The state of the top-down support sweep between layers: the connected parts of the regions that need support,
+   carried down from the layers above. Each part is an outer path followed by its holes. */
+struct support_sweep {
+	std::vector<ClipperLib::Paths> parts;
+};
+
+static struct cint_rect find_path_bounds(const ClipperLib::Path &p)
 {
-	ClipperLib::Paths p, tmp;
-	struct slice *slice = &o->slices[slice_index];
-	p.push_back(n->Contour);
-	for (const ClipperLib::PolyNode *c : n->Childs)
-		p.push_back(c->Contour);
-	for (ssize_t k = slice_index; k >= 0; --k) {
-		ClipperLib::Clipper c;
-		c.AddPaths(p, ClipperLib::ptSubject, true);
-		for (ssize_t i = (k >= config.support_vert_margin) ? -config.support_vert_margin : -k; k + i <= o->n_slices && i <= config.support_vert_margin; ++i)
-			c.AddPaths(o->slices[k + i].support_boundaries, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctDifference, tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		slice->support_map_clipped_paths[k].insert(slice->support_map_clipped_paths[k].end(), tmp.begin(), tmp.end());
-		if (tmp.size() == 0)
-			break;
+	struct cint_rect r = { p[0].X, p[0].Y, p[0].X, p[0].Y };
+	for (const ClipperLib::IntPoint &pt : p) {
+		r.x0 = MINIMUM(r.x0, pt.X);
+		r.y0 = MINIMUM(r.y0, pt.Y);
+		r.x1 = MAXIMUM(r.x1, pt.X);
+		r.y1 = MAXIMUM(r.y1, pt.Y);
 	}
+	return r;
 }
 
-static void generate_support_map_clipped_paths(struct object *o, const ClipperLib::PolyNode *n, ssize_t slice_index)
+/* Append the connected parts below 'n' to 'parts', including the ones in holes */
+static void add_support_parts(const ClipperLib::PolyNode *n, std::vector<ClipperLib::Paths> &parts)
 {
 	for (const ClipperLib::PolyNode *c : n->Childs) {
-		extend_support_downward(o, c, slice_index);
+		ClipperLib::Paths part;
+		part.push_back(c->Contour);
+		for (const ClipperLib::PolyNode *cc : c->Childs)
+			part.push_back(cc->Contour);
+		parts.push_back(std::move(part));
 		for (const ClipperLib::PolyNode *cc : c->Childs)
-			generate_support_map_clipped_paths(o, cc, slice_index);
+			add_support_parts(cc, parts);
 	}
 }
 
-static void generate_support_maps(struct object *o, ssize_t slice_index)
+/* Union the carried parts with the regions that need support starting at this layer */
+static void add_support_regions(struct support_sweep *sw, const ClipperLib::Paths &regions)
 {
-	struct slice *slice = &o->slices[slice_index];
-	if (config.support_everywhere || slice->support_map_clipped_paths[0].size() > 0)
-		for (ssize_t k = 0; k <= slice_index; ++k)
-			o->slices[k].support_map.insert(o->slices[k].support_map.end(), slice->support_map_clipped_paths[k].begin(), slice->support_map_clipped_paths[k].end());
+	if (regions.size() == 0)
+		return;
+	ClipperLib::Clipper c;
+	ClipperLib::PolyTree tree;
+	for (const ClipperLib::Paths &part : sw->parts)
+		c.AddPaths(part, ClipperLib::ptSubject, true);
+	c.AddPaths(regions, ClipperLib::ptSubject, true);
+	c.Execute(ClipperLib::ctUnion, tree, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+	sw->parts.clear();
+	add_support_parts(&tree, sw->parts);
 }
 
-static void union_support_maps(struct slice *slice)
+/* Remove the support boundaries of layers k - support_vert_margin through k + support_vert_margin from the carried
+   parts, all in one clip */
+static void clip_support_parts(const struct object *o, const struct support_sweep *sw, ssize_t k, ClipperLib::Paths &map)
 {
-	ClipperLib::SimplifyPolygons(slice->support_map, ClipperLib::pftNonZero);
+	map.clear();
+	if (sw->parts.size() == 0)
+		return;
+	ClipperLib::Clipper c;
+	for (const ClipperLib::Paths &part : sw->parts)
+		c.AddPaths(part, ClipperLib::ptSubject, true);
+	for (ssize_t i = MAXIMUM(k - config.support_vert_margin, 0); i < o->n_slices && i <= k + config.support_vert_margin; ++i)
+		c.AddPaths(o->slices[i].support_boundaries, ClipperLib::ptClip, true);
+	c.Execute(ClipperLib::ctDifference, map, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
 }
 
-static void remove_supports_not_touching_build_plate(struct object *o)
+/* Mark the parts that 'pt' is inside of or on the boundary of as live. Returns false if there are none. */
+static bool mark_support_parts(const std::vector<ClipperLib::Paths> &parts, const std::vector<struct cint_rect> &bounds, const ClipperLib::IntPoint &pt, std::vector<char> &live)
 {
-	if (o->n_slices < 1)
-		return;
-	ClipperLib::Clipper c;
-	ClipperLib::Paths clip_paths;
-	clip_paths.insert(clip_paths.end(), o->slices[0].support_boundaries.begin(), o->slices[0].support_boundaries.end());
-	for (ssize_t i = 1; i < o->n_slices; ++i) {
-		clip_paths.insert(clip_paths.end(), o->slices[i].support_boundaries.begin(), o->slices[i].support_boundaries.end());
-		ClipperLib::SimplifyPolygons(clip_paths, ClipperLib::pftNonZero);
-		c.AddPaths(o->slices[i].support_map, ClipperLib::ptSubject, true);
-		c.AddPaths(clip_paths, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctDifference, o->slices[i].support_map, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		c.Clear();
+	bool found = false;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		const struct cint_rect &r = bounds[i];
+		if (pt.X < r.x0 || pt.X > r.x1 || pt.Y < r.y0 || pt.Y > r.y1 || ClipperLib::PointInPolygon(pt, parts[i][0]) == 0)
+			continue;
+		bool in_hole = false;
+		for (size_t h = 1; h < parts[i].size() && !in_hole; ++h)
+			in_hole = (ClipperLib::PointInPolygon(pt, parts[i][h]) == 1);
+		if (!in_hole) {
+			live[i] = true;
+			found = true;
+		}
 	}
+	return found;
 }
 
-static void generate_support_interface_clip_regions(struct slice *slice)
+/* Find the indices of the parts that the support boundaries cover completely, which are the ones that no outer path
+   of 'map' lies in. Each outer path is placed by the first of its vertices that is inside or on the boundary of a
+   part. The vertices where the boundaries cross a part are rounded, so they may lie just outside of it, and a vertex
+   where two parts touch keeps both. If no vertex is placed, every part whose bounds overlap the path is kept. */
+static void find_covered_support_parts(const struct support_sweep *sw, const ClipperLib::Paths &map, std::vector<size_t> &covered)
 {
-	do_offset_square(slice->support_map, slice->support_interface_clip, config.interface_clip_offset, 0.0);
+	const size_t n = sw->parts.size();
+	std::vector<char> live(n, (n == 1 && map.size() > 0));
+	std::vector<struct cint_rect> bounds(n);
+	for (size_t i = 0; i < n && n > 1; ++i)
+		bounds[i] = find_path_bounds(sw->parts[i][0]);
+	for (size_t i = 0; i < map.size() && n > 1; ++i) {
+		if (!ClipperLib::Orientation(map[i]))
+			continue;
+		bool found = false;
+		for (size_t j = 0; j < map[i].size() && !found; ++j)
+			found = mark_support_parts(sw->parts, bounds, map[i][j], live);
+		if (!found) {
+			const struct cint_rect r = find_path_bounds(map[i]);
+			for (size_t j = 0; j < n; ++j)
+				if (r.x0 <= bounds[j].x1 && r.x1 >= bounds[j].x0 && r.y0 <= bounds[j].y1 && r.y1 >= bounds[j].y0)
+					live[j] = true;
+		}
+	}
+	for (size_t i = 0; i < n; ++i)
+		if (!live[i])
+			covered.push_back(i);
 }
 
-static void generate_support_lines(struct object *o, struct slice *slice, ssize_t slice_index)
+static void drop_support_parts(struct support_sweep *sw, const std::vector<size_t> &covered)
 {
-	ClipperLib::Clipper c;
-	ClipperLib::PolyTree s;
-	if (config.solid_support_base && slice_index == 0) {
-		c.AddPaths(o->solid_infill_patterns[1], ClipperLib::ptSubject, false);
-		c.AddPaths(slice->support_map, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		ClipperLib::OpenPathsFromPolyTree(s, slice->support_interface_lines);
+	if (covered.size() == 0)
+		return;
+	std::vector<ClipperLib::Paths> parts;
+	size_t j = 0;
+	for (size_t i = 0; i < sw->parts.size(); ++i) {
+		if (j < covered.size() && covered[j] == i)
+			++j;
+		else
+			parts.push_back(std::move(sw->parts[i]));
 	}
-	else if (config.interface_roof_layers > 0 || config.interface_floor_layers > 0) {
-		ClipperLib::Paths s_tmp;
-		c.AddPaths(slice->support_map, ClipperLib::ptSubject, true);
-		for (int i = (slice_index > config.interface_floor_layers) ? -config.interface_floor_layers : -slice_index; slice_index + i < o->n_slices && i <= config.interface_roof_layers; ++i) {
+	sw->parts.swap(parts);
+}
+
+/* Remove the regions that need support starting at layer k that the nearby support boundaries already cover
+   completely. Such a region would stop being carried at layer k, but once it is joined with the carried parts it is
+   no longer tested on its own. Only the boundaries whose bounds overlap the regions are used, since the result only
+   decides which regions are kept. */
+static void remove_covered_support_regions(struct object *o, ssize_t k)
+{
+	ClipperLib::Paths &regions = o->slices[k].layer_support_map;
+	if (regions.size() == 0)
+		return;
+	struct support_sweep fresh;
+	add_support_regions(&fresh, regions);
+	struct cint_rect r = find_path_bounds(fresh.parts[0][0]);
+	for (const ClipperLib::Paths &part : fresh.parts) {
+		const struct cint_rect pr = find_path_bounds(part[0]);
+		r.x0 = MINIMUM(r.x0, pr.x0);
+		r.y0 = MINIMUM(r.y0, pr.y0);
+		r.x1 = MAXIMUM(r.x1, pr.x1);
+		r.y1 = MAXIMUM(r.y1, pr.y1);
+	}
+	ClipperLib::Clipper c;
+	ClipperLib::Paths map;
+	std::vector<size_t> covered;
+	for (const ClipperLib::Paths &part : fresh.parts)
+		c.AddPaths(part, ClipperLib::ptSubject, true);
+	for (ssize_t i = MAXIMUM(k - config.support_vert_margin, 0); i < o->n_slices && i <= k + config.support_vert_margin; ++i) {
+		for (const ClipperLib::Path &p : o->slices[i].support_boundaries) {
+			const struct cint_rect pr = find_path_bounds(p);
+			if (pr.x0 <= r.x1 && pr.x1 >= r.x0 && pr.y0 <= r.y1 && pr.y1 >= r.y0)
+				c.AddPath(p, ClipperLib::ptClip, true);
+		}
+	}
+	c.Execute(ClipperLib::ctDifference, map, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+	find_covered_support_parts(&fresh, map, covered);
+	if (covered.size() == 0)
+		return;
+	drop_support_parts(&fresh, covered);
+	regions.clear();
+	for (const ClipperLib::Paths &part : fresh.parts)
+		regions.insert(regions.end(), part.begin(), part.end());
+}
+
+/* Carry the regions that need support down to layer k and build the layer's support map. The regions that need
+   support starting at layer k are added to the carried parts, and the map is what is left of them after one clip
+   against the nearby support boundaries. A part stops being carried at the first layer that covers it completely.
+   If 'covered' is not NULL, the indices of the parts that stopped are appended to it so that the layer can be
+   replayed by replay_support_layer(). */
+static void sweep_support_layer(struct object *o, struct support_sweep *sw, ssize_t k, ClipperLib::Paths &map, std::vector<size_t> *covered)
+{
+	std::vector<size_t> tmp;
+	std::vector<size_t> &c = (covered) ? *covered : tmp;
+	remove_covered_support_regions(o, k);
+	add_support_regions(sw, o->slices[k].layer_support_map);
+	clip_support_parts(o, sw, k, map);
+	find_covered_support_parts(sw, map, c);
+	drop_support_parts(sw, c);
+}
+
+/* Carry the regions down through layer k the same way sweep_support_layer() did, given the parts it found to be
+   covered there. The support map is only built if 'map' is not NULL, so the layers above the ones whose maps are
+   wanted only cost a union when they start new regions. */
+static void replay_support_layer(struct object *o, struct support_sweep *sw, ssize_t k, const std::vector<size_t> &covered, ClipperLib::Paths *map)
+{
+	add_support_regions(sw, o->slices[k].layer_support_map);
+	if (map)
+		clip_support_parts(o, sw, k, *map);
+	drop_support_parts(sw, covered);
+}
+
+/* Carry the regions that need support down from the top of the object in a single sweep, clipping the carried
+   regions once per layer. With support_everywhere=false, the parts that stop before the build plate are left for
+   the footprint (see struct support_footprint), which removes the support above the object anyway. */
+static void extend_support_downward(struct object *o)
+{
+	struct support_sweep sw;
+	for (ssize_t k = o->n_slices - 1; k >= 0; --k) {
+		sweep_support_layer(o, &sw, k, o->slices[k].support_map, NULL);
+		FREE_VECTOR(o->slices[k].layer_support_map);
+	}
+}
+
+/* Union 'footprint' with the support boundaries of layers [start, end) */
+static void extend_support_footprint(const struct object *o, ClipperLib::Paths &footprint, ssize_t start, ssize_t end)
+{
+	if (start >= end)
+		return;
+	ClipperLib::Clipper c;
+	c.StrictlySimple(true);
+	c.AddPaths(footprint, ClipperLib::ptSubject, true);
+	for (ssize_t i = start; i < end; ++i)
+		c.AddPaths(o->slices[i].support_boundaries, ClipperLib::ptSubject, true);
+	c.Execute(ClipperLib::ctUnion, footprint, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+}
+
+/* With support_everywhere=false, support is removed wherever the object is present on the same layer or any layer
+   below. The object's footprint up to each layer is a running union of the support boundaries. It is built as a
+   parallel prefix: each chunk of layers first unions its own boundaries, then the chunk totals are combined, and
+   finally each chunk carries its footprint upward (see slice_object() and build_support_maps_up()).
+
+   The footprint as it is carried up through a chunk of layers. 'paths' covers every layer below 'done'. */
+struct support_footprint {
+	ClipperLib::Paths paths;
+	ssize_t done;
+};
+
+/* Layers per footprint chunk. The chunks fix the order of the unions, so their size must not depend on the number
+   of threads or on memory_budget. A fixed number of layers (rather than a fraction of the object) lets a band find
+   the totals of the chunks below it and free their support boundaries after at most this many more layers, and
+   taller objects get more chunks to union in parallel. */
+#define SUPPORT_FOOTPRINT_CHUNK_LAYERS 32
+
+/* Union 'prefix' (the footprint below chunk c - 1) into 'total' (the union of the boundaries of chunk c - 1), giving
+   the footprint below chunk c */
+static void add_support_footprint_prefix(const ClipperLib::Paths &prefix, ClipperLib::Paths &total)
+{
+	ClipperLib::Clipper c;
+	c.StrictlySimple(true);
+	c.AddPaths(prefix, ClipperLib::ptSubject, true);
+	c.AddPaths(total, ClipperLib::ptSubject, true);
+	c.Execute(ClipperLib::ctUnion, total, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+}
+
+/* Remove the footprint of layers 0 through i from the support map of layer i. The footprint is only brought up to
+   date at layers that actually have support. */
+static void clip_support_to_footprint(struct object *o, struct support_footprint *fp, ssize_t i)
+{
+	struct slice *slice = &o->slices[i];
+	if (slice->support_map.size() == 0)
+		return;
+	extend_support_footprint(o, fp->paths, fp->done, i + 1);
+	fp->done = i + 1;
+	ClipperLib::Clipper c;
+	c.AddPaths(slice->support_map, ClipperLib::ptSubject, true);
+	c.AddPaths(fp->paths, ClipperLib::ptClip, true);
+	c.Execute(ClipperLib::ctDifference, slice->support_map, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+}
+
+/* Carry 'fp' (the footprint below chunk c) up through chunk c, removing it from the support map of each layer of the
+   chunk. Layer 0 is never clipped. */
+static void clip_support_chunk_to_footprint(struct object *o, struct support_footprint *fp, ssize_t c)
+{
+	const ssize_t end = MINIMUM((c + 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS, o->n_slices);
+	fp->done = c * SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	for (ssize_t i = MAXIMUM(fp->done, 1); i < end; ++i)
+		clip_support_to_footprint(o, fp, i);
+}
+
+static void generate_support_interface_clip_regions(struct slice *slice)
+{
+	do_offset_square(slice->support_map, slice->support_interface_clip, config.interface_clip_offset, 0.0);
+}
+
+static void generate_support_lines(struct object *o, struct slice *slice, ssize_t slice_index)
+{
+	ClipperLib::Clipper c;
+	if (config.solid_support_base && slice_index == 0)
+		clip_lines(o->solid_infill_patterns[1], slice->support_map, slice->support_interface_lines);
+	else if (config.interface_roof_layers > 0 || config.interface_floor_layers > 0) {
+		ClipperLib::Paths s_tmp;
+		c.AddPaths(slice->support_map, ClipperLib::ptSubject, true);
+		for (int i = (slice_index > config.interface_floor_layers) ? -config.interface_floor_layers : -slice_index; slice_index + i < o->n_slices && i <= config.interface_roof_layers; ++i) {
 			if (i != 0) {
 				c.AddPaths(o->slices[slice_index + i].support_interface_clip, ClipperLib::ptClip, true);
 				c.Execute(ClipperLib::ctIntersection, s_tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
@@ -1743,26 +3141,43 @@ static void generate_support_lines(struct object *o, struct slice *slice, ssize_
 			c.Execute(ClipperLib::ctIntersection, s_tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
 			c.Clear();
 		}
-		c.AddPaths(o->support_interface_pattern, ClipperLib::ptSubject, false);
-		c.AddPaths(s_tmp, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		c.Clear();
-		ClipperLib::OpenPathsFromPolyTree(s, slice->support_interface_lines);
+		clip_lines(o->support_interface_pattern, s_tmp, slice->support_interface_lines);
 
 		c.AddPaths(slice->support_map, ClipperLib::ptSubject, true);
 		c.AddPaths(s_tmp, ClipperLib::ptClip, true);
 		c.Execute(ClipperLib::ctDifference, s_tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		c.Clear();
-		c.AddPaths(o->support_pattern, ClipperLib::ptSubject, false);
-		c.AddPaths(s_tmp, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		ClipperLib::OpenPathsFromPolyTree(s, slice->support_lines);
+		clip_lines(o->support_pattern, s_tmp, slice->support_lines);
 	}
-	else {
-		c.AddPaths(o->support_pattern, ClipperLib::ptSubject, false);
-		c.AddPaths(slice->support_map, ClipperLib::ptClip, true);
-		c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-		ClipperLib::OpenPathsFromPolyTree(s, slice->support_lines);
+	else
+		clip_lines(o->support_pattern, slice->support_map, slice->support_lines);
+}
+
+static void translate_paths(ClipperLib::Paths &paths, ClipperLib::cInt dx, ClipperLib::cInt dy)
+{
+	for (ClipperLib::Path &path : paths) {
+		for (ClipperLib::IntPoint &p : path) {
+			p.X += dx;
+			p.Y += dy;
+		}
+	}
+}
+
+/* Append 'src' once for each copy of the object, or once unchanged if there is only the object itself */
+static void append_copies(ClipperLib::Paths &dst, const ClipperLib::Paths &src, const struct object *o)
+{
+	if (o->copies.empty()) {
+		dst.insert(dst.end(), src.begin(), src.end());
+		return;
+	}
+	for (const ClipperLib::IntPoint &c : o->copies) {
+		const size_t start = dst.size();
+		dst.insert(dst.end(), src.begin(), src.end());
+		for (size_t i = start; i < dst.size(); ++i) {
+			for (ClipperLib::IntPoint &p : dst[i]) {
+				p.X += c.X;
+				p.Y += c.Y;
+			}
+		}
 	}
 }
 
@@ -1774,9 +3189,9 @@ static void generate_brim(struct object *o)
 	for (int i = 1; i <= config.brim_lines; ++i) {
 		ClipperLib::Paths tmp;
 		for (const struct island &island : o->slices[0].islands)
-			tmp.insert(tmp.end(), island.insets[0].begin(), island.insets[0].end());
+			append_copies(tmp, island.insets[0], o);
 		if (config.generate_support) {
-			tmp.insert(tmp.end(), o->slices[0].support_map.begin(), o->slices[0].support_map.end());
+			append_copies(tmp, o->slices[0].support_map, o);
 			ClipperLib::SimplifyPolygons(tmp, ClipperLib::pftNonZero);
 		}
 		do_offset_square(tmp, tmp, config.extrusion_width * i + (config.edge_offset * -2.0 - config.extrusion_width) * (1.0 - config.brim_adhesion_factor) * 2.0, 1.0);
@@ -1790,8 +3205,6 @@ static void generate_raft(struct object *o)
 {
 	if (o->n_slices < 1)
 		return;
-	ClipperLib::Clipper c;
-	ClipperLib::PolyTree s;
 	ClipperLib::Paths tmp;
 	if (config.brim_lines > 0) {
 		for (const ClipperLib::Paths &p : o->brim)
@@ -1800,1296 +3213,3846 @@ static void generate_raft(struct object *o)
 	}
 	else {
 		for (const struct island &island : o->slices[0].islands)
-			tmp.insert(tmp.end(), island.insets[0].begin(), island.insets[0].end());
+			append_copies(tmp, island.insets[0], o);
 		if (config.generate_support) {
-			tmp.insert(tmp.end(), o->slices[0].support_map.begin(), o->slices[0].support_map.end());
+			append_copies(tmp, o->slices[0].support_map, o);
 			ClipperLib::SimplifyPolygons(tmp, ClipperLib::pftNonZero);
 		}
 	}
 	do_offset_square(tmp, tmp, config.raft_xy_expansion, 0.0);
-	c.AddPaths(o->raft_base_layer_pattern, ClipperLib::ptSubject, false);
-	c.AddPaths(tmp, ClipperLib::ptClip, true);
-	c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-	ClipperLib::OpenPathsFromPolyTree(s, o->raft[0]);
-	c.Clear();
-	c.AddPaths(o->solid_infill_patterns[1], ClipperLib::ptSubject, false);
-	c.AddPaths(tmp, ClipperLib::ptClip, true);
-	c.Execute(ClipperLib::ctIntersection, s, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
-	ClipperLib::OpenPathsFromPolyTree(s, o->raft[1]);
+	std::vector<struct line_clip_edge> clip_edges;
+	add_line_clip_paths(clip_edges, tmp);
+	clip_lines(o->raft_base_layer_pattern, clip_edges, o->raft[0]);
+	clip_lines(o->solid_infill_patterns[1], clip_edges, o->raft[1]);
 }
 
-static void slice_object(struct object *o)
+#define IS_INSET_SOURCE(island, slice_index, island_index) ((island)->inset_src_slice == (slice_index) && (island)->inset_src_island == (ssize_t) (island_index))
+static bool layer_key_less(const struct layer_key &a, const struct layer_key &b)
 {
-	std::chrono::time_point<std::chrono::high_resolution_clock> start;
-	ssize_t i;
-	o->n_slices = (ssize_t) ceil((o->c.z + o->h / 2.0) / config.layer_height);
-	o->slices = new struct slice[o->n_slices]();
-	if (!o->slices)
-		die(e_nomem, 2);
-
-	start = std::chrono::high_resolution_clock::now();
-	fputs("  find segments...", stderr);
-	for (i = 0; i < o->n; ++i)
-		find_segments(o->slices, &o->t[i]);
-	fputs(" done\n", stderr);
-	free(o->t);
-	fputs("  generate outlines...", stderr);
-#ifdef _OPENMP
-	#pragma omp parallel for schedule(dynamic)
-#endif
-	for (i = 0; i < o->n_slices; ++i)
-		generate_outlines(&o->slices[i], i);
-	fputs(" done\n", stderr);
-	fputs("  generate insets...", stderr);
-#ifdef _OPENMP
-	#pragma omp parallel for schedule(dynamic)
-#endif
-	for (i = 0; i < o->n_slices; ++i)
-		generate_insets(&o->slices[i]);
-	fputs(" done\n", stderr);
-	fputs("  generate infill...", stderr);
-	generate_infill_patterns(o);
-#ifdef _OPENMP
-	#pragma omp parallel for schedule(dynamic)
-#endif
-	for (i = 0; i < o->n_slices; ++i)
-		generate_infill(o, i);
-	fputs(" done\n", stderr);
+	if (a.hash != b.hash)
+		return a.hash < b.hash;
+	if (a.slice != b.slice)
+		return a.slice < b.slice;
+	return a.island < b.island;
+}
 
-	if (config.generate_support) {
-		fputs("  generate support...", stderr);
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i) {
-			generate_layer_support_map(o, i);
-			generate_support_boundaries(&o->slices[i]);
-		}
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i) {
-			o->slices[i].support_map_clipped_paths = new ClipperLib::Paths[i + 1]();
-			generate_support_map_clipped_paths(o, &o->slices[i].layer_support_map, i);
-			o->slices[i].layer_support_map.Clear();
-		}
-		for (i = 0; i < o->n_slices; ++i) {
-			generate_support_maps(o, i);
-			delete[] o->slices[i].support_map_clipped_paths;
-		}
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i)
-			union_support_maps(&o->slices[i]);
-		if (!config.support_everywhere)
-			remove_supports_not_touching_build_plate(o);
-		if (config.interface_roof_layers > 0 || config.interface_floor_layers > 0) {
-		#ifdef _OPENMP
-			#pragma omp parallel for schedule(dynamic)
-		#endif
-			for (i = 0; i < o->n_slices; ++i)
-				generate_support_interface_clip_regions(&o->slices[i]);
-		}
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i)
-			generate_support_lines(o, &o->slices[i], i);
-		/* Free unneeded memory */
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i) {
-			FREE_VECTOR(o->slices[i].support_boundaries);
-			FREE_VECTOR(o->slices[i].support_interface_clip);
+/* Prismatic parts have long runs of layers with identical outlines. Find the first island in [start, end) with
+   the same outline as each island so that its insets can be copied instead of generated again. */
+static void find_inset_sources(struct object *o, ssize_t start, ssize_t end)
+{
+	std::vector<struct layer_key> keys;
+	for (ssize_t i = start; i < end; ++i) {
+		for (size_t k = 0; k < o->slices[i].islands.size(); ++k) {
+			struct island *island = &o->slices[i].islands[k];
+			island->inset_src_slice = i;
+			island->inset_src_island = k;
+			keys.push_back({ island->outline_hash, i, (ssize_t) k });
 		}
-		fputs(" done\n", stderr);
-	}
-	if (config.brim_lines > 0) {
-		fputs("  generate brim...", stderr);
-		generate_brim(o);
-		fputs(" done\n", stderr);
-	}
-	if (config.generate_raft) {
-		fputs("  generate raft...", stderr);
-		generate_raft(o);
-		fputs(" done\n", stderr);
 	}
-	/* Free unneeded memory */
-	if (config.generate_support) {
-	#ifdef _OPENMP
-		#pragma omp parallel for schedule(dynamic)
-	#endif
-		for (i = 0; i < o->n_slices; ++i) {
-			FREE_VECTOR(o->slices[i].support_map);
+	std::sort(keys.begin(), keys.end(), layer_key_less);
+	for (size_t g = 0, g_end; g < keys.size(); g = g_end) {
+		for (g_end = g + 1; g_end < keys.size() && keys[g_end].hash == keys[g].hash; ++g_end) {
+			struct island *island = &o->slices[keys[g_end].slice].islands[keys[g_end].island];
+			for (size_t r = g; r < g_end; ++r) {
+				const struct island *src = &o->slices[keys[r].slice].islands[keys[r].island];
+				if (IS_INSET_SOURCE(src, keys[r].slice, keys[r].island) && src->insets[0] == island->insets[0]) {
+					island->inset_src_slice = keys[r].slice;
+					island->inset_src_island = keys[r].island;
+					break;
+				}
+			}
 		}
 	}
-
-	fprintf(stderr, "sliced in %fs\n",
-		(double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0);
 }
 
-/* 0 is colinear, 1 is counter-clockwise and -1 is clockwise */
-static int triplet_orientation(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c)
+static size_t hash_layer_islands(const struct slice *slice)
 {
-	const ClipperLib::cInt v = (b.X - a.X) * (c.Y - a.Y) - (c.X - a.X) * (b.Y - a.Y);  /* Calculate signed area * 2 */
-	return (v == 0) ? 0 : (v > 0) ? 1 : -1;
+	unsigned long long h = slice->islands.size();
+	for (const struct island &island : slice->islands)
+		h = (h ^ (unsigned long long) island.inset_src_slice * 0xc2b2ae3d27d4eb4fULL ^ (unsigned long long) island.inset_src_island * 0x165667b19e3779f9ULL) * 0x9e3779b97f4a7c15ULL;
+	return (size_t) (h ^ (h >> 29));
 }
 
-static int is_on_segment(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c)
+static bool layer_islands_match(const struct slice *a, const struct slice *b)
 {
-	if (b.X <= MAXIMUM(a.X, c.X) && b.X >= MINIMUM(a.X, c.X) && b.Y <= MAXIMUM(a.Y, c.Y) && b.Y >= MINIMUM(a.Y, c.Y))
-		return true;
-	return false;
+	if (a->islands.size() != b->islands.size())
+		return false;
+	for (size_t k = 0; k < a->islands.size(); ++k)
+		if (a->islands[k].inset_src_slice != b->islands[k].inset_src_slice || a->islands[k].inset_src_island != b->islands[k].inset_src_island)
+			return false;
+	return true;
 }
 
-static bool intersects(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c, const ClipperLib::IntPoint &d)
+/* The infill for a layer depends on the islands of layers slice_index - floor_layers through slice_index +
+   roof_layers and on the infill angle, which repeats every get_infill_period() layers. For each layer in
+   [start, end), set src[i - start] to the first layer whose infill is known to be identical, or to i. The
+   bottom and top layers are always generated since they depend on the edges of the object. */
+static void find_infill_sources(const struct object *o, ssize_t start, ssize_t end, std::vector<ssize_t> &src)
 {
-	const int o1 = triplet_orientation(a, b, c);
-	const int o2 = triplet_orientation(a, b, d);
-	const int o3 = triplet_orientation(c, d, a);
-	const int o4 = triplet_orientation(c, d, b);
-	if (o1 != o2 && o3 != o4)
-		return true;
-	if (o1 == 0 && is_on_segment(a, c, b))
-		return true;
-	if (o2 == 0 && is_on_segment(a, d, b))
-		return true;
-	if (o3 == 0 && is_on_segment(c, a, d))
-		return true;
-	if (o4 == 0 && is_on_segment(c, b, d))
-		return true;
-	return false;
+	const ssize_t period = get_infill_period();
+	const ssize_t w_start = MAXIMUM(start - config.floor_layers, 0), w_end = MINIMUM(end + config.roof_layers, o->n_slices);
+	std::vector<size_t> layer_hash;
+	std::vector<struct layer_key> keys;
+	for (ssize_t i = w_start; i < w_end; ++i)
+		layer_hash.push_back(hash_layer_islands(&o->slices[i]));
+	src.resize(end - start);
+	for (ssize_t i = start; i < end; ++i) {
+		src[i - start] = i;
+		if (i < config.floor_layers || i + config.roof_layers >= o->n_slices)
+			continue;
+		unsigned long long h = i % period;
+		for (ssize_t k = i - config.floor_layers; k <= i + config.roof_layers; ++k)
+			h = (h ^ layer_hash[k - w_start]) * 0x9e3779b97f4a7c15ULL;
+		keys.push_back({ (size_t) h, i, 0 });
+	}
+	std::sort(keys.begin(), keys.end(), layer_key_less);
+	for (size_t g = 0, g_end; g < keys.size(); g = g_end) {
+		const ssize_t root = keys[g].slice;
+		for (g_end = g + 1; g_end < keys.size() && keys[g_end].hash == keys[g].hash; ++g_end) {
+			const ssize_t i = keys[g_end].slice;
+			bool match = ((i - root) % period == 0);
+			for (ssize_t k = -config.floor_layers; match && k <= config.roof_layers; ++k)
+				match = layer_islands_match(&o->slices[i + k], &o->slices[root + k]);
+			if (match)
+				src[i - start] = root;
+		}
+	}
 }
 
-static ssize_t get_boundary_crossing(const ClipperLib::Path &p, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+/* While slice_object() runs, a layer's islands and infill may be copied from any of the COPY_WINDOW layers below
+   it that are done instead of from the first identical layer in the object. Those layers must not be planned (which
+   frees their islands) until every layer that may copy from them is done. */
+#define COPY_WINDOW 24
+
+/* Whether 'outline' (as generated by generate_outlines()) is the outline 'island' had before its seams were
+   aligned */
+static bool is_same_outline(const ClipperLib::Paths &outline, const struct island *island)
 {
-	for (size_t i = 1; i < p.size(); ++i) {
-		if (intersects(p[i - 1], p[i], p0, p1))
-			return (ssize_t) i - 1;
+	const ClipperLib::Paths &p = island->insets[0];
+	if (outline.size() != p.size())
+		return false;
+	for (size_t k = 0; k < p.size(); ++k) {
+		const size_t n = p[k].size(), r = (k < island->seam_rotations.size()) ? island->seam_rotations[k] : 0;
+		if (outline[k].size() != n)
+			return false;
+		for (size_t j = 0; j < n; ++j)
+			if (outline[k][j] != p[k][(j + n - r) % n])
+				return false;
 	}
-	if (intersects(p[p.size() - 1], p[0], p0, p1))
-		return p.size() - 1;
-	return -1;
+	return true;
 }
 
-static ssize_t crosses_boundary(const struct machine *m, const ClipperLib::Paths &bounds, ClipperLib::cInt x, ClipperLib::cInt y)
+static const struct island * find_done_island(const struct object *o, const struct island *island, ssize_t slice_index, const std::atomic<char> *insets_done)
 {
-	const ClipperLib::IntPoint p0(m->x, m->y);
-	const ClipperLib::IntPoint p1(x, y);
-	for (size_t i = 0; i < bounds.size(); ++i) {
-		if (get_boundary_crossing(bounds[i], p0, p1) >= 0)
-			return (ssize_t) i;
+	for (ssize_t i = slice_index - 1; i >= MAXIMUM(slice_index - COPY_WINDOW, 0); --i) {
+		if (!insets_done[i].load(std::memory_order_acquire))
+			continue;
+		for (const struct island &c : o->slices[i].islands)
+			if (c.outline_hash == island->outline_hash && is_same_outline(island->insets[0], &c))
+				return &c;
 	}
-	return -1;
+	return NULL;
 }
 
-static bool crosses_exposed_surface(const struct island *island, ClipperLib::cInt x0, ClipperLib::cInt y0, ClipperLib::cInt x1, ClipperLib::cInt y1)
+/* Generate the insets for the islands of a layer, or copy them from an identical island in the COPY_WINDOW layers
+   below whose insets are done. A copy takes the inset source of the island it was copied from. */
+static void generate_layer_insets_in_window(struct object *o, ssize_t slice_index, const std::atomic<char> *insets_done)
 {
-	const ClipperLib::IntPoint p0(x0, y0);
-	const ClipperLib::IntPoint p1(x1, y1);
-	bool in_outer = false;
-	for (const ClipperLib::Path &p : island->exposed_surface) {
-		if (get_boundary_crossing(p, p0, p1) >= 0)
-			return true;
-		else if (ClipperLib::PointInPolygon(p0, p) || ClipperLib::PointInPolygon(p1, p)) {
-			if (!ClipperLib::Orientation(p))
-				return false;  /* p0 and p1 are inside a hole, so no exposed surface was crossed */
-			else
-				in_outer = true;
+	struct slice *slice = &o->slices[slice_index];
+	for (size_t k = 0; k < slice->islands.size(); ++k) {
+		struct island *island = &slice->islands[k];
+		const struct island *src = find_done_island(o, island, slice_index, insets_done);
+		if (src) {
+			copy_insets(island, src);
+			island->inset_src_slice = src->inset_src_slice;
+			island->inset_src_island = src->inset_src_island;
+		}
+		else {
+			generate_insets(island);
+			island->inset_src_slice = slice_index;
+			island->inset_src_island = k;
 		}
 	}
-	return in_outer;
 }
 
-/* Looks for the nearest line segment and then returns the nearest endpoint on that segment. */
-static size_t find_nearest_segment_endpoint_on_closed_path(const ClipperLib::Path &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist)
+/* Generate the infill for a layer, or copy it from a layer in the COPY_WINDOW layers below whose infill is done and
+   whose infill is known to be identical (see find_infill_sources()). 'infill_keys' holds the hash of the infill angle
+   and the islands the infill depends on for each layer that is done. */
+static void generate_layer_infill_in_window(struct object *o, ssize_t slice_index, const std::atomic<char> *infill_done, size_t *infill_keys)
 {
-	size_t best = 0;
-	fl_t best_dist = FL_T_INF;
-	const ClipperLib::IntPoint p0(x, y);
-	for (size_t i = 0, i2 = 1; i < p.size(); ++i) {
-		i2 = (i2 == p.size()) ? 0 : i2;
-		const fl_t dist = distance_to_line(p0, p[i], p[i2]);
-		if (dist < best_dist) {
-			best_dist = dist;
-			best = (distance_to_point(p0, p[i]) < distance_to_point(p0, p[i2])) ? i : i2;
+	const ssize_t period = get_infill_period();
+	ssize_t src = slice_index;
+	if (slice_index >= config.floor_layers && slice_index + config.roof_layers < o->n_slices) {
+		unsigned long long h = slice_index % period;
+		for (ssize_t k = slice_index - config.floor_layers; k <= slice_index + config.roof_layers; ++k)
+			h = (h ^ hash_layer_islands(&o->slices[k])) * 0x9e3779b97f4a7c15ULL;
+		infill_keys[slice_index] = (size_t) h;
+		for (ssize_t r = slice_index - period; src == slice_index && r >= config.floor_layers && r >= slice_index - COPY_WINDOW; r -= period) {
+			if (!infill_done[r].load(std::memory_order_acquire) || infill_keys[r] != (size_t) h)
+				continue;
+			bool match = true;
+			for (ssize_t k = -config.floor_layers; match && k <= config.roof_layers; ++k)
+				match = layer_islands_match(&o->slices[slice_index + k], &o->slices[r + k]);
+			if (match)
+				src = r;
 		}
-		++i2;
 	}
-	if (r_dist)
-		*r_dist = distance_to_point(p0, p[best]) / config.scale_constant;
-	return best;
+	if (src == slice_index)
+		generate_infill(o, slice_index);
+	else
+		copy_infill(&o->slices[slice_index], &o->slices[src]);
 }
 
-static size_t find_nearest_path(const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist, size_t *r_start)
+static double get_wall_time(void)
 {
-	size_t best = 0, start = 0;
-	fl_t best_dist = FL_T_INF;
-	const fl_t x0 = CINT_TO_FL_T(x), y0 = CINT_TO_FL_T(y);
-	for (size_t i = 0; i < p.size(); ++i) {
-		for (size_t k = 0; k < p[i].size(); ++k) {
-			fl_t x1 = CINT_TO_FL_T(p[i][k].X), y1 = CINT_TO_FL_T(p[i][k].Y);
-			fl_t dist = (x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0);
-			if (dist < best_dist) {
-				best_dist = dist;
-				best = i;
-				start = k;
-			}
-		}
-	}
-	if (r_dist)
-		*r_dist = sqrt(best_dist);
-	if (r_start)
-		*r_start = start;
-	return best;
+	return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() / 1e9;
 }
 
-static size_t find_nearest_aligned_path(const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist)
+#ifdef _WIN32
+static double filetime_to_seconds(const FILETIME *t)
 {
-	size_t best = 0;
-	fl_t best_dist = FL_T_INF;
-	const fl_t x0 = CINT_TO_FL_T(x), y0 = CINT_TO_FL_T(y);
-	for (size_t i = 0; i < p.size(); ++i) {
-		fl_t x1 = CINT_TO_FL_T(p[i][0].X), y1 = CINT_TO_FL_T(p[i][0].Y);
-		fl_t dist = (x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0);
-		if (dist < best_dist) {
-			best_dist = dist;
-			best = i;
-		}
-	}
-	if (r_dist)
-		*r_dist = sqrt(best_dist);
-	return best;
+	return (double) (((unsigned long long) t->dwHighDateTime << 32) | t->dwLowDateTime) / 1e7;  /* 100 ns units */
 }
+#endif
 
-static size_t find_nearest_segment(const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist, bool *r_flip)
+/* CPU time used by all threads of the process. std::clock() gives this on POSIX systems, but the Microsoft C runtime
+   returns the elapsed time instead. */
+static double get_process_cpu_time(void)
 {
-	size_t best = 0;
-	fl_t best_dist = FL_T_INF;
-	const ClipperLib::IntPoint p0(x, y);
-	for (size_t i = 0; i < p.size(); ++i) {
-		if (p[i].size() > 2)
-			fprintf(stderr, "error: bug in clipper: line segment has more than two points!\n");
-		const fl_t dist = distance_to_line(p0, p[i][0], p[i][1]);
-		if (dist < best_dist) {
-			best_dist = dist;
-			best = i;
-		}
-	}
-	const fl_t dist0 = distance_to_point(p0, p[best][0]);
-	const fl_t dist1 = distance_to_point(p0, p[best][1]);
-	const bool flip = dist0 > dist1;
-	if (r_dist)
-		*r_dist = ((flip) ? dist1 : dist0) / config.scale_constant;
-	if (r_flip)
-		*r_flip = flip;
-	return best;
+#ifdef _WIN32
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return filetime_to_seconds(&kernel_time) + filetime_to_seconds(&user_time);
+#endif
+	return (double) std::clock() / CLOCKS_PER_SEC;
 }
 
-static void append_g_move(struct slice *slice, const struct g_move &move)
+static double get_thread_cpu_time(void)
 {
-	/* FIXME: should probably take acceleration into account... */
-	slice->layer_time += move.len / move.feed_rate;
-	slice->moves.push_back(move);
+#ifdef _WIN32
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return filetime_to_seconds(&kernel_time) + filetime_to_seconds(&user_time);
+#endif
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+	return get_wall_time();
 }
 
-static fl_t get_partial_path_len(const ClipperLib::Path &p, size_t start, size_t end, bool reverse)
+static struct stage_timer start_stage_timer(void)
 {
-	fl_t l = 0.0;
-	fl_t x0 = CINT_TO_FL_T(p[start].X), y0 = CINT_TO_FL_T(p[start].Y);
-	size_t i = start;
-	do {
-		if (reverse) i = (i > 0) ? i - 1 : p.size() - 1;
-		else i = (i < p.size() - 1) ? i + 1 : 0;
-		fl_t x1 = CINT_TO_FL_T(p[i].X), y1 = CINT_TO_FL_T(p[i].Y);
-		l += sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
-		x0 = x1;
-		y0 = y1;
-	} while (i != end);
-	return l;
-}
-
-static bool crosses_boundary_2pt(const ClipperLib::Path &p, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, fl_t *r_dist)
-{
-	fl_t best_dist = FL_T_INF;
-	size_t intersections = 0;
-	for (size_t k = 0; k < p.size(); ++k) {
-		const size_t k2 = (k == 0) ? p.size() - 1 : k - 1;
-		if (intersects(p[k2], p[k], p0, p1)) {
-			const fl_t dist = distance_to_line(p0, p[k2], p[k]);
-			if (dist < best_dist)
-				best_dist = dist;
-			++intersections;
-			if (p[k] == p0 || p[k] == p1)
-				++k;  /* So the same point isn't registered as two intersections */
-		}
+	struct stage_timer t = {};
+	if (perf.enabled) {
+		t.wall = get_wall_time();
+		t.cpu = get_process_cpu_time();
+		t.clipper_executes = ClipperLib::ClipperExecuteCount();
+		t.offset_executes = ClipperLib::OffsetExecuteCount();
 	}
-	if (r_dist)
-		*r_dist = best_dist / config.scale_constant;
-	return (intersections > 1);
+	return t;
 }
 
-static ssize_t nearest_boundary_crossing_2pt(const ClipperLib::Paths &b, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+static struct stage_stats * find_stage_stats(const char *name)
 {
-	fl_t best_dist = FL_T_INF;
-	ssize_t b_idx = -1;
-	for (size_t i = 0; i < b.size(); ++i) {
-		/* Find all intersections, selecting the nearest one. Ignore if there are fewer than two intersections. */
-		fl_t tmp_dist = FL_T_INF;
-		if (crosses_boundary_2pt(b[i], p0, p1, &tmp_dist) && tmp_dist < best_dist) {
-			b_idx = (ssize_t) i;
-			best_dist = tmp_dist;
-		}
-	}
-	return b_idx;
+	for (struct stage_stats &st : perf.stages)
+		if (strcmp(st.name, name) == 0)
+			return &st;
+	perf.stages.push_back({ name, 0, 0.0, 0.0, 0, 0 });
+	return &perf.stages.back();
 }
 
-static size_t find_best_travel_point(const ClipperLib::Paths &b, size_t b_idx, const ClipperLib::IntPoint &p0, size_t start_idx, size_t end_idx, bool reverse)
+/* Add the time and Clipper operations since 't' was started to stage 'name'. Stages that run more than once
+   (once per band, for example) are summed. */
+static void end_stage_timer(const struct stage_timer *t, const char *name)
 {
-	const ClipperLib::Path &p = b[b_idx];
-	size_t i = end_idx, r;
-	do {
-		r = i;
-		if (nearest_boundary_crossing_2pt(b, p0, p[i]) < 0) return i;
-		if (reverse) i = (i < p.size() - 1) ? i + 1 : 0;
-		else i = (i > 0) ? i - 1 : p.size() - 1;
-	} while (i != start_idx);
-	return r;
+	if (!perf.enabled)
+		return;
+	struct stage_stats *st = find_stage_stats(name);
+	++st->runs;
+	st->wall += get_wall_time() - t->wall;
+	st->cpu += get_process_cpu_time() - t->cpu;
+	st->clipper_executes += ClipperLib::ClipperExecuteCount() - t->clipper_executes;
+	st->offset_executes += ClipperLib::OffsetExecuteCount() - t->offset_executes;
 }
 
-static void append_linear_travel(struct slice *slice, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, ClipperLib::cInt z, fl_t feed_rate)
+static struct layer_timer start_layer_timer(void)
 {
-	if (x != m->x || y != m->y || z != m->z) {
-		const fl_t f_x = CINT_TO_FL_T(x), f_y = CINT_TO_FL_T(y), f_z = CINT_TO_FL_T(z);
-		const fl_t f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y), f_mz = CINT_TO_FL_T(m->z);
-		const fl_t len = sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z));
-		const struct g_move move = { x, y, z, 0.0, feed_rate, len, false, false };
-		append_g_move(slice, move);
-		m->x = x;
-		m->y = y;
-		m->z = z;
+	struct layer_timer t = {};
+	if (perf.enabled) {
+		t.wall = get_wall_time();
+		t.cpu = get_thread_cpu_time();
 	}
+	return t;
 }
 
-static void do_wipe(struct slice *slice, struct machine *m)
+/* Only one thread works on a given stage of a layer at a time, so no locking is needed */
+static void end_layer_timer(const struct layer_timer *t, ssize_t slice_index, enum layer_stage stage)
 {
-	if (config.wipe_len <= 0.0 || m->is_wiped || slice->moves.size() < 3)
+	if (!perf.enabled)
 		return;
-	ClipperLib::Path wipe_moves;
-	fl_t wiped_len = 0.0, x0 = CINT_TO_FL_T(m->x), y0 = CINT_TO_FL_T(m->y);
-	bool forward = false;
-	/* moves.rbegin() is the retract move and moves.rbegin() + 1 is the last kinematic move,
-	   so we want to start at moves.rbegin() + 2 */
-	auto it_start = slice->moves.rbegin() + 2, it_end = slice->moves.rend();
-	if (it_start->is_closed_path) {
-		auto it = it_start;
-		while (it != it_end && it->is_closed_path)
-			++it;
-		it_start = it;
-		it_end = slice->moves.rbegin();  /* stop when we hit the retract move */
-		forward = true;
-	}
-	for (auto it = it_start; it != it_end; (forward) ? --it : ++it) {
-		const fl_t x1 = CINT_TO_FL_T(it->x), y1 = CINT_TO_FL_T(it->y);
-		if (x1 == x0 && y1 == y0)
-			break;  /* break at first non-kinematic move */
-		const fl_t xv = x1 - x0, yv = y1 - y0;
-		const fl_t norm = sqrt(xv * xv + yv * yv);
-		wiped_len += norm;
-		if (wiped_len >= config.wipe_len) {
-			const fl_t new_x = x1 - (wiped_len - config.wipe_len) * (xv / norm), new_y = y1 - (wiped_len - config.wipe_len) * (yv / norm);
-			wipe_moves.push_back(ClipperLib::IntPoint(FL_T_TO_CINT(new_x), FL_T_TO_CINT(new_y)));
-			break;
-		}
-		else {
-			wipe_moves.push_back(ClipperLib::IntPoint(it->x, it->y));
-		}
-		x0 = x1;
-		y0 = y1;
-	}
-	for (ClipperLib::IntPoint &pt : wipe_moves)
-		append_linear_travel(slice, m, pt.X, pt.Y, m->z, config.travel_feed_rate);
-	m->is_wiped = true;
+	perf.layers[slice_index].wall[stage] += get_wall_time() - t->wall;
+	perf.layers[slice_index].cpu[stage] += get_thread_cpu_time() - t->cpu;
 }
 
-static void do_retract(struct slice *slice, struct machine *m, bool should_wipe)
+static void record_layer_outlines(const struct slice *slice, ssize_t slice_index)
 {
-	if (!m->is_retracted) {
-		struct g_move retract_move = { m->x, m->y, m->z, -config.retract_len, config.retract_speed, config.retract_len, false, false };
-		append_g_move(slice, retract_move);
-		m->is_retracted = true;
-	}
-	m->force_retract = false;
-	if (should_wipe)
-		do_wipe(slice, m);
+	if (!perf.enabled)
+		return;
+	ssize_t vertices = 0;
+	for (const struct island &island : slice->islands)
+		for (const ClipperLib::Path &p : island.insets[0])
+			vertices += p.size();
+	perf.layers[slice_index].islands = slice->islands.size();
+	perf.layers[slice_index].vertices = vertices;
 }
 
-static fl_t append_comb_move(const struct machine *m, const struct island *island, ClipperLib::Path &comb_moves, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, bool *force_retract)
+/* A graph of tasks with dependencies. Each task counts its unfinished dependencies and becomes ready when the count
+   reaches zero. A ready task goes on the queue of the thread that finished its last dependency. Each thread takes
+   tasks from the back of its own queue, so a layer tends to stay on one thread from one stage to the next, and
+   steals from the front of the other queues when its own is empty. The queues and the sleep/wakeup use std::mutex and
+   std::condition_variable, because OpenMP locks have no way to wait for a condition. */
+struct task {
+	int kind;
+	ssize_t layer;
+	ssize_t n_deps;
+	std::vector<ssize_t> dependents;
+};
+
+struct task_queue {
+	std::mutex lock;
+	std::deque<ssize_t> tasks;
+};
+
+static ssize_t add_task(std::vector<struct task> &tasks, int kind, ssize_t layer)
 {
-	if (!(*force_retract) && !m->is_retracted && island && crosses_exposed_surface(island, p0.X, p0.Y, p1.X, p1.Y))
-		*force_retract = true;
-	comb_moves.push_back(p1);
-	return distance_to_point(p0, p1) / config.scale_constant;
+	tasks.push_back({ kind, layer, 0, std::vector<ssize_t>() });
+	return tasks.size() - 1;
 }
 
-static void combed_travel(struct slice *slice, const struct island *island, struct machine *m, const ClipperLib::Paths &bounds, const ClipperLib::Paths &paths, ClipperLib::cInt x, ClipperLib::cInt y, fl_t feed_rate, fl_t retract_threshold)
+/* Make 'task' wait for 'dep'. Nothing is done if either is -1. */
+static void add_task_dependency(std::vector<struct task> &tasks, ssize_t task, ssize_t dep)
 {
-	if (x == m->x || y == m->y || paths.size() == 0)
+	if (task < 0 || dep < 0)
 		return;
-	ClipperLib::Paths b = bounds;
-	ssize_t last_bound_idx = -1;
-	fl_t closest_dist = FL_T_INF, comb_dist = 0.0;
-	ClipperLib::IntPoint p0(m->x, m->y), p1(x, y);
-	ClipperLib::Path comb_moves;
-	bool force_retract = false;
-
-	while (b.size() > 0) {
-		ssize_t bound_idx = nearest_boundary_crossing_2pt(b, p0, p1);
-		if (bound_idx < 0)  /* No boundary crossings, so we can move directly there */
-			break;
-		if (bound_idx == last_bound_idx) {
-			b.erase(b.begin() + bound_idx);
-			last_bound_idx = -1;
-			force_retract = true;
-			DEBUG("combed_travel(): warning: removed a boundary at z = %f\n", CINT_TO_FL_T(m->z));
-			continue;
-		}
+	tasks[dep].dependents.push_back(task);
+	++tasks[task].n_deps;
+}
 
-		ClipperLib::Path &p = b[bound_idx];
-		/* Find the boundary point closest to the start point */
-		size_t start_idx = find_nearest_segment_endpoint_on_closed_path(p, p0.X, p0.Y, NULL);
-		/* Find the boundary point closest to the end point */
-		size_t end_idx = find_nearest_segment_endpoint_on_closed_path(p, x, y, NULL);
-		/* fprintf(stderr, "bound_idx=%zd last_bound_idx=%zd start_idx=%zd end_idx=%zd\n", bound_idx, last_bound_idx, start_idx, end_idx); */
-		if (distance_to_point(p[end_idx], p1) >= closest_dist) {
-			b.erase(b.begin() + bound_idx);
-			last_bound_idx = -1;
-			force_retract = true;
-			DEBUG("combed_travel(): warning: useless indirection at z = %f\n", CINT_TO_FL_T(m->z));
-			continue;
-		}
-		if (start_idx == end_idx) {
-			size_t path_pt_idx, path_idx = find_nearest_path(paths, p[end_idx].X, p[end_idx].Y, NULL, &path_pt_idx);
-			comb_dist += append_comb_move(m, island, comb_moves, p0, paths[path_idx][path_pt_idx], &force_retract);
-			p0 = paths[path_idx][path_pt_idx];
-		}
-		else {
-			/* Find shortest direction */
-			const fl_t f_len = get_partial_path_len(p, start_idx, end_idx, false);
-			const fl_t r_len = get_partial_path_len(p, start_idx, end_idx, true);
-			bool reverse = (r_len < f_len) ? true : false;
-
-			size_t i;
-			/* Start one point back from start_idx so we check all relevant segments */
-			if (reverse) i = (start_idx < p.size() - 1) ? start_idx + 1 : 0;
-			else i = (start_idx > 0) ? start_idx - 1 : p.size() - 1;
-			do {
-				i = find_best_travel_point(b, bound_idx, p0, i, end_idx, reverse);
-				size_t path_pt_idx, path_idx = find_nearest_path(paths, p[i].X, p[i].Y, NULL, &path_pt_idx);
-				comb_dist += append_comb_move(m, island, comb_moves, p0, paths[path_idx][path_pt_idx], &force_retract);
-				p0 = paths[path_idx][path_pt_idx];
-				if (!crosses_boundary_2pt(p, p0, p1, NULL) && distance_to_point(p0, p1) < closest_dist)
-					break;  /* Progress was made and there are no more boundary crossings for current boundary */
-			} while (i != end_idx);
-		}
-		const fl_t dist = distance_to_point(p0, p1);
-		if (dist >= closest_dist) {
-			b.erase(b.begin() + bound_idx);
-			last_bound_idx = -1;
-			force_retract = true;
-			DEBUG("combed_travel(): warning: ended up farther away at z = %f\n", CINT_TO_FL_T(m->z));
+static bool pop_task(struct task_queue *q, bool steal, ssize_t *t)
+{
+	bool found = false;
+	std::lock_guard<std::mutex> l(q->lock);
+	if (!q->tasks.empty()) {
+		if (steal) {
+			*t = q->tasks.front();
+			q->tasks.pop_front();
 		}
 		else {
-			closest_dist = dist;
-			last_bound_idx = bound_idx;
+			*t = q->tasks.back();
+			q->tasks.pop_back();
 		}
+		found = true;
 	}
-	comb_dist += distance_to_point(p0, p1) / config.scale_constant;
-	if (force_retract || comb_dist >= retract_threshold)
-		do_retract(slice, m, false);  /* can't wipe or we may cross a boundary (wiping is not very useful with combing anyway) */
-	for (ClipperLib::IntPoint &pt : comb_moves)
-		append_linear_travel(slice, m, pt.X, pt.Y, m->z, feed_rate);
+	return found;
 }
 
-/* Move to the point nearest to the target location */
-static void move_to_island_exit(struct slice *slice, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, fl_t feed_rate)
+static void push_task(struct task_queue *q, ssize_t t)
 {
-	if (nearest_boundary_crossing_2pt(slice->last_boundaries, ClipperLib::IntPoint(m->x, m->y), ClipperLib::IntPoint(x, y)) >= 0) {
-		size_t path_pt_idx, path_idx = find_nearest_path(slice->last_comb_paths, x, y, NULL, &path_pt_idx);
-		const ClipperLib::IntPoint &point = slice->last_comb_paths[path_idx][path_pt_idx];
-		combed_travel(slice, NULL, m, slice->last_boundaries, slice->last_comb_paths, point.X, point.Y, feed_rate, 0.0);
-		append_linear_travel(slice, m, point.X, point.Y, m->z, feed_rate);
-	}
+	std::lock_guard<std::mutex> l(q->lock);
+	q->tasks.push_back(t);
 }
 
-static void linear_move(struct slice *slice, const struct island *island, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, ClipperLib::cInt z, fl_t extra_e_len, fl_t feed_rate, fl_t flow_adjust, bool scalable, bool is_travel, bool is_closed_path, fl_t retract_threshold)
+/* Call run_task(arg, task) once for each task, after all of the task's dependencies have returned. A thread that
+   finds every queue empty sleeps until a task is queued or the graph is finished. */
+static void run_task_graph(const std::vector<struct task> &tasks, void (*run_task)(void *, const struct task *), void *arg)
 {
-	const fl_t f_x = CINT_TO_FL_T(x), f_y = CINT_TO_FL_T(y), f_z = CINT_TO_FL_T(z);
-	fl_t f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y), f_mz = CINT_TO_FL_T(m->z);
-	struct g_move move = {
-		x, y, z, 0.0, feed_rate,
-		sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z)),
-		scalable, (is_travel) ? false : is_closed_path
-	};
-	bool do_island_hop = (config.only_hop_between_islands && config.z_hop > 0.0 && (slice->last_boundaries.size() > 0 || !island));
-	if (is_travel) {
-		if (m->force_retract)
-			do_retract(slice, m, true);
-		if (!do_island_hop && z == m->z && config.comb) {  /* NOTE: config.comb is false if z-hop is enabled and config.only_hop_between_islands is false */
-			if (slice->last_boundaries.size() > 0) {
-				/* Inside an island and moving to a point outside of it */
-				do_retract(slice, m, true);
-				if (slice->last_comb_paths.size() > 0)
-					move_to_island_exit(slice, m, x, y, feed_rate);
-				combed_travel(slice, island, m, slice->printed_outer_boundaries, slice->printed_outer_comb_paths, x, y, feed_rate, retract_threshold);
-			}
-			else if (island) {
-				/* Moving within an island */
-				combed_travel(slice, island, m, island->boundaries, island->comb_paths, x, y, feed_rate, retract_threshold);
-			}
-			else {
-				/* Moving between two points that are not in an island */
-				combed_travel(slice, island, m, slice->printed_outer_boundaries, slice->printed_outer_comb_paths, x, y, feed_rate, retract_threshold);
-			}
-		}
-		else if (!m->is_retracted
-			&& (slice->last_boundaries.size() > 0
-				|| move.len > retract_threshold
-				|| (island && crosses_boundary(m, island->boundaries, x, y) >= 0)
-				|| (island && move.len > config.extrusion_width * 2.0 && crosses_exposed_surface(island, m->x, m->y, x, y)))) {
-			do_retract(slice, m, true);
-		}
-		if (config.comb) {
-			slice->last_boundaries.clear();
-			slice->last_comb_paths.clear();
-		}
-		f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y);  /* m->{x,y} will change if a wipe happened. m->z will not change */
-		move.len = sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z));
-		/* FIXME: hopping will only work correctly if there is only a single travel
-		   move between extrusion moves. This should always be the case currently. */
-		if (z == m->z && m->is_retracted && !m->is_hopped && ((config.only_hop_between_islands) ? do_island_hop : config.z_hop > 0.0)) {
-			if (config.z_hop_angle == 90.0) {
-				move.z += FL_T_TO_CINT(config.z_hop);
-				struct g_move hop_move = { m->x, m->y, move.z, 0.0, config.travel_feed_rate, config.z_hop, false, false };
-				append_g_move(slice, hop_move);
+	const ssize_t n = tasks.size();
+#ifdef _OPENMP
+	const int n_queues = omp_get_max_threads();
+#else
+	const int n_queues = 1;
+#endif
+	std::vector<struct task_queue> queues(n_queues);
+	std::vector<std::atomic<ssize_t>> pending(n);
+	std::mutex wait_lock;
+	std::condition_variable wait_cond;
+	std::atomic<ssize_t> n_queued(0), n_done(0);
+	ssize_t n_ready = 0;
+	/* Deal out the tasks that are ready at the start, with the first ones at the back of each queue */
+	for (ssize_t t = 0; t < n; ++t) {
+		pending[t] = tasks[t].n_deps;
+		if (tasks[t].n_deps == 0)
+			queues[n_ready++ % n_queues].tasks.push_front(t);
+	}
+	n_queued = n_ready;
+#ifdef _OPENMP
+	#pragma omp parallel
+#endif
+	{
+	#ifdef _OPENMP
+		const int self = omp_get_thread_num();
+	#else
+		const int self = 0;
+	#endif
+		while (n_done < n) {
+			ssize_t t;
+			bool found = pop_task(&queues[self], false, &t);
+			for (int k = 1; !found && k < n_queues; ++k)
+				found = pop_task(&queues[(self + k) % n_queues], true, &t);
+			if (!found) {
+				/* The counters are changed under the lock before notifying, so a wakeup cannot be missed */
+				std::unique_lock<std::mutex> l(wait_lock);
+				wait_cond.wait(l, [&]() { return n_queued > 0 || n_done == n; });
+				continue;
 			}
-			else {
-				const fl_t hop_angle_rad = config.z_hop_angle / 180.0 * M_PI;
-				const fl_t hop_min_travel = config.z_hop / tan(hop_angle_rad);
-				const fl_t xv = f_x - f_mx, yv = f_y - f_my;
-				const fl_t norm = sqrt(xv * xv + yv * yv);
-				if (norm <= hop_min_travel) {
-					move.z += FL_T_TO_CINT(tan(hop_angle_rad) * norm);
-				}
-				else {
-					const fl_t x1 = f_mx + hop_min_travel * (xv / norm), y1 = f_my + hop_min_travel * (yv / norm), z1 = f_mz + config.z_hop;
-					struct g_move hop_move = {
-						FL_T_TO_CINT(x1), FL_T_TO_CINT(y1), FL_T_TO_CINT(z1),
-						0.0, config.travel_feed_rate, 0.0, false, false
-					};
-					hop_move.len = sqrt((x1 - f_mx) * (x1 - f_mx) + (y1 - f_my) * (y1 - f_my) + (z1 - f_mz) * (z1 - f_mz));
-					append_g_move(slice, hop_move);
-					move.len -= sqrt((x1 - f_mx) * (x1 - f_mx) + (y1 - f_my) * (y1 - f_my));
-					move.z += FL_T_TO_CINT(config.z_hop);
+			--n_queued;
+			run_task(arg, &tasks[t]);
+			ssize_t n_new = 0;
+			for (ssize_t d : tasks[t].dependents) {
+				if (--pending[d] == 0) {
+					push_task(&queues[self], d);
+					++n_new;
 				}
 			}
-			m->is_hopped = true;
-		}
-	}
-	else {
-		if (m->is_retracted) {
-			if (m->is_hopped) {
-				/* FIXME: len is technically not correct, but the error is very small in most cases */
-				struct g_move unhop_move = { m->x, m->y, m->z, 0.0, config.travel_feed_rate, config.z_hop, false, false };
-				append_g_move(slice, unhop_move);
-				m->is_hopped = false;
+			{
+				std::lock_guard<std::mutex> l(wait_lock);
+				n_queued += n_new;
+				++n_done;
 			}
-			struct g_move restart_move = { m->x, m->y, m->z, config.retract_len, config.restart_speed, 0.0, false, false };
-			if (config.extra_restart_len < 0.0)
-				restart_move.e += config.extra_restart_len;
+			/* This thread takes one of the new tasks itself, so only the others need to wake a thread */
+			if (n_done == n)
+				wait_cond.notify_all();
 			else
-				extra_e_len += config.extra_restart_len;
-			restart_move.len = restart_move.e;
-			append_g_move(slice, restart_move);
-			m->is_retracted = false;
-		}
-		move.e = move.len * config.extrusion_area * config.flow_multiplier * flow_adjust / config.material_area;
-		if (extra_e_len != 0.0) {
-			struct g_move extra_e_move = { m->x, m->y, m->z, extra_e_len, feed_rate * config.extrusion_area / config.material_area, fabs(extra_e_len), true, false };
-			append_g_move(slice, extra_e_move);
+				for (ssize_t i = 1; i < n_new; ++i)
+					wait_cond.notify_one();
 		}
 	}
-	if (x != m->x || y != m->y || z != m->z || move.e != 0.0) {
-		append_g_move(slice, move);
-		m->x = x;
-		m->y = y;
-		m->z = z;
+}
+
+/* Per-layer stages. Each one runs over the layer range [start, end). */
+static void generate_layer_outlines(struct object *o, ssize_t start, ssize_t end)
+{
+	const struct stage_timer st = start_stage_timer();
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		const struct layer_timer lt = start_layer_timer();
+		generate_outlines(&o->slices[i], o->adj, i);
+		end_layer_timer(&lt, i, LAYER_STAGE_OUTLINES);
+		record_layer_outlines(&o->slices[i], i);
 	}
-	m->force_retract = false;
-	m->is_wiped = false;
+	end_stage_timer(&st, "outlines");
 }
 
-static bool path_len_is_greater_than(const ClipperLib::Path &p, fl_t len)
+static void generate_layer_insets(struct object *o, ssize_t start, ssize_t end)
 {
-	fl_t l = 0.0;
-	fl_t x0 = CINT_TO_FL_T(p[0].X), y0 = CINT_TO_FL_T(p[0].Y);
-	for (size_t i = 1; i < p.size(); ++i) {
-		const fl_t x1 = CINT_TO_FL_T(p[i].X), y1 = CINT_TO_FL_T(p[i].Y);
-		l += sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
-		if (l > len)
-			return true;
-		x0 = x1;
-		y0 = y1;
+	const struct stage_timer st = start_stage_timer();
+	find_inset_sources(o, start, end);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		const struct layer_timer lt = start_layer_timer();
+		for (size_t k = 0; k < o->slices[i].islands.size(); ++k)
+			if (IS_INSET_SOURCE(&o->slices[i].islands[k], i, k))
+				generate_insets(&o->slices[i].islands[k]);
+		end_layer_timer(&lt, i, LAYER_STAGE_INSETS);
 	}
-	const fl_t x1 = CINT_TO_FL_T(p[0].X), y1 = CINT_TO_FL_T(p[0].Y);
-	l += sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
-	if (l > len)
-		return true;
-	return false;
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		const struct layer_timer lt = start_layer_timer();
+		for (size_t k = 0; k < o->slices[i].islands.size(); ++k) {
+			struct island *island = &o->slices[i].islands[k];
+			if (!IS_INSET_SOURCE(island, i, k))
+				copy_insets(island, &o->slices[island->inset_src_slice].islands[island->inset_src_island]);
+		}
+		end_layer_timer(&lt, i, LAYER_STAGE_INSETS);
+	}
+	end_stage_timer(&st, "insets");
 }
 
-/* Requires the last point to be the actual end point. For a closed
-   path, the last point should be the same as the first point. */
-static void clip_path_from_end(ClipperLib::Path &p, ClipperLib::Path *clipped_points, fl_t clip)
+static void generate_layer_infill(struct object *o, ssize_t start, ssize_t end)
 {
-	fl_t x0 = CINT_TO_FL_T((p.end() - 1)->X), y0 = CINT_TO_FL_T((p.end() - 1)->Y), l = 0.0;
-	for (;;) {
-		if (clipped_points)
-			clipped_points->push_back(*(p.end() - 1));
-		p.erase(p.end() - 1);
-		const fl_t x1 = CINT_TO_FL_T((p.end() - 1)->X), y1 = CINT_TO_FL_T((p.end() - 1)->Y);
-		const fl_t xv = x1 - x0, yv = y1 - y0;
-		const fl_t norm = sqrt(xv * xv + yv * yv);
-		l += norm;
-		if (l == clip)
-			break;
-		else if (l > clip) {
-			const fl_t new_x = x1 - (l - clip) * (xv / norm), new_y = y1 - (l - clip) * (yv / norm);
-			p.push_back(FL_T_TO_INTPOINT(new_x, new_y));
-			break;
+	const struct stage_timer st = start_stage_timer();
+	std::vector<ssize_t> src;
+	find_infill_sources(o, start, end, src);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		if (src[i - start] == i) {
+			const struct layer_timer lt = start_layer_timer();
+			generate_infill(o, i);
+			end_layer_timer(&lt, i, LAYER_STAGE_INFILL);
 		}
-		x0 = x1;
-		y0 = y1;
 	}
-	if (clipped_points)
-		std::reverse(clipped_points->begin(), clipped_points->end());
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		if (src[i - start] != i) {
+			const struct layer_timer lt = start_layer_timer();
+			copy_infill(&o->slices[i], &o->slices[src[i - start]]);
+			end_layer_timer(&lt, i, LAYER_STAGE_INFILL);
+		}
+	}
+	end_stage_timer(&st, "infill");
 }
 
-static void generate_closed_path_moves(const ClipperLib::Path &p, size_t start_idx, struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, fl_t feed_rate)
+static void generate_layer_support_boundaries(struct object *o, ssize_t start, ssize_t end)
 {
-	if (p.size() < 3)
-		return;
-	fl_t total_clip = 0.0, anchor_e_len = 0.0;
-	ClipperLib::Path lp = p;
-	if (start_idx != 0)
-		std::rotate(lp.begin(), lp.begin() + start_idx, lp.end());
-	lp.push_back(lp[0]);
-	linear_move(slice, island, m, lp[0].X, lp[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.extrusion_width * 2.0);
-	if (config.shell_clip > 0.0 && path_len_is_greater_than(p, config.shell_clip * config.extrusion_width * 2.0))
-		total_clip += config.shell_clip * config.extrusion_width;
-	if (config.anchor && m->is_retracted && path_len_is_greater_than(p, total_clip + config.extrusion_width)) {
-		total_clip += config.extrusion_width / 2.0 * M_PI_4;
-		anchor_e_len = config.extrusion_width / 2.0 * M_PI_4 * config.extrusion_area * config.flow_multiplier / config.material_area;
+	const struct stage_timer st = start_stage_timer();
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		const struct layer_timer lt = start_layer_timer();
+		generate_support_boundaries(&o->slices[i]);
+		end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
 	}
-	if (total_clip > 0.0)
-		clip_path_from_end(lp, NULL, total_clip);
-	ClipperLib::Path coast_path;
-	if (config.coast_len > 0.0 && path_len_is_greater_than(p, total_clip + config.coast_len * 2.0))
-		clip_path_from_end(lp, &coast_path, config.coast_len);
-	linear_move(slice, island, m, lp[1].X, lp[1].Y, z, anchor_e_len, feed_rate, 1.0, true, false, false, 0.0);
-	for (auto it = lp.begin() + 2; it != lp.end(); ++it)
-		linear_move(slice, island, m, it->X, it->Y, z, 0.0, feed_rate, 1.0, true, false, true, 0.0);
-	m->is_retracted = true;  /* Make sure we don't retract */
-	m->is_hopped = true;     /* Make sure we don't hop */
-	for (const ClipperLib::IntPoint &point : coast_path)
-		linear_move(slice, island, m, point.X, point.Y, z, 0.0, feed_rate, 1.0, true, true, false, 0.0);
-	m->is_retracted = false;
-	m->is_hopped = false;
+	end_stage_timer(&st, "support_boundaries");
 }
 
-static void plan_brim(struct object *o, struct machine *m, ClipperLib::cInt z)
+static void generate_layer_support_lines(struct object *o, ssize_t start, ssize_t end)
 {
-	for (ClipperLib::Paths &p : o->brim) {
-		while (!p.empty()) {
-			size_t best = 0, start = 0;
-			best = find_nearest_path(p, m->x, m->y, NULL, &start);
-			generate_closed_path_moves(p[best], start, &o->slices[0], NULL, m, z, config.perimeter_feed_rate);
-			p.erase(p.begin() + best);
-		}
+	const struct stage_timer st = start_stage_timer();
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i) {
+		const struct layer_timer lt = start_layer_timer();
+		generate_support_lines(o, &o->slices[i], i);
+		end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
 	}
-	m->force_retract = true;
+	end_stage_timer(&st, "support_lines");
 }
 
-static void plan_support(struct slice *slice, ClipperLib::Paths &lines, struct machine *m, ClipperLib::cInt z, fl_t min_len, fl_t connect_threshold, fl_t flow_adjust, fl_t feed_rate)
+static void free_support_boundaries(struct object *o)
 {
-	bool first = true;
-	while (!lines.empty()) {
-		bool flip_points;
-		fl_t best_dist;
-		size_t best = find_nearest_segment(lines, m->x, m->y, &best_dist, &flip_points);
-		ClipperLib::Path &p = lines[best];
-		const fl_t len = distance_to_point(p[0], p[1]) / config.scale_constant;
-		if (len > min_len) {
-			bool cross_bound = false;
-			if (flip_points)
-				std::swap(p[0], p[1]);
-			if (!first) {
-				const ClipperLib::IntPoint p0(m->x, m->y);
-				for (const struct island &island : slice->islands) {
-					for (const ClipperLib::Path &bound : island.outer_boundaries) {
-						if (get_boundary_crossing(bound, p0, p[0]) >= 0) {
-							cross_bound = true;
-							m->force_retract = true;
-							break;
-						}
-					}
-				}
-			}
-			bool connect = (!first && !cross_bound && best_dist < connect_threshold);
-			if (connect)
-				linear_move(slice, NULL, m, p[0].X, p[0].Y, z, 0.0, feed_rate, flow_adjust, true, false, false, 0.0);
-			else
-				linear_move(slice, NULL, m, p[0].X, p[0].Y, z, 0.0, config.travel_feed_rate, flow_adjust, false, true, false, config.retract_threshold);
-			linear_move(slice, NULL, m, p[1].X, p[1].Y, z, 0.0, feed_rate, flow_adjust, true, false, false, 0.0);
-			first = false;
-		}
-		lines.erase(lines.begin() + best);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = 0; i < o->n_slices; ++i)
+		FREE_VECTOR(o->slices[i].support_boundaries);
+}
+
+/* The carried parts of the support sweep are copied every this many layers so that stream_object() can replay the
+   sweep from the copy above a band instead of from the top of the object */
+#define SUPPORT_CHECKPOINT_LAYERS 32
+
+/* The support state that stream_object() carries from band to band. The sweep over the whole object (see
+   sweep_support_in_bands()) keeps each layer's layer_support_map, the parts that were covered at each layer and the
+   checkpoints. Each band then replays the sweep from the checkpoint above it to build the support maps of its
+   layers, so the support maps are not kept for the whole object. */
+struct support_stream {
+	std::vector<std::vector<size_t>> covered;  /* The parts that sweep_support_layer() found to be covered at each layer */
+	std::vector<std::vector<ClipperLib::Paths>> checkpoints;  /* checkpoints[c] is the carried parts below layer c * SUPPORT_CHECKPOINT_LAYERS */
+	std::vector<ClipperLib::Paths> footprint_totals;  /* Union of the support boundaries of each footprint chunk until it is used */
+	ssize_t n_totals;               /* The totals of chunks below this have been found */
+	ClipperLib::Paths footprint_prefix;  /* Footprint of every chunk below 'footprint_chunk' */
+	ssize_t footprint_chunk;
+	struct support_footprint footprint;
+	ssize_t n_maps;                 /* The support maps of layers below this have been built */
+	ssize_t n_boundaries_freed;     /* The support boundaries of layers below this have been freed */
+};
+
+/* Build the support maps of layers [start, end) by replaying the sweep from the first checkpoint at or above 'end'
+   (or from the top of the object). The layers between the checkpoint and 'end' are only carried through. */
+static void replay_support_sweep(struct object *o, struct support_stream *ss, ssize_t start, ssize_t end)
+{
+	const ssize_t c = (end + SUPPORT_CHECKPOINT_LAYERS - 1) / SUPPORT_CHECKPOINT_LAYERS;
+	struct support_sweep sw;
+	ssize_t top = o->n_slices;
+	if (c * SUPPORT_CHECKPOINT_LAYERS < o->n_slices) {
+		sw.parts = ss->checkpoints[c];
+		top = c * SUPPORT_CHECKPOINT_LAYERS;
 	}
+	for (ssize_t k = top - 1; k >= start; --k)
+		replay_support_layer(o, &sw, k, ss->covered[k], (k < end) ? &o->slices[k].support_map : NULL);
+	for (ssize_t k = start; k < end; ++k) {
+		FREE_VECTOR(o->slices[k].layer_support_map);
+		FREE_VECTOR(ss->covered[k]);
+	}
+	/* The bands above start from later checkpoints */
+	for (ssize_t i = MAXIMUM(start / SUPPORT_CHECKPOINT_LAYERS, 1); i * SUPPORT_CHECKPOINT_LAYERS <= end && i < (ssize_t) ss->checkpoints.size(); ++i)
+		FREE_VECTOR(ss->checkpoints[i]);
 }
 
-static void plan_insets_weighted(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+/* Remove the footprint from the support map of layer k the way clip_support_chunk_to_footprint() does. The layers
+   must be given in order. */
+static void clip_support_to_footprint_up(struct object *o, struct support_stream *ss, ssize_t k)
 {
-	for (;;) {
-		bool done = true;
-		fl_t best_dist = FL_T_INF;
-		size_t best = 0, inset = 0, start = 0;
-		for (int i = 0; i < config.shells; ++i) {
-			if (!island->insets[i].empty()) {
-				fl_t dist;
-				size_t r, start_tmp = 0;
-				if (config.align_seams && (config.align_interior_seams || i == 0))
-					r = find_nearest_aligned_path(island->insets[i], m->x, m->y, &dist);
-				else
-					r = find_nearest_path(island->insets[i], m->x, m->y, &dist, &start_tmp);
-				if (outside_first) {
-					if (i != 0)
-						dist = dist * (i + 1) + config.extrusion_width * 10.0;  /* prefer exterior */
-				}
-				else {
-					if (i != config.shells - 1)
-						dist = dist * (config.shells - i) + config.extrusion_width * 10.0;  /* prefer interior */
-				}
-				if (dist < best_dist) {
-					best_dist = dist;
-					best = r;
-					inset = i;
-					start = start_tmp;
-					done = false;
-				}
-			}
+	const ssize_t c = k / SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	if (ss->footprint_chunk < c) {
+		for (; ss->footprint_chunk < c; ++ss->footprint_chunk) {
+			ClipperLib::Paths total;
+			total.swap(ss->footprint_totals[ss->footprint_chunk]);
+			if (ss->footprint_chunk > 0)
+				add_support_footprint_prefix(ss->footprint_prefix, total);
+			ss->footprint_prefix.swap(total);
 		}
-		if (done)
-			break;
-		generate_closed_path_moves(island->insets[inset][best], start, slice, island, m, z, (inset == 0) ? config.perimeter_feed_rate : config.loop_feed_rate);
-		island->insets[inset].erase(island->insets[inset].begin() + best);
+		ss->footprint.paths = ss->footprint_prefix;
+		ss->footprint.done = c * SUPPORT_FOOTPRINT_CHUNK_LAYERS;
 	}
+	if (k > 0)
+		clip_support_to_footprint(o, &ss->footprint, k);
 }
 
-static void plan_insets_strict_order(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+/* Find the footprint totals of the chunks whose support boundaries are all built. The last chunk's total is never
+   used. */
+static void find_support_footprint_totals(const struct object *o, struct support_stream *ss, ssize_t n_boundaries)
 {
-	int i = (outside_first) ? 0 : config.shells - 1;
-	while (i >= 0 && i < config.shells) {
-		if (island->insets[i].empty()) {
-			i = (outside_first) ? i + 1 : i - 1;
-			continue;
-		}
-		size_t best, start = 0;
-		if (config.align_seams && (config.align_interior_seams || i == 0))
-			best = find_nearest_aligned_path(island->insets[i], m->x, m->y, NULL);
-		else
-			best = find_nearest_path(island->insets[i], m->x, m->y, NULL, &start);
-		generate_closed_path_moves(island->insets[i][best], start, slice, island, m, z, (i == 0) ? config.perimeter_feed_rate : config.loop_feed_rate);
-		island->insets[i].erase(island->insets[i].begin() + best);
+	const ssize_t n_chunks = ss->footprint_totals.size();
+	for (; ss->n_totals + 1 < n_chunks && (ss->n_totals + 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS <= n_boundaries; ++ss->n_totals)
+		extend_support_footprint(o, ss->footprint_totals[ss->n_totals], ss->n_totals * SUPPORT_FOOTPRINT_CHUNK_LAYERS, (ss->n_totals + 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS);
+}
+
+/* Build the support maps and support interface clip regions of layers [ss->n_maps, end). The support boundaries of
+   layers ss->n_maps - support_vert_margin through end + support_vert_margin must be built. Afterwards, the boundaries
+   that are no longer needed are freed. */
+static void build_support_maps_up(struct object *o, struct support_stream *ss, ssize_t end)
+{
+	const ssize_t start = ss->n_maps;
+	if (start >= end)
+		return;
+	struct stage_timer st = start_stage_timer();
+	ssize_t k;
+	replay_support_sweep(o, ss, start, end);
+	end_stage_timer(&st, "support_extend");
+	if (!config.support_everywhere) {
+		st = start_stage_timer();
+		for (k = start; k < end; ++k)
+			clip_support_to_footprint_up(o, ss, k);
+		end_stage_timer(&st, "support_build_plate");
+	}
+	if (config.interface_roof_layers > 0 || config.interface_floor_layers > 0) {
+		st = start_stage_timer();
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+		for (k = start; k < end; ++k)
+			generate_support_interface_clip_regions(&o->slices[k]);
+		end_stage_timer(&st, "support_interface");
 	}
+	ss->n_maps = end;
+	/* The footprint still needs the boundaries of the chunks without a total and the ones it has not reached yet */
+	ssize_t keep = end - config.support_vert_margin;
+	if (!config.support_everywhere)
+		keep = MINIMUM(keep, MINIMUM(ss->footprint.done, ss->n_totals * SUPPORT_FOOTPRINT_CHUNK_LAYERS));
+	for (; ss->n_boundaries_freed < keep; ++ss->n_boundaries_freed)
+		FREE_VECTOR(o->slices[ss->n_boundaries_freed].support_boundaries);
 }
 
-static void plan_insets(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+static void free_islands(struct slice *slice)
 {
-	if (config.shells > 0) {
-		if (config.strict_shell_order)
-			plan_insets_strict_order(slice, island, m, z, outside_first);
-		else
-			plan_insets_weighted(slice, island, m, z, outside_first);
+	for (struct island &island : slice->islands) {
+		delete[] island.insets;
+		delete[] island.inset_gaps;
 	}
-	if (config.retract_after_shells)
-		m->force_retract = true;
+	FREE_VECTOR(slice->islands);
 }
 
-static void plan_infill_simple(ClipperLib::Paths &lines, struct slice *slice, struct island *island, struct machine *m, fl_t feed_rate, fl_t flow_adjust, ClipperLib::cInt z)
+static void report_open_outlines(const struct object *o)
 {
-	while (!lines.empty()) {
-		bool flip_points;
-		fl_t extra_e_len = 0.0;
-		const ClipperLib::IntPoint p_start(m->x, m->y);
-		const size_t best = find_nearest_segment(lines, m->x, m->y, NULL, &flip_points);
-		ClipperLib::Path &p = lines[best];
-		if (flip_points)
-			std::swap(p[0], p[1]);
-		linear_move(slice, island, m, p[0].X, p[0].Y, z, 0.0, config.travel_feed_rate, flow_adjust, false, true, false, config.retract_threshold);
-		if (!m->is_retracted) {
-			const fl_t travel_dist = distance_to_point(p_start, p[0]) / config.scale_constant;
-			const fl_t extra_vol = (travel_dist <= config.sparse_restart_max_dist) ? travel_dist / config.sparse_restart_max_dist * config.sparse_restart_max_vol : config.sparse_restart_max_vol;
-			extra_e_len = extra_vol / config.material_area;
+	ssize_t open_outlines = 0, open_layers = 0, first_open_layer = -1;
+	for (ssize_t i = 0; i < o->n_slices; ++i) {
+		if (o->slices[i].open_outlines > 0) {
+			open_outlines += o->slices[i].open_outlines;
+			if (open_layers++ == 0)
+				first_open_layer = i;
 		}
-		linear_move(slice, island, m, p[1].X, p[1].Y, z, extra_e_len, feed_rate, flow_adjust, true, false, false, 0.0);
-		lines.erase(lines.begin() + best);
 	}
+	if (open_layers > 0)
+		fprintf(stderr, "warning: there is (probably) a hole in the mesh: %zd outline(s) could not be closed on %zd layer(s) (first at layer %zd)\n",
+			open_outlines, open_layers, first_open_layer + 1);
 }
 
-static size_t find_next_solid_infill_segment(const ClipperLib::Paths &p, ClipperLib::Path &line0, fl_t *r_dist, bool *r_flip, bool *r_is_adjacent)
+static ssize_t count_layers(const struct object *o)
 {
-	const fl_t adjacent_dist_fudge = config.extrusion_width / 8.0;
-	bool best_flip = false, best_is_adjacent = false;
-	size_t best = 0;
-	fl_t best_dist = FL_T_INF, best_adj_dist = FL_T_INF;
+	return (ssize_t) ceil((o->c.z + o->h / 2.0) / config.layer_height);
+}
 
-	for (size_t i = 0; i < p.size(); ++i) {
-		if (p[i].size() > 2)
-			fprintf(stderr, "error: bug in clipper: line segment has more than two points!\n");
-		ClipperLib::Path line1 = p[i];
-		const fl_t l_dist0 = distance_to_line(line0[0], line1[0], line1[1]);
-		const fl_t l_dist1 = distance_to_line(line0[1], line1[0], line1[1]);
-		const fl_t l_dist2 = distance_to_line(line1[0], line0[0], line0[1]);
-		const fl_t l_dist3 = distance_to_line(line1[1], line0[0], line0[1]);
-		const fl_t min_dist = MINIMUM_4(l_dist0, l_dist1, l_dist2, l_dist3);
-		const fl_t scaled_min_dist = min_dist / config.scale_constant;
-		const fl_t scaled_p_dist = perpendicular_distance_to_line(line0[1], line1[0], line1[1]) / config.scale_constant;
-		const fl_t pt_dist0 = distance_to_point(line0[1], line1[0]);
-		const fl_t pt_dist1 = distance_to_point(line0[1], line1[1]);
-		const bool is_adjacent = scaled_p_dist < config.extrusion_width + adjacent_dist_fudge && scaled_p_dist > config.extrusion_width - adjacent_dist_fudge && scaled_min_dist < config.extrusion_width * 2.0;
-		const bool is_opposite_dir = ((line0[0].X < line0[1].X) != (line1[0].X < line1[1].X)) || ((line0[0].Y < line0[1].Y) != (line1[0].Y < line1[1].Y));
-		fl_t adj_dist = l_dist1;
-		if (is_opposite_dir != (pt_dist1 > pt_dist0))
-			adj_dist *= 2.0;
-		if (!is_adjacent)
-			adj_dist *= 4.0;
-		if (adj_dist < best_adj_dist) {
-			best_adj_dist = adj_dist;
-			best_flip = (is_adjacent) ? (is_opposite_dir) ? pt_dist0 > pt_dist1 * 4.0 : !(pt_dist1 > pt_dist0 * 4.0) : pt_dist1 < pt_dist0;
-			best_dist = (best_flip) ? pt_dist1 : pt_dist0;
-			best_is_adjacent = is_adjacent;
-			best = i;
-		}
-	}
-	if (r_dist)
-		*r_dist = best_dist / config.scale_constant;
-	if (r_flip)
-		*r_flip = best_flip;
-	if (r_is_adjacent)
-		*r_is_adjacent = best_is_adjacent;
-	return best;
+/* Allocate the layers and build the mesh topology */
+static void build_object_topology(struct object *o)
+{
+	o->n_slices = count_layers(o);
+	o->slices = new struct slice[o->n_slices]();
+	if (!o->slices)
+		die(e_nomem, 2);
+
+	if (perf.enabled)
+		perf.layers.resize(o->n_slices);
+
+	if (show_progress)
+		fputs("  build mesh topology...", stderr);
+	const struct stage_timer st = start_stage_timer();
+	ssize_t n_open_edges, n_non_manifold_edges, n_flipped_edges;
+	build_mesh_topology(o, &n_open_edges, &n_non_manifold_edges, &n_flipped_edges);
+	end_stage_timer(&st, "mesh_topology");
+	if (show_progress)
+		fputs(" done\n", stderr);
+	if (n_open_edges > 0 || n_non_manifold_edges > 0 || n_flipped_edges > 0)
+		fprintf(stderr, "warning: mesh has %zd open edge(s), %zd non-manifold edge(s) and %zd inconsistently oriented edge(s)\n",
+			n_open_edges, n_non_manifold_edges, n_flipped_edges);
 }
 
-static void plan_smoothed_solid_infill(ClipperLib::Paths &lines, struct slice *slice, struct island *island, struct machine *m, fl_t feed_rate, ClipperLib::cInt z)
+/* Build the mesh topology and find the segments for every layer. The triangles and vertices are freed afterwards. */
+static void find_object_segments(struct object *o)
 {
-	if (lines.empty())
+	build_object_topology(o);
+	if (show_progress)
+		fputs("  find segments...", stderr);
+	const struct stage_timer st = start_stage_timer();
+	find_segments(o, NULL, o->n, 0, o->n_slices);
+	end_stage_timer(&st, "find_segments");
+	if (show_progress)
+		fputs(" done\n", stderr);
+	free(o->t);
+	free(o->v);
+}
+
+/* Find the segments for layers [start, end) when the layers are sliced in bands. Only the triangles that cross the
+   band are looked at: any triangle that crosses a layer of the band and starts below it also crosses layer 'start',
+   so it starts at or above o->bins.reach[start]. The triangles and vertices must be kept until every band is
+   done. */
+static void find_band_segments(struct object *o, ssize_t start, ssize_t end)
+{
+	if (start >= end)
 		return;
-	bool flip_points, last_was_smoothed = false, needs_travel = true;
-	size_t best = find_nearest_segment(lines, m->x, m->y, NULL, &flip_points);
-	ClipperLib::Path line0 = lines[best];
-	lines.erase(lines.begin() + best);
-	if (flip_points)
-		std::swap(line0[0], line0[1]);
-	while (!lines.empty()) {
-		fl_t best_dist;
-		bool is_adjacent;
-		best = find_next_solid_infill_segment(lines, line0, &best_dist, &flip_points, &is_adjacent);
-		ClipperLib::Path line1 = lines[best];
-		lines.erase(lines.begin() + best);
-		if (flip_points)
-			std::swap(line1[0], line1[1]);
-		bool cross_bound = false;
-		for (const ClipperLib::Path &bound : island->solid_infill_boundaries) {
-			   if (get_boundary_crossing(bound, line0[1], line1[0]) >= 0) {
-					   cross_bound = true;
-					   break;
-			   }
-		}
-		bool is_constrained = false, in_outer = false, in_hole = false;
-		if (island->constraining_edge.empty()) {
-			is_constrained = true;  /* All solid infill is inset gap fill if there's no constraining edge */
+	const struct stage_timer st = start_stage_timer();
+	std::vector<int> tris;
+	for (ssize_t i = o->bins.start[o->bins.reach[start]]; i < o->bins.start[end]; ++i) {
+		ssize_t t_start, t_stop;
+		find_layer_range(o, &o->t[o->bins.t[i]], &t_start, &t_stop);
+		if (t_stop > start)
+			tris.push_back(o->bins.t[i]);
+	}
+	std::sort(tris.begin(), tris.end());
+	find_segments(o, tris.data(), tris.size(), start, end);
+	end_stage_timer(&st, "find_segments");
+}
+
+/* 0 is colinear, 1 is counter-clockwise and -1 is clockwise */
+static int triplet_orientation(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c)
+{
+	const ClipperLib::cInt v = (b.X - a.X) * (c.Y - a.Y) - (c.X - a.X) * (b.Y - a.Y);  /* Calculate signed area * 2 */
+	return (v == 0) ? 0 : (v > 0) ? 1 : -1;
+}
+
+static int is_on_segment(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c)
+{
+	if (b.X <= MAXIMUM(a.X, c.X) && b.X >= MINIMUM(a.X, c.X) && b.Y <= MAXIMUM(a.Y, c.Y) && b.Y >= MINIMUM(a.Y, c.Y))
+		return true;
+	return false;
+}
+
+static bool intersects(const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, const ClipperLib::IntPoint &c, const ClipperLib::IntPoint &d)
+{
+	const int o1 = triplet_orientation(a, b, c);
+	const int o2 = triplet_orientation(a, b, d);
+	const int o3 = triplet_orientation(c, d, a);
+	const int o4 = triplet_orientation(c, d, b);
+	if (o1 != o2 && o3 != o4)
+		return true;
+	if (o1 == 0 && is_on_segment(a, c, b))
+		return true;
+	if (o2 == 0 && is_on_segment(a, d, b))
+		return true;
+	if (o3 == 0 && is_on_segment(c, a, d))
+		return true;
+	if (o4 == 0 && is_on_segment(c, b, d))
+		return true;
+	return false;
+}
+
+static ssize_t grid_cell(ClipperLib::cInt v, ClipperLib::cInt v0, ClipperLib::cInt cell_size)
+{
+	return (v >= v0) ? (v - v0) / cell_size : -((v0 - v - 1) / cell_size) - 1;
+}
+
+/* Append the index of every cell of a w by h grid with its origin at (x0, y0) that the segment from a to b passes
+   through. The range in each row is widened by one unit to absorb rounding error. */
+static void find_grid_cells(ClipperLib::cInt x0, ClipperLib::cInt y0, ClipperLib::cInt cell_size, ssize_t w, ssize_t h, const ClipperLib::IntPoint &a, const ClipperLib::IntPoint &b, std::vector<size_t> &cells)
+{
+	const ClipperLib::cInt min_y = MINIMUM(a.Y, b.Y), max_y = MAXIMUM(a.Y, b.Y);
+	const ssize_t cy0 = MAXIMUM(grid_cell(min_y, y0, cell_size), 0), cy1 = MINIMUM(grid_cell(max_y, y0, cell_size), h - 1);
+	for (ssize_t cy = cy0; cy <= cy1; ++cy) {
+		fl_t x_lo, x_hi;
+		if (a.Y == b.Y) {
+			x_lo = MINIMUM(a.X, b.X);
+			x_hi = MAXIMUM(a.X, b.X);
 		}
 		else {
-			for (const ClipperLib::Path &bound : island->constraining_edge) {
-				/* Note: is_constrained will always be true for inset gap fill */
-				bool in_bound = ClipperLib::PointInPolygon(line0[1], bound) || ClipperLib::PointInPolygon(line1[0], bound);
-				bool bound_is_hole = !ClipperLib::Orientation(bound);
-				if (in_bound == bound_is_hole) {
-					is_constrained = true;
-					in_hole = in_hole || bound_is_hole;
-				}
-				else if (in_bound && !bound_is_hole) {
-					in_outer = true;
+			const fl_t y_lo = MAXIMUM(y0 + cy * cell_size, min_y), y_hi = MINIMUM(y0 + (cy + 1) * cell_size, max_y);
+			const fl_t x_at_lo = a.X + (y_lo - a.Y) * (b.X - a.X) / (b.Y - a.Y);
+			const fl_t x_at_hi = a.X + (y_hi - a.Y) * (b.X - a.X) / (b.Y - a.Y);
+			x_lo = MINIMUM(x_at_lo, x_at_hi);
+			x_hi = MAXIMUM(x_at_lo, x_at_hi);
+		}
+		const ssize_t cx0 = MAXIMUM(grid_cell((ClipperLib::cInt) floor(x_lo) - 1, x0, cell_size), 0);
+		const ssize_t cx1 = MINIMUM(grid_cell((ClipperLib::cInt) ceil(x_hi) + 1, x0, cell_size), w - 1);
+		for (ssize_t cx = cx0; cx <= cx1; ++cx)
+			cells.push_back(cy * w + cx);
+	}
+}
+
+static void build_edge_grid(struct edge_grid *g, const ClipperLib::Paths &paths)
+{
+	size_t n = 0;
+	bool first = true;
+	g->x0 = g->y0 = g->x1 = g->y1 = 0;
+	g->path_start.clear();
+	g->orientation.clear();
+	for (const ClipperLib::Path &p : paths) {
+		g->path_start.push_back(n);
+		g->orientation.push_back(ClipperLib::Orientation(p));
+		n += p.size();
+		for (const ClipperLib::IntPoint &pt : p) {
+			if (first) {
+				g->x0 = g->x1 = pt.X;
+				g->y0 = g->y1 = pt.Y;
+				first = false;
+			}
+			g->x0 = MINIMUM(g->x0, pt.X);
+			g->y0 = MINIMUM(g->y0, pt.Y);
+			g->x1 = MAXIMUM(g->x1, pt.X);
+			g->y1 = MAXIMUM(g->y1, pt.Y);
+		}
+	}
+	g->path_start.push_back(n);
+	g->visited.assign(n, 0);
+	g->query = 0;
+	/* Aim for about one cell per edge */
+	const fl_t area = ((fl_t) (g->x1 - g->x0) + 1.0) * ((fl_t) (g->y1 - g->y0) + 1.0);
+	g->cell_size = (ClipperLib::cInt) MAXIMUM(sqrt(area / MAXIMUM(n, 1)), config.extrusion_width * config.scale_constant);
+	g->w = (g->x1 - g->x0) / g->cell_size + 1;
+	g->h = (g->y1 - g->y0) / g->cell_size + 1;
+	g->cell_start.assign(g->w * g->h + 1, 0);
+	std::vector<size_t> cells;
+	for (int pass = 0; pass < 2; ++pass) {
+		std::vector<size_t> cell_end(g->cell_start.begin(), g->cell_start.end() - 1);
+		for (size_t i = 0; i < paths.size(); ++i) {
+			const ClipperLib::Path &p = paths[i];
+			for (size_t j = 0; j < p.size(); ++j) {
+				cells.clear();
+				find_grid_cells(g->x0, g->y0, g->cell_size, g->w, g->h, p[j], p[(j + 1 < p.size()) ? j + 1 : 0], cells);
+				for (size_t c : cells) {
+					if (pass == 0)
+						++g->cell_start[c + 1];
+					else
+						g->entries[cell_end[c]++] = g->path_start[i] + j;
 				}
 			}
-			if (is_constrained && in_outer && !in_hole)
-				is_constrained = false;
 		}
-		const ClipperLib::IntPoint line0_midpoint((line0[0].X + line0[1].X) / 2, (line0[0].Y + line0[1].Y) / 2);
-		const ClipperLib::IntPoint line1_midpoint((line1[0].X + line1[1].X) / 2, (line1[0].Y + line1[1].Y) / 2);
-		const fl_t len_line0 = distance_to_point(line0[0], line0[1]);
-		const fl_t len_line1 = distance_to_point(line1[0], line1[1]);
-		const fl_t len_mid = distance_to_point(line0_midpoint, line1_midpoint);
-		const fl_t xv0 = line0[1].X - line0[0].X, yv0 = line0[1].Y - line0[0].Y;
-		const fl_t xv1 = line1[1].X - line1[0].X, yv1 = line1[1].Y - line1[0].Y;
-		const fl_t xv_mid = line1_midpoint.X - line0_midpoint.X, yv_mid = line1_midpoint.Y - line0_midpoint.Y;
-		/* det(a, b) / (||a|| * ||b||) * ||a|| gives the width of the region covered by a (measured perpendicular to b) */
-		const fl_t region_width0 = fabs((xv0 * yv_mid - yv0 * xv_mid) / len_mid);
-		const fl_t region_width1 = fabs((xv1 * yv_mid - yv1 * xv_mid) / len_mid);
-		const fl_t p_dist = perpendicular_distance_to_line(line0[1], line1[0], line1[1]) / config.scale_constant;
-		const fl_t shortening_dist = best_dist / p_dist * config.extrusion_width / 2.0;
-		const bool is_opposite_dir = ((line0[0].X < line0[1].X) != (line1[0].X < line1[1].X)) || ((line0[0].Y < line0[1].Y) != (line1[0].Y < line1[1].Y));
-		const fl_t connect_min_len = MAXIMUM(shortening_dist, config.extrusion_width / 2.0) * config.scale_constant;
-		if (config.infill_smooth_threshold > 0.0
-				&& !cross_bound
-				&& is_adjacent
-				&& len_line0 <= config.extrusion_width * config.infill_smooth_threshold * 2.0 * config.scale_constant
-				&& len_line1 <= config.extrusion_width * config.infill_smooth_threshold * 2.0 * config.scale_constant
-				&& region_width0 <= config.extrusion_width * config.infill_smooth_threshold * config.scale_constant
-				&& region_width1 <= config.extrusion_width * config.infill_smooth_threshold * config.scale_constant) {
-			if (!last_was_smoothed) {
-				/* move to line0 start */
-				if (needs_travel)
-					linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
-				/* extrude to line0_midpoint */
-				linear_move(slice, island, m, line0_midpoint.X, line0_midpoint.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+		if (pass == 0) {
+			for (size_t i = 1; i < g->cell_start.size(); ++i)
+				g->cell_start[i] += g->cell_start[i - 1];
+			g->entries.resize(g->cell_start.back());
+		}
+	}
+	g->built = true;
+}
+
+static const struct edge_grid * get_edge_grid(struct edge_grid *g, const ClipperLib::Paths &paths)
+{
+	if (!g->built)
+		build_edge_grid(g, paths);
+	return g;
+}
+
+static void clear_edge_grid(struct edge_grid *g)
+{
+	g->built = false;
+	FREE_VECTOR(g->cell_start);
+	FREE_VECTOR(g->entries);
+	FREE_VECTOR(g->path_start);
+	FREE_VECTOR(g->orientation);
+	FREE_VECTOR(g->cells);
+	FREE_VECTOR(g->candidates);
+	FREE_VECTOR(g->visited);
+}
+
+/* Find the ids of all edges that may touch the segment from p0 to p1, sorted by id (and therefore by path). The
+   result is valid until the next query. */
+static const std::vector<size_t> & find_edge_grid_candidates(const struct edge_grid *g, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+{
+	std::vector<size_t> &r_edges = g->candidates;
+	r_edges.clear();
+	g->cells.clear();
+	find_grid_cells(g->x0, g->y0, g->cell_size, g->w, g->h, p0, p1, g->cells);
+	++g->query;
+	for (size_t c : g->cells) {
+		for (size_t k = g->cell_start[c]; k < g->cell_start[c + 1]; ++k) {
+			const size_t e = g->entries[k];
+			if (g->visited[e] != g->query) {
+				g->visited[e] = g->query;
+				r_edges.push_back(e);
 			}
-			/* extrude to line1_midpoint */
-			const fl_t extrude_ratio = (len_line0 + len_line1) / 2.0 / distance_to_point(line0_midpoint, line1_midpoint);
-			const fl_t scaled_feed_rate = (feed_rate / extrude_ratio < config.travel_feed_rate) ? feed_rate / extrude_ratio : config.travel_feed_rate;
-			linear_move(slice, island, m, line1_midpoint.X, line1_midpoint.Y, z, 0.0, scaled_feed_rate, extrude_ratio, true, false, false, 0.0);
-			last_was_smoothed = true;
-			needs_travel = false;
 		}
-		else if (!cross_bound
-				&& !is_constrained
-				&& is_adjacent
-				&& is_opposite_dir
-				&& best_dist < config.extrusion_width * 3.864
-				&& ((last_was_smoothed) ? len_line0 / 2.0 : len_line0) > connect_min_len
-				&& len_line1 / 2.0 > connect_min_len) {
-			ClipperLib::IntPoint pt0, pt1;
-			/* adjusted line0 end point */
-			pt0.X = line0[1].X - llround(shortening_dist * config.scale_constant * (xv0 / len_line0));
-			pt0.Y = line0[1].Y - llround(shortening_dist * config.scale_constant * (yv0 / len_line0));
-			/* adjusted line1 start point */
-			pt1.X = line1[0].X - llround(shortening_dist * config.scale_constant * (-xv1 / len_line1));
-			pt1.Y = line1[0].Y - llround(shortening_dist * config.scale_constant * (-yv1 / len_line1));
-			if (needs_travel)
-				linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
-			/* extrude line0 */
-			linear_move(slice, island, m, pt0.X, pt0.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
-			/* extrude connection */
-			linear_move(slice, island, m, pt1.X, pt1.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
-			last_was_smoothed = false;
-			needs_travel = false;
+	}
+	std::sort(r_edges.begin(), r_edges.end());
+	return r_edges;
+}
+
+static size_t get_edge_grid_path(const struct edge_grid *g, size_t e)
+{
+	return std::upper_bound(g->path_start.begin(), g->path_start.end(), e) - g->path_start.begin() - 1;
+}
+
+/* Find the edges that may cross a ray from pt in the +x direction. Any edge that ClipperLib::PointInPolygon() would
+   count is among them. */
+static const std::vector<size_t> & find_edge_grid_ray_candidates(const struct edge_grid *g, const ClipperLib::IntPoint &pt)
+{
+	return find_edge_grid_candidates(g, pt, ClipperLib::IntPoint(MAXIMUM(pt.X, g->x1), pt.Y));
+}
+
+/* Same as ClipperLib::PointInPolygon(), but only visits the given edges of path p (in the order of
+   find_edge_grid_ray_candidates()) */
+static int point_in_path_edges(const ClipperLib::IntPoint &pt, const ClipperLib::Path &p, size_t p_start, std::vector<size_t>::const_iterator begin, std::vector<size_t>::const_iterator end)
+{
+	int result = 0;
+	if (p.size() < 3)
+		return 0;
+	for (auto it = begin; it != end; ++it) {
+		const size_t j = *it - p_start;
+		const ClipperLib::IntPoint &ip = p[j], &ip_next = p[(j + 1 < p.size()) ? j + 1 : 0];
+		if (ip_next.Y == pt.Y) {
+			if ((ip_next.X == pt.X) || (ip.Y == pt.Y && ((ip_next.X > pt.X) == (ip.X < pt.X))))
+				return -1;
+		}
+		if ((ip.Y < pt.Y) != (ip_next.Y < pt.Y)) {
+			if (ip.X >= pt.X && ip_next.X > pt.X)
+				result = 1 - result;
+			else if (ip.X >= pt.X || ip_next.X > pt.X) {
+				const double d = (double) (ip.X - pt.X) * (ip_next.Y - pt.Y) - (double) (ip_next.X - pt.X) * (ip.Y - pt.Y);
+				if (!d)
+					return -1;
+				if ((d > 0) == (ip_next.Y > ip.Y))
+					result = 1 - result;
+			}
+		}
+	}
+	return result;
+}
+
+/* Returns the index of the first boundary crossed by the segment from p0 to p1, or -1 if none are */
+static ssize_t crosses_boundary(const struct edge_grid *g, const ClipperLib::Paths &bounds, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+{
+	const std::vector<size_t> &edges = find_edge_grid_candidates(g, p0, p1);
+	for (size_t e : edges) {
+		const size_t i = get_edge_grid_path(g, e), j = e - g->path_start[i];
+		const ClipperLib::Path &p = bounds[i];
+		if (intersects(p[j], p[(j + 1 < p.size()) ? j + 1 : 0], p0, p1))
+			return (ssize_t) i;
+	}
+	return -1;
+}
+
+/* Adds the paths that contain pt (or that pt is on) to r_paths */
+static void find_containing_paths(const struct edge_grid *g, const ClipperLib::Paths &paths, const ClipperLib::IntPoint &pt, std::vector<size_t> &r_paths)
+{
+	const std::vector<size_t> &edges = find_edge_grid_ray_candidates(g, pt);
+	for (auto begin = edges.begin(); begin != edges.end();) {
+		const size_t i = get_edge_grid_path(g, *begin);
+		auto end = std::lower_bound(begin, edges.end(), g->path_start[i + 1]);
+		if (point_in_path_edges(pt, paths[i], g->path_start[i], begin, end))
+			r_paths.push_back(i);
+		begin = end;
+	}
+}
+
+static bool crosses_exposed_surface(const struct island *island, ClipperLib::cInt x0, ClipperLib::cInt y0, ClipperLib::cInt x1, ClipperLib::cInt y1)
+{
+	const ClipperLib::IntPoint p0(x0, y0);
+	const ClipperLib::IntPoint p1(x1, y1);
+	if (island->exposed_surface.empty())
+		return false;
+	const struct edge_grid *g = get_edge_grid(&island->exposed_surface_grid, island->exposed_surface);
+	const ssize_t crossed = crosses_boundary(g, island->exposed_surface, p0, p1);
+	std::vector<size_t> containing;
+	find_containing_paths(g, island->exposed_surface, p0, containing);
+	find_containing_paths(g, island->exposed_surface, p1, containing);
+	/* The paths are checked in order, as if each one were tested for a crossing and then for containing p0 or p1 */
+	bool in_outer = false;
+	std::sort(containing.begin(), containing.end());
+	for (size_t i : containing) {
+		if (crossed >= 0 && (size_t) crossed <= i)
+			return true;
+		if (!g->orientation[i])
+			return false;  /* p0 and p1 are inside a hole, so no exposed surface was crossed */
+		in_outer = true;
+	}
+	return (crossed >= 0) ? true : in_outer;
+}
+
+static size_t find_nearest_path(const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist, size_t *r_start)
+{
+	size_t best = 0, start = 0;
+	fl_t best_dist = FL_T_INF;
+	const fl_t x0 = CINT_TO_FL_T(x), y0 = CINT_TO_FL_T(y);
+	for (size_t i = 0; i < p.size(); ++i) {
+		for (size_t k = 0; k < p[i].size(); ++k) {
+			fl_t x1 = CINT_TO_FL_T(p[i][k].X), y1 = CINT_TO_FL_T(p[i][k].Y);
+			fl_t dist = (x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0);
+			if (dist < best_dist) {
+				best_dist = dist;
+				best = i;
+				start = k;
+			}
+		}
+	}
+	if (r_dist)
+		*r_dist = sqrt(best_dist);
+	if (r_start)
+		*r_start = start;
+	return best;
+}
+
+static size_t find_nearest_aligned_path(const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist)
+{
+	size_t best = 0;
+	fl_t best_dist = FL_T_INF;
+	const fl_t x0 = CINT_TO_FL_T(x), y0 = CINT_TO_FL_T(y);
+	for (size_t i = 0; i < p.size(); ++i) {
+		fl_t x1 = CINT_TO_FL_T(p[i][0].X), y1 = CINT_TO_FL_T(p[i][0].Y);
+		fl_t dist = (x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = i;
+		}
+	}
+	if (r_dist)
+		*r_dist = sqrt(best_dist);
+	return best;
+}
+
+static ssize_t line_grid_cell(const struct line_grid *g, ClipperLib::cInt v, ClipperLib::cInt v0)
+{
+	return grid_cell(v, v0, g->cell_size);
+}
+
+/* Append the index of every cell that the line passes through */
+static void find_line_grid_cells(const struct line_grid *g, const ClipperLib::Path &p, std::vector<size_t> &cells)
+{
+	find_grid_cells(g->x0, g->y0, g->cell_size, g->w, g->h, p[0], p[1], cells);
+}
+
+static void build_line_grid(struct line_grid *g, const ClipperLib::Paths &lines)
+{
+	ClipperLib::cInt x1 = 0, y1 = 0;
+	g->x0 = g->y0 = 0;
+	if (lines.size() > 0 && lines[0].size() > 0) {
+		g->x0 = x1 = lines[0][0].X;
+		g->y0 = y1 = lines[0][0].Y;
+	}
+	for (const ClipperLib::Path &p : lines) {
+		if (p.size() > 2)
+			fprintf(stderr, "error: bug in clipper: line segment has more than two points!\n");
+		for (const ClipperLib::IntPoint &pt : p) {
+			g->x0 = MINIMUM(g->x0, pt.X);
+			g->y0 = MINIMUM(g->y0, pt.Y);
+			x1 = MAXIMUM(x1, pt.X);
+			y1 = MAXIMUM(y1, pt.Y);
+		}
+	}
+	/* Aim for about one cell per line, but don't make the cells much narrower than the line spacing */
+	const fl_t area = ((fl_t) (x1 - g->x0) + 1.0) * ((fl_t) (y1 - g->y0) + 1.0);
+	g->cell_size = (ClipperLib::cInt) MAXIMUM(sqrt(area / MAXIMUM(lines.size(), 1)), config.extrusion_width * config.scale_constant);
+	g->w = (x1 - g->x0) / g->cell_size + 1;
+	g->h = (y1 - g->y0) / g->cell_size + 1;
+	g->cell_start.assign(g->w * g->h + 1, 0);
+	g->removed.assign(lines.size(), false);
+	std::vector<size_t> cells;
+	for (const ClipperLib::Path &p : lines) {
+		cells.clear();
+		find_line_grid_cells(g, p, cells);
+		for (size_t c : cells)
+			++g->cell_start[c + 1];
+	}
+	for (size_t i = 1; i < g->cell_start.size(); ++i)
+		g->cell_start[i] += g->cell_start[i - 1];
+	g->entries.resize(g->cell_start.back());
+	g->cell_end.assign(g->cell_start.begin(), g->cell_start.end() - 1);
+	for (size_t i = 0; i < lines.size(); ++i) {
+		cells.clear();
+		find_line_grid_cells(g, lines[i], cells);
+		for (size_t c : cells)
+			g->entries[g->cell_end[c]++] = i;
+	}
+}
+
+static void remove_from_line_grid(struct line_grid *g, size_t i)
+{
+	g->removed[i] = true;
+}
+
+/* Searches go outward from the cell containing the query point one ring (cells at the same Chebyshev distance)
+   at a time. The first ring is the nearest one that overlaps the grid. */
+static void find_line_grid_start(const struct line_grid *g, ClipperLib::cInt x, ClipperLib::cInt y, ssize_t *r_cx, ssize_t *r_cy, ssize_t *r_ring)
+{
+	const ssize_t cx = line_grid_cell(g, x, g->x0), cy = line_grid_cell(g, y, g->y0);
+	*r_cx = cx;
+	*r_cy = cy;
+	*r_ring = MAXIMUM(MAXIMUM(-cx, cx - (g->w - 1)), MAXIMUM(MAXIMUM(-cy, cy - (g->h - 1)), 0));
+}
+
+/* Lower bound on the distance from the query point to any line first found in the given ring. distance_to_line()
+   truncates the projected point, so allow a couple of units of slack. */
+static fl_t line_grid_ring_min_dist(const struct line_grid *g, ssize_t ring)
+{
+	return (ring > 0) ? (fl_t) (ring - 1) * g->cell_size - 2.0 : -FL_T_INF;
+}
+
+static void find_lines_in_cell(struct line_grid *g, size_t c, std::vector<size_t> &found)
+{
+	for (size_t k = g->cell_start[c]; k < g->cell_end[c];) {
+		if (g->removed[g->entries[k]])
+			g->entries[k] = g->entries[--g->cell_end[c]];
+		else
+			found.push_back(g->entries[k++]);
+	}
+}
+
+/* Set 'found' to the remaining lines stored in the given ring (lines may be repeated). Returns false once the ring
+   lies completely outside of the grid, as will every larger ring. */
+static bool find_lines_in_ring(struct line_grid *g, ssize_t cx, ssize_t cy, ssize_t ring, std::vector<size_t> &found)
+{
+	const ssize_t x_lo = cx - ring, x_hi = cx + ring, y_lo = cy - ring, y_hi = cy + ring;
+	found.clear();
+	if (x_lo < 0 && y_lo < 0 && x_hi >= g->w && y_hi >= g->h)
+		return false;
+	for (ssize_t y = MAXIMUM(y_lo, 0); y <= MINIMUM(y_hi, g->h - 1); ++y) {
+		if (y == y_lo || y == y_hi) {
+			for (ssize_t x = MAXIMUM(x_lo, 0); x <= MINIMUM(x_hi, g->w - 1); ++x)
+				find_lines_in_cell(g, y * g->w + x, found);
 		}
 		else {
-			if (needs_travel)
-				linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
-			linear_move(slice, island, m, line0[1].X, line0[1].Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
-			last_was_smoothed = false;
-			needs_travel = true;
+			if (x_lo >= 0 && x_lo < g->w)
+				find_lines_in_cell(g, y * g->w + x_lo, found);
+			if (x_hi >= 0 && x_hi < g->w)
+				find_lines_in_cell(g, y * g->w + x_hi, found);
 		}
-		line0 = line1;
 	}
-	if (needs_travel)
-		linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
-	linear_move(slice, island, m, line0[1].X, line0[1].Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+	return true;
+}
+
+/* Returns the remaining line nearest to (x, y). Ties go to the lowest index (the order of the lines is preserved). */
+static size_t find_nearest_segment(struct line_grid *g, const ClipperLib::Paths &p, ClipperLib::cInt x, ClipperLib::cInt y, fl_t *r_dist, bool *r_flip)
+{
+	size_t best = 0;
+	fl_t best_dist = FL_T_INF;
+	const ClipperLib::IntPoint p0(x, y);
+	std::vector<size_t> found;
+	ssize_t cx, cy, ring;
+	for (find_line_grid_start(g, x, y, &cx, &cy, &ring); line_grid_ring_min_dist(g, ring) <= best_dist && find_lines_in_ring(g, cx, cy, ring, found); ++ring) {
+		for (size_t i : found) {
+			const fl_t dist = distance_to_line(p0, p[i][0], p[i][1]);
+			if (dist < best_dist || (dist == best_dist && i < best)) {
+				best_dist = dist;
+				best = i;
+			}
+		}
+	}
+	const fl_t dist0 = distance_to_point(p0, p[best][0]);
+	const fl_t dist1 = distance_to_point(p0, p[best][1]);
+	const bool flip = dist0 > dist1;
+	if (r_dist)
+		*r_dist = ((flip) ? dist1 : dist0) / config.scale_constant;
+	if (r_flip)
+		*r_flip = flip;
+	return best;
+}
+
+static void append_g_move(struct slice *slice, const struct g_move &move)
+{
+	/* Assumes the programmed feed rate for the whole move. export_layer() replaces this with a better estimate if
+	   'acceleration' is set. */
+	slice->layer_time += move.len / move.feed_rate;
+	slice->moves.push_back(move);
+}
+
+/* Test the segment from p0 to p1 against the given edges of path p (sorted ids, offset by p_start). The edge ending
+   at point k is visited k-th, with the closing edge first. */
+static bool crosses_boundary_2pt(const ClipperLib::Path &p, size_t p_start, std::vector<size_t>::const_iterator begin, std::vector<size_t>::const_iterator end, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, fl_t *r_dist)
+{
+	fl_t best_dist = FL_T_INF;
+	size_t intersections = 0;
+	ssize_t skip = -1;
+	const size_t n_edges = end - begin;
+	const bool closing_first = (n_edges > 0 && *(end - 1) - p_start == p.size() - 1);
+	for (size_t n = 0; n < n_edges; ++n) {
+		const size_t k2 = (closing_first) ? ((n == 0) ? p.size() - 1 : begin[n - 1] - p_start) : begin[n] - p_start;
+		const size_t k = (k2 + 1 < p.size()) ? k2 + 1 : 0;
+		if ((ssize_t) k2 != skip && intersects(p[k2], p[k], p0, p1)) {
+			const fl_t dist = distance_to_line(p0, p[k2], p[k]);
+			if (dist < best_dist)
+				best_dist = dist;
+			++intersections;
+			if (p[k] == p0 || p[k] == p1)
+				skip = k;  /* So the same point isn't registered as two intersections */
+		}
+	}
+	if (r_dist)
+		*r_dist = best_dist / config.scale_constant;
+	return (intersections > 1);
+}
+
+/* Returns the boundary with the nearest crossing, or the first boundary found to be crossed if 'nearest' is false.
+   Boundaries with fewer than two intersections are ignored. */
+static ssize_t boundary_crossing_2pt(const struct edge_grid *g, const ClipperLib::Paths &b, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, bool nearest)
+{
+	fl_t best_dist = FL_T_INF;
+	ssize_t b_idx = -1;
+	const std::vector<size_t> &edges = find_edge_grid_candidates(g, p0, p1);
+	for (auto begin = edges.begin(); begin != edges.end();) {
+		const size_t i = get_edge_grid_path(g, *begin);
+		auto end = std::lower_bound(begin, edges.end(), g->path_start[i + 1]);
+		fl_t tmp_dist = FL_T_INF;
+		if (crosses_boundary_2pt(b[i], g->path_start[i], begin, end, p0, p1, &tmp_dist) && tmp_dist < best_dist) {
+			if (!nearest)
+				return (ssize_t) i;
+			b_idx = (ssize_t) i;
+			best_dist = tmp_dist;
+		}
+		begin = end;
+	}
+	return b_idx;
+}
+
+static void append_linear_travel(struct slice *slice, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, ClipperLib::cInt z, fl_t feed_rate)
+{
+	if (x != m->x || y != m->y || z != m->z) {
+		const fl_t f_x = CINT_TO_FL_T(x), f_y = CINT_TO_FL_T(y), f_z = CINT_TO_FL_T(z);
+		const fl_t f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y), f_mz = CINT_TO_FL_T(m->z);
+		const fl_t len = sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z));
+		const struct g_move move = { x, y, z, 0.0, feed_rate, len, false, false, 0, 0, 0 };
+		append_g_move(slice, move);
+		m->x = x;
+		m->y = y;
+		m->z = z;
+	}
+}
+
+static void do_wipe(struct slice *slice, struct machine *m)
+{
+	if (config.wipe_len <= 0.0 || m->is_wiped || slice->moves.size() < 3)
+		return;
+	ClipperLib::Path wipe_moves;
+	fl_t wiped_len = 0.0, x0 = CINT_TO_FL_T(m->x), y0 = CINT_TO_FL_T(m->y);
+	bool forward = false;
+	/* moves.rbegin() is the retract move and moves.rbegin() + 1 is the last kinematic move,
+	   so we want to start at moves.rbegin() + 2 */
+	auto it_start = slice->moves.rbegin() + 2, it_end = slice->moves.rend();
+	if (it_start->is_closed_path) {
+		auto it = it_start;
+		while (it != it_end && it->is_closed_path)
+			++it;
+		it_start = it;
+		it_end = slice->moves.rbegin();  /* stop when we hit the retract move */
+		forward = true;
+	}
+	for (auto it = it_start; it != it_end; (forward) ? --it : ++it) {
+		const fl_t x1 = CINT_TO_FL_T(it->x), y1 = CINT_TO_FL_T(it->y);
+		if (x1 == x0 && y1 == y0)
+			break;  /* break at first non-kinematic move */
+		const fl_t xv = x1 - x0, yv = y1 - y0;
+		const fl_t norm = sqrt(xv * xv + yv * yv);
+		wiped_len += norm;
+		if (wiped_len >= config.wipe_len) {
+			const fl_t new_x = x1 - (wiped_len - config.wipe_len) * (xv / norm), new_y = y1 - (wiped_len - config.wipe_len) * (yv / norm);
+			wipe_moves.push_back(ClipperLib::IntPoint(FL_T_TO_CINT(new_x), FL_T_TO_CINT(new_y)));
+			break;
+		}
+		else {
+			wipe_moves.push_back(ClipperLib::IntPoint(it->x, it->y));
+		}
+		x0 = x1;
+		y0 = y1;
+	}
+	for (ClipperLib::IntPoint &pt : wipe_moves)
+		append_linear_travel(slice, m, pt.X, pt.Y, m->z, config.travel_feed_rate);
+	m->is_wiped = true;
+}
+
+static void do_retract(struct slice *slice, struct machine *m, bool should_wipe)
+{
+	if (!m->is_retracted) {
+		struct g_move retract_move = { m->x, m->y, m->z, -config.retract_len, config.retract_speed, config.retract_len, false, false, 0, 0, 0 };
+		append_g_move(slice, retract_move);
+		m->is_retracted = true;
+	}
+	m->force_retract = false;
+	if (should_wipe)
+		do_wipe(slice, m);
+}
+
+static fl_t append_comb_move(const struct machine *m, const struct island *island, ClipperLib::Path &comb_moves, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, bool *force_retract)
+{
+	if (!(*force_retract) && !m->is_retracted && island && crosses_exposed_surface(island, p0.X, p0.Y, p1.X, p1.Y))
+		*force_retract = true;
+	comb_moves.push_back(p1);
+	return distance_to_point(p0, p1) / config.scale_constant;
+}
+
+static void build_comb_graph(struct comb_graph *g, const ClipperLib::Paths &paths, bool outside)
+{
+	g->nodes.clear();
+	g->node_prev.clear();
+	g->node_next.clear();
+	for (const ClipperLib::Path &p : paths) {
+		for (size_t i = 0; i < p.size(); ++i) {
+			const ClipperLib::IntPoint &a = p[(i > 0) ? i - 1 : p.size() - 1], &b = p[i], &c = p[(i + 1 < p.size()) ? i + 1 : 0];
+			const fl_t cross = (fl_t) (b.X - a.X) * (fl_t) (c.Y - b.Y) - (fl_t) (b.Y - a.Y) * (fl_t) (c.X - b.X);
+			/* The free space is on the left of the comb paths when moving inside and on the right when moving outside */
+			if ((outside) ? cross > 0.0 : cross < 0.0) {
+				g->nodes.push_back(b);
+				g->node_prev.push_back(a);
+				g->node_next.push_back(c);
+			}
+		}
+	}
+	g->built = true;
+}
+
+static void clear_comb_graph(struct comb_graph *g)
+{
+	g->built = false;
+	clear_edge_grid(&g->bound_grid);
+	FREE_VECTOR(g->nodes);
+	FREE_VECTOR(g->node_prev);
+	FREE_VECTOR(g->node_next);
+}
+
+static bool comb_segment_is_clear(const struct comb_graph *g, const ClipperLib::Paths &bounds, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+{
+	return (boundary_crossing_2pt(&g->bound_grid, bounds, p0, p1, false) < 0);
+}
+
+/* A shortest path can only pass through a node along a line that is tangent to the comb path there (both
+   neighbors of the node are on the same side of the line) */
+static bool is_comb_graph_tangent(const struct comb_graph *g, size_t u, const ClipperLib::IntPoint &p)
+{
+	const ClipperLib::IntPoint &pu = g->nodes[u], &a = g->node_prev[u], &b = g->node_next[u];
+	const fl_t dx = (fl_t) (p.X - pu.X), dy = (fl_t) (p.Y - pu.Y);
+	const fl_t side_a = dx * (fl_t) (a.Y - pu.Y) - dy * (fl_t) (a.X - pu.X);
+	const fl_t side_b = dx * (fl_t) (b.Y - pu.Y) - dy * (fl_t) (b.X - pu.X);
+	return (side_a >= 0.0 && side_b >= 0.0) || (side_a <= 0.0 && side_b <= 0.0);
+}
+
+/* A* search through the comb graph from p0 to p1. The result is the list of nodes to travel through. Returns false
+   if there is no path. The search is lazy: each edge is queued with the distance it would give and its visibility is
+   only tested when it comes off the queue, so most edges are never tested. A shortest path between points in the
+   free space only leaves p0 and reaches p1 along tangents, so if 'tangent_ends' is set, only those edges are
+   queued. */
+static bool find_comb_path(const struct comb_graph *g, const ClipperLib::Paths &bounds, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1, bool tangent_ends, ClipperLib::Path &r_path)
+{
+	struct queue_entry {
+		fl_t f, d;  /* Estimated total distance and distance from p0 */
+		size_t u, prev;
+		bool operator>(const struct queue_entry &b) const { return f > b.f; }
+	};
+	const size_t n = g->nodes.size(), start = n, goal = n + 1;
+	std::vector<size_t> prev(n + 2, start);
+	std::vector<bool> done(n + 2, false);
+	std::priority_queue<struct queue_entry, std::vector<struct queue_entry>, std::greater<struct queue_entry>> open;
+	auto point = [&](size_t u) -> const ClipperLib::IntPoint & { return (u == start) ? p0 : (u == goal) ? p1 : g->nodes[u]; };
+	open.push({ distance_to_point(p0, p1), 0.0, start, start });
+	while (!open.empty()) {
+		const struct queue_entry e = open.top();
+		open.pop();
+		if (done[e.u])
+			continue;
+		const ClipperLib::IntPoint &pu = point(e.u);
+		if (e.u != start && !comb_segment_is_clear(g, bounds, point(e.prev), pu))
+			continue;
+		done[e.u] = true;
+		prev[e.u] = e.prev;
+		if (e.u == goal) {
+			/* Paths through collinear nodes tie with the direct edge, so drop nodes that do not bend the path */
+			r_path.clear();
+			for (size_t v = prev[goal], next = goal; v != start; next = v, v = prev[v]) {
+				const ClipperLib::IntPoint &a = point(prev[v]), &b = g->nodes[v], &c = point(next);
+				if ((fl_t) (b.X - a.X) * (fl_t) (c.Y - b.Y) != (fl_t) (b.Y - a.Y) * (fl_t) (c.X - b.X))
+					r_path.push_back(b);
+			}
+			std::reverse(r_path.begin(), r_path.end());
+			return true;
+		}
+		if (e.u != start && (!tangent_ends || is_comb_graph_tangent(g, e.u, p1))) {
+			const fl_t d = e.d + distance_to_point(pu, p1);
+			open.push({ d, d, goal, e.u });
+		}
+		for (size_t v = 0; v < n; ++v) {
+			if (done[v])
+				continue;
+			const ClipperLib::IntPoint &pv = g->nodes[v];
+			if ((e.u == start) ? (!tangent_ends || is_comb_graph_tangent(g, v, p0)) : (is_comb_graph_tangent(g, e.u, pv) && is_comb_graph_tangent(g, v, pu))) {
+				const fl_t d = e.d + distance_to_point(pu, pv);
+				open.push({ d + distance_to_point(pv, p1), d, v, e.u });
+			}
+		}
+	}
+	return false;
+}
+
+static void combed_travel(struct slice *slice, const struct island *island, struct machine *m, struct comb_graph *g, const ClipperLib::Paths &bounds, const ClipperLib::Paths &paths, bool outside, ClipperLib::cInt x, ClipperLib::cInt y, fl_t feed_rate, fl_t retract_threshold)
+{
+	if (x == m->x || y == m->y || paths.size() == 0)
+		return;
+	const ClipperLib::IntPoint p0(m->x, m->y), p1(x, y);
+	ClipperLib::Path comb_moves, nodes;
+	fl_t comb_dist = 0.0;
+	bool force_retract = false;
+
+	/* Most travels are direct, so the nodes are only found once a travel needs a search */
+	get_edge_grid(&g->bound_grid, bounds);
+	if (!comb_segment_is_clear(g, bounds, p0, p1)) {
+		if (!g->built)
+			build_comb_graph(g, paths, outside);
+		/* p0 is not in the free space if it is on the comb path of the island just printed and the printed outer
+		   boundaries overlap there. No tangent may then be visible from it, so try again without the restriction. */
+		if (find_comb_path(g, bounds, p0, p1, true, nodes) || find_comb_path(g, bounds, p0, p1, false, nodes)) {
+			ClipperLib::IntPoint last = p0;
+			for (const ClipperLib::IntPoint &pt : nodes) {
+				comb_dist += append_comb_move(m, island, comb_moves, last, pt, &force_retract);
+				last = pt;
+			}
+			comb_dist += distance_to_point(last, p1) / config.scale_constant;
+		}
+		else {
+			force_retract = true;
+			DEBUG("combed_travel(): warning: no path found at z = %f\n", CINT_TO_FL_T(m->z));
+		}
+	}
+	else
+		comb_dist = distance_to_point(p0, p1) / config.scale_constant;
+	if (force_retract || comb_dist >= retract_threshold)
+		do_retract(slice, m, false);  /* can't wipe or we may cross a boundary (wiping is not very useful with combing anyway) */
+	for (ClipperLib::IntPoint &pt : comb_moves)
+		append_linear_travel(slice, m, pt.X, pt.Y, m->z, feed_rate);
+}
+
+/* Move to the point nearest to the target location */
+static void move_to_island_exit(struct slice *slice, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, fl_t feed_rate)
+{
+	const struct edge_grid *g = get_edge_grid(&slice->last_comb_graph.bound_grid, slice->last_boundaries);
+	if (boundary_crossing_2pt(g, slice->last_boundaries, ClipperLib::IntPoint(m->x, m->y), ClipperLib::IntPoint(x, y), true) >= 0) {
+		size_t path_pt_idx, path_idx = find_nearest_path(slice->last_comb_paths, x, y, NULL, &path_pt_idx);
+		const ClipperLib::IntPoint &point = slice->last_comb_paths[path_idx][path_pt_idx];
+		combed_travel(slice, NULL, m, &slice->last_comb_graph, slice->last_boundaries, slice->last_comb_paths, false, point.X, point.Y, feed_rate, 0.0);
+		append_linear_travel(slice, m, point.X, point.Y, m->z, feed_rate);
+	}
+}
+
+static void linear_move(struct slice *slice, const struct island *island, struct machine *m, ClipperLib::cInt x, ClipperLib::cInt y, ClipperLib::cInt z, fl_t extra_e_len, fl_t feed_rate, fl_t flow_adjust, bool scalable, bool is_travel, bool is_closed_path, fl_t retract_threshold)
+{
+	const fl_t f_x = CINT_TO_FL_T(x), f_y = CINT_TO_FL_T(y), f_z = CINT_TO_FL_T(z);
+	fl_t f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y), f_mz = CINT_TO_FL_T(m->z);
+	struct g_move move = {
+		x, y, z, 0.0, feed_rate,
+		sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z)),
+		scalable, (is_travel) ? false : is_closed_path, 0, 0, 0
+	};
+	bool do_island_hop = (config.only_hop_between_islands && config.z_hop > 0.0 && (slice->last_boundaries.size() > 0 || !island));
+	if (is_travel) {
+		if (m->force_retract)
+			do_retract(slice, m, true);
+		if (!do_island_hop && z == m->z && config.comb) {  /* NOTE: config.comb is false if z-hop is enabled and config.only_hop_between_islands is false */
+			if (slice->last_boundaries.size() > 0) {
+				/* Inside an island and moving to a point outside of it */
+				do_retract(slice, m, true);
+				if (slice->last_comb_paths.size() > 0)
+					move_to_island_exit(slice, m, x, y, feed_rate);
+				combed_travel(slice, island, m, &slice->printed_outer_comb_graph, slice->printed_outer_boundaries, slice->printed_outer_comb_paths, true, x, y, feed_rate, retract_threshold);
+			}
+			else if (island) {
+				/* Moving within an island */
+				combed_travel(slice, island, m, &island->comb_graph, island->boundaries, island->comb_paths, false, x, y, feed_rate, retract_threshold);
+			}
+			else {
+				/* Moving between two points that are not in an island */
+				combed_travel(slice, island, m, &slice->printed_outer_comb_graph, slice->printed_outer_boundaries, slice->printed_outer_comb_paths, true, x, y, feed_rate, retract_threshold);
+			}
+		}
+		else if (!m->is_retracted
+			&& (slice->last_boundaries.size() > 0
+				|| move.len > retract_threshold
+				|| (island && crosses_boundary(get_edge_grid(&island->comb_graph.bound_grid, island->boundaries), island->boundaries, ClipperLib::IntPoint(m->x, m->y), ClipperLib::IntPoint(x, y)) >= 0)
+				|| (island && move.len > config.extrusion_width * 2.0 && crosses_exposed_surface(island, m->x, m->y, x, y)))) {
+			do_retract(slice, m, true);
+		}
+		if (config.comb) {
+			slice->last_boundaries.clear();
+			slice->last_comb_paths.clear();
+		}
+		f_mx = CINT_TO_FL_T(m->x), f_my = CINT_TO_FL_T(m->y);  /* m->{x,y} will change if a wipe happened. m->z will not change */
+		move.len = sqrt((f_mx - f_x) * (f_mx - f_x) + (f_my - f_y) * (f_my - f_y) + (f_mz - f_z) * (f_mz - f_z));
+		/* FIXME: hopping will only work correctly if there is only a single travel
+		   move between extrusion moves. This should always be the case currently. */
+		if (z == m->z && m->is_retracted && !m->is_hopped && ((config.only_hop_between_islands) ? do_island_hop : config.z_hop > 0.0)) {
+			if (config.z_hop_angle == 90.0) {
+				move.z += FL_T_TO_CINT(config.z_hop);
+				struct g_move hop_move = { m->x, m->y, move.z, 0.0, config.travel_feed_rate, config.z_hop, false, false, 0, 0, 0 };
+				append_g_move(slice, hop_move);
+			}
+			else {
+				const fl_t hop_angle_rad = config.z_hop_angle / 180.0 * M_PI;
+				const fl_t hop_min_travel = config.z_hop / tan(hop_angle_rad);
+				const fl_t xv = f_x - f_mx, yv = f_y - f_my;
+				const fl_t norm = sqrt(xv * xv + yv * yv);
+				if (norm <= hop_min_travel) {
+					move.z += FL_T_TO_CINT(tan(hop_angle_rad) * norm);
+				}
+				else {
+					const fl_t x1 = f_mx + hop_min_travel * (xv / norm), y1 = f_my + hop_min_travel * (yv / norm), z1 = f_mz + config.z_hop;
+					struct g_move hop_move = {
+						FL_T_TO_CINT(x1), FL_T_TO_CINT(y1), FL_T_TO_CINT(z1),
+						0.0, config.travel_feed_rate, 0.0, false, false, 0, 0, 0
+					};
+					hop_move.len = sqrt((x1 - f_mx) * (x1 - f_mx) + (y1 - f_my) * (y1 - f_my) + (z1 - f_mz) * (z1 - f_mz));
+					append_g_move(slice, hop_move);
+					move.len -= sqrt((x1 - f_mx) * (x1 - f_mx) + (y1 - f_my) * (y1 - f_my));
+					move.z += FL_T_TO_CINT(config.z_hop);
+				}
+			}
+			m->is_hopped = true;
+		}
+	}
+	else {
+		if (m->is_retracted) {
+			if (m->is_hopped) {
+				/* FIXME: len is technically not correct, but the error is very small in most cases */
+				struct g_move unhop_move = { m->x, m->y, m->z, 0.0, config.travel_feed_rate, config.z_hop, false, false, 0, 0, 0 };
+				append_g_move(slice, unhop_move);
+				m->is_hopped = false;
+			}
+			struct g_move restart_move = { m->x, m->y, m->z, config.retract_len, config.restart_speed, 0.0, false, false, 0, 0, 0 };
+			if (config.extra_restart_len < 0.0)
+				restart_move.e += config.extra_restart_len;
+			else
+				extra_e_len += config.extra_restart_len;
+			restart_move.len = restart_move.e;
+			append_g_move(slice, restart_move);
+			m->is_retracted = false;
+		}
+		move.e = move.len * config.extrusion_area * config.flow_multiplier * flow_adjust / config.material_area;
+		if (extra_e_len != 0.0) {
+			struct g_move extra_e_move = { m->x, m->y, m->z, extra_e_len, feed_rate * config.extrusion_area / config.material_area, fabs(extra_e_len), true, false, 0, 0, 0 };
+			append_g_move(slice, extra_e_move);
+		}
+	}
+	if (x != m->x || y != m->y || z != m->z || move.e != 0.0) {
+		append_g_move(slice, move);
+		m->x = x;
+		m->y = y;
+		m->z = z;
+	}
+	m->force_retract = false;
+	m->is_wiped = false;
+}
+
+static bool path_len_is_greater_than(const ClipperLib::Path &p, fl_t len)
+{
+	fl_t l = 0.0;
+	fl_t x0 = CINT_TO_FL_T(p[0].X), y0 = CINT_TO_FL_T(p[0].Y);
+	for (size_t i = 1; i < p.size(); ++i) {
+		const fl_t x1 = CINT_TO_FL_T(p[i].X), y1 = CINT_TO_FL_T(p[i].Y);
+		l += sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+		if (l > len)
+			return true;
+		x0 = x1;
+		y0 = y1;
+	}
+	const fl_t x1 = CINT_TO_FL_T(p[0].X), y1 = CINT_TO_FL_T(p[0].Y);
+	l += sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+	if (l > len)
+		return true;
+	return false;
+}
+
+/* Requires the last point to be the actual end point. For a closed
+   path, the last point should be the same as the first point. */
+static void clip_path_from_end(ClipperLib::Path &p, ClipperLib::Path *clipped_points, fl_t clip)
+{
+	fl_t x0 = CINT_TO_FL_T((p.end() - 1)->X), y0 = CINT_TO_FL_T((p.end() - 1)->Y), l = 0.0;
+	for (;;) {
+		if (clipped_points)
+			clipped_points->push_back(*(p.end() - 1));
+		p.erase(p.end() - 1);
+		const fl_t x1 = CINT_TO_FL_T((p.end() - 1)->X), y1 = CINT_TO_FL_T((p.end() - 1)->Y);
+		const fl_t xv = x1 - x0, yv = y1 - y0;
+		const fl_t norm = sqrt(xv * xv + yv * yv);
+		l += norm;
+		if (l == clip)
+			break;
+		else if (l > clip) {
+			const fl_t new_x = x1 - (l - clip) * (xv / norm), new_y = y1 - (l - clip) * (yv / norm);
+			p.push_back(FL_T_TO_INTPOINT(new_x, new_y));
+			break;
+		}
+		x0 = x1;
+		y0 = y1;
+	}
+	if (clipped_points)
+		std::reverse(clipped_points->begin(), clipped_points->end());
+}
+
+static void generate_closed_path_moves(const ClipperLib::Path &p, size_t start_idx, struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, fl_t feed_rate)
+{
+	if (p.size() < 3)
+		return;
+	fl_t total_clip = 0.0, anchor_e_len = 0.0;
+	ClipperLib::Path lp = p;
+	if (start_idx != 0)
+		std::rotate(lp.begin(), lp.begin() + start_idx, lp.end());
+	lp.push_back(lp[0]);
+	linear_move(slice, island, m, lp[0].X, lp[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.extrusion_width * 2.0);
+	if (config.shell_clip > 0.0 && path_len_is_greater_than(p, config.shell_clip * config.extrusion_width * 2.0))
+		total_clip += config.shell_clip * config.extrusion_width;
+	if (config.anchor && m->is_retracted && path_len_is_greater_than(p, total_clip + config.extrusion_width)) {
+		total_clip += config.extrusion_width / 2.0 * M_PI_4;
+		anchor_e_len = config.extrusion_width / 2.0 * M_PI_4 * config.extrusion_area * config.flow_multiplier / config.material_area;
+	}
+	if (total_clip > 0.0)
+		clip_path_from_end(lp, NULL, total_clip);
+	ClipperLib::Path coast_path;
+	if (config.coast_len > 0.0 && path_len_is_greater_than(p, total_clip + config.coast_len * 2.0))
+		clip_path_from_end(lp, &coast_path, config.coast_len);
+	linear_move(slice, island, m, lp[1].X, lp[1].Y, z, anchor_e_len, feed_rate, 1.0, true, false, false, 0.0);
+	for (auto it = lp.begin() + 2; it != lp.end(); ++it)
+		linear_move(slice, island, m, it->X, it->Y, z, 0.0, feed_rate, 1.0, true, false, true, 0.0);
+	m->is_retracted = true;  /* Make sure we don't retract */
+	m->is_hopped = true;     /* Make sure we don't hop */
+	for (const ClipperLib::IntPoint &point : coast_path)
+		linear_move(slice, island, m, point.X, point.Y, z, 0.0, feed_rate, 1.0, true, true, false, 0.0);
+	m->is_retracted = false;
+	m->is_hopped = false;
+}
+
+static void plan_brim(struct object *o, struct machine *m, ClipperLib::cInt z)
+{
+	for (ClipperLib::Paths &p : o->brim) {
+		while (!p.empty()) {
+			size_t best = 0, start = 0;
+			best = find_nearest_path(p, m->x, m->y, NULL, &start);
+			generate_closed_path_moves(p[best], start, &o->slices[0], NULL, m, z, config.perimeter_feed_rate);
+			p.erase(p.begin() + best);
+		}
+	}
+	m->force_retract = true;
+}
+
+static void plan_support(struct slice *slice, ClipperLib::Paths &lines, struct machine *m, ClipperLib::cInt z, fl_t min_len, fl_t connect_threshold, fl_t flow_adjust, fl_t feed_rate)
+{
+	bool first = true;
+	struct line_grid grid;
+	build_line_grid(&grid, lines);
+	for (size_t n = lines.size(); n > 0; --n) {
+		bool flip_points;
+		fl_t best_dist;
+		size_t best = find_nearest_segment(&grid, lines, m->x, m->y, &best_dist, &flip_points);
+		ClipperLib::Path &p = lines[best];
+		const fl_t len = distance_to_point(p[0], p[1]) / config.scale_constant;
+		if (len > min_len) {
+			bool cross_bound = false;
+			if (flip_points)
+				std::swap(p[0], p[1]);
+			if (!first) {
+				const ClipperLib::IntPoint p0(m->x, m->y);
+				for (const struct island &island : slice->islands) {
+					if (crosses_boundary(get_edge_grid(&island.outer_boundary_grid, island.outer_boundaries), island.outer_boundaries, p0, p[0]) >= 0) {
+						cross_bound = true;
+						m->force_retract = true;
+						break;
+					}
+				}
+			}
+			bool connect = (!first && !cross_bound && best_dist < connect_threshold);
+			if (connect)
+				linear_move(slice, NULL, m, p[0].X, p[0].Y, z, 0.0, feed_rate, flow_adjust, true, false, false, 0.0);
+			else
+				linear_move(slice, NULL, m, p[0].X, p[0].Y, z, 0.0, config.travel_feed_rate, flow_adjust, false, true, false, config.retract_threshold);
+			linear_move(slice, NULL, m, p[1].X, p[1].Y, z, 0.0, feed_rate, flow_adjust, true, false, false, 0.0);
+			first = false;
+		}
+		remove_from_line_grid(&grid, best);
+	}
+	lines.clear();
+}
+
+static void plan_insets_weighted(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+{
+	for (;;) {
+		bool done = true;
+		fl_t best_dist = FL_T_INF;
+		size_t best = 0, inset = 0, start = 0;
+		for (int i = 0; i < config.shells; ++i) {
+			if (!island->insets[i].empty()) {
+				fl_t dist;
+				size_t r, start_tmp = 0;
+				if (config.align_seams && (config.align_interior_seams || i == 0))
+					r = find_nearest_aligned_path(island->insets[i], m->x, m->y, &dist);
+				else
+					r = find_nearest_path(island->insets[i], m->x, m->y, &dist, &start_tmp);
+				if (outside_first) {
+					if (i != 0)
+						dist = dist * (i + 1) + config.extrusion_width * 10.0;  /* prefer exterior */
+				}
+				else {
+					if (i != config.shells - 1)
+						dist = dist * (config.shells - i) + config.extrusion_width * 10.0;  /* prefer interior */
+				}
+				if (dist < best_dist) {
+					best_dist = dist;
+					best = r;
+					inset = i;
+					start = start_tmp;
+					done = false;
+				}
+			}
+		}
+		if (done)
+			break;
+		generate_closed_path_moves(island->insets[inset][best], start, slice, island, m, z, (inset == 0) ? config.perimeter_feed_rate : config.loop_feed_rate);
+		island->insets[inset].erase(island->insets[inset].begin() + best);
+	}
+}
+
+static void plan_insets_strict_order(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+{
+	int i = (outside_first) ? 0 : config.shells - 1;
+	while (i >= 0 && i < config.shells) {
+		if (island->insets[i].empty()) {
+			i = (outside_first) ? i + 1 : i - 1;
+			continue;
+		}
+		size_t best, start = 0;
+		if (config.align_seams && (config.align_interior_seams || i == 0))
+			best = find_nearest_aligned_path(island->insets[i], m->x, m->y, NULL);
+		else
+			best = find_nearest_path(island->insets[i], m->x, m->y, NULL, &start);
+		generate_closed_path_moves(island->insets[i][best], start, slice, island, m, z, (i == 0) ? config.perimeter_feed_rate : config.loop_feed_rate);
+		island->insets[i].erase(island->insets[i].begin() + best);
+	}
+}
+
+static void plan_insets(struct slice *slice, struct island *island, struct machine *m, ClipperLib::cInt z, bool outside_first)
+{
+	if (config.shells > 0) {
+		if (config.strict_shell_order)
+			plan_insets_strict_order(slice, island, m, z, outside_first);
+		else
+			plan_insets_weighted(slice, island, m, z, outside_first);
+	}
+	if (config.retract_after_shells)
+		m->force_retract = true;
+}
+
+#define SPARSE_LINK_MAX_SPACINGS 2.0  /* Longest link between sparse infill lines, in units of the infill line spacing */
+
+/* Find an edge of 'paths' that 'pt' is within 'tol' of */
+static bool find_edge_at_point(const struct edge_grid *g, const ClipperLib::Paths &paths, const ClipperLib::IntPoint &pt, fl_t tol, size_t *r_path, size_t *r_edge)
+{
+	for (size_t e : find_edge_grid_candidates(g, pt, pt)) {
+		const size_t i = get_edge_grid_path(g, e), j = e - g->path_start[i];
+		const ClipperLib::Path &p = paths[i];
+		if (distance_to_line(pt, p[j], p[(j + 1 < p.size()) ? j + 1 : 0]) <= tol) {
+			*r_path = i;
+			*r_edge = j;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Extrude from the current position (the end of a sparse infill line) to p1 (the start of the next one) along the
+   infill boundary, going whichever way around is shorter. Only done if both points lie on the same boundary path,
+   the link is no longer than 'max_len' and it doesn't run along solid infill. Returns whether the link was made. */
+static bool link_along_boundary(struct slice *slice, struct island *island, struct machine *m, const struct edge_grid *bound_grid, const struct edge_grid *solid_grid, const ClipperLib::IntPoint &p1, fl_t max_len, fl_t feed_rate, fl_t flow_adjust, ClipperLib::cInt z)
+{
+	const ClipperLib::Paths &bounds = island->infill_insets;
+	const ClipperLib::IntPoint p0(m->x, m->y);
+	const fl_t tol = config.extrusion_width / 64.0 * config.scale_constant;
+	size_t i0, j0, i1, j1;
+	if (!find_edge_at_point(bound_grid, bounds, p0, tol, &i0, &j0) || !find_edge_at_point(bound_grid, bounds, p1, tol, &i1, &j1) || i0 != i1)
+		return false;
+	const ClipperLib::Path &p = bounds[i0];
+	const size_t n = p.size();
+	const ClipperLib::IntPoint &e0 = p[j0], &e1 = p[(j0 + 1) % n];
+	const fl_t ahead = (fl_t) (p1.X - p0.X) * (fl_t) (e1.X - e0.X) + (fl_t) (p1.Y - p0.Y) * (fl_t) (e1.Y - e0.Y);
+	std::vector<ClipperLib::IntPoint> walk[2];  /* Forward and backward along the path */
+	fl_t len[2];
+	for (int dir = 0; dir < 2; ++dir) {
+		ClipperLib::IntPoint prev = p0;
+		len[dir] = 0.0;
+		if (j0 != j1 || ((dir == 0) ? ahead < 0.0 : ahead > 0.0)) {
+			size_t k = (dir == 0) ? (j0 + 1) % n : j0;
+			const size_t last = (dir == 0) ? j1 : (j1 + 1) % n;
+			for (size_t steps = 0; len[dir] <= max_len && steps < n; ++steps) {
+				len[dir] += distance_to_point(prev, p[k]);
+				walk[dir].push_back(p[k]);
+				prev = p[k];
+				if (k == last)
+					break;
+				k = (dir == 0) ? (k + 1) % n : (k + n - 1) % n;
+			}
+		}
+		len[dir] += distance_to_point(prev, p1);
+		walk[dir].push_back(p1);
+	}
+	const int dir = (len[1] < len[0]) ? 1 : 0;
+	if (len[dir] > max_len)
+		return false;
+	if (!island->solid_infill_boundaries.empty()) {
+		ClipperLib::IntPoint prev = p0;
+		for (const ClipperLib::IntPoint &pt : walk[dir]) {
+			if (crosses_boundary(solid_grid, island->solid_infill_boundaries, prev, pt) >= 0)
+				return false;
+			prev = pt;
+		}
+	}
+	for (const ClipperLib::IntPoint &pt : walk[dir])
+		if (pt.X != m->x || pt.Y != m->y)
+			linear_move(slice, island, m, pt.X, pt.Y, z, 0.0, feed_rate, flow_adjust, true, false, false, 0.0);
+	return true;
+}
+
+/* If 'connect' is true, consecutive lines are linked along the infill boundary where possible (see
+   link_along_boundary()) */
+static void plan_infill_simple(ClipperLib::Paths &lines, struct slice *slice, struct island *island, struct machine *m, fl_t feed_rate, fl_t flow_adjust, ClipperLib::cInt z, bool connect)
+{
+	struct line_grid grid;
+	struct edge_grid bound_grid = {}, solid_grid = {};
+	const fl_t max_link_len = config.extrusion_width / config.infill_density * SPARSE_LINK_MAX_SPACINGS * config.scale_constant;
+	bool is_first = true;
+	build_line_grid(&grid, lines);
+	if (connect && !lines.empty()) {
+		build_edge_grid(&bound_grid, island->infill_insets);
+		build_edge_grid(&solid_grid, island->solid_infill_boundaries);
+	}
+	for (size_t n = lines.size(); n > 0; --n) {
+		bool flip_points;
+		fl_t extra_e_len = 0.0;
+		const ClipperLib::IntPoint p_start(m->x, m->y);
+		const size_t best = find_nearest_segment(&grid, lines, m->x, m->y, NULL, &flip_points);
+		ClipperLib::Path &p = lines[best];
+		if (flip_points)
+			std::swap(p[0], p[1]);
+		const bool linked = connect && !is_first && link_along_boundary(slice, island, m, &bound_grid, &solid_grid, p[0], max_link_len, feed_rate, flow_adjust, z);
+		is_first = false;
+		if (!linked)
+			linear_move(slice, island, m, p[0].X, p[0].Y, z, 0.0, config.travel_feed_rate, flow_adjust, false, true, false, config.retract_threshold);
+		if (!linked && !m->is_retracted) {
+			const fl_t travel_dist = distance_to_point(p_start, p[0]) / config.scale_constant;
+			/* Clipped lines can meet end to end, so the travel may have zero length */
+			if (travel_dist > 0.0) {
+				const fl_t extra_vol = (config.sparse_restart_max_dist > 0.0 && travel_dist <= config.sparse_restart_max_dist) ? travel_dist / config.sparse_restart_max_dist * config.sparse_restart_max_vol : config.sparse_restart_max_vol;
+				extra_e_len = extra_vol / config.material_area;
+			}
+		}
+		linear_move(slice, island, m, p[1].X, p[1].Y, z, extra_e_len, feed_rate, flow_adjust, true, false, false, 0.0);
+		remove_from_line_grid(&grid, best);
+	}
+	lines.clear();
+}
+
+/* Ties go to the lowest index. Every candidate's score is at least its distance from line0[1], so the search can
+   stop at the first ring that is farther away than the best score. */
+static size_t find_next_solid_infill_segment(struct line_grid *g, const ClipperLib::Paths &p, ClipperLib::Path &line0, fl_t *r_dist, bool *r_flip, bool *r_is_adjacent)
+{
+	const fl_t adjacent_dist_fudge = config.extrusion_width / 8.0;
+	bool best_flip = false, best_is_adjacent = false;
+	size_t best = 0;
+	fl_t best_dist = FL_T_INF, best_adj_dist = FL_T_INF;
+	std::vector<size_t> found;
+	ssize_t cx, cy, ring;
+
+	for (find_line_grid_start(g, line0[1].X, line0[1].Y, &cx, &cy, &ring); line_grid_ring_min_dist(g, ring) <= best_adj_dist && find_lines_in_ring(g, cx, cy, ring, found); ++ring) {
+		for (size_t i : found) {
+			const ClipperLib::Path &line1 = p[i];
+			const fl_t l_dist0 = distance_to_line(line0[0], line1[0], line1[1]);
+			const fl_t l_dist1 = distance_to_line(line0[1], line1[0], line1[1]);
+			const fl_t l_dist2 = distance_to_line(line1[0], line0[0], line0[1]);
+			const fl_t l_dist3 = distance_to_line(line1[1], line0[0], line0[1]);
+			const fl_t min_dist = MINIMUM_4(l_dist0, l_dist1, l_dist2, l_dist3);
+			const fl_t scaled_min_dist = min_dist / config.scale_constant;
+			const fl_t scaled_p_dist = perpendicular_distance_to_line(line0[1], line1[0], line1[1]) / config.scale_constant;
+			const fl_t pt_dist0 = distance_to_point(line0[1], line1[0]);
+			const fl_t pt_dist1 = distance_to_point(line0[1], line1[1]);
+			const bool is_adjacent = scaled_p_dist < config.extrusion_width + adjacent_dist_fudge && scaled_p_dist > config.extrusion_width - adjacent_dist_fudge && scaled_min_dist < config.extrusion_width * 2.0;
+			const bool is_opposite_dir = ((line0[0].X < line0[1].X) != (line1[0].X < line1[1].X)) || ((line0[0].Y < line0[1].Y) != (line1[0].Y < line1[1].Y));
+			fl_t adj_dist = l_dist1;
+			if (is_opposite_dir != (pt_dist1 > pt_dist0))
+				adj_dist *= 2.0;
+			if (!is_adjacent)
+				adj_dist *= 4.0;
+			if (adj_dist < best_adj_dist || (adj_dist == best_adj_dist && i < best)) {
+				best_adj_dist = adj_dist;
+				best_flip = (is_adjacent) ? (is_opposite_dir) ? pt_dist0 > pt_dist1 * 4.0 : !(pt_dist1 > pt_dist0 * 4.0) : pt_dist1 < pt_dist0;
+				best_dist = (best_flip) ? pt_dist1 : pt_dist0;
+				best_is_adjacent = is_adjacent;
+				best = i;
+			}
+		}
+	}
+	if (r_dist)
+		*r_dist = best_dist / config.scale_constant;
+	if (r_flip)
+		*r_flip = best_flip;
+	if (r_is_adjacent)
+		*r_is_adjacent = best_is_adjacent;
+	return best;
+}
+
+static void plan_smoothed_solid_infill(ClipperLib::Paths &lines, struct slice *slice, struct island *island, struct machine *m, fl_t feed_rate, ClipperLib::cInt z)
+{
+	if (lines.empty())
+		return;
+	bool flip_points, last_was_smoothed = false, needs_travel = true;
+	struct line_grid grid;
+	struct edge_grid bound_grid = {}, constraining_grid = {};
+	std::vector<size_t> containing;
+	size_t n_constraining_outer = 0;
+	build_line_grid(&grid, lines);
+	build_edge_grid(&bound_grid, island->solid_infill_boundaries);
+	build_edge_grid(&constraining_grid, island->constraining_edge);
+	for (size_t i = 0; i < island->constraining_edge.size(); ++i)
+		if (constraining_grid.orientation[i])
+			++n_constraining_outer;
+	size_t best = find_nearest_segment(&grid, lines, m->x, m->y, NULL, &flip_points);
+	ClipperLib::Path line0 = lines[best];
+	remove_from_line_grid(&grid, best);
+	if (flip_points)
+		std::swap(line0[0], line0[1]);
+	for (size_t n = lines.size() - 1; n > 0; --n) {
+		fl_t best_dist;
+		bool is_adjacent;
+		best = find_next_solid_infill_segment(&grid, lines, line0, &best_dist, &flip_points, &is_adjacent);
+		ClipperLib::Path line1 = lines[best];
+		remove_from_line_grid(&grid, best);
+		if (flip_points)
+			std::swap(line1[0], line1[1]);
+		const bool cross_bound = (crosses_boundary(&bound_grid, island->solid_infill_boundaries, line0[1], line1[0]) >= 0);
+		bool is_constrained = false, in_outer = false, in_hole = false;
+		if (island->constraining_edge.empty()) {
+			is_constrained = true;  /* All solid infill is inset gap fill if there's no constraining edge */
+		}
+		else {
+			/* Constrained if inside a hole or outside of any outer boundary.
+			   Note: is_constrained will always be true for inset gap fill. */
+			size_t n_in_outer = 0;
+			containing.clear();
+			find_containing_paths(&constraining_grid, island->constraining_edge, line0[1], containing);
+			find_containing_paths(&constraining_grid, island->constraining_edge, line1[0], containing);
+			std::sort(containing.begin(), containing.end());
+			containing.erase(std::unique(containing.begin(), containing.end()), containing.end());
+			for (size_t i : containing) {
+				if (constraining_grid.orientation[i]) {
+					in_outer = true;
+					++n_in_outer;
+				}
+				else {
+					in_hole = true;
+				}
+			}
+			is_constrained = (in_hole || n_in_outer < n_constraining_outer);
+			if (is_constrained && in_outer && !in_hole)
+				is_constrained = false;
+		}
+		const ClipperLib::IntPoint line0_midpoint((line0[0].X + line0[1].X) / 2, (line0[0].Y + line0[1].Y) / 2);
+		const ClipperLib::IntPoint line1_midpoint((line1[0].X + line1[1].X) / 2, (line1[0].Y + line1[1].Y) / 2);
+		const fl_t len_line0 = distance_to_point(line0[0], line0[1]);
+		const fl_t len_line1 = distance_to_point(line1[0], line1[1]);
+		const fl_t len_mid = distance_to_point(line0_midpoint, line1_midpoint);
+		const fl_t xv0 = line0[1].X - line0[0].X, yv0 = line0[1].Y - line0[0].Y;
+		const fl_t xv1 = line1[1].X - line1[0].X, yv1 = line1[1].Y - line1[0].Y;
+		const fl_t xv_mid = line1_midpoint.X - line0_midpoint.X, yv_mid = line1_midpoint.Y - line0_midpoint.Y;
+		/* det(a, b) / (||a|| * ||b||) * ||a|| gives the width of the region covered by a (measured perpendicular to b) */
+		const fl_t region_width0 = fabs((xv0 * yv_mid - yv0 * xv_mid) / len_mid);
+		const fl_t region_width1 = fabs((xv1 * yv_mid - yv1 * xv_mid) / len_mid);
+		const fl_t p_dist = perpendicular_distance_to_line(line0[1], line1[0], line1[1]) / config.scale_constant;
+		const fl_t shortening_dist = best_dist / p_dist * config.extrusion_width / 2.0;
+		const bool is_opposite_dir = ((line0[0].X < line0[1].X) != (line1[0].X < line1[1].X)) || ((line0[0].Y < line0[1].Y) != (line1[0].Y < line1[1].Y));
+		const fl_t connect_min_len = MAXIMUM(shortening_dist, config.extrusion_width / 2.0) * config.scale_constant;
+		if (config.infill_smooth_threshold > 0.0
+				&& !cross_bound
+				&& is_adjacent
+				&& len_line0 <= config.extrusion_width * config.infill_smooth_threshold * 2.0 * config.scale_constant
+				&& len_line1 <= config.extrusion_width * config.infill_smooth_threshold * 2.0 * config.scale_constant
+				&& region_width0 <= config.extrusion_width * config.infill_smooth_threshold * config.scale_constant
+				&& region_width1 <= config.extrusion_width * config.infill_smooth_threshold * config.scale_constant) {
+			if (!last_was_smoothed) {
+				/* move to line0 start */
+				if (needs_travel)
+					linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
+				/* extrude to line0_midpoint */
+				linear_move(slice, island, m, line0_midpoint.X, line0_midpoint.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+			}
+			/* extrude to line1_midpoint */
+			const fl_t extrude_ratio = (len_line0 + len_line1) / 2.0 / distance_to_point(line0_midpoint, line1_midpoint);
+			const fl_t scaled_feed_rate = (feed_rate / extrude_ratio < config.travel_feed_rate) ? feed_rate / extrude_ratio : config.travel_feed_rate;
+			linear_move(slice, island, m, line1_midpoint.X, line1_midpoint.Y, z, 0.0, scaled_feed_rate, extrude_ratio, true, false, false, 0.0);
+			last_was_smoothed = true;
+			needs_travel = false;
+		}
+		else if (!cross_bound
+				&& !is_constrained
+				&& is_adjacent
+				&& is_opposite_dir
+				&& best_dist < config.extrusion_width * 3.864
+				&& ((last_was_smoothed) ? len_line0 / 2.0 : len_line0) > connect_min_len
+				&& len_line1 / 2.0 > connect_min_len) {
+			ClipperLib::IntPoint pt0, pt1;
+			/* adjusted line0 end point */
+			pt0.X = line0[1].X - llround(shortening_dist * config.scale_constant * (xv0 / len_line0));
+			pt0.Y = line0[1].Y - llround(shortening_dist * config.scale_constant * (yv0 / len_line0));
+			/* adjusted line1 start point */
+			pt1.X = line1[0].X - llround(shortening_dist * config.scale_constant * (-xv1 / len_line1));
+			pt1.Y = line1[0].Y - llround(shortening_dist * config.scale_constant * (-yv1 / len_line1));
+			if (needs_travel)
+				linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
+			/* extrude line0 */
+			linear_move(slice, island, m, pt0.X, pt0.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+			/* extrude connection */
+			linear_move(slice, island, m, pt1.X, pt1.Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+			last_was_smoothed = false;
+			needs_travel = false;
+		}
+		else {
+			if (needs_travel)
+				linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
+			linear_move(slice, island, m, line0[1].X, line0[1].Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+			last_was_smoothed = false;
+			needs_travel = true;
+		}
+		line0 = line1;
+	}
+	if (needs_travel)
+		linear_move(slice, island, m, line0[0].X, line0[0].Y, z, 0.0, config.travel_feed_rate, 1.0, false, true, false, config.solid_infill_retract_threshold * config.extrusion_width);
+	linear_move(slice, island, m, line0[1].X, line0[1].Y, z, 0.0, feed_rate, 1.0, true, false, false, 0.0);
+	lines.clear();
+}
+
+/* Translate everything in the island that planning uses. The comb graph and edge grids are caches, so they are
+   cleared and rebuilt on first use. */
+static void translate_island(struct island *island, ClipperLib::cInt dx, ClipperLib::cInt dy)
+{
+	for (int i = 0; i < ((config.shells > 1) ? config.shells : 1); ++i)
+		translate_paths(island->insets[i], dx, dy);
+	if (island->inset_gaps)
+		for (int i = 0; i < config.shells - 1; ++i)
+			translate_paths(island->inset_gaps[i], dx, dy);
+	ClipperLib::Paths *paths[] = {
+		&island->infill_insets, &island->solid_infill, &island->sparse_infill, &island->boundaries, &island->comb_paths,
+		&island->outer_boundaries, &island->outer_comb_paths, &island->solid_infill_clip, &island->solid_infill_boundaries,
+		&island->exposed_surface, &island->constraining_edge, &island->iron_paths,
+	};
+	for (ClipperLib::Paths *p : paths)
+		translate_paths(*p, dx, dy);
+	island->box.x0 += dx;
+	island->box.y0 += dy;
+	island->box.x1 += dx;
+	island->box.y1 += dy;
+	clear_comb_graph(&island->comb_graph);
+	clear_edge_grid(&island->outer_boundary_grid);
+	clear_edge_grid(&island->exposed_surface_grid);
+}
+
+static void copy_island(struct island *island, const struct island *src)
+{
+	island->insets = new ClipperLib::Paths[(config.shells > 1) ? config.shells : 1]();
+	if (!island->insets)
+		die(e_nomem, 2);
+	island->inset_gaps = NULL;
+	copy_insets(island, src);
+	island->solid_infill = src->solid_infill;
+	island->sparse_infill = src->sparse_infill;
+	island->solid_infill_boundaries = src->solid_infill_boundaries;
+	island->exposed_surface = src->exposed_surface;
+	island->iron_paths = src->iron_paths;
+	island->box = src->box;
+	island->outline_hash = src->outline_hash;
+	island->inset_src_slice = src->inset_src_slice;
+	island->inset_src_island = src->inset_src_island;
+}
+
+/* Place the islands and support lines of the layer once for each copy of the object. Planning then orders all of
+   the islands together, so the copies are visited in whatever order keeps travel short. */
+static void place_layer_copies(const struct object *o, struct slice *slice)
+{
+	if (o->copies.empty())
+		return;
+	const size_t n_islands = slice->islands.size();
+	slice->islands.resize(n_islands * o->copies.size());
+	for (size_t c = 1; c < o->copies.size(); ++c) {
+		for (size_t k = 0; k < n_islands; ++k) {
+			struct island *island = &slice->islands[c * n_islands + k];
+			copy_island(island, &slice->islands[k]);
+			translate_island(island, o->copies[c].X, o->copies[c].Y);
+		}
+	}
+	for (size_t k = 0; k < n_islands; ++k)
+		translate_island(&slice->islands[k], o->copies[0].X, o->copies[0].Y);
+	ClipperLib::Paths *lines[] = { &slice->support_lines, &slice->support_interface_lines };
+	for (ClipperLib::Paths *p : lines) {
+		ClipperLib::Paths tmp;
+		append_copies(tmp, *p, o);
+		p->swap(tmp);
+	}
+}
+
+/* Island ordering: each island is reduced to the center of its bounding box (an island is entered at a seam and
+   left wherever its infill ends, so the center is the best single guess for both). A nearest neighbor tour over
+   these points is built from the current position, then improved with passes of 2-opt and Or-opt moves until a pass
+   finds nothing or ISLAND_ORDER_MAX_EVALS candidate moves have been tried. The budget is a move count rather than
+   a time limit so the output doesn't depend on machine load. The tour is open, so it may end anywhere. */
+#define ISLAND_ORDER_MAX_EVALS   250000
+#define ISLAND_ORDER_MAX_SEG_LEN 3  /* Longest run of islands an Or-opt move relocates */
+
+static ClipperLib::IntPoint island_order_point(const struct island *island)
+{
+	return ClipperLib::IntPoint((island->box.x0 + island->box.x1) / 2, (island->box.y0 + island->box.y1) / 2);
+}
+
+/* One pass of 2-opt moves (reversing tour[i..j]). tour[0] is the fixed start. Returns whether the tour got
+   shorter. */
+static bool improve_tour_2opt(std::vector<size_t> &tour, const std::vector<ClipperLib::IntPoint> &pt, fl_t min_gain, long *evals)
+{
+	const size_t n = tour.size();
+	bool improved = false;
+	for (size_t i = 1; i + 1 < n && *evals <= ISLAND_ORDER_MAX_EVALS; ++i) {
+		for (size_t j = i + 1; j < n; ++j) {
+			const ClipperLib::IntPoint &a = pt[tour[i - 1]], &b = pt[tour[i]], &c = pt[tour[j]];
+			fl_t delta = distance_to_point(a, c) - distance_to_point(a, b);
+			if (j + 1 < n)
+				delta += distance_to_point(b, pt[tour[j + 1]]) - distance_to_point(c, pt[tour[j + 1]]);
+			if (delta < -min_gain) {
+				std::reverse(tour.begin() + i, tour.begin() + j + 1);
+				improved = true;
+			}
+		}
+		*evals += n - i - 1;
+	}
+	return improved;
+}
+
+/* One pass of Or-opt moves (moving a run of up to ISLAND_ORDER_MAX_SEG_LEN islands elsewhere, either way around).
+   Returns whether the tour got shorter. */
+static bool improve_tour_or_opt(std::vector<size_t> &tour, const std::vector<ClipperLib::IntPoint> &pt, fl_t min_gain, long *evals)
+{
+	const size_t n = tour.size();
+	bool improved = false;
+	for (size_t len = 1; len <= ISLAND_ORDER_MAX_SEG_LEN; ++len) {
+		for (size_t i = 1; i + len <= n && *evals <= ISLAND_ORDER_MAX_EVALS; ++i) {
+			const size_t last = i + len - 1;
+			const ClipperLib::IntPoint &prev = pt[tour[i - 1]], &first_pt = pt[tour[i]], &last_pt = pt[tour[last]];
+			fl_t removed = distance_to_point(prev, first_pt);
+			if (last + 1 < n)
+				removed += distance_to_point(last_pt, pt[tour[last + 1]]) - distance_to_point(prev, pt[tour[last + 1]]);
+			for (size_t k = 0; k < n; ++k) {
+				if (k + 1 >= i && k <= last)
+					continue;  /* Insert between tour[k] and tour[k + 1], which must not touch the run */
+				const ClipperLib::IntPoint &p = pt[tour[k]];
+				const fl_t d_next = (k + 1 < n) ? distance_to_point(p, pt[tour[k + 1]]) : 0.0;
+				for (int rev = 0; rev < 2; ++rev) {
+					const ClipperLib::IntPoint &in = (rev) ? last_pt : first_pt, &out = (rev) ? first_pt : last_pt;
+					fl_t added = distance_to_point(p, in);
+					if (k + 1 < n)
+						added += distance_to_point(out, pt[tour[k + 1]]) - d_next;
+					if (added - removed < -min_gain) {
+						if (rev)
+							std::reverse(tour.begin() + i, tour.begin() + last + 1);
+						if (k < i)
+							std::rotate(tour.begin() + k + 1, tour.begin() + i, tour.begin() + last + 1);
+						else
+							std::rotate(tour.begin() + i, tour.begin() + last + 1, tour.begin() + k + 1);
+						improved = true;
+						goto next_run;
+					}
+				}
+			}
+			next_run:
+			*evals += n;
+		}
+	}
+	return improved;
+}
+
+/* Returns the order in which to plan 'islands', starting from (x, y) */
+static std::vector<size_t> order_islands(const std::vector<struct island> &islands, ClipperLib::cInt x, ClipperLib::cInt y)
+{
+	const size_t n = islands.size();
+	std::vector<ClipperLib::IntPoint> pt(n + 1);
+	for (size_t i = 0; i < n; ++i)
+		pt[i] = island_order_point(&islands[i]);
+	pt[n] = ClipperLib::IntPoint(x, y);
+	/* Nearest neighbor tour. tour[0] is the start position. */
+	std::vector<size_t> tour(1, n);
+	std::vector<char> used(n, false);
+	for (size_t k = 0; k < n; ++k) {
+		size_t best = 0;
+		fl_t best_dist = FL_T_INF;
+		for (size_t i = 0; i < n; ++i) {
+			if (!used[i]) {
+				const fl_t dist = distance_to_point(pt[tour.back()], pt[i]);
+				if (dist < best_dist) {
+					best_dist = dist;
+					best = i;
+				}
+			}
+		}
+		used[best] = true;
+		tour.push_back(best);
+	}
+	const fl_t min_gain = config.scale_constant * 1e-6;
+	long evals = 0;
+	for (bool improved = n > 2; improved && evals <= ISLAND_ORDER_MAX_EVALS;) {
+		improved = improve_tour_2opt(tour, pt, min_gain, &evals);
+		improved = improve_tour_or_opt(tour, pt, min_gain, &evals) || improved;
+	}
+	tour.erase(tour.begin());
+	return tour;
+}
+
+/* Lower bound on the distance from (x, y) to the island's outline (and so to its insets). The arithmetic matches
+   find_nearest_path() and find_nearest_aligned_path(), so the bound is never more than the distance they return. */
+static fl_t island_box_dist(const struct island *island, ClipperLib::cInt x, ClipperLib::cInt y)
+{
+	const ClipperLib::cInt bx = MAXIMUM(island->box.x0, MINIMUM(x, island->box.x1));
+	const ClipperLib::cInt by = MAXIMUM(island->box.y1, MINIMUM(y, island->box.y0));  /* y0 is the top of the box */
+	const fl_t x0 = CINT_TO_FL_T(x), y0 = CINT_TO_FL_T(y), x1 = CINT_TO_FL_T(bx), y1 = CINT_TO_FL_T(by);
+	return sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+}
+
+static void plan_island(struct slice *slice, struct island *island, ssize_t layer_num, struct machine *m, ClipperLib::cInt z)
+{
+	plan_insets(slice, island, m, z, config.outside_first || layer_num == 0);
+	plan_smoothed_solid_infill(island->solid_infill, slice, island, m, config.solid_infill_feed_rate, z);
+	plan_infill_simple(island->iron_paths, slice, island, m, config.iron_feed_rate, config.iron_flow_multiplier, z, false);
+	plan_infill_simple(island->sparse_infill, slice, island, m, config.sparse_infill_feed_rate, 1.0, z, config.connect_sparse_infill);
+	delete[] island->insets;
+	delete[] island->inset_gaps;
+	island->insets = island->inset_gaps = NULL;
+	if (config.comb) {
+		/* Insert outer boundaries and comb paths for the island we just printed */
+		slice->printed_outer_boundaries.insert(slice->printed_outer_boundaries.end(), island->outer_boundaries.begin(), island->outer_boundaries.end());
+		slice->printed_outer_comb_paths.insert(slice->printed_outer_comb_paths.end(), island->outer_comb_paths.begin(), island->outer_comb_paths.end());
+		clear_comb_graph(&slice->printed_outer_comb_graph);
+		/* Set last_boundaries and last_comb_paths */
+		slice->last_boundaries = island->boundaries;
+		slice->last_comb_paths = island->comb_paths;
+		std::swap(slice->last_comb_graph, island->comb_graph);
+	}
+}
+
+static void plan_moves(struct object *o, struct slice *slice, ssize_t layer_num, struct machine *m)
+{
+	const ClipperLib::cInt z = FL_T_TO_CINT(((fl_t) layer_num) * config.layer_height + config.layer_height + config.object_z_extra);
+	if (layer_num == 0 && config.brim_lines > 0)
+		plan_brim(o, m, z);
+	if (config.generate_support) {
+		const fl_t support_flow_adjust = (layer_num > 0) ? config.support_flow_mult : 1.0;
+		const fl_t support_feed_rate = (layer_num > 0) ? config.support_feed_rate : config.perimeter_feed_rate;
+		plan_support(slice, slice->support_interface_lines, m, z, config.extrusion_width, (layer_num == 0 || config.connect_support_lines) ? (layer_num == 0 && config.solid_support_base) ? config.extrusion_width * 1.9 : config.extrusion_width / config.interface_density * 1.9 : 0.0, support_flow_adjust, support_feed_rate);
+		plan_support(slice, slice->support_lines, m, z, config.extrusion_width * 2.0, (layer_num == 0 || config.connect_support_lines) ? config.extrusion_width / config.support_density * 10.0 : 0.0, support_flow_adjust, support_feed_rate);
+	}
+	if (config.optimize_island_order) {
+		for (size_t i : order_islands(slice->islands, m->x, m->y))
+			plan_island(slice, &slice->islands[i], layer_num, m, z);
+	}
+	else {
+		while (slice->islands.size() > 0) {
+			size_t best = 0;
+			fl_t best_dist = FL_T_INF;
+			for (size_t i = 0; i < slice->islands.size(); ++i) {
+				fl_t dist;
+				if (island_box_dist(&slice->islands[i], m->x, m->y) >= best_dist)
+					continue;  /* Can't be nearer than the best island so far */
+				if (config.align_seams)
+					find_nearest_aligned_path(slice->islands[i].insets[0], m->x, m->y, &dist);
+				else
+					find_nearest_path(slice->islands[i].insets[0], m->x, m->y, &dist, NULL);
+				if (dist < best_dist) {
+					best = i;
+					best_dist = dist;
+				}
+			}
+			plan_island(slice, &slice->islands[best], layer_num, m, z);
+			slice->islands.erase(slice->islands.begin() + best);
+		}
+	}
+	m->force_retract = true;  /* Force retract on layer change */
+	FREE_VECTOR(slice->islands);
+	if (config.comb) {
+		FREE_VECTOR(slice->last_boundaries);
+		FREE_VECTOR(slice->last_comb_paths);
+		FREE_VECTOR(slice->printed_outer_boundaries);
+		FREE_VECTOR(slice->printed_outer_comb_paths);
+		clear_comb_graph(&slice->last_comb_graph);
+		clear_comb_graph(&slice->printed_outer_comb_graph);
+	}
+}
+
+static void plan_raft(struct object *o, struct slice *slice, struct machine *m)
+{
+	ClipperLib::cInt z = FL_T_TO_CINT(config.raft_base_layer_height);
+
+	fl_t flow_adjust = (config.raft_base_layer_height * config.raft_base_layer_width) / (config.layer_height * config.extrusion_width);
+	fl_t feed_rate = config.solid_infill_feed_rate * config.first_layer_mult;
+	plan_support(slice, o->raft[0], m, z, config.extrusion_width * 2.0, config.raft_base_layer_width / config.raft_base_layer_density * 1.9, flow_adjust, feed_rate);
+
+	flow_adjust = config.raft_interface_flow_mult;
+	feed_rate = config.solid_infill_feed_rate;
+	for (int i = 1; i <= config.raft_interface_layers; ++i) {
+		ClipperLib::Paths lines = o->raft[1];
+		z = FL_T_TO_CINT(config.raft_base_layer_height + config.layer_height * i);
+		plan_support(slice, lines, m, z, config.extrusion_width * 2.0, config.extrusion_width * 1.9, flow_adjust, feed_rate);
+	}
+	m->force_retract = true;
+}
+
+static char * format_uint(char *p, unsigned long long v)
+{
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+/* Writes q / 10^prec with exactly prec decimal places */
+static char * format_fixed_point(char *p, unsigned long long q, int prec, unsigned long long scale)
+{
+	p = format_uint(p, q / scale);
+	*p++ = '.';
+	q %= scale;
+	for (int i = prec - 1; i >= 0; --i) {
+		p[i] = '0' + q % 10;
+		q /= 10;
+	}
+	return p + prec;
+}
+
+/* Writes v exactly as printf("%.*f", prec, v) would (the exact binary value rounded half to even). prec must be
+   between 1 and 9. Only values that are within rounding error of a tie need the exact fma() residual. */
+static char * format_fixed(char *p, double v, int prec)
+{
+	static const unsigned long long pow10[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL };
+	const double scale = (double) pow10[prec];
+	if (std::signbit(v)) {
+		*p++ = '-';
+		v = -v;
+	}
+	const double t = v * scale;
+	if (!(t < 4.0e15))  /* q + 0.5 must be exact */
+		return p + sprintf(p, "%.*f", prec, v);
+	unsigned long long q = (unsigned long long) t;
+	const double frac = t - (double) q, err = t * 8.8817841970012523233890533447265625e-16;  /* 2^-50 */
+	if (frac < err || frac > 1.0 - err || fabs(frac - 0.5) < err) {
+		/* Find q <= v * scale < q + 1 and compare the remainder to one half using the exact value of v * scale */
+		if (q > 0 && fma(v, scale, -(double) q) < 0.0)
+			--q;
+		else if (fma(v, scale, -(double) (q + 1)) >= 0.0)
+			++q;
+		const double r = fma(v, scale, -((double) q + 0.5));
+		if (r > 0.0 || (r == 0.0 && (q & 1)))
+			++q;
+	}
+	else if (frac > 0.5) {
+		++q;
+	}
+	return format_fixed_point(p, q, prec, pow10[prec]);
+}
+
+/* Writes CINT_TO_FL_T(x) with three decimal places. When the scale constant is a multiple of 1000, the digits come
+   from integer division. This matches printf() on the fl_t value except for exact ties, where the fl_t value decides. */
+static char * format_cint(char *p, ClipperLib::cInt x)
+{
+#ifndef SHIV_FL_T_IS_FLOAT
+	const fl_t div = config.scale_constant / 1000.0;
+	if (div >= 1.0 && div == (fl_t) (ClipperLib::cInt) div && x < (1LL << 50) && x > -(1LL << 50)) {
+		const ClipperLib::cInt d = (ClipperLib::cInt) div;
+		const unsigned long long ax = (x < 0) ? -x : x;
+		unsigned long long q = ax / d;
+		const unsigned long long rem = ax % d;
+		if (rem * 2 != (unsigned long long) d) {
+			if (rem * 2 > (unsigned long long) d)
+				++q;
+			if (x < 0)
+				*p++ = '-';
+			return format_fixed_point(p, q, 3, 1000);
+		}
+	}
+#endif
+	return format_fixed(p, CINT_TO_FL_T(x), 3);
+}
+
+static char * format_feed_rate(char *p, fl_t feed_rate)
+{
+	const long int f = (feed_rate * 60.0 <= 1.0) ? 1 : lround(feed_rate * 60.0);
+	if (f < 0) {
+		*p++ = '-';
+		return format_uint(p, -(unsigned long long) f);
+	}
+	return format_uint(p, f);
+}
+
+static void write_gcode_move(std::string &out, const struct g_move *move, struct machine *m, bool force_xyz)
+{
+	char buf[512], *p = buf;
+	if (move->e == 0.0 && move->z != m->z && config.separate_z_travel) {
+		memcpy(p, "G1 Z", 4);
+		p = format_cint(p + 4, move->z);
+		if (move->feed_rate != m->feed_rate) {
+			memcpy(p, " F", 2);
+			p = format_feed_rate(p + 2, move->feed_rate);
+		}
+		*p++ = '\n';
+		m->z = move->z;
+	}
+	const bool x_changed = move->x != m->x;
+	const bool y_changed = move->y != m->y;
+	const bool z_changed = move->z != m->z;
+	const bool e_changed = move->e != 0.0;
+	if (force_xyz || x_changed || y_changed || z_changed || e_changed) {
+		memcpy(p, (move->arc == 2) ? "G2" : (move->arc == 3) ? "G3" : "G1", 2);
+		p += 2;
+		if (force_xyz || x_changed || move->arc) {
+			memcpy(p, " X", 2);
+			p = format_cint(p + 2, move->x);
+		}
+		if (force_xyz || y_changed || move->arc) {
+			memcpy(p, " Y", 2);
+			p = format_cint(p + 2, move->y);
+		}
+		if (force_xyz || z_changed) {
+			memcpy(p, " Z", 2);
+			p = format_cint(p + 2, move->z);
+		}
+		if (move->arc) {
+			memcpy(p, " I", 2);
+			p = format_cint(p + 2, move->cx - m->x);
+			memcpy(p, " J", 2);
+			p = format_cint(p + 2, move->cy - m->y);
+		}
+		if (e_changed) {
+			memcpy(p, " E", 2);
+			p = format_fixed(p + 2, m->e + move->e, 5);
+		}
+		if (move->feed_rate != m->feed_rate) {
+			memcpy(p, " F", 2);
+			p = format_feed_rate(p + 2, move->feed_rate);
+		}
+		*p++ = '\n';
+		m->x = move->x;
+		m->y = move->y;
+		m->z = move->z;
+		m->e += move->e;
+		m->feed_rate = move->feed_rate;
+	}
+	out.append(buf, p - buf);
+}
+
+#define ARC_MIN_MOVES  3
+#define ARC_MAX_SWEEP  M_PI
+#define ARC_MAX_RADIUS 1000.0  /* In input/output units. Larger arcs are left as lines. */
+
+/* Whether 'b' can be part of the same arc as 'a': an extrusion move at the same height, feed rate and flow */
+static bool arc_moves_match(const struct g_move &a, const struct g_move &b)
+{
+	return b.arc == 0 && b.e > 0.0 && b.len > 0.0 && b.z == a.z && b.feed_rate == a.feed_rate && b.scalable == a.scalable
+		&& b.is_closed_path == a.is_closed_path && fabs(b.e * a.len - a.e * b.len) <= 1e-9 * a.e * b.len;
+}
+
+/* Fit a circle through the start point (x0, y0), the middle end point and the last end point of moves[0..n). The
+   moves fit if every end point is within 'tol' (in scaled units) of the circle, no move strays more than 'tol' from
+   the arc between its ends, and the moves all turn the same way through at most ARC_MAX_SWEEP in total. Sets the
+   center and the swept angle (positive is counter-clockwise). */
+static bool fit_arc(ClipperLib::cInt x0, ClipperLib::cInt y0, const struct g_move *moves, size_t n, fl_t tol, fl_t *cx, fl_t *cy, fl_t *sweep)
+{
+	const struct g_move &mid = moves[(n + 1) / 2 - 1], &last = moves[n - 1];
+	const fl_t bx = (fl_t) (mid.x - x0), by = (fl_t) (mid.y - y0), ex = (fl_t) (last.x - x0), ey = (fl_t) (last.y - y0);
+	const fl_t d = 2.0 * (bx * ey - by * ex);
+	if (d == 0.0)
+		return false;
+	const fl_t b2 = bx * bx + by * by, e2 = ex * ex + ey * ey;
+	const fl_t ux = (ey * b2 - by * e2) / d, uy = (bx * e2 - ex * b2) / d;  /* Center relative to (x0, y0) */
+	const fl_t r = sqrt(ux * ux + uy * uy);
+	if (r > ARC_MAX_RADIUS * config.scale_constant)
+		return false;
+	fl_t px = -ux, py = -uy, total = 0.0;
+	for (size_t i = 0; i < n; ++i) {
+		const fl_t qx = (fl_t) (moves[i].x - x0) - ux, qy = (fl_t) (moves[i].y - y0) - uy;
+		if (fabs(sqrt(qx * qx + qy * qy) - r) > tol)
+			return false;
+		const fl_t a = atan2(px * qy - py * qx, px * qx + py * qy);
+		if (a == 0.0 || (i > 0 && (a > 0.0) != (total > 0.0)))
+			return false;
+		const fl_t half_chord_sq = ((qx - px) * (qx - px) + (qy - py) * (qy - py)) / 4.0;
+		if (r - sqrt(MAXIMUM(r * r - half_chord_sq, 0.0)) > tol)  /* Sagitta */
+			return false;
+		total += a;
+		px = qx;
+		py = qy;
+	}
+	if (fabs(total) > ARC_MAX_SWEEP)
+		return false;
+	*cx = (fl_t) x0 + ux;
+	*cy = (fl_t) y0 + uy;
+	*sweep = total;
+	return true;
+}
+
+/* Replace runs of at least ARC_MIN_MOVES matching extrusion moves that fit an arc within arc_fit_tolerance with a
+   single G2/G3 move. The arc extrudes the sum of the moves' extrusion lengths. Travel and retraction moves, and
+   moves of other paths (which differ in is_closed_path, flow or feed rate), end a run. */
+static void fit_arcs(struct slice *slice)
+{
+	const fl_t tol = config.arc_fit_tolerance * config.scale_constant;
+	std::vector<struct g_move> &moves = slice->moves;
+	size_t w = 1;
+	if (moves.size() < ARC_MIN_MOVES + 1)
+		return;
+	for (size_t i = 1; i < moves.size();) {
+		const struct g_move &start = moves[w - 1];  /* The runs before i have been replaced, but they end at the same point */
+		size_t run = 0, n = 0;
+		if (arc_moves_match(moves[i], moves[i]) && moves[i].z == start.z)
+			for (run = 1; i + run < moves.size() && arc_moves_match(moves[i], moves[i + run]); ++run);
+		fl_t cx, cy, sweep;
+		if (run >= ARC_MIN_MOVES && fit_arc(start.x, start.y, &moves[i], ARC_MIN_MOVES, tol, &cx, &cy, &sweep)) {
+			/* Double the length of the arc until it no longer fits, then bisect */
+			size_t lo = ARC_MIN_MOVES, hi = run + 1;
+			for (n = lo * 2; n <= run; n *= 2) {
+				if (!fit_arc(start.x, start.y, &moves[i], n, tol, &cx, &cy, &sweep)) {
+					hi = n;
+					break;
+				}
+				lo = n;
+			}
+			while (hi - lo > 1) {
+				const size_t mid = (lo + hi) / 2;
+				if (fit_arc(start.x, start.y, &moves[i], mid, tol, &cx, &cy, &sweep))
+					lo = mid;
+				else
+					hi = mid;
+			}
+			n = lo;
+			fit_arc(start.x, start.y, &moves[i], n, tol, &cx, &cy, &sweep);
+		}
+		if (n > 0) {
+			struct g_move arc = moves[i + n - 1];
+			const fl_t r = sqrt(((fl_t) start.x - cx) * ((fl_t) start.x - cx) + ((fl_t) start.y - cy) * ((fl_t) start.y - cy));
+			fl_t lines_len = 0.0;
+			arc.e = 0.0;
+			for (size_t k = i; k < i + n; ++k) {
+				arc.e += moves[k].e;
+				lines_len += moves[k].len;
+			}
+			arc.len = r * fabs(sweep) / config.scale_constant;
+			arc.arc = (sweep < 0.0) ? 2 : 3;
+			arc.cx = (ClipperLib::cInt) llround(cx);
+			arc.cy = (ClipperLib::cInt) llround(cy);
+			slice->layer_time += (arc.len - lines_len) / arc.feed_rate;
+			moves[w++] = arc;
+			i += n;
+		}
+		else
+			moves[w++] = moves[i++];
+	}
+	moves.resize(w);
+}
+
+struct motion_block {
+	fl_t len, v, entry;  /* Length, cruise speed and entry speed */
+};
+
+/* Time to move 'len' entering at v0 and leaving at v1, accelerating at 'a' up to a cruise speed of at most 'v' */
+static fl_t trapezoid_time(fl_t len, fl_t v, fl_t v0, fl_t v1, fl_t a)
+{
+	const fl_t d_acc = (v * v - v0 * v0) / (2.0 * a), d_dec = (v * v - v1 * v1) / (2.0 * a);
+	if (d_acc + d_dec <= len)
+		return (v - v0) / a + (v - v1) / a + (len - d_acc - d_dec) / v;
+	/* Never reaches cruise speed */
+	const fl_t vp = MAXIMUM(sqrt((2.0 * a * len + v0 * v0 + v1 * v1) / 2.0), MAXIMUM(v0, v1));
+	return (vp - v0) / a + (vp - v1) / a;
+}
+
+/* Estimate how long the moves take. If 'acceleration' is zero, each move runs at its feed rate. Otherwise, each
+   move has a trapezoidal speed profile: it accelerates from its entry speed towards its feed rate (capped by the
+   z and e speed limits) and decelerates to the next move's entry speed. Corner speeds are limited so the velocity
+   changes by at most 'jerk', and a forward and a backward pass over the layer make sure every move can reach its
+   exit speed. E-only moves (retract and restart) move along a fourth axis at a right angle to x, y and z. The
+   layer starts and ends at rest. */
+static fl_t estimate_layer_time(const std::vector<struct g_move> &moves)
+{
+	fl_t t = 0.0;
+	if (config.acceleration <= 0.0) {
+		for (const struct g_move &move : moves)
+			t += move.len / move.feed_rate;
+		return t;
+	}
+	const fl_t a = config.acceleration, jerk = config.jerk;
+	std::vector<struct motion_block> b(moves.size());
+	fl_t u_prev[4] = { 0.0, 0.0, 0.0, 0.0 }, v_prev = jerk;
+	for (size_t i = 0; i < moves.size(); ++i) {
+		const struct g_move &m = moves[i];
+		fl_t u0[4] = { 0.0, 0.0, 0.0, 0.0 }, u1[4] = { 0.0, 0.0, 0.0, 0.0 };  /* Directions at the start and end */
+		fl_t len = m.len, dz = 0.0;
+		if (i > 0) {  /* Direction of the first move is unknown because the layer below isn't available */
+			const struct g_move &p = moves[i - 1];
+			const fl_t dx = CINT_TO_FL_T(m.x - p.x), dy = CINT_TO_FL_T(m.y - p.y);
+			dz = CINT_TO_FL_T(m.z - p.z);
+			if (m.arc) {
+				const fl_t r0x = CINT_TO_FL_T(p.x - m.cx), r0y = CINT_TO_FL_T(p.y - m.cy);
+				const fl_t r1x = CINT_TO_FL_T(m.x - m.cx), r1y = CINT_TO_FL_T(m.y - m.cy);
+				const fl_t dir = (m.arc == 3) ? 1.0 : -1.0, r0 = sqrt(r0x * r0x + r0y * r0y), r1 = sqrt(r1x * r1x + r1y * r1y);
+				u0[0] = -dir * r0y / r0;
+				u0[1] = dir * r0x / r0;
+				u1[0] = -dir * r1y / r1;
+				u1[1] = dir * r1x / r1;
+			}
+			else if (dx == 0.0 && dy == 0.0 && dz == 0.0) {
+				len = fabs(m.e);
+				u0[3] = u1[3] = (m.e < 0.0) ? -1.0 : 1.0;
+			}
+			else {
+				len = sqrt(dx * dx + dy * dy + dz * dz);
+				u0[0] = u1[0] = dx / len;
+				u0[1] = u1[1] = dy / len;
+				u0[2] = u1[2] = dz / len;
+			}
+		}
+		fl_t v = m.feed_rate;
+		if (config.max_z_feed_rate > 0.0 && dz != 0.0)
+			v = MINIMUM(v, config.max_z_feed_rate * len / fabs(dz));
+		if (config.max_e_feed_rate > 0.0 && m.e != 0.0 && len > 0.0)
+			v = MINIMUM(v, config.max_e_feed_rate * len / fabs(m.e));
+		fl_t du = 0.0;
+		for (int k = 0; k < 4; ++k)
+			du += (u0[k] - u_prev[k]) * (u0[k] - u_prev[k]);
+		du = sqrt(du);
+		b[i].len = len;
+		b[i].v = v;
+		b[i].entry = (du > 0.0) ? MINIMUM(jerk / du, MINIMUM(v, v_prev)) : MINIMUM(v, v_prev);
+		memcpy(u_prev, u1, sizeof(u_prev));
+		v_prev = v;
+	}
+	fl_t exit = MINIMUM(jerk, v_prev);
+	for (size_t i = b.size(); i-- > 0;) {
+		b[i].entry = MINIMUM(b[i].entry, sqrt(exit * exit + 2.0 * a * b[i].len));
+		exit = b[i].entry;
+	}
+	for (size_t i = 0; i < b.size(); ++i) {
+		const fl_t max_exit = sqrt(b[i].entry * b[i].entry + 2.0 * a * b[i].len);
+		exit = (i + 1 < b.size()) ? b[i + 1].entry : MINIMUM(jerk, b[i].v);
+		if (exit > max_exit) {
+			exit = max_exit;
+			if (i + 1 < b.size())
+				b[i + 1].entry = exit;
+		}
+		if (b[i].len > 0.0)
+			t += trapezoid_time(b[i].len, b[i].v, b[i].entry, exit, a);
+	}
+	return t;
+}
+
+static void apply_feed_rate_mult(struct slice *slice, fl_t feed_rate_mult)
+{
+	if (feed_rate_mult == 1.0)
+		return;
+	ClipperLib::cInt prev_x = 0, prev_y = 0, prev_z = 0;
+	for (struct g_move &move : slice->moves) {
+		if (move.scalable) {
+			/* Note: first move will *always* be a travel move */
+			const fl_t min_feed_rate = (move.e > 0.0 && move.x == prev_x && move.y == prev_y && move.z == prev_z)  /* is a scalable e-only move */
+				? config.min_feed_rate * config.extrusion_area / config.material_area : config.min_feed_rate;
+			move.feed_rate = MAXIMUM(move.feed_rate * feed_rate_mult, min_feed_rate);
+		}
+		prev_x = move.x;
+		prev_y = move.y;
+		prev_z = move.z;
+	}
+	slice->layer_time = estimate_layer_time(slice->moves);
+}
+
+#define MIN_LAYER_TIME_TRIES 4
+#define GCODE_BYTES_PER_MOVE 32  /* Typical length of a line written by write_gcode_move() */
+#define NEW_PLAN_MACHINE(name, obj) struct machine name = { FL_T_TO_CINT(obj->c.x - (obj->w + config.xy_extra) / 2.0), FL_T_TO_CINT(obj->c.y - (obj->d + config.xy_extra) / 2.0), 0, 0.0, 0.0, true, false, true, false }
+
+static struct slice * plan_raft_gcode(struct object *o, fl_t *total_e, fl_t *total_time)
+{
+	NEW_PLAN_MACHINE(plan_m, o);
+	struct slice *raft_dummy_slice = new struct slice();
+	plan_raft(o, raft_dummy_slice, &plan_m);
+	do_retract(raft_dummy_slice, &plan_m, true);
+	if (config.acceleration > 0.0)
+		raft_dummy_slice->layer_time = estimate_layer_time(raft_dummy_slice->moves);
+	bool is_first_move = true;
+	struct machine export_m = {};
+	/* Convert g_moves to gcode */
+	raft_dummy_slice->gcode.reserve(raft_dummy_slice->moves.size() * GCODE_BYTES_PER_MOVE);
+	for (const struct g_move &move : raft_dummy_slice->moves) {
+		write_gcode_move(raft_dummy_slice->gcode, &move, &export_m, is_first_move);
+		is_first_move = false;
+	}
+	*total_e += export_m.e;
+	*total_time += raft_dummy_slice->layer_time;
+	FREE_VECTOR(raft_dummy_slice->moves);
+	return raft_dummy_slice;
+}
+
+/* We now know where the previous layer ends (at m0), so recalculate the move length and layer time */
+static void update_first_move(struct slice *slice, const struct g_move &m0)
+{
+	struct g_move &m1 = slice->moves[0];
+	slice->layer_time -= m1.len / m1.feed_rate;
+	const fl_t xv = CINT_TO_FL_T(m1.x - m0.x), yv = CINT_TO_FL_T(m1.y - m0.y), zv = CINT_TO_FL_T(m1.z - m0.z);
+	m1.len = sqrt(xv * xv + yv * yv + zv * zv);
+	slice->layer_time += m1.len / m1.feed_rate;
+}
+
+/* Returns the total extrusion length of the layer */
+static fl_t export_layer(struct slice *slice, ssize_t layer_num)
+{
+	if (config.arc_fit_tolerance > 0.0)
+		fit_arcs(slice);
+	if (config.acceleration > 0.0)
+		slice->layer_time = estimate_layer_time(slice->moves);
+	if (layer_num == 0)
+		apply_feed_rate_mult(slice, config.first_layer_mult);
+	if (slice->layer_time > 0.0 && slice->layer_time < config.min_layer_time) {
+		apply_feed_rate_mult(slice, slice->layer_time / config.min_layer_time);
+		/* Slowing down doesn't lengthen moves that never reach their feed rate by as much, so try again if needed */
+		for (int k = 0; k < MIN_LAYER_TIME_TRIES && config.acceleration > 0.0 && slice->layer_time > 0.0 && slice->layer_time < config.min_layer_time * 0.99; ++k)
+			apply_feed_rate_mult(slice, slice->layer_time / config.min_layer_time);
+	}
+	bool is_first_move = true;
+	struct machine export_m = {};
+	/* Convert g_moves to gcode */
+	slice->gcode.reserve(slice->moves.size() * GCODE_BYTES_PER_MOVE);
+	for (const struct g_move &move : slice->moves) {
+		write_gcode_move(slice->gcode, &move, &export_m, is_first_move);
+		is_first_move = false;
+	}
+	if (perf.enabled) {
+		struct layer_stats *ls = &perf.layers[layer_num];
+		ls->moves = slice->moves.size();
+		ls->retracts = std::count_if(slice->moves.begin(), slice->moves.end(), [](const struct g_move &m) { return m.e < 0.0; });
+		ls->bytes = slice->gcode.size();
+	}
+	FREE_VECTOR(slice->moves);
+	return export_m.e;
+}
+
+static void write_gcode_header(FILE *f, struct slice *raft_dummy_slice)
+{
+	write_gcode_string(config.start_gcode, f, false);
+	if (raft_dummy_slice) {
+		fputs("; raft\n", f);
+		fwrite(raft_dummy_slice->gcode.data(), 1, raft_dummy_slice->gcode.size(), f);
+		fputs("G92 E0\n", f);
+	}
+}
+
+static void write_layer(FILE *f, struct slice *slice, ssize_t i)
+{
+	fprintf(f, "; layer %zd (z = %f; t = %f)\n", i, ((fl_t) i) * config.layer_height + config.layer_height + config.object_z_extra, slice->layer_time);
+	for (struct at_layer_gcode &g : config.at_layer)
+		if (g.layer == i)
+			write_gcode_string(g.value, f, false);
+	if (config.cool_layer >= 0 && i >= config.cool_layer) {
+		if (config.cool_off_time > 0.0 && slice->layer_time >= config.cool_off_time) {
+			write_gcode_string(config.cool_off_gcode, f, false);
+		}
+		else {
+			fl_t cool_value = 0.0;
+			if (config.cool_min_time - config.cool_max_time == 0.0)
+				cool_value = config.cool_max;
+			else if (slice->layer_time >= config.cool_min_time)
+				cool_value = config.cool_min;
+			else if (slice->layer_time <= config.cool_max_time)
+				cool_value = config.cool_max;
+			else  /* use linear interpolation */
+				cool_value = config.cool_max + (slice->layer_time - config.cool_max_time) * (config.cool_min - config.cool_max) / (config.cool_min_time - config.cool_max_time);
+			config.cool_value = lround(cool_value);
+			config.cool_value_float = cool_value;
+			write_gcode_string(config.cool_on_gcode, f, false);
+		}
+	}
+	fwrite(slice->gcode.data(), 1, slice->gcode.size(), f);
+	FREE_VECTOR(slice->gcode);
+	fputs("G92 E0\n", f);
+}
+
+/* Plans, exports and writes layers [start, end), one layer at a time as each one becomes ready to plan. Layers may
+   be planned in any order and on any thread. The length of a layer's first move depends on where the layer below
+   ends, so a layer is exported once it and the layer below are planned. Layers are written (if f is not NULL) in
+   order as soon as they and all earlier layers are exported. */
+struct layer_writer {
+	FILE *f;
+	ssize_t start, end, next_write;
+	struct g_move start_last_move;  /* End of the layer below 'start' */
+	bool start_has_last_move;
+	std::vector<struct g_move> last_moves;
+	std::vector<fl_t> layer_e;
+	std::vector<char> is_planned, has_moves, is_claimed, is_exported;
+	fl_t total_e, total_time;
+};
+
+static void init_layer_writer(struct layer_writer *w, FILE *f, ssize_t start, ssize_t end, const struct g_move *last_move, bool has_last_move)
+{
+	const ssize_t n = end - start;
+	w->f = f;
+	w->start = start;
+	w->end = end;
+	w->next_write = start;
+	w->start_last_move = *last_move;
+	w->start_has_last_move = has_last_move;
+	w->last_moves.assign(n, {});
+	w->layer_e.assign(n, 0.0);
+	w->is_planned.assign(n, false);
+	w->has_moves.assign(n, false);
+	w->is_claimed.assign(n, false);
+	w->is_exported.assign(n, false);
+	w->total_e = 0.0;
+	w->total_time = 0.0;
+}
+
+static void plan_and_write_layer(struct layer_writer *w, struct object *o, ssize_t i)
+{
+	const ssize_t start = w->start, end = w->end;
+	struct slice *slice = &o->slices[i];
+	const struct layer_timer plan_lt = start_layer_timer();
+	place_layer_copies(o, slice);
+	NEW_PLAN_MACHINE(plan_m, o);  /* Note: first move len on each layer will be wrong because starting position is unknown at this time */
+	plan_moves(o, slice, i, &plan_m);
+	do_retract(slice, &plan_m, true);
+	end_layer_timer(&plan_lt, i, LAYER_STAGE_PLAN);
+	ssize_t ready[2], n_ready = 0;
+#ifdef _OPENMP
+	#pragma omp critical(layer_ready)
+#endif
+	{
+		w->has_moves[i - start] = slice->moves.size() > 0;
+		if (w->has_moves[i - start])
+			w->last_moves[i - start] = slice->moves.back();
+		w->is_planned[i - start] = true;
+		for (ssize_t k = i; k < MINIMUM(i + 2, end); ++k) {
+			if (w->is_planned[k - start] && !w->is_claimed[k - start] && (k == start || w->is_planned[k - start - 1])) {
+				w->is_claimed[k - start] = true;
+				ready[n_ready++] = k;
+			}
+		}
+	}
+	for (ssize_t r = 0; r < n_ready; ++r) {
+		const ssize_t k = ready[r];
+		struct slice *k_slice = &o->slices[k];
+		const struct layer_timer format_lt = start_layer_timer();
+		const bool prev_has_moves = (k == start) ? w->start_has_last_move : w->has_moves[k - start - 1];
+		if (k_slice->moves.size() > 0 && prev_has_moves)
+			update_first_move(k_slice, (k == start) ? w->start_last_move : w->last_moves[k - start - 1]);
+		w->layer_e[k - start] = export_layer(k_slice, k);
+		end_layer_timer(&format_lt, k, LAYER_STAGE_FORMAT);
+	#ifdef _OPENMP
+		#pragma omp critical(layer_write)
+	#endif
+		{
+			w->is_exported[k - start] = true;
+			for (; w->next_write < end && w->is_exported[w->next_write - start]; ++w->next_write) {
+				struct slice *w_slice = &o->slices[w->next_write];
+				const struct layer_timer write_lt = start_layer_timer();
+				w->total_e += w->layer_e[w->next_write - start];
+				w->total_time += w_slice->layer_time;
+				if (w->f)
+					write_layer(w->f, w_slice, w->next_write);
+				else
+					FREE_VECTOR(w_slice->gcode);
+				end_layer_timer(&write_lt, w->next_write, LAYER_STAGE_WRITE);
+			}
+		}
+	}
+}
+
+/* Add the writer's totals and set 'last_move' and 'has_last_move' to the end of the last layer */
+static void finish_layer_writer(const struct layer_writer *w, struct g_move *last_move, bool *has_last_move, fl_t *r_total_e, fl_t *r_total_time)
+{
+	const ssize_t n = w->end - w->start;
+	if (n > 0) {
+		*has_last_move = w->has_moves[n - 1];
+		if (*has_last_move)
+			*last_move = w->last_moves[n - 1];
+	}
+	*r_total_e += w->total_e;
+	*r_total_time += w->total_time;
+}
+
+/* Plan layers [start, end) in parallel and export and write (if f is not NULL) each one as soon as possible.
+   'last_move' and 'has_last_move' carry the end of the layer below 'start' between calls. */
+static void plan_and_write_layers(FILE *f, struct object *o, ssize_t start, ssize_t end, struct g_move *last_move, bool *has_last_move, fl_t *r_total_e, fl_t *r_total_time)
+{
+	struct layer_writer w;
+	const struct stage_timer st = start_stage_timer();
+	init_layer_writer(&w, f, start, end, last_move, *has_last_move);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = start; i < end; ++i)
+		plan_and_write_layer(&w, o, i);
+	finish_layer_writer(&w, last_move, has_last_move, r_total_e, r_total_time);
+	end_stage_timer(&st, "plan_and_write");
+}
+
+/* The settings that turn the total extrusion into the material statistics of the footer */
+struct material_stats {
+	fl_t flow_multiplier, material_area, material_density, material_cost;
+};
+
+static struct material_stats config_material_stats(void)
+{
+	return { config.flow_multiplier, config.material_area, config.material_density, config.material_cost };
+}
+
+static void write_gcode_end(FILE *f)
+{
+	write_gcode_string(config.cool_off_gcode, f, false);
+	write_gcode_string(config.end_gcode, f, false);
+}
+
+/* Returns the size of the file */
+static long int write_gcode_totals(FILE *f, const struct material_stats *m, fl_t total_e, fl_t total_time)
+{
+	const fl_t mass = m->material_area * total_e * m->material_density / m->flow_multiplier;
+	fprintf(f, "; material length = %.4f\n", total_e / m->flow_multiplier);
+	fprintf(f, "; material mass   = %.4f\n", mass);
+	fprintf(f, "; material cost   = %.4f\n", mass * m->material_cost);
+	fprintf(f, "; print time      = %.2d:%.2d:%02.0lf\n", (int) (total_time / 3600.0), (int) (total_time / 60.0) % 60, fmod(total_time, 60.0));
+	return ftell(f);
+}
+
+/* Returns the size of the file */
+static long int write_gcode_footer(FILE *f, fl_t total_e, fl_t total_time)
+{
+	const struct material_stats m = config_material_stats();
+	write_gcode_end(f);
+	return write_gcode_totals(f, &m, total_e, total_time);
+}
+
+static void print_gcode_stats(const struct material_stats *m, fl_t total_e, fl_t total_time, long int bytes)
+{
+	const fl_t mass = m->material_area * total_e * m->material_density / m->flow_multiplier;
+	fprintf(stderr, "material length = %.4f\n", total_e / m->flow_multiplier);
+	fprintf(stderr, "material mass   = %.4f\n", mass);
+	fprintf(stderr, "material cost   = %.4f\n", mass * m->material_cost);
+	fprintf(stderr, "print time      = %.2d:%.2d:%02.0lf\n", (int) (total_time / 3600.0), (int) (total_time / 60.0) % 60, fmod(total_time, 60.0));
+	if (bytes >= 2048 * 1024)
+		fprintf(stderr, "wrote %.2fMiB\n", bytes / 1024.0 / 1024.0);
+	else if (bytes >= 2048)
+		fprintf(stderr, "wrote %.2fKiB\n", bytes / 1024.0);
+	else
+		fprintf(stderr, "wrote %ldB\n", bytes);
+}
+
+static FILE * open_gcode_output(const char *path)
+{
+	if (strcmp(path, "-") == 0)
+		return stdout;
+	return fopen(path, "w");
+}
+
+enum slice_task_kind {
+	SLICE_TASK_OUTLINES,
+	SLICE_TASK_INSETS,
+	SLICE_TASK_INFILL,
+	SLICE_TASK_SUPPORT_BOUNDARIES,
+	SLICE_TASK_FOOTPRINT_TOTAL,
+	SLICE_TASK_FOOTPRINT_PREFIX,
+	SLICE_TASK_BUILD_PLATE,
+	SLICE_TASK_SUPPORT_INTERFACE,
+	SLICE_TASK_SUPPORT_LINES,
+	SLICE_TASK_BRIM,
+	SLICE_TASK_RAFT,
+	SLICE_TASK_PLAN,
+};
+
+struct slice_tasks {
+	struct object *o;
+	struct layer_writer *w;  /* NULL if the layers are not planned */
+	fl_t raft_e, raft_time;
+	std::atomic<char> *insets_done, *infill_done;
+	size_t *infill_keys;
+	struct support_footprint *footprint;  /* Footprint below each chunk (see struct support_footprint) */
+};
+
+/* The footprint tasks are given a chunk number instead of a layer */
+static void run_slice_task(void *arg, const struct task *t)
+{
+	struct slice_tasks *s = (struct slice_tasks *) arg;
+	struct object *o = s->o;
+	const ssize_t i = t->layer;
+	const struct layer_timer lt = start_layer_timer();
+	struct stage_timer st;
+	ssize_t k;
+	switch (t->kind) {
+	case SLICE_TASK_OUTLINES:
+		generate_outlines(&o->slices[i], o->adj, i);
+		end_layer_timer(&lt, i, LAYER_STAGE_OUTLINES);
+		record_layer_outlines(&o->slices[i], i);
+		break;
+	case SLICE_TASK_INSETS:
+		generate_layer_insets_in_window(o, i, s->insets_done);
+		end_layer_timer(&lt, i, LAYER_STAGE_INSETS);
+		s->insets_done[i].store(true, std::memory_order_release);
+		break;
+	case SLICE_TASK_INFILL:
+		generate_layer_infill_in_window(o, i, s->infill_done, s->infill_keys);
+		end_layer_timer(&lt, i, LAYER_STAGE_INFILL);
+		s->infill_done[i].store(true, std::memory_order_release);
+		break;
+	case SLICE_TASK_SUPPORT_BOUNDARIES:
+		generate_layer_support_map(o, i);
+		generate_support_boundaries(&o->slices[i]);
+		end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
+		break;
+	case SLICE_TASK_FOOTPRINT_TOTAL:
+		st = start_stage_timer();
+		extend_support_footprint(o, s->footprint[i].paths, (i - 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS, i * SUPPORT_FOOTPRINT_CHUNK_LAYERS);
+		end_stage_timer(&st, "support_build_plate");
+		break;
+	case SLICE_TASK_FOOTPRINT_PREFIX:
+		st = start_stage_timer();
+		add_support_footprint_prefix(s->footprint[i - 1].paths, s->footprint[i].paths);
+		end_stage_timer(&st, "support_build_plate");
+		break;
+	case SLICE_TASK_BUILD_PLATE:
+		st = start_stage_timer();
+		clip_support_chunk_to_footprint(o, &s->footprint[i], i);
+		end_stage_timer(&st, "support_build_plate");
+		FREE_VECTOR(s->footprint[i].paths);
+		for (k = i * SUPPORT_FOOTPRINT_CHUNK_LAYERS; k < o->n_slices && k < (i + 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS; ++k)
+			FREE_VECTOR(o->slices[k].support_boundaries);
+		break;
+	case SLICE_TASK_SUPPORT_INTERFACE:
+		generate_support_interface_clip_regions(&o->slices[i]);
+		end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
+		break;
+	case SLICE_TASK_SUPPORT_LINES:
+		generate_support_lines(o, &o->slices[i], i);
+		end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
+		break;
+	case SLICE_TASK_BRIM:
+		st = start_stage_timer();
+		generate_brim(o);
+		end_stage_timer(&st, "brim");
+		break;
+	case SLICE_TASK_RAFT:
+		st = start_stage_timer();
+		generate_raft(o);
+		end_stage_timer(&st, "raft");
+		if (s->w) {
+			st = start_stage_timer();
+			struct slice *raft_dummy_slice = plan_raft_gcode(o, &s->raft_e, &s->raft_time);
+			end_stage_timer(&st, "raft_gcode");
+			write_gcode_header(s->w->f, raft_dummy_slice);
+			delete raft_dummy_slice;
+		}
+		break;
+	case SLICE_TASK_PLAN:
+		plan_and_write_layer(s->w, o, i);
+		break;
+	}
+}
+
+/* Slice the object and, if 'path' is not NULL, plan each layer and write it to 'path'. Each stage of a layer runs
+   as soon as the layers it depends on are through the stages it needs, so the stages overlap instead of each one
+   waiting for the slowest layer of the one before. The exceptions are the support maps, which depend on every layer
+   above, and the raft, which is written before the first layer. The support maps are swept down between two runs
+   of the graph: the first run builds everything the sweep depends on, along with the build plate footprint, and
+   the second run everything that depends on the sweep. Returns non-zero if the output could not be opened. */
+static int slice_object(struct object *o, const char *path)
+{
+	std::chrono::time_point<std::chrono::high_resolution_clock> start;
+	FILE *f = NULL;
+	struct layer_writer w;
+	struct slice_tasks s = {};
+	std::vector<struct task> tasks, support_tasks;
+	struct g_move last_move = {};
+	bool has_last_move = false;
+	fl_t total_e = 0.0, total_time = 0.0;
+	ssize_t i, k;
+
+	if (path) {
+		f = open_gcode_output(path);
+		if (!f)
+			return 1;
+	}
+	start = std::chrono::high_resolution_clock::now();
+	find_object_segments(o);
+	const ssize_t n = o->n_slices;
+	std::vector<std::atomic<char>> insets_done(n), infill_done(n);
+	std::vector<size_t> infill_keys(n);
+	s.o = o;
+	s.insets_done = insets_done.data();
+	s.infill_done = infill_done.data();
+	s.infill_keys = infill_keys.data();
+	if (f) {
+		fprintf(stderr, "  generate layers and write gcode to %s...", path);
+		init_layer_writer(&w, f, 0, n, &last_move, has_last_move);
+		s.w = &w;
+	}
+	else
+		fputs("  generate layers...", stderr);
+	struct stage_timer st = start_stage_timer();
+	generate_infill_patterns(o);
+	end_stage_timer(&st, "infill_patterns");
+	if (f && !config.generate_raft)
+		write_gcode_header(f, NULL);
+
+	/* With support, the tasks that wait for the support maps go in 'late' and do not depend on the tasks in
+	   'tasks', which are all done by then */
+	std::vector<struct task> &late = (config.generate_support) ? support_tasks : tasks;
+	auto early_dep = [](ssize_t t) -> ssize_t { return (config.generate_support) ? -1 : t; };
+	std::vector<ssize_t> outlines(n), insets(n), infill(n), support_boundaries(n, -1), support_interface(n, -1), support_lines(n, -1);
+	ssize_t brim = -1, raft = -1;
+	const ssize_t n_chunks = (config.generate_support && !config.support_everywhere) ? (n + SUPPORT_FOOTPRINT_CHUNK_LAYERS - 1) / SUPPORT_FOOTPRINT_CHUNK_LAYERS : 0;
+	std::vector<struct support_footprint> footprint(n_chunks);
+	std::vector<ssize_t> build_plate(n_chunks);
+	auto build_plate_dep = [&](ssize_t i) -> ssize_t { return (n_chunks > 0) ? build_plate[i / SUPPORT_FOOTPRINT_CHUNK_LAYERS] : -1; };
+	s.footprint = footprint.data();
+	for (i = 0; i < n; ++i)
+		outlines[i] = add_task(tasks, SLICE_TASK_OUTLINES, i);
+	for (i = 0; i < n; ++i) {
+		insets[i] = add_task(tasks, SLICE_TASK_INSETS, i);
+		add_task_dependency(tasks, insets[i], outlines[i]);
+	}
+	/* generate_infill() needs the insets of layers i - floor_layers through i + roof_layers (and i + 1 for the
+	   exposed surface, which is only needed if roof_layers > 0) */
+	for (i = 0; i < n; ++i) {
+		infill[i] = add_task(tasks, SLICE_TASK_INFILL, i);
+		for (k = MAXIMUM(i - config.floor_layers, 0); k < n && k <= i + config.roof_layers; ++k)
+			add_task_dependency(tasks, infill[i], insets[k]);
+	}
+	if (config.generate_support) {
+		const bool has_interface = config.interface_roof_layers > 0 || config.interface_floor_layers > 0;
+		for (i = 0; i < n; ++i) {
+			support_boundaries[i] = add_task(tasks, SLICE_TASK_SUPPORT_BOUNDARIES, i);
+			add_task_dependency(tasks, support_boundaries[i], insets[i]);  /* The boundaries are built from the aligned outlines */
+			if (i > 0)
+				add_task_dependency(tasks, support_boundaries[i], insets[i - 1]);
+		}
+		/* The footprint (see struct support_footprint) needs only the support boundaries, so the chunk totals and
+		   their running union are found in the first run. The prefix is a chain, but each link is one union and
+		   the rest of the first run goes on around it. The support maps of a chunk can only be clipped once the
+		   sweep has built them, so that is done in the second run. */
+		ssize_t prefix = -1;
+		for (ssize_t c = 1; c < n_chunks; ++c) {
+			const ssize_t total = add_task(tasks, SLICE_TASK_FOOTPRINT_TOTAL, c);
+			for (i = (c - 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS; i < c * SUPPORT_FOOTPRINT_CHUNK_LAYERS; ++i)
+				add_task_dependency(tasks, total, support_boundaries[i]);
+			if (c == 1)
+				prefix = total;
+			else {
+				const ssize_t t = add_task(tasks, SLICE_TASK_FOOTPRINT_PREFIX, c);
+				add_task_dependency(tasks, t, total);
+				add_task_dependency(tasks, t, prefix);
+				prefix = t;
+			}
+		}
+		for (ssize_t c = 0; c < n_chunks; ++c)
+			build_plate[c] = add_task(late, SLICE_TASK_BUILD_PLATE, c);
+		for (i = 0; i < n && has_interface; ++i) {
+			support_interface[i] = add_task(late, SLICE_TASK_SUPPORT_INTERFACE, i);
+			add_task_dependency(late, support_interface[i], build_plate_dep(i));
+		}
+		for (i = 0; i < n; ++i) {
+			support_lines[i] = add_task(late, SLICE_TASK_SUPPORT_LINES, i);
+			add_task_dependency(late, support_lines[i], build_plate_dep(i));
+			if (has_interface)
+				for (k = MAXIMUM(i - config.interface_floor_layers, 0); k < n && k <= i + config.interface_roof_layers; ++k)
+					add_task_dependency(late, support_lines[i], support_interface[k]);
+		}
+	}
+	if (config.brim_lines > 0) {
+		brim = add_task(late, SLICE_TASK_BRIM, 0);
+		add_task_dependency(late, brim, early_dep((n > 0) ? insets[0] : -1));
+	}
+	if (config.generate_raft) {
+		raft = add_task(late, SLICE_TASK_RAFT, 0);
+		add_task_dependency(late, raft, early_dep((n > 0) ? insets[0] : -1));
+		add_task_dependency(late, raft, brim);
+	}
+	/* Planning frees a layer's islands, so it must wait for every task that reads them. The infill of layer i reads
+	   layers i - floor_layers through i + roof_layers, and the insets and infill of a layer may be copied from the
+	   COPY_WINDOW layers below it. */
+	for (i = 0; i < n && f; ++i) {
+		const ssize_t t = add_task(late, SLICE_TASK_PLAN, i);
+		for (k = MAXIMUM(i - config.roof_layers, 0); k < n && k <= i + COPY_WINDOW + config.floor_layers; ++k)
+			add_task_dependency(late, t, early_dep(infill[k]));
+		add_task_dependency(late, t, support_lines[i]);
+		if (i == 0) {
+			add_task_dependency(late, t, brim);
+			add_task_dependency(late, t, raft);
+		}
+	}
+
+	st = start_stage_timer();
+	run_task_graph(tasks, run_slice_task, &s);
+	if (config.generate_support) {
+		struct stage_timer sweep_st = start_stage_timer();
+		extend_support_downward(o);
+		end_stage_timer(&sweep_st, "support_extend");
+		if (config.support_everywhere)
+			free_support_boundaries(o);
+		run_task_graph(support_tasks, run_slice_task, &s);
+	}
+	end_stage_timer(&st, "layers");
+	fputs(" done\n", stderr);
+	report_open_outlines(o);
+	free(o->adj);
+	/* Free unneeded memory */
+	if (config.generate_support) {
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+		for (i = 0; i < n; ++i) {
+			FREE_VECTOR(o->slices[i].support_interface_clip);
+			FREE_VECTOR(o->slices[i].support_map);
+		}
+	}
+	long int bytes = 0;
+	if (f) {
+		total_e = s.raft_e;
+		total_time = s.raft_time;
+		finish_layer_writer(&w, &last_move, &has_last_move, &total_e, &total_time);
+		bytes = write_gcode_footer(f, total_e, total_time);
+		perf.bytes = bytes;
+		fclose(f);
+	}
+	fprintf(stderr, "sliced in %fs\n",
+		(double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0);
+	if (f) {
+		const struct material_stats m = config_material_stats();
+		print_gcode_stats(&m, total_e, total_time, bytes);
+	}
+	return 0;
+}
+
+/* Estimate of the memory used by a layer while it is in flight (its segments, islands, moves and G-code), based on
+   the number of triangles that cross it (its s_len, set by bin_triangles() before any segments are found). Measured
+   on the shiv-bench models with the configs in configs/, a layer took 130 to 310 bytes per segment on average and
+   never more than this estimate (the median was less than half of it). */
+#define BAND_LAYER_BYTES   (16 * 1024)
+#define BAND_SEGMENT_BYTES 512
+#define BAND_LAYER_COST(o, i) ((fl_t) BAND_LAYER_BYTES + (fl_t) BAND_SEGMENT_BYTES * (o)->slices[i].s_len)
+
+/* Find the end of the band starting at 'start'. Layers [start, end + window) are held in memory while the band
+   is processed. At least one layer is always included and the band never extends past 'limit'. Without a memory
+   budget, the band extends to 'limit'. */
+static ssize_t find_band_end(const struct object *o, ssize_t start, ssize_t window, ssize_t limit)
+{
+	const fl_t budget = config.memory_budget * 1024.0 * 1024.0;
+	ssize_t end = start + 1;
+	fl_t used = 0.0;
+	if (budget <= 0.0)
+		return MAXIMUM(limit, end);
+	for (ssize_t i = start; i < MINIMUM(end + window, o->n_slices); ++i)
+		used += BAND_LAYER_COST(o, i);
+	while (end < limit) {
+		const fl_t next = (end + window < o->n_slices) ? BAND_LAYER_COST(o, end + window) : 0.0;
+		if (used + next > budget)
+			break;
+		used += next;
+		++end;
+	}
+	return end;
+}
+
+/* Find the start of the band ending at 'end', for bands that go from the top of the object down. Layers
+   [start - window, end) are held in memory while the band is processed. At least one layer is always included and
+   the band never extends below 'limit'. Without a memory budget, the band extends to 'limit'. */
+static ssize_t find_band_start(const struct object *o, ssize_t end, ssize_t window, ssize_t limit)
+{
+	const fl_t budget = config.memory_budget * 1024.0 * 1024.0;
+	ssize_t start = end - 1;
+	fl_t used = 0.0;
+	if (budget <= 0.0)
+		return MINIMUM(limit, start);
+	for (ssize_t i = MAXIMUM(start - window, 0); i < end; ++i)
+		used += BAND_LAYER_COST(o, i);
+	while (start > limit) {
+		const fl_t next = (start - window > 0) ? BAND_LAYER_COST(o, start - window - 1) : 0.0;
+		if (used + next > budget)
+			break;
+		used += next;
+		--start;
+	}
+	return start;
+}
+
+/* The support maps depend on every layer above, so the support sweep must reach the build plate before any layer
+   can be written. Sweep the object from the top down one band at a time, building only the outlines, support
+   boundaries and layer support maps that the sweep needs and freeing them once it has passed. For the layers from
+   'first' (the first layer whose support map is built) up, the layer support maps, the parts covered at each layer
+   and the checkpoints are kept for build_support_maps_up(), along with the footprint totals of the chunks below
+   'first'. The islands of layers 'keep' and up in the last band are kept so that stream_object() does not have to
+   generate them again, and the end of the kept layers is returned. */
+static ssize_t sweep_support_in_bands(struct object *o, struct support_stream *ss, ssize_t first, ssize_t keep)
+{
+	const ssize_t window = MAXIMUM(config.support_vert_margin, 1);
+	const ssize_t n_chunks = (config.support_everywhere) ? 0 : (o->n_slices + SUPPORT_FOOTPRINT_CHUNK_LAYERS - 1) / SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	const ssize_t first_chunk = (config.support_everywhere) ? 0 : first / SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	struct support_sweep sw;
+	ssize_t n_outlined = o->n_slices;  /* Layers at or above this have been outlined */
+	ssize_t n_freed = o->n_slices;     /* The support boundaries at or above this have been freed */
+	ssize_t n_totals = first_chunk;    /* The footprint totals of chunks at or above this have been found */
+	ssize_t kept_end = keep;
+	ClipperLib::Paths map;
+	ss->covered.resize(o->n_slices);
+	ss->checkpoints.resize((o->n_slices + SUPPORT_CHECKPOINT_LAYERS - 1) / SUPPORT_CHECKPOINT_LAYERS);
+	ss->footprint_totals.resize(n_chunks);
+	for (ssize_t end = o->n_slices; end > 0;) {
+		const ssize_t start = find_band_start(o, end, window, 0);
+		const ssize_t lo = MAXIMUM(start - window, 0);
+		find_band_segments(o, lo, n_outlined);
+		struct stage_timer st = start_stage_timer();
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+		for (ssize_t i = lo; i < n_outlined; ++i) {
+			const struct layer_timer lt = start_layer_timer();
+			generate_outlines(&o->slices[i], o->adj, i);
+			/* The boundaries are built from the aligned outlines */
+			if (config.align_seams)
+				for (struct island &island : o->slices[i].islands)
+					align_seams(island.insets[0], &island.seam_rotations);
+			end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
+		}
+		end_stage_timer(&st, "support_outlines");
+		st = start_stage_timer();
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+		for (ssize_t i = lo; i < end; ++i) {
+			const struct layer_timer lt = start_layer_timer();
+			if (i >= start)
+				generate_layer_support_map(o, i);
+			if (i < n_outlined)
+				generate_support_boundaries(&o->slices[i]);
+			end_layer_timer(&lt, i, LAYER_STAGE_SUPPORT);
+		}
+		end_stage_timer(&st, "support_boundaries");
+		n_outlined = lo;
+		st = start_stage_timer();
+		for (ssize_t k = end - 1; k >= start; --k) {
+			sweep_support_layer(o, &sw, k, map, &ss->covered[k]);
+			if (k < first) {
+				FREE_VECTOR(o->slices[k].layer_support_map);
+				FREE_VECTOR(ss->covered[k]);
+			}
+			else if (k > first && k % SUPPORT_CHECKPOINT_LAYERS == 0)
+				ss->checkpoints[k / SUPPORT_CHECKPOINT_LAYERS] = sw.parts;
+		}
+		for (; n_totals > 0 && (n_totals - 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS >= lo; --n_totals)
+			extend_support_footprint(o, ss->footprint_totals[n_totals - 1], (n_totals - 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS, n_totals * SUPPORT_FOOTPRINT_CHUNK_LAYERS);
+		end_stage_timer(&st, "support_sweep");
+		/* generate_layer_support_map() needs the islands of the layer below the band, and the sweep and the footprint
+		   totals still need the boundaries below start + support_vert_margin */
+		const ssize_t free_end = (start == 0) ? MINIMUM(keep, end) : end;
+		for (ssize_t i = start; i < end; ++i) {
+			if (i < free_end) {
+				free_islands(&o->slices[i]);
+				o->slices[i].open_outlines = 0;  /* Counted when the outlines are generated again */
+			}
+			else {
+				if (config.align_seams)
+					for (struct island &island : o->slices[i].islands)
+						unalign_seams(island.insets[0], island.seam_rotations);
+				record_layer_outlines(&o->slices[i], i);
+				kept_end = end;
+			}
+		}
+		const ssize_t boundaries_end = MAXIMUM(start + config.support_vert_margin, n_totals * SUPPORT_FOOTPRINT_CHUNK_LAYERS);
+		for (; n_freed > boundaries_end; --n_freed)
+			FREE_VECTOR(o->slices[n_freed - 1].support_boundaries);
+		end = start;
+	}
+	for (; n_freed > 0; --n_freed)
+		FREE_VECTOR(o->slices[n_freed - 1].support_boundaries);
+	ss->n_totals = first_chunk;
+	ss->footprint_chunk = 0;
+	ss->footprint.done = 0;
+	ss->n_maps = first;
+	ss->n_boundaries_freed = 0;
+	return kept_end;
+}
+
+#define PARTIAL_MARKER "; partial output: layers "
+#define PARTIAL_MATERIAL_MARKER "; partial output: material "
+
+static bool is_partial_run(void)
+{
+	return config.start_layer > 0 || config.end_layer >= 0;
+}
+
+/* Slice, plan and write layers [start_layer, end_layer) of the object in bands of layers so that the memory used by
+   the layers in flight is bounded by config.memory_budget instead of the height of the object. The segments of each
+   band are found when the band is sliced, so the triangles are kept instead. With support, the object is first swept
+   from the top down in bands (see sweep_support_in_bands()), and each band then replays the sweep from the
+   checkpoint above it to build its support maps. Other layers are only sliced as far as the written layers depend
+   on them. When every layer is written, the output is identical to slice_object(). A partial output ends with marker
+   lines holding its totals and the settings for the material statistics instead of the footer. It only has the
+   start G-code if it starts at layer 0 and the end G-code if it ends at the top of the object. merge_gcode() joins
+   the partial outputs. */
+static int stream_object(struct object *o, const char *path)
+{
+	std::chrono::time_point<std::chrono::high_resolution_clock> start;
+	FILE *f = NULL;
+	if (path) {
+		f = open_gcode_output(path);
+		if (!f)
+			return 1;
+	}
+	fl_t total_e = 0.0, total_time = 0.0;
+	struct g_move last_move = {};
+	bool has_last_move = false;
+	struct support_stream ss;
+
+	start = std::chrono::high_resolution_clock::now();
+	build_object_topology(o);
+	bin_triangles(o);
+	const ssize_t first = MINIMUM((ssize_t) config.start_layer, o->n_slices);
+	const ssize_t last = (config.end_layer < 0) ? o->n_slices : MINIMUM((ssize_t) config.end_layer, o->n_slices);
+	/* The first move of a layer depends on where the layer below ends, so the layer below 'first' is planned too */
+	const ssize_t plan_start = MAXIMUM(first - 1, 0);
+	/* The support lines of a layer need the support interface clip regions of the interface_floor_layers layers
+	   below it. Without support_everywhere, the support maps are built from the start of that layer's footprint
+	   chunk so that the footprint is brought up to date at the same layers as in clip_support_chunk_to_footprint(). */
+	ssize_t support_start = MAXIMUM(plan_start - config.interface_floor_layers, 0);
+	if (!config.support_everywhere)
+		support_start -= support_start % SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	ssize_t n_outlines = MAXIMUM(plan_start - config.floor_layers, 0), n_infill = plan_start, n_written = plan_start, n_bands = 0, n_clip_freed = 0;
+	if (config.generate_support)
+		n_outlines = MAXIMUM(MINIMUM(n_outlines, support_start - config.support_vert_margin), 0);
+	ssize_t n_support_freed = support_start, kept_end = n_outlines;
+	struct stage_timer st = start_stage_timer();
+	generate_infill_patterns(o);
+	end_stage_timer(&st, "infill_patterns");
+	if (config.generate_support) {
+		fputs("  generate support...", stderr);
+		kept_end = sweep_support_in_bands(o, &ss, support_start, n_outlines);
+		fputs(" done\n", stderr);
+	}
+	fputs("  slice and write layers...", stderr);
+	const ssize_t window = (config.generate_support) ? MAXIMUM(config.floor_layers + config.roof_layers, config.interface_roof_layers + config.support_vert_margin) : config.floor_layers + config.roof_layers;
+	while (n_written < last) {
+		/* The infill for layer i needs the islands of layers i - floor_layers through i + roof_layers, and a
+		   layer cannot be planned until all of the infill that depends on it is done. The support lines need the
+		   support maps of the interface_roof_layers layers above, and those need the support boundaries of the
+		   support_vert_margin layers above them. */
+		const ssize_t band_end = find_band_end(o, n_written, window, last);
+		const ssize_t infill_end = (band_end == last) ? band_end : MINIMUM(band_end + config.floor_layers, last);
+		const ssize_t support_end = MINIMUM(band_end + config.interface_roof_layers, o->n_slices);
+		ssize_t outlines_end = MINIMUM(infill_end + config.roof_layers, o->n_slices);
+		if (config.generate_support)
+			outlines_end = MAXIMUM(outlines_end, MINIMUM(support_end + config.support_vert_margin, o->n_slices));
+		find_band_segments(o, MAXIMUM(n_outlines, kept_end), outlines_end);
+		generate_layer_outlines(o, MAXIMUM(n_outlines, kept_end), outlines_end);
+		generate_layer_insets(o, n_outlines, outlines_end);
+		if (config.generate_support) {
+			generate_layer_support_boundaries(o, n_outlines, outlines_end);
+			if (!config.support_everywhere)
+				find_support_footprint_totals(o, &ss, outlines_end);
+			build_support_maps_up(o, &ss, support_end);
+		}
+		generate_layer_infill(o, n_infill, infill_end);
+		n_outlines = outlines_end;
+		n_infill = infill_end;
+		if (n_written == 0) {
+			struct slice *raft_dummy_slice = NULL;
+			if (config.brim_lines > 0) {
+				st = start_stage_timer();
+				generate_brim(o);
+				end_stage_timer(&st, "brim");
+			}
+			if (config.generate_raft && first == 0) {
+				st = start_stage_timer();
+				generate_raft(o);
+				end_stage_timer(&st, "raft");
+				st = start_stage_timer();
+				raft_dummy_slice = plan_raft_gcode(o, &total_e, &total_time);
+				end_stage_timer(&st, "raft_gcode");
+			}
+			if (f && first == 0)
+				write_gcode_header(f, raft_dummy_slice);
+			delete raft_dummy_slice;
+		}
+		if (config.generate_support) {
+			generate_layer_support_lines(o, n_written, band_end);
+			for (; n_support_freed < band_end; ++n_support_freed)
+				FREE_VECTOR(o->slices[n_support_freed].support_map);
+			for (; n_clip_freed < band_end - config.interface_floor_layers; ++n_clip_freed)
+				FREE_VECTOR(o->slices[n_clip_freed].support_interface_clip);
+		}
+		if (n_written < first) {
+			fl_t unused_e = 0.0, unused_time = 0.0;
+			plan_and_write_layers(NULL, o, n_written, first, &last_move, &has_last_move, &unused_e, &unused_time);
+			n_written = first;
+		}
+		plan_and_write_layers(f, o, n_written, band_end, &last_move, &has_last_move, &total_e, &total_time);
+		n_written = band_end;
+		++n_bands;
+	}
+	fputs(" done\n", stderr);
+	free(o->t);
+	free(o->v);
+	free(o->adj);
+	FREE_VECTOR(o->bins.t);
+	report_open_outlines(o);
+	if (config.generate_support) {
+		for (; n_support_freed < o->n_slices; ++n_support_freed) {
+			FREE_VECTOR(o->slices[n_support_freed].support_map);
+			FREE_VECTOR(o->slices[n_support_freed].layer_support_map);
+		}
+		for (; n_clip_freed < o->n_slices; ++n_clip_freed)
+			FREE_VECTOR(o->slices[n_clip_freed].support_interface_clip);
+		for (ssize_t i = ss.n_boundaries_freed; i < o->n_slices; ++i)
+			FREE_VECTOR(o->slices[i].support_boundaries);
+	}
+	fprintf(stderr, "sliced and planned %zd layer(s) in %zd band(s) in %fs\n", last - first, n_bands,
+		(double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0);
+
+	if (f) {
+		long int bytes;
+		const struct material_stats m = config_material_stats();
+		if (is_partial_run()) {
+			if (last == o->n_slices)
+				write_gcode_end(f);
+			/* Hexadecimal floats so that the totals are merged exactly */
+			fprintf(f, PARTIAL_MARKER "%zd-%zd of %zd: e = %a, t = %a\n", first, last, o->n_slices, (double) total_e, (double) total_time);
+			fprintf(f, PARTIAL_MATERIAL_MARKER "%a %a %a %a\n", (double) m.flow_multiplier, (double) m.material_area, (double) m.material_density, (double) m.material_cost);
+			bytes = ftell(f);
+			fprintf(stderr, "wrote layers %zd through %zd of %zd to %s\n", first, last - 1, o->n_slices, path);
+		}
+		else {
+			bytes = write_gcode_footer(f, total_e, total_time);
+			fprintf(stderr, "wrote gcode to %s\n", path);
+		}
+		perf.bytes = bytes;
+		fclose(f);
+		print_gcode_stats(&m, total_e, total_time, bytes);
+	}
+	return 0;
 }
 
-static void plan_moves(struct object *o, struct slice *slice, ssize_t layer_num, struct machine *m)
+/* Join partial outputs (given in layer order) into a complete output. The partial marker lines are dropped and
+   the material statistics are written with the summed totals. The end G-code comes from the last partial output and
+   the material settings from the partial outputs themselves, so the configuration of the merge run is not used. All
+   of the partial outputs must have been written with the same material settings. The output is written to a temporary file that is renamed to 'path'
+   once it is complete, so a failed merge never leaves a partial output at 'path'. Returns non-zero on failure. */
+static int merge_gcode(const char *path, char * const *inputs, int n_inputs)
 {
-	const ClipperLib::cInt z = FL_T_TO_CINT(((fl_t) layer_num) * config.layer_height + config.layer_height + config.object_z_extra);
-	if (layer_num == 0 && config.brim_lines > 0)
-		plan_brim(o, m, z);
-	if (config.generate_support) {
-		const fl_t support_flow_adjust = (layer_num > 0) ? config.support_flow_mult : 1.0;
-		const fl_t support_feed_rate = (layer_num > 0) ? config.support_feed_rate : config.perimeter_feed_rate;
-		plan_support(slice, slice->support_interface_lines, m, z, config.extrusion_width, (layer_num == 0 || config.connect_support_lines) ? (layer_num == 0 && config.solid_support_base) ? config.extrusion_width * 1.9 : config.extrusion_width / config.interface_density * 1.9 : 0.0, support_flow_adjust, support_feed_rate);
-		plan_support(slice, slice->support_lines, m, z, config.extrusion_width * 2.0, (layer_num == 0 || config.connect_support_lines) ? config.extrusion_width / config.support_density * 10.0 : 0.0, support_flow_adjust, support_feed_rate);
+	const bool to_stdout = (strcmp(path, "-") == 0);
+	const std::string tmp_path = std::string(path) + ".tmp";
+	const char *out_path = (to_stdout) ? path : tmp_path.c_str();
+	FILE *f = (to_stdout) ? stdout : fopen(out_path, "w"), *in = NULL;
+	if (!f) {
+		fprintf(stderr, "error: failed to open gcode output: %s: %s\n", out_path, strerror(errno));
+		return 1;
 	}
-	while (slice->islands.size() > 0) {
-		size_t best = 0;
-		fl_t best_dist = FL_T_INF;
-		for (size_t i = 0; i < slice->islands.size(); ++i) {
-			fl_t dist;
-			if (config.align_seams)
-				find_nearest_aligned_path(slice->islands[i].insets[0], m->x, m->y, &dist);
-			else
-				find_nearest_path(slice->islands[i].insets[0], m->x, m->y, &dist, NULL);
-			if (dist < best_dist) {
-				best = i;
-				best_dist = dist;
+	fl_t total_e = 0.0, total_time = 0.0;
+	ssize_t next_layer = 0, n_layers = -1;
+	struct material_stats m = {};
+	long int bytes;
+	bool write_error;
+	char buf[4096];
+	for (int i = 0; i < n_inputs; ++i) {
+		in = fopen(inputs[i], "r");
+		if (!in) {
+			fprintf(stderr, "error: failed to open partial output: %s: %s\n", inputs[i], strerror(errno));
+			goto fail;
+		}
+		bool line_start = true, found_marker = false, found_material = false;
+		while (fgets(buf, sizeof(buf), in)) {
+			const size_t len = strlen(buf);
+			if (line_start && strncmp(buf, PARTIAL_MARKER, strlen(PARTIAL_MARKER)) == 0) {
+				long long first, last, n;
+				const char *e_str = strstr(buf, "e = "), *t_str = strstr(buf, "t = ");
+				if (sscanf(buf + strlen(PARTIAL_MARKER), "%lld-%lld of %lld", &first, &last, &n) != 3 || !e_str || !t_str) {
+					fprintf(stderr, "error: %s: malformed partial output marker\n", inputs[i]);
+					goto fail;
+				}
+				if (first != next_layer || (n_layers >= 0 && n != n_layers)) {
+					fprintf(stderr, "error: %s: has layers %lld through %lld of %lld, but layer %zd of %zd was expected next\n",
+						inputs[i], first, last - 1, n, next_layer, (n_layers >= 0) ? n_layers : (ssize_t) n);
+					goto fail;
+				}
+				total_e += strtod(e_str + 4, NULL);
+				total_time += strtod(t_str + 4, NULL);
+				next_layer = last;
+				n_layers = n;
+				found_marker = true;
+			}
+			else if (line_start && strncmp(buf, PARTIAL_MATERIAL_MARKER, strlen(PARTIAL_MATERIAL_MARKER)) == 0) {
+				double v[4];
+				if (sscanf(buf + strlen(PARTIAL_MATERIAL_MARKER), "%la %la %la %la", &v[0], &v[1], &v[2], &v[3]) != 4) {
+					fprintf(stderr, "error: %s: malformed partial output marker\n", inputs[i]);
+					goto fail;
+				}
+				const struct material_stats pm = { (fl_t) v[0], (fl_t) v[1], (fl_t) v[2], (fl_t) v[3] };
+				if (i > 0 && (pm.flow_multiplier != m.flow_multiplier || pm.material_area != m.material_area
+						|| pm.material_density != m.material_density || pm.material_cost != m.material_cost)) {
+					fprintf(stderr, "error: %s: material settings differ from %s\n", inputs[i], inputs[0]);
+					goto fail;
+				}
+				m = pm;
+				found_material = true;
 			}
+			else
+				fwrite(buf, 1, len, f);
+			line_start = (len > 0 && buf[len - 1] == '\n');
 		}
-		struct island &island = slice->islands[best];
-		plan_insets(slice, &island, m, z, config.outside_first || layer_num == 0);
-		plan_smoothed_solid_infill(island.solid_infill, slice, &island, m, config.solid_infill_feed_rate, z);
-		plan_infill_simple(island.iron_paths, slice, &island, m, config.iron_feed_rate, config.iron_flow_multiplier, z);
-		plan_infill_simple(island.sparse_infill, slice, &island, m, config.sparse_infill_feed_rate, 1.0, z);
-		delete[] island.insets;
-		delete[] island.inset_gaps;
-		if (config.comb) {
-			/* Insert outer boundaries and comb paths for the island we just printed */
-			slice->printed_outer_boundaries.insert(slice->printed_outer_boundaries.end(), island.outer_boundaries.begin(), island.outer_boundaries.end());
-			slice->printed_outer_comb_paths.insert(slice->printed_outer_comb_paths.end(), island.outer_comb_paths.begin(), island.outer_comb_paths.end());
-			/* Set last_boundaries and last_comb_paths */
-			slice->last_boundaries = island.boundaries;
-			slice->last_comb_paths = island.comb_paths;
+		if (ferror(in)) {
+			fprintf(stderr, "error: failed to read partial output: %s: %s\n", inputs[i], strerror(errno));
+			goto fail;
+		}
+		fclose(in);
+		in = NULL;
+		if (!found_marker) {
+			fprintf(stderr, "error: %s: not a partial output (see start_layer and end_layer)\n", inputs[i]);
+			goto fail;
+		}
+		if (!found_material) {
+			fprintf(stderr, "error: %s: partial output has no material settings (written by an older version?)\n", inputs[i]);
+			goto fail;
 		}
-		slice->islands.erase(slice->islands.begin() + best);
 	}
-	m->force_retract = true;  /* Force retract on layer change */
-	FREE_VECTOR(slice->islands);
-	if (config.comb) {
-		FREE_VECTOR(slice->last_boundaries);
-		FREE_VECTOR(slice->last_comb_paths);
-		FREE_VECTOR(slice->printed_outer_boundaries);
-		FREE_VECTOR(slice->printed_outer_comb_paths);
+	if (next_layer != n_layers) {
+		fprintf(stderr, "error: layers %zd through %zd are missing\n", next_layer, n_layers - 1);
+		goto fail;
+	}
+	bytes = write_gcode_totals(f, &m, total_e, total_time);
+	write_error = ferror(f);
+	if (fclose(f) != 0 || write_error) {
+		f = NULL;
+		fprintf(stderr, "error: failed to write gcode output: %s: %s\n", out_path, strerror(errno));
+		goto fail;
+	}
+#ifdef _WIN32
+	/* rename() does not replace an existing file with the Microsoft C runtime */
+	if (!to_stdout)
+		remove(path);
+#endif
+	if (!to_stdout && rename(tmp_path.c_str(), path) != 0) {
+		fprintf(stderr, "error: failed to rename %s to %s: %s\n", tmp_path.c_str(), path, strerror(errno));
+		remove(tmp_path.c_str());
+		return 1;
 	}
+	fprintf(stderr, "merged %d partial output(s) (%zd layers) to %s\n", n_inputs, n_layers, path);
+	print_gcode_stats(&m, total_e, total_time, bytes);
+	return 0;
+
+	fail:
+	if (in)
+		fclose(in);
+	if (f && !to_stdout)
+		fclose(f);
+	if (!to_stdout)
+		remove(tmp_path.c_str());
+	return 1;
 }
 
-static void plan_raft(struct object *o, struct slice *slice, struct machine *m)
+static void write_json_string(FILE *f, const char *s)
 {
-	ClipperLib::cInt z = FL_T_TO_CINT(config.raft_base_layer_height);
-
-	fl_t flow_adjust = (config.raft_base_layer_height * config.raft_base_layer_width) / (config.layer_height * config.extrusion_width);
-	fl_t feed_rate = config.solid_infill_feed_rate * config.first_layer_mult;
-	plan_support(slice, o->raft[0], m, z, config.extrusion_width * 2.0, config.raft_base_layer_width / config.raft_base_layer_density * 1.9, flow_adjust, feed_rate);
-
-	flow_adjust = config.raft_interface_flow_mult;
-	feed_rate = config.solid_infill_feed_rate;
-	for (int i = 1; i <= config.raft_interface_layers; ++i) {
-		ClipperLib::Paths lines = o->raft[1];
-		z = FL_T_TO_CINT(config.raft_base_layer_height + config.layer_height * i);
-		plan_support(slice, lines, m, z, config.extrusion_width * 2.0, config.extrusion_width * 1.9, flow_adjust, feed_rate);
+	putc('"', f);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *s);
+		else
+			putc(*s, f);
 	}
-	m->force_retract = true;
+	putc('"', f);
 }
 
-static void write_gcode_move(std::ostringstream &ss, const struct g_move *move, struct machine *m, bool force_xyz)
+/* Write the performance report as JSON. The per-layer times are summed over every thread that worked on the
+   layer, so "layer_stage_totals" is busy time rather than elapsed time. Planning, formatting and writing run
+   interleaved within the "plan_and_write" stage and are only broken out there. Returns non-zero on failure. */
+static int write_perf_report(const char *path, const char *input_path)
 {
-	ss << std::fixed << std::setprecision(3);
-	if (move->e == 0.0 && move->z != m->z && config.separate_z_travel) {
-		ss << "G1 Z" << CINT_TO_FL_T(move->z);
-		if (move->feed_rate != m->feed_rate)
-			ss << " F" << ((move->feed_rate * 60.0 <= 1.0) ? 1 : lround(move->feed_rate * 60.0));
-		ss << '\n';
-		m->z = move->z;
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return 1;
+	const double wall = get_wall_time() - perf.total.wall;
+	const double cpu = get_process_cpu_time() - perf.total.cpu;
+	struct layer_stats sum = {};
+	for (const struct layer_stats &ls : perf.layers) {
+		for (int k = 0; k < LAYER_STAGE_COUNT; ++k) {
+			sum.wall[k] += ls.wall[k];
+			sum.cpu[k] += ls.cpu[k];
+		}
+		sum.segments += ls.segments;
+		sum.islands += ls.islands;
+		sum.vertices += ls.vertices;
+		sum.moves += ls.moves;
+		sum.retracts += ls.retracts;
+		sum.bytes += ls.bytes;
 	}
-	const bool x_changed = move->x != m->x;
-	const bool y_changed = move->y != m->y;
-	const bool z_changed = move->z != m->z;
-	const bool e_changed = move->e != 0.0;
-	if (force_xyz || x_changed || y_changed || z_changed || e_changed) {
-		ss << "G1";
-		if (force_xyz || x_changed)
-			ss << " X" << CINT_TO_FL_T(move->x);
-		if (force_xyz || y_changed)
-			ss << " Y" << CINT_TO_FL_T(move->y);
-		if (force_xyz || z_changed)
-			ss << " Z" << CINT_TO_FL_T(move->z);
-		if (e_changed)
-			ss << " E" << std::setprecision(5) << (m->e + move->e) << std::setprecision(3);
-		if (move->feed_rate != m->feed_rate)
-			ss << " F" << ((move->feed_rate * 60.0 <= 1.0) ? 1 : lround(move->feed_rate * 60.0));
-		ss << '\n';
-		m->x = move->x;
-		m->y = move->y;
-		m->z = move->z;
-		m->e += move->e;
-		m->feed_rate = move->feed_rate;
+#ifdef _OPENMP
+	const int threads = omp_get_max_threads();
+#else
+	const int threads = 1;
+#endif
+
+	fputs("{\n\t\"input\": ", f);
+	write_json_string(f, input_path);
+	fprintf(f, ",\n\t\"threads\": %d,\n", threads);
+	fprintf(f, "\t\"totals\": {\"wall\": %.6f, \"cpu\": %.6f, \"triangles\": %zd, \"layers\": %zu, \"segments\": %zd, \"islands\": %zd, "
+		"\"vertices\": %zd, \"clipper_executes\": %llu, \"offset_executes\": %llu, \"moves\": %zd, \"retracts\": %zd, \"gcode_bytes\": %zd, \"file_bytes\": %ld},\n",
+		wall, cpu, perf.triangles, perf.layers.size(), sum.segments, sum.islands, sum.vertices,
+		ClipperLib::ClipperExecuteCount() - perf.total.clipper_executes, ClipperLib::OffsetExecuteCount() - perf.total.offset_executes,
+		sum.moves, sum.retracts, sum.bytes, perf.bytes);
+	fputs("\t\"stages\": [", f);
+	for (size_t i = 0; i < perf.stages.size(); ++i) {
+		const struct stage_stats *st = &perf.stages[i];
+		fprintf(f, "%s\n\t\t{\"name\": ", (i > 0) ? "," : "");
+		write_json_string(f, st->name);
+		fprintf(f, ", \"runs\": %zu, \"wall\": %.6f, \"cpu\": %.6f, \"clipper_executes\": %llu, \"offset_executes\": %llu}",
+			st->runs, st->wall, st->cpu, st->clipper_executes, st->offset_executes);
+	}
+	fputs("\n\t],\n\t\"layer_stage_totals\": {", f);
+	for (int k = 0; k < LAYER_STAGE_COUNT; ++k)
+		fprintf(f, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", (k > 0) ? ", " : "", layer_stage_names[k], sum.wall[k], sum.cpu[k]);
+	fputs("},\n\t\"layers\": [", f);
+	for (size_t i = 0; i < perf.layers.size(); ++i) {
+		const struct layer_stats *ls = &perf.layers[i];
+		fprintf(f, "%s\n\t\t{\"layer\": %zu, \"z\": %.6f, \"segments\": %zd, \"islands\": %zd, \"vertices\": %zd, \"moves\": %zd, \"retracts\": %zd, \"gcode_bytes\": %zd",
+			(i > 0) ? "," : "", i, ((fl_t) i) * config.layer_height + config.layer_height + config.object_z_extra,
+			ls->segments, ls->islands, ls->vertices, ls->moves, ls->retracts, ls->bytes);
+		for (int k = 0; k < LAYER_STAGE_COUNT; ++k)
+			fprintf(f, ", \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", layer_stage_names[k], ls->wall[k], ls->cpu[k]);
+		putc('}', f);
 	}
+	fputs("\n\t]\n}\n", f);
+	return (fclose(f) == 0) ? 0 : 1;
 }
 
-static void apply_feed_rate_mult(struct slice *slice, fl_t feed_rate_mult)
+#define GET_FEED_RATE(x, m) (((x) >= 0.0) ? (x) : (m) * -(x))
+
+/* Find the offset of each copy of the object. The footprint of a copy is the object's bounding box grown by
+   xy_extra (brim, raft, support, etc.). Explicit offsets are used as given. Otherwise, the copies are arranged in a
+   grid centered on the object with copy_spacing between their footprints. Returns non-zero if the footprints of
+   two explicit copies overlap. */
+static int arrange_copies(struct object *o)
 {
-	if (feed_rate_mult == 1.0)
-		return;
-	slice->layer_time = 0.0;
-	ClipperLib::cInt prev_x = 0, prev_y = 0, prev_z = 0;
-	for (struct g_move &move : slice->moves) {
-		if (move.scalable) {
-			/* Note: first move will *always* be a travel move */
-			const fl_t min_feed_rate = (move.e > 0.0 && move.x == prev_x && move.y == prev_y && move.z == prev_z)  /* is a scalable e-only move */
-				? config.min_feed_rate * config.extrusion_area / config.material_area : config.min_feed_rate;
-			move.feed_rate = MAXIMUM(move.feed_rate * feed_rate_mult, min_feed_rate);
+	const fl_t w = o->w + config.xy_extra, d = o->d + config.xy_extra;
+	o->copies.clear();
+	if (!config.copy_offsets.empty()) {
+		for (size_t i = 0; i < config.copy_offsets.size(); ++i) {
+			const struct copy_offset *a = &config.copy_offsets[i];
+			for (size_t k = 0; k < i; ++k) {
+				const struct copy_offset *b = &config.copy_offsets[k];
+				if (fabs(a->x - b->x) < w && fabs(a->y - b->y) < d) {
+					fprintf(stderr, "error: copies at %g,%g and %g,%g overlap (their centers must be at least %g apart in x or %g apart in y)\n", b->x, b->y, a->x, a->y, w, d);
+					return 1;
+				}
+			}
+			o->copies.push_back(FL_T_TO_INTPOINT(a->x, a->y));
 		}
-		slice->layer_time += move.len / move.feed_rate;
-		prev_x = move.x;
-		prev_y = move.y;
-		prev_z = move.z;
+		return 0;
 	}
+	if (config.copies < 2)
+		return 0;
+	const int cols = (int) ceil(sqrt((double) config.copies));
+	const int rows = (config.copies + cols - 1) / cols;
+	const fl_t x_pitch = w + config.copy_spacing, y_pitch = d + config.copy_spacing;
+	for (int i = 0; i < config.copies; ++i) {
+		const fl_t x = (i % cols - (cols - 1) / 2.0) * x_pitch;
+		const fl_t y = (i / cols - (rows - 1) / 2.0) * y_pitch;
+		o->copies.push_back(FL_T_TO_INTPOINT(x, y));
+	}
+	return 0;
 }
 
-#define NEW_PLAN_MACHINE(name, obj) struct machine name = { FL_T_TO_CINT(obj->c.x - (obj->w + config.xy_extra) / 2.0), FL_T_TO_CINT(obj->c.y - (obj->d + config.xy_extra) / 2.0), 0, 0.0, 0.0, true, false, true, false }
+/* Scale the object, move it to the center of the build plate and arrange the copies around it. Returns non-zero if
+   the copies overlap. */
+static int place_object(struct object *o, fl_t scale_factor, fl_t z_chop)
+{
+	scale_object(o, config.xy_scale_factor * scale_factor, config.xy_scale_factor * scale_factor, config.z_scale_factor * scale_factor);
+	const fl_t z_translate = (config.preserve_layer_offset) ? round((o->h / 2.0 - o->c.z) / config.layer_height) * config.layer_height : o->h / 2.0 - o->c.z;
+	translate_object(o, -o->c.x + config.x_center, -o->c.y + config.y_center, z_translate - z_chop);
+	return arrange_copies(o);
+}
 
-static int write_gcode(const char *path, struct object *o)
+/* Compute the derived (read-only) settings once all of the user settings are known. Returns non-zero if the
+   settings are invalid. */
+static int derive_config_settings(fl_t x_translate, fl_t y_translate)
 {
-	std::chrono::time_point<std::chrono::high_resolution_clock> start;
-	FILE *f;
-	if (strcmp(path, "-") == 0)
-		f = stdout;
-	else
-		f = fopen(path, "w");
-	if (!f)
+	if (config.layer_height > config.extrusion_width) {
+		fputs("error: layer_height must not be greater than extrusion_width\n", stderr);
 		return 1;
-	fl_t total_e = 0.0, total_time = 0.0;
-	struct slice *raft_dummy_slice;
-
-	/* Plan moves and generate g-code in memory */
-	fputs("plan moves...", stderr);
-	start = std::chrono::high_resolution_clock::now();
-	if (config.generate_raft) {
-		NEW_PLAN_MACHINE(plan_m, o);
-		raft_dummy_slice = new struct slice();
-		plan_raft(o, raft_dummy_slice, &plan_m);
-		do_retract(raft_dummy_slice, &plan_m, true);
-		bool is_first_move = true;
-		struct machine export_m = {};
-		/* Convert g_moves to gcode */
-		for (const struct g_move &move : raft_dummy_slice->moves) {
-			write_gcode_move(raft_dummy_slice->gcode, &move, &export_m, is_first_move);
-			is_first_move = false;
-		}
-		total_e += export_m.e;
-		total_time += raft_dummy_slice->layer_time;
-		FREE_VECTOR(raft_dummy_slice->moves);
-	}
-#ifdef _OPENMP
-	#pragma omp parallel for schedule(dynamic)
-#endif
-	for (ssize_t i = 0; i < o->n_slices; ++i) {
-		struct slice *slice = &o->slices[i];
-		NEW_PLAN_MACHINE(plan_m, o);  /* Note: first move len on each layer will be wrong because starting position is unknown at this time */
-		plan_moves(o, slice, i, &plan_m);
-		do_retract(slice, &plan_m, true);
-	}
-	/* We now know where the previous layer ends, so recalculate the move length and layer time */
-	for (ssize_t i = 1; i < o->n_slices; ++i) {
-		struct slice *slice = &o->slices[i];
-		const struct slice *prev_slice = &o->slices[i - 1];
-		if (slice->moves.size() > 0 && prev_slice->moves.size() > 0) {
-			const struct g_move &m0 = prev_slice->moves[prev_slice->moves.size() - 1];
-			struct g_move &m1 = slice->moves[0];
-			slice->layer_time -= m1.len / m1.feed_rate;
-			const fl_t xv = CINT_TO_FL_T(m1.x - m0.x), yv = CINT_TO_FL_T(m1.y - m0.y), zv = CINT_TO_FL_T(m1.z - m0.z);
-			m1.len = sqrt(xv * xv + yv * yv + zv * zv);
-			slice->layer_time += m1.len / m1.feed_rate;
-		}
 	}
-#ifdef _OPENMP
-	#pragma omp parallel for schedule(dynamic) reduction(+:total_e,total_time)
-#endif
-	for (ssize_t i = 0; i < o->n_slices; ++i) {
-		struct slice *slice = &o->slices[i];
-		if (i == 0)
-			apply_feed_rate_mult(slice, config.first_layer_mult);
-		if (slice->layer_time > 0.0 && slice->layer_time < config.min_layer_time)
-			apply_feed_rate_mult(slice, slice->layer_time / config.min_layer_time);
-		bool is_first_move = true;
-		struct machine export_m = {};
-		/* Convert g_moves to gcode */
-		for (const struct g_move &move : slice->moves) {
-			write_gcode_move(slice->gcode, &move, &export_m, is_first_move);
-			is_first_move = false;
-		}
-		total_e += export_m.e;
-		total_time += slice->layer_time;
-		FREE_VECTOR(slice->moves);
-	}
-	fprintf(stderr, " done (%fs)\n",
-		(double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0);
 
-	/* Write g-code to file */
-	fprintf(stderr, "write gcode to %s...", path);
-	start = std::chrono::high_resolution_clock::now();
-	write_gcode_string(config.start_gcode, f, false);
+	config.roof_layers = lround(config.roof_thickness / config.layer_height);
+	config.floor_layers = lround(config.floor_thickness / config.layer_height);
+	if (config.outside_first || config.shells < 2)
+		config.edge_packing_density = 1.0;
+	config.extrusion_area = config.extrusion_width * config.layer_height - (config.layer_height * config.layer_height - config.layer_height * config.layer_height * M_PI_4) * (1.0 - config.packing_density);
+	config.edge_width = (config.extrusion_area - (config.layer_height * config.layer_height * M_PI_4)) / config.layer_height + config.layer_height;
+	config.edge_offset = (config.edge_width + (config.edge_width - config.extrusion_width) * (1.0 - config.edge_packing_density)) / -2.0;
+	config.material_area = config.material_diameter * config.material_diameter * M_PI_4;
+	if (config.z_hop > 0.0 && !config.only_hop_between_islands)
+		config.comb = false;  /* combing is useless if z-hop is enabled */
+	if (config.cool_on_gcode == NULL)
+		config.cool_on_gcode = strdup(DEFAULT_COOL_ON_STR);
+	if (config.cool_off_gcode == NULL)
+		config.cool_off_gcode = strdup(DEFAULT_COOL_OFF_STR);
+	config.x_center += x_translate;
+	config.y_center += y_translate;
+	config.brim_lines = lround(config.brim_width / config.extrusion_width);
+	config.solid_infill_clip_offset = (0.5 + config.shells - config.fill_threshold - config.min_shell_contact) * config.extrusion_width;
+	config.solid_infill_clip_offset = MAXIMUM(config.solid_infill_clip_offset, 0.0);
+	config.xy_extra = (config.extra_offset + config.extrusion_width * config.brim_lines) * 2.0;
+	if (config.generate_support)
+		config.xy_extra += (config.support_xy_expansion + (0.5 + config.support_margin) * config.edge_width - config.edge_offset) * 2.0;
+	const fl_t interface_clip_offset_1 = config.extrusion_width * (1.0 - config.edge_overlap) / 2.0 + (0.5 + config.support_margin) * config.edge_width - config.edge_offset - config.extrusion_width / 8.0;
+	const fl_t interface_clip_offset_2 = tan(config.support_angle / 180.0 * M_PI) * config.layer_height;
+	config.interface_clip_offset = MINIMUM(interface_clip_offset_1, interface_clip_offset_2);
 	if (config.generate_raft) {
-		fputs("; raft\n", f);
-		fputs(raft_dummy_slice->gcode.str().c_str(), f);
-		delete raft_dummy_slice;
-		fputs("G92 E0\n", f);
-	}
-	for (ssize_t i = 0; i < o->n_slices; ++i) {
-		struct slice *slice = &o->slices[i];
-		fprintf(f, "; layer %zd (z = %f; t = %f)\n", i, ((fl_t) i) * config.layer_height + config.layer_height + config.object_z_extra, slice->layer_time);
-		for (struct at_layer_gcode &g : config.at_layer)
-			if (g.layer == i)
-				write_gcode_string(g.value, f, false);
-		if (config.cool_layer >= 0 && i >= config.cool_layer) {
-			if (config.cool_off_time > 0.0 && slice->layer_time >= config.cool_off_time) {
-				write_gcode_string(config.cool_off_gcode, f, false);
-			}
-			else {
-				fl_t cool_value = 0.0;
-				if (config.cool_min_time - config.cool_max_time == 0.0)
-					cool_value = config.cool_max;
-				else if (slice->layer_time >= config.cool_min_time)
-					cool_value = config.cool_min;
-				else if (slice->layer_time <= config.cool_max_time)
-					cool_value = config.cool_max;
-				else  /* use linear interpolation */
-					cool_value = config.cool_max + (slice->layer_time - config.cool_max_time) * (config.cool_min - config.cool_max) / (config.cool_min_time - config.cool_max_time);
-				config.cool_value = lround(cool_value);
-				config.cool_value_float = cool_value;
-				write_gcode_string(config.cool_on_gcode, f, false);
-			}
-		}
-		fputs(slice->gcode.str().c_str(), f);
-		FREE_VECTOR(slice->gcode);
-		fputs("G92 E0\n", f);
+		config.xy_extra += config.raft_xy_expansion * 2.0;
+		config.object_z_extra += config.raft_base_layer_height + config.layer_height * (config.raft_vert_margin + config.raft_interface_layers);
 	}
-	write_gcode_string(config.cool_off_gcode, f, false);
-	write_gcode_string(config.end_gcode, f, false);
-	const fl_t mass = config.material_area * total_e * config.material_density / config.flow_multiplier;
-	fprintf(f, "; material length = %.4f\n", total_e / config.flow_multiplier);
-	fprintf(f, "; material mass   = %.4f\n", mass);
-	fprintf(f, "; material cost   = %.4f\n", mass * config.material_cost);
-	fprintf(f, "; print time      = %.2d:%.2d:%02.0lf\n", (int) (total_time / 3600.0), (int) (total_time / 60.0) % 60, fmod(total_time, 60.0));
-	const long int bytes = ftell(f);
-	fclose(f);
-	fprintf(stderr, " done (%fs)\n",
-		(double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0);
-
-	fprintf(stderr, "material length = %.4f\n", total_e / config.flow_multiplier);
-	fprintf(stderr, "material mass   = %.4f\n", mass);
-	fprintf(stderr, "material cost   = %.4f\n", mass * config.material_cost);
-	fprintf(stderr, "print time      = %.2d:%.2d:%02.0lf\n", (int) (total_time / 3600.0), (int) (total_time / 60.0) % 60, fmod(total_time, 60.0));
-	if (bytes >= 2048 * 1024)
-		fprintf(stderr, "wrote %.2fMiB\n", bytes / 1024.0 / 1024.0);
-	else if (bytes >= 2048)
-		fprintf(stderr, "wrote %.2fKiB\n", bytes / 1024.0);
-	else
-		fprintf(stderr, "wrote %ldB\n", bytes);
+	/* set feed rates */
+	config.perimeter_feed_rate = GET_FEED_RATE(config.perimeter_feed_rate, config.feed_rate);
+	config.loop_feed_rate = GET_FEED_RATE(config.loop_feed_rate, config.feed_rate);
+	config.solid_infill_feed_rate = GET_FEED_RATE(config.solid_infill_feed_rate, config.feed_rate);
+	config.sparse_infill_feed_rate = GET_FEED_RATE(config.sparse_infill_feed_rate, config.feed_rate);
+	config.support_feed_rate = GET_FEED_RATE(config.support_feed_rate, config.feed_rate);
+	config.iron_feed_rate = GET_FEED_RATE(config.iron_feed_rate, config.solid_infill_feed_rate);
+	config.travel_feed_rate = GET_FEED_RATE(config.travel_feed_rate, config.feed_rate);
+	config.restart_speed = GET_FEED_RATE(config.restart_speed, config.retract_speed);
+	config.solid_infill_retract_threshold = MINIMUM(config.solid_infill_retract_threshold, config.retract_threshold / config.extrusion_width);
 	return 0;
 }
 
-#define GET_FEED_RATE(x, m) (((x) >= 0.0) ? (x) : (m) * -(x))
-
 int main(int argc, char *argv[])
 {
 	int opt, ret;
-	char *path, *output_path = NULL;
+	char *path, *output_path = NULL, *stats_path = NULL;
 	struct object *o;
 	fl_t scale_factor = 1.0, x_translate = 0.0, y_translate = 0.0, z_chop = 0.0;
-	bool print_config = false;
+	bool print_config = false, merge = false;
 
 	/* Parse options */
-	while ((opt = getopt(argc, argv, ":hpo:c:O:S:l:w:t:s:d:n:r:f:b:C:x:y:z:")) != -1) {
+	while ((opt = getopt(argc, argv, ":hpMo:j:c:O:S:l:w:t:s:d:n:r:f:b:C:x:y:z:")) != -1) {
 		char *key, *value;
 		int ret;
 		switch (opt) {
@@ -3099,9 +7062,16 @@ int main(int argc, char *argv[])
 		case 'p':
 			print_config = true;
 			break;
+		case 'M':
+			merge = true;
+			break;
 		case 'o':
 			output_path = optarg;
 			break;
+		case 'j':
+			stats_path = optarg;
+			perf.enabled = true;
+			break;
 		case 'c':
 			ret = read_config(optarg);
 			if (ret == 1)
@@ -3180,50 +7150,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (config.layer_height > config.extrusion_width) {
-		fputs("error: layer_height must not be greater than extrusion_width\n", stderr);
+	if (derive_config_settings(x_translate, y_translate))
 		return 1;
-	}
-
-	config.roof_layers = lround(config.roof_thickness / config.layer_height);
-	config.floor_layers = lround(config.floor_thickness / config.layer_height);
-	if (config.outside_first || config.shells < 2)
-		config.edge_packing_density = 1.0;
-	config.extrusion_area = config.extrusion_width * config.layer_height - (config.layer_height * config.layer_height - config.layer_height * config.layer_height * M_PI_4) * (1.0 - config.packing_density);
-	config.edge_width = (config.extrusion_area - (config.layer_height * config.layer_height * M_PI_4)) / config.layer_height + config.layer_height;
-	config.edge_offset = (config.edge_width + (config.edge_width - config.extrusion_width) * (1.0 - config.edge_packing_density)) / -2.0;
-	config.material_area = config.material_diameter * config.material_diameter * M_PI_4;
-	if (config.z_hop > 0.0 && !config.only_hop_between_islands)
-		config.comb = false;  /* combing is useless if z-hop is enabled */
-	if (config.cool_on_gcode == NULL)
-		config.cool_on_gcode = strdup(DEFAULT_COOL_ON_STR);
-	if (config.cool_off_gcode == NULL)
-		config.cool_off_gcode = strdup(DEFAULT_COOL_OFF_STR);
-	config.x_center += x_translate;
-	config.y_center += y_translate;
-	config.brim_lines = lround(config.brim_width / config.extrusion_width);
-	config.solid_infill_clip_offset = (0.5 + config.shells - config.fill_threshold - config.min_shell_contact) * config.extrusion_width;
-	config.solid_infill_clip_offset = MAXIMUM(config.solid_infill_clip_offset, 0.0);
-	config.xy_extra = (config.extra_offset + config.extrusion_width * config.brim_lines) * 2.0;
-	if (config.generate_support)
-		config.xy_extra += (config.support_xy_expansion + (0.5 + config.support_margin) * config.edge_width - config.edge_offset) * 2.0;
-	const fl_t interface_clip_offset_1 = config.extrusion_width * (1.0 - config.edge_overlap) / 2.0 + (0.5 + config.support_margin) * config.edge_width - config.edge_offset - config.extrusion_width / 8.0;
-	const fl_t interface_clip_offset_2 = tan(config.support_angle / 180.0 * M_PI) * config.layer_height;
-	config.interface_clip_offset = MINIMUM(interface_clip_offset_1, interface_clip_offset_2);
-	if (config.generate_raft) {
-		config.xy_extra += config.raft_xy_expansion * 2.0;
-		config.object_z_extra += config.raft_base_layer_height + config.layer_height * (config.raft_vert_margin + config.raft_interface_layers);
-	}
-	/* set feed rates */
-	config.perimeter_feed_rate = GET_FEED_RATE(config.perimeter_feed_rate, config.feed_rate);
-	config.loop_feed_rate = GET_FEED_RATE(config.loop_feed_rate, config.feed_rate);
-	config.solid_infill_feed_rate = GET_FEED_RATE(config.solid_infill_feed_rate, config.feed_rate);
-	config.sparse_infill_feed_rate = GET_FEED_RATE(config.sparse_infill_feed_rate, config.feed_rate);
-	config.support_feed_rate = GET_FEED_RATE(config.support_feed_rate, config.feed_rate);
-	config.iron_feed_rate = GET_FEED_RATE(config.iron_feed_rate, config.solid_infill_feed_rate);
-	config.travel_feed_rate = GET_FEED_RATE(config.travel_feed_rate, config.feed_rate);
-	config.restart_speed = GET_FEED_RATE(config.restart_speed, config.retract_speed);
-	config.solid_infill_retract_threshold = MINIMUM(config.solid_infill_retract_threshold, config.retract_threshold / config.extrusion_width);
 
 	if (print_config) {
 		fprintf(stderr, "configuration:\n");
@@ -3240,6 +7168,18 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "OpenMP enabled (%d threads)\n", omp_get_max_threads());
 #endif
 
+	if (merge) {
+		if (!output_path) {
+			fputs("error: -M needs an output path (-o)\n", stderr);
+			return 1;
+		}
+		if (optind == argc) {
+			fputs("error: expected partial output paths\n", stderr);
+			return 1;
+		}
+		return merge_gcode(output_path, &argv[optind], argc - optind);
+	}
+
 	if (optind + 1 == argc)
 		path = argv[optind];
 	else if (optind + 1 < argc) {
@@ -3254,36 +7194,62 @@ int main(int argc, char *argv[])
 	}
 
 	fprintf(stderr, "load object...\n");
+	perf.total = start_stage_timer();
 	o = new struct object();
 	ret = read_binary_stl(o, path);
 	if (ret) {
-		fprintf(stderr, "error: failed to read stl: %s: %s\n", path, (ret == 2) ? "short read" : strerror(errno));
+		fprintf(stderr, "error: failed to read stl: %s: %s\n", path, (ret == 3) ? "too many facets" : (ret == 2) ? "short read" : strerror(errno));
 		return 1;
 	}
+	end_stage_timer(&perf.total, "read_stl");
+	perf.triangles = o->n;
 
 	fprintf(stderr, "  polygons = %zd\n", o->n);
+	fprintf(stderr, "  vertices = %zd\n", o->n_v);
 	fprintf(stderr, "  center   = (%f, %f, %f)\n", o->c.x, o->c.y, o->c.z);
 	fprintf(stderr, "  height   = %f\n", o->h);
 	fprintf(stderr, "  width    = %f\n", o->w);
 	fprintf(stderr, "  depth    = %f\n", o->d);
 
 	fprintf(stderr, "scale and translate object...\n");
-	scale_object(o, config.xy_scale_factor * scale_factor, config.xy_scale_factor * scale_factor, config.z_scale_factor * scale_factor);
-	const fl_t z_translate = (config.preserve_layer_offset) ? round((o->h / 2.0 - o->c.z) / config.layer_height) * config.layer_height : o->h / 2.0 - o->c.z;
-	translate_object(o, -o->c.x + config.x_center, -o->c.y + config.y_center, z_translate - z_chop);
+	if (place_object(o, scale_factor, z_chop))
+		return 1;
+	if (!o->copies.empty())
+		fprintf(stderr, "  copies   = %zu\n", o->copies.size());
 	fprintf(stderr, "  center   = (%f, %f, %f)\n", o->c.x, o->c.y, o->c.z);
 	fprintf(stderr, "  height   = %f\n", o->h);
 	fprintf(stderr, "  width    = %f\n", o->w);
 	fprintf(stderr, "  depth    = %f\n", o->d);
 
+	if (is_partial_run()) {
+		const ssize_t n_layers = count_layers(o);
+		const ssize_t end_layer = (config.end_layer < 0) ? n_layers : MINIMUM((ssize_t) config.end_layer, n_layers);
+		if (config.start_layer >= end_layer) {
+			fprintf(stderr, "error: no layers to write: start_layer = %d, end_layer = %d (the object has %zd layers)\n", config.start_layer, config.end_layer, n_layers);
+			return 1;
+		}
+	}
+
 	fprintf(stderr, "slice object...\n");
-	slice_object(o);
-	if (output_path) {
-		if (write_gcode(output_path, o)) {
+	if (config.memory_budget > 0.0 || is_partial_run()) {
+		if (stream_object(o, output_path)) {
 			fprintf(stderr, "error: failed to write gcode output: %s: %s\n", output_path, strerror(errno));
 			return 1;
 		}
 	}
+	else {
+		if (slice_object(o, output_path)) {
+			fprintf(stderr, "error: failed to write gcode output: %s: %s\n", output_path, strerror(errno));
+			return 1;
+		}
+	}
+	if (stats_path) {
+		if (write_perf_report(stats_path, path)) {
+			fprintf(stderr, "error: failed to write stats: %s: %s\n", stats_path, strerror(errno));
+			return 1;
+		}
+		fprintf(stderr, "wrote stats to %s\n", stats_path);
+	}
 
 	return 0;
 }
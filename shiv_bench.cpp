@@ -0,0 +1,810 @@
+/*
+ * Copyright (C) 2016-2019 Michael Barbour <barbour.michael.0@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* shiv-bench: generate synthetic binary STL models and time each stage of the slicing pipeline on them. The
+   stages are static, so shiv.cpp is compiled as part of this file. */
+
+#include <cstdint>
+
+#define main shiv_main
+#include "shiv.cpp"
+#undef main
+
+static const char bench_usage_string[] =
+	"usage: shiv-bench [-hkpv] [-r runs] [-m model[,model...]] [-d model_dir]\n"
+	"                  [-c config_path] [-S setting=value]\n"
+	"\n"
+	"flags:\n"
+	"  -h                    show this help\n"
+	"  -k                    keep the generated models\n"
+	"  -p                    print progress messages while generating and slicing the models\n"
+	"  -v                    check the support maps against the original support map code\n"
+	"  -r runs               run each model this many times and report the best time for each stage\n"
+	"  -m model[,model...]   only run these models\n"
+	"  -d model_dir          directory to write the generated models to (created if missing)\n"
+	"  -c config_path        configuration file path (replaces the default configs)\n"
+	"  -S setting=value      set setting to value for every model\n"
+	"\n"
+	"Without -c, the configs in configs/ next to the shiv-bench executable are used\n"
+	"(in the working directory if shiv-bench was found through PATH).\n";
+
+/* Used when no -c option is given (relative to the directory of the executable) */
+static const char *default_bench_configs[] = {
+	"configs/global",
+	"configs/ultra3d/ultra3d",
+	"configs/ultra3d/left",
+	"configs/ultra3d/inland_pla",
+};
+
+struct bench_point {
+	double x, y, z;
+};
+
+struct bench_mesh {
+	std::vector<float> facets;  /* 9 floats (three vertices) per facet */
+};
+
+enum bench_stage {
+	BENCH_STAGE_READ,
+	BENCH_STAGE_SEGMENTS,
+	BENCH_STAGE_OUTLINES,
+	BENCH_STAGE_INSETS,
+	BENCH_STAGE_INFILL,
+	BENCH_STAGE_SUPPORT,
+	BENCH_STAGE_PLAN,
+	BENCH_STAGE_FORMAT,
+	BENCH_STAGE_WRITE,
+	BENCH_STAGE_COUNT,
+};
+
+enum bench_unit {
+	BENCH_UNIT_TRIANGLES,
+	BENCH_UNIT_LAYERS,
+	BENCH_UNIT_MOVES,
+	BENCH_UNIT_BYTES,
+};
+
+static const struct {
+	const char *name;
+	enum bench_unit unit;
+} bench_stages[BENCH_STAGE_COUNT] = {
+	{ "read_stl",      BENCH_UNIT_TRIANGLES },
+	{ "find_segments", BENCH_UNIT_TRIANGLES },
+	{ "outlines",      BENCH_UNIT_LAYERS },
+	{ "insets",        BENCH_UNIT_LAYERS },
+	{ "infill",        BENCH_UNIT_LAYERS },
+	{ "support",       BENCH_UNIT_LAYERS },
+	{ "planning",      BENCH_UNIT_MOVES },
+	{ "formatting",    BENCH_UNIT_MOVES },
+	{ "writing",       BENCH_UNIT_BYTES },
+};
+
+static const char *bench_unit_names[] = { "triangles/s", "layers/s", "moves/s", "MiB/s" };
+
+struct bench_result {
+	double time[BENCH_STAGE_COUNT];  /* seconds; negative if the stage did not run */
+	ssize_t triangles, layers, moves, bytes;
+};
+
+static void add_facet(struct bench_mesh *m, const struct bench_point &a, const struct bench_point &b, const struct bench_point &c)
+{
+	const struct bench_point *p[3] = { &a, &b, &c };
+	for (int k = 0; k < 3; ++k) {
+		m->facets.push_back((float) p[k]->x);
+		m->facets.push_back((float) p[k]->y);
+		m->facets.push_back((float) p[k]->z);
+	}
+}
+
+/* Add a facet with its normal pointing along 'dir' */
+static void add_oriented_facet(struct bench_mesh *m, const struct bench_point &a, const struct bench_point &b, const struct bench_point &c, const struct bench_point &dir)
+{
+	const double ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+	const double vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+	const double nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+	if (nx * dir.x + ny * dir.y + nz * dir.z < 0.0)
+		add_facet(m, a, c, b);
+	else
+		add_facet(m, a, b, c);
+}
+
+/* Add a facet of a convex solid with its normal pointing away from 'center' */
+static void add_convex_facet(struct bench_mesh *m, const struct bench_point &a, const struct bench_point &b, const struct bench_point &c, const struct bench_point &center)
+{
+	const struct bench_point dir = { (a.x + b.x + c.x) / 3.0 - center.x, (a.y + b.y + c.y) / 3.0 - center.y, (a.z + b.z + c.z) / 3.0 - center.z };
+	add_oriented_facet(m, a, b, c, dir);
+}
+
+struct bench_profile_point {
+	double r, z;
+};
+
+/* Closed solid of revolution around the z axis through (x, y). The profile runs from a point on the axis at
+   the bottom to a point on the axis at the top with the solid on its left. */
+static void add_lathe(struct bench_mesh *m, double x, double y, const std::vector<struct bench_profile_point> &profile, int sides)
+{
+	std::vector<struct bench_point> rings(profile.size() * sides);
+	for (size_t j = 0; j < profile.size(); ++j) {
+		for (int i = 0; i < sides; ++i) {
+			const double a = 2.0 * M_PI * i / sides;
+			rings[j * sides + i] = { x + profile[j].r * cos(a), y + profile[j].r * sin(a), profile[j].z };  /* exactly (x, y) on the axis */
+		}
+	}
+	for (size_t j = 0; j + 1 < profile.size(); ++j) {
+		const double nr = profile[j + 1].z - profile[j].z, nz = profile[j].r - profile[j + 1].r;  /* outward normal of the profile segment */
+		for (int i = 0; i < sides; ++i) {
+			const int ni = (i + 1 == sides) ? 0 : i + 1;
+			const double a = 2.0 * M_PI * (i + 0.5) / sides;
+			const struct bench_point dir = { nr * cos(a), nr * sin(a), nz };
+			const struct bench_point &p00 = rings[j * sides + i], &p01 = rings[j * sides + ni];
+			const struct bench_point &p10 = rings[(j + 1) * sides + i], &p11 = rings[(j + 1) * sides + ni];
+			if (profile[j].r != 0.0)
+				add_oriented_facet(m, p00, p01, p11, dir);
+			if (profile[j + 1].r != 0.0)
+				add_oriented_facet(m, p00, p11, p10, dir);
+		}
+	}
+}
+
+static void add_cylinder(struct bench_mesh *m, double x, double y, double z0, double z1, double r, int sides)
+{
+	add_lathe(m, x, y, { { 0.0, z0 }, { r, z0 }, { r, z1 }, { 0.0, z1 } }, sides);
+}
+
+static void add_sphere(struct bench_mesh *m, const struct bench_point &c, double r, int slices, int stacks)
+{
+	std::vector<struct bench_point> ring((stacks + 1) * slices);
+	for (int j = 0; j <= stacks; ++j) {
+		const double phi = M_PI * j / stacks;
+		for (int i = 0; i < slices; ++i) {
+			const double a = 2.0 * M_PI * i / slices;
+			/* The poles must be a single point */
+			const double rs = (j == 0 || j == stacks) ? 0.0 : r * sin(phi);
+			ring[j * slices + i] = { c.x + rs * cos(a), c.y + rs * sin(a), c.z + r * cos(phi) };
+		}
+	}
+	for (int j = 0; j < stacks; ++j) {
+		for (int i = 0; i < slices; ++i) {
+			const int ni = (i + 1 == slices) ? 0 : i + 1;
+			const struct bench_point &p00 = ring[j * slices + i], &p01 = ring[j * slices + ni];
+			const struct bench_point &p10 = ring[(j + 1) * slices + i], &p11 = ring[(j + 1) * slices + ni];
+			if (j > 0)
+				add_convex_facet(m, p00, p01, p11, c);
+			if (j + 1 < stacks)
+				add_convex_facet(m, p00, p11, p10, c);
+		}
+	}
+}
+
+/* A high-poly sphere: many short segments per layer */
+static void generate_sphere(struct bench_mesh *m)
+{
+	add_sphere(m, { 0.0, 0.0, 25.0 }, 25.0, 512, 256);
+}
+
+/* A solid gyroid lattice (a thickened gyroid surface cut to a cube), polygonized with marching tetrahedra */
+static void generate_gyroid(struct bench_mesh *m)
+{
+	const int n = 60;  /* cells along each axis */
+	const double size = 30.0, period = 10.0, thickness = 0.45;
+	const double h = size / n, k = 2.0 * M_PI / period;
+	const int np = n + 1;
+	std::vector<double> value(np * np * np);
+	for (int z = 0; z < np; ++z) {
+		for (int y = 0; y < np; ++y) {
+			for (int x = 0; x < np; ++x) {
+				const double px = x * h * k, py = y * h * k, pz = z * h * k;
+				double v = fabs(sin(px) * cos(py) + sin(py) * cos(pz) + sin(pz) * cos(px)) - thickness;
+				if (x == 0 || y == 0 || z == 0 || x == n || y == n || z == n)
+					v = 1.0;  /* Close the surface at the edges of the cube */
+				value[(z * np + y) * np + x] = v;
+			}
+		}
+	}
+	/* Split each cell into the six tetrahedra around its main diagonal. Adjacent cells split their shared
+	   faces the same way, so the surface is closed. */
+	static const int tets[6][4] = { { 0, 1, 3, 7 }, { 0, 1, 5, 7 }, { 0, 2, 3, 7 }, { 0, 2, 6, 7 }, { 0, 4, 5, 7 }, { 0, 4, 6, 7 } };
+	auto vertex_index = [&](int x, int y, int z, int c) { return ((z + ((c >> 2) & 1)) * np + y + ((c >> 1) & 1)) * np + x + (c & 1); };
+	auto vertex_point = [&](int i) -> struct bench_point { return { (i % np) * h, (i / np % np) * h, (i / np / np) * h }; };
+	/* Both ends are always taken in the same order so that cells sharing an edge get exactly the same point */
+	auto edge_point = [&](int a, int b) -> struct bench_point {
+		if (a > b)
+			std::swap(a, b);
+		const struct bench_point pa = vertex_point(a), pb = vertex_point(b);
+		const double t = value[a] / (value[a] - value[b]);
+		return { pa.x + (pb.x - pa.x) * t, pa.y + (pb.y - pa.y) * t, pa.z + (pb.z - pa.z) * t };
+	};
+	for (int z = 0; z < n; ++z) {
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				for (const int *tet : tets) {
+					int in[4], out[4], n_in = 0, n_out = 0;
+					for (int c = 0; c < 4; ++c) {
+						const int i = vertex_index(x, y, z, tet[c]);
+						if (value[i] < 0.0)
+							in[n_in++] = i;
+						else
+							out[n_out++] = i;
+					}
+					if (n_in == 0 || n_out == 0)
+						continue;
+					/* The normal points from the inside vertices towards the outside vertices */
+					struct bench_point dir = { 0.0, 0.0, 0.0 };
+					for (int c = 0; c < n_out; ++c) {
+						const struct bench_point p = vertex_point(out[c]);
+						dir.x += p.x / n_out; dir.y += p.y / n_out; dir.z += p.z / n_out;
+					}
+					for (int c = 0; c < n_in; ++c) {
+						const struct bench_point p = vertex_point(in[c]);
+						dir.x -= p.x / n_in; dir.y -= p.y / n_in; dir.z -= p.z / n_in;
+					}
+					if (n_in == 1)
+						add_oriented_facet(m, edge_point(in[0], out[0]), edge_point(in[0], out[1]), edge_point(in[0], out[2]), dir);
+					else if (n_in == 3)
+						add_oriented_facet(m, edge_point(out[0], in[0]), edge_point(out[0], in[1]), edge_point(out[0], in[2]), dir);
+					else {
+						const struct bench_point p0 = edge_point(in[0], out[0]), p1 = edge_point(in[0], out[1]);
+						const struct bench_point p2 = edge_point(in[1], out[1]), p3 = edge_point(in[1], out[0]);
+						add_oriented_facet(m, p0, p1, p2, dir);
+						add_oriented_facet(m, p0, p2, p3, dir);
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Tall thin towers: many layers with little work on each */
+static void generate_towers(struct bench_mesh *m)
+{
+	for (int i = 0; i < 4; ++i)
+		add_cylinder(m, (i % 2) * 15.0, (i / 2) * 15.0, 0.0, 120.0, 3.0, 64);
+}
+
+/* A plate of small pegs: many islands on every layer */
+static void generate_plate(struct bench_mesh *m)
+{
+	for (int y = 0; y < 16; ++y)
+		for (int x = 0; x < 16; ++x)
+			add_cylinder(m, x * 5.0, y * 5.0, 0.0, 4.0, 1.5, 24);
+}
+
+/* Mushrooms (inverted cones on thin stems) with increasingly shallow overhangs */
+static void generate_overhangs(struct bench_mesh *m)
+{
+	for (int y = 0; y < 3; ++y) {
+		for (int x = 0; x < 3; ++x) {
+			const double r = 8.0 + 2.0 * (y * 3 + x), h = 12.0 - (y * 3 + x);
+			add_lathe(m, x * 30.0, y * 30.0, { { 0.0, 0.0 }, { 1.5, 0.0 }, { 1.5, 10.0 }, { r, 10.0 + h }, { r, 12.0 + h }, { 0.0, 12.0 + h } }, 64);
+		}
+	}
+}
+
+/* An inverted cone: every layer overhangs the one below, so support is carried down from every layer to the build
+   plate */
+static void generate_cone(struct bench_mesh *m)
+{
+	add_lathe(m, 0.0, 0.0, { { 0.0, 0.0 }, { 2.0, 0.0 }, { 30.0, 40.0 }, { 0.0, 40.0 } }, 128);
+}
+
+static const struct {
+	const char *name;
+	void (*generate)(struct bench_mesh *);
+	const char *settings[4];  /* applied on top of the configs */
+} bench_models[] = {
+	{ "sphere",    generate_sphere,    { NULL } },
+	{ "gyroid",    generate_gyroid,    { NULL } },
+	{ "towers",    generate_towers,    { NULL } },
+	{ "plate",     generate_plate,     { NULL } },
+	{ "overhangs", generate_overhangs, { "generate_support=true", "support_everywhere=false", NULL } },
+	{ "cone",      generate_cone,      { "generate_support=true", "support_everywhere=true", "support_angle=30", NULL } },
+};
+
+static int write_binary_stl(const struct bench_mesh *m, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return 1;
+	char header[80] = "shiv-bench";
+	const size_t n = m->facets.size() / 9;
+	const uint32_t count = (uint32_t) n;
+	const uint16_t attr = 0;
+	const float normal[3] = { 0.0f, 0.0f, 0.0f };
+	fwrite(header, 1, sizeof(header), f);
+	fwrite(&count, sizeof(count), 1, f);
+	for (size_t i = 0; i < n; ++i) {
+		fwrite(normal, sizeof(float), 3, f);
+		fwrite(&m->facets[i * 9], sizeof(float), 9, f);
+		fwrite(&attr, sizeof(attr), 1, f);
+	}
+	return (fclose(f) == 0) ? 0 : 1;
+}
+
+/* The directory part of 'path', or "." if it has none */
+static std::string dir_name(const char *path)
+{
+	const char *end = strrchr(path, '/');
+#ifdef _WIN32
+	const char *bs = strrchr(path, '\\');
+	if (!end || (bs && bs > end))
+		end = bs;
+#endif
+	return (end) ? std::string(path, end - path + 1) : std::string("./");
+}
+
+/* Create 'path' if it does not exist. Parent directories are not created. */
+static int make_dir(const char *path)
+{
+#ifdef _WIN32
+	if (!CreateDirectoryA(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		fprintf(stderr, "error: failed to create directory: %s\n", path);
+		return 1;
+	}
+#else
+	struct stat st;
+	if (mkdir(path, 0777) && (errno != EEXIST || stat(path, &st) || !S_ISDIR(st.st_mode))) {
+		fprintf(stderr, "error: failed to create directory: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+static void free_object(struct object *o)
+{
+	for (ssize_t i = 0; i < o->n_slices; ++i)
+		free_islands(&o->slices[i]);
+	delete[] o->slices;
+	delete o;
+}
+
+/* The support map code from before extend_support_downward() swept the object once, kept as a reference for -v.
+   Each layer's regions are carried down separately, and the regions of a layer are all kept if one of them reaches
+   the build plate (or always with support_everywhere). The only change is that the nearby support boundaries stop
+   at the top layer instead of reading one layer past it. */
+static void reference_layer_support_map(const struct object *o, ssize_t slice_index, ClipperLib::PolyTree &tree)
+{
+	if (slice_index < config.support_vert_margin + 1)
+		return;
+	ClipperLib::ClipperOffset co(config.offset_miter_limit, config.offset_arc_tolerance);
+	ClipperLib::Clipper c;
+	ClipperLib::Paths clip_paths;
+	for (const struct island &island : o->slices[slice_index - 1].islands)
+		co.AddPaths(island.insets[0], config.outset_join_type, ClipperLib::etClosedPolygon);
+	co.Execute(clip_paths, FL_T_TO_CINT(tan(config.support_angle / 180.0 * M_PI) * config.layer_height));
+	co.Clear();
+	for (const struct island &island : o->slices[slice_index].islands)
+		c.AddPaths(island.insets[0], ClipperLib::ptSubject, true);
+	c.AddPaths(clip_paths, ClipperLib::ptClip, true);
+	c.Execute(ClipperLib::ctDifference, clip_paths, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+	c.Clear();
+	co.AddPaths(clip_paths, ClipperLib::jtSquare, ClipperLib::etClosedPolygon);
+	co.Execute(tree, FL_T_TO_CINT(config.support_xy_expansion + (0.5 + config.support_margin) * config.edge_width - config.edge_offset));
+}
+
+static void reference_extend_support_downward(const struct object *o, const ClipperLib::PolyNode *n, ssize_t slice_index, ClipperLib::Paths *clipped_paths)
+{
+	ClipperLib::Paths p, tmp;
+	p.push_back(n->Contour);
+	for (const ClipperLib::PolyNode *c : n->Childs)
+		p.push_back(c->Contour);
+	for (ssize_t k = slice_index; k >= 0; --k) {
+		ClipperLib::Clipper c;
+		c.AddPaths(p, ClipperLib::ptSubject, true);
+		for (ssize_t i = (k >= config.support_vert_margin) ? -config.support_vert_margin : -k; k + i < o->n_slices && i <= config.support_vert_margin; ++i)
+			c.AddPaths(o->slices[k + i].support_boundaries, ClipperLib::ptClip, true);
+		c.Execute(ClipperLib::ctDifference, tmp, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+		clipped_paths[k].insert(clipped_paths[k].end(), tmp.begin(), tmp.end());
+		if (tmp.size() == 0)
+			break;
+	}
+}
+
+static void reference_support_map_clipped_paths(const struct object *o, const ClipperLib::PolyNode *n, ssize_t slice_index, ClipperLib::Paths *clipped_paths)
+{
+	for (const ClipperLib::PolyNode *c : n->Childs) {
+		reference_extend_support_downward(o, c, slice_index, clipped_paths);
+		for (const ClipperLib::PolyNode *cc : c->Childs)
+			reference_support_map_clipped_paths(o, cc, slice_index, clipped_paths);
+	}
+}
+
+/* Remove support wherever the object is present on the same layer or any layer below. This is the footprint of
+   slice_object() (see struct support_footprint) as parallel loops instead of graph tasks, so that it can be timed as
+   part of the support stage. */
+static void remove_supports_not_touching_build_plate(struct object *o)
+{
+	const ssize_t n_chunks = (o->n_slices + SUPPORT_FOOTPRINT_CHUNK_LAYERS - 1) / SUPPORT_FOOTPRINT_CHUNK_LAYERS;
+	std::vector<struct support_footprint> footprint(n_chunks);  /* Footprint of all layers below each chunk */
+	ssize_t c;
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (c = 1; c < n_chunks; ++c)
+		extend_support_footprint(o, footprint[c].paths, (c - 1) * SUPPORT_FOOTPRINT_CHUNK_LAYERS, c * SUPPORT_FOOTPRINT_CHUNK_LAYERS);
+	for (c = 2; c < n_chunks; ++c)
+		add_support_footprint_prefix(footprint[c - 1].paths, footprint[c].paths);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (c = 0; c < n_chunks; ++c)
+		clip_support_chunk_to_footprint(o, &footprint[c], c);
+}
+
+/* Must be called before the support boundaries are freed */
+static void reference_support_maps(struct object *o, std::vector<ClipperLib::Paths> &maps)
+{
+	std::vector<ClipperLib::Paths *> clipped_paths(o->n_slices);
+	ssize_t i;
+	maps.assign(o->n_slices, ClipperLib::Paths());
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (i = 0; i < o->n_slices; ++i) {
+		ClipperLib::PolyTree tree;
+		reference_layer_support_map(o, i, tree);
+		clipped_paths[i] = new ClipperLib::Paths[i + 1]();
+		reference_support_map_clipped_paths(o, &tree, i, clipped_paths[i]);
+	}
+	for (i = 0; i < o->n_slices; ++i) {
+		if (config.support_everywhere || clipped_paths[i][0].size() > 0)
+			for (ssize_t k = 0; k <= i; ++k)
+				maps[k].insert(maps[k].end(), clipped_paths[i][k].begin(), clipped_paths[i][k].end());
+		delete[] clipped_paths[i];
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (i = 0; i < o->n_slices; ++i)
+		ClipperLib::SimplifyPolygons(maps[i], ClipperLib::pftNonZero);
+	/* remove_supports_not_touching_build_plate() unions the footprint in a different order than the original code,
+	   which moves some vertices, so it is used here too and only the propagation is checked */
+	if (!config.support_everywhere) {
+		for (i = 0; i < o->n_slices; ++i)
+			maps[i].swap(o->slices[i].support_map);
+		remove_supports_not_touching_build_plate(o);
+		for (i = 0; i < o->n_slices; ++i)
+			maps[i].swap(o->slices[i].support_map);
+	}
+}
+
+/* A layer's support map may differ from the reference by this much (the area of their symmetric difference) */
+#define SUPPORT_CHECK_ABS_TOLERANCE 0.01   /* mm^2 */
+#define SUPPORT_CHECK_REL_TOLERANCE 0.001  /* fraction of the reference map's area */
+
+/* Compare the support maps with 'maps' and report the layers whose symmetric difference with the reference is more
+   than the tolerance. The single sweep clips the union of the carried regions instead of each region on its own, so
+   the rounded vertices and a few regions that stop being carried at a different layer are expected to differ. */
+static int check_support_maps(const struct object *o, const std::vector<ClipperLib::Paths> &maps)
+{
+	const double scale = config.scale_constant * config.scale_constant;
+	ssize_t bad_layers = 0, moved_layers = 0;
+	double total = 0.0, max_area = 0.0;
+	for (ssize_t i = 0; i < o->n_slices; ++i) {
+		ClipperLib::Clipper c;
+		ClipperLib::Paths diff;
+		c.AddPaths(maps[i], ClipperLib::ptSubject, true);
+		c.AddPaths(o->slices[i].support_map, ClipperLib::ptClip, true);
+		c.Execute(ClipperLib::ctXor, diff, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+		double area = 0.0, ref_area = 0.0;
+		for (const ClipperLib::Path &p : diff)
+			area += ClipperLib::Area(p) / scale;
+		for (const ClipperLib::Path &p : maps[i])
+			ref_area += ClipperLib::Area(p) / scale;
+		area = fabs(area);
+		total += area;
+		max_area = MAXIMUM(max_area, area);
+		if (maps[i] != o->slices[i].support_map)
+			++moved_layers;
+		if (area > SUPPORT_CHECK_ABS_TOLERANCE + SUPPORT_CHECK_REL_TOLERANCE * fabs(ref_area)) {
+			fprintf(stderr, "error: support map differs from the reference at layer %zd (%.4fmm^2 of %.4fmm^2)\n", i, area, fabs(ref_area));
+			++bad_layers;
+		}
+	}
+	fprintf(stderr, "support check: %zd of %zd layers differ by more than the tolerance, %zd differ at all (%.4fmm^2 total, %.4fmm^2 at most)\n",
+		bad_layers, o->n_slices, moved_layers, total, max_area);
+	return (bad_layers > 0) ? 1 : 0;
+}
+
+/* Run every stage once, in the order slice_object() runs them for a single layer, but with each one
+   finished for every layer before the next starts so that they can be timed separately */
+static int run_pipeline(const char *stl_path, const char *gcode_path, bool check_support, struct bench_result *r)
+{
+	double start, check_time = 0.0;
+	std::vector<ClipperLib::Paths> reference_maps;
+	struct object *o = new struct object();
+	for (double &t : r->time)
+		t = -1.0;
+
+	start = get_wall_time();
+	if (read_binary_stl(o, stl_path)) {
+		fprintf(stderr, "error: failed to read stl: %s\n", stl_path);
+		return 1;
+	}
+	r->time[BENCH_STAGE_READ] = get_wall_time() - start;
+	r->triangles = o->n;
+	if (place_object(o, 1.0, 0.0))
+		return 1;
+
+	start = get_wall_time();
+	find_object_segments(o);
+	r->time[BENCH_STAGE_SEGMENTS] = get_wall_time() - start;
+	r->layers = o->n_slices;
+
+	start = get_wall_time();
+	generate_layer_outlines(o, 0, o->n_slices);
+	r->time[BENCH_STAGE_OUTLINES] = get_wall_time() - start;
+	free(o->adj);
+
+	start = get_wall_time();
+	generate_layer_insets(o, 0, o->n_slices);
+	r->time[BENCH_STAGE_INSETS] = get_wall_time() - start;
+
+	start = get_wall_time();
+	generate_infill_patterns(o);
+	generate_layer_infill(o, 0, o->n_slices);
+	r->time[BENCH_STAGE_INFILL] = get_wall_time() - start;
+
+	if (config.generate_support) {
+		start = get_wall_time();
+		generate_layer_support_boundaries(o, 0, o->n_slices);
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+		for (ssize_t i = 0; i < o->n_slices; ++i)
+			generate_layer_support_map(o, i);
+		if (check_support) {
+			check_time = get_wall_time();
+			reference_support_maps(o, reference_maps);
+			check_time = get_wall_time() - check_time;
+		}
+		extend_support_downward(o);
+		if (!config.support_everywhere)
+			remove_supports_not_touching_build_plate(o);
+		free_support_boundaries(o);
+		if (config.interface_roof_layers > 0 || config.interface_floor_layers > 0)
+			for (ssize_t i = 0; i < o->n_slices; ++i)
+				generate_support_interface_clip_regions(&o->slices[i]);
+		generate_layer_support_lines(o, 0, o->n_slices);
+		r->time[BENCH_STAGE_SUPPORT] = get_wall_time() - start - check_time;
+		if (check_support && check_support_maps(o, reference_maps))
+			return 1;
+		FREE_VECTOR(reference_maps);
+		for (ssize_t i = 0; i < o->n_slices; ++i)
+			FREE_VECTOR(o->slices[i].support_interface_clip);
+	}
+	if (config.brim_lines > 0)
+		generate_brim(o);
+	if (config.generate_raft)
+		generate_raft(o);
+	if (config.generate_support)
+		for (ssize_t i = 0; i < o->n_slices; ++i)
+			FREE_VECTOR(o->slices[i].support_map);
+
+	std::vector<struct g_move> last_moves(o->n_slices);
+	std::vector<char> has_moves(o->n_slices);
+	start = get_wall_time();
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = 0; i < o->n_slices; ++i) {
+		struct slice *slice = &o->slices[i];
+		NEW_PLAN_MACHINE(plan_m, o);
+		plan_moves(o, slice, i, &plan_m);
+		do_retract(slice, &plan_m, true);
+		has_moves[i] = slice->moves.size() > 0;
+		if (has_moves[i])
+			last_moves[i] = slice->moves.back();
+	}
+	r->time[BENCH_STAGE_PLAN] = get_wall_time() - start;
+	r->moves = 0;
+	for (ssize_t i = 0; i < o->n_slices; ++i)
+		r->moves += o->slices[i].moves.size();
+
+	start = get_wall_time();
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ssize_t i = 0; i < o->n_slices; ++i) {
+		struct slice *slice = &o->slices[i];
+		if (i > 0 && has_moves[i] && has_moves[i - 1])
+			update_first_move(slice, last_moves[i - 1]);
+		export_layer(slice, i);
+	}
+	r->time[BENCH_STAGE_FORMAT] = get_wall_time() - start;
+
+	FILE *f = fopen(gcode_path, "wb");
+	if (!f) {
+		fprintf(stderr, "error: failed to open %s: %s\n", gcode_path, strerror(errno));
+		return 1;
+	}
+	start = get_wall_time();
+	write_gcode_header(f, NULL);
+	for (ssize_t i = 0; i < o->n_slices; ++i)
+		write_layer(f, &o->slices[i], i);
+	r->bytes = write_gcode_footer(f, 0.0, 0.0);
+	fclose(f);
+	r->time[BENCH_STAGE_WRITE] = get_wall_time() - start;
+	remove(gcode_path);
+
+	free_object(o);
+	return 0;
+}
+
+/* Reset the configuration to the defaults and apply the configs, the model settings and the -S settings */
+static int load_bench_config(const std::vector<const char *> &configs, const char * const *model_settings, const std::vector<const char *> &settings)
+{
+	config = decltype(config)();
+	for (const char *path : configs) {
+		const int ret = read_config(path);
+		if (ret == 1)
+			fprintf(stderr, "error: failed to open config file: %s: %s\n", path, strerror(errno));
+		if (ret)
+			return 1;
+	}
+	for (int pass = 0; pass < 2; ++pass) {
+		const char * const *list = (pass == 0) ? model_settings : settings.data();
+		const size_t n = (pass == 0) ? LENGTH(bench_models[0].settings) : settings.size();
+		for (size_t i = 0; i < n && list[i]; ++i) {
+			char *key = strdup(list[i]);
+			char *value = isolate(key, '=');
+			const int ret = set_config_setting(key, value, 0, NULL);
+			free(key);
+			if (ret)
+				return 1;
+		}
+	}
+	return derive_config_settings(0.0, 0.0);
+}
+
+static bool model_selected(const char *list, const char *name)
+{
+	if (!list)
+		return true;
+	const size_t len = strlen(name);
+	for (const char *p = list; *p;) {
+		const char *end = strchr(p, ',');
+		const size_t n = (end) ? (size_t) (end - p) : strlen(p);
+		if (n == len && strncmp(p, name, n) == 0)
+			return true;
+		p += n + ((end) ? 1 : 0);
+	}
+	return false;
+}
+
+static void print_bench_result(const char *name, const struct bench_result *r)
+{
+	for (int s = 0; s < BENCH_STAGE_COUNT; ++s) {
+		if (r->time[s] < 0.0)
+			continue;
+		double amount = 0.0;
+		switch (bench_stages[s].unit) {
+		case BENCH_UNIT_TRIANGLES: amount = r->triangles; break;
+		case BENCH_UNIT_LAYERS:    amount = r->layers; break;
+		case BENCH_UNIT_MOVES:     amount = r->moves; break;
+		case BENCH_UNIT_BYTES:     amount = r->bytes / 1024.0 / 1024.0; break;
+		}
+		const double rate = (r->time[s] > 0.0) ? amount / r->time[s] : 0.0;
+		printf("%-10s %-14s %10.4f %14.1f %s\n", name, bench_stages[s].name, r->time[s], rate, bench_unit_names[bench_stages[s].unit]);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, runs = 3;
+	const char *model_list = NULL, *model_dir = ".";
+	bool keep_models = false, check_support = false, progress = false;
+	std::vector<const char *> configs, settings;
+	std::vector<std::string> default_configs;
+
+	while ((opt = getopt(argc, argv, ":hkpvr:m:d:c:S:")) != -1) {
+		switch (opt) {
+		case 'h':
+			fputs(bench_usage_string, stderr);
+			return 0;
+		case 'k':
+			keep_models = true;
+			break;
+		case 'p':
+			progress = true;
+			break;
+		case 'v':
+			check_support = true;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			if (runs < 1) {
+				fputs("error: runs must be at least 1\n", stderr);
+				return 1;
+			}
+			break;
+		case 'm':
+			model_list = optarg;
+			break;
+		case 'd':
+			model_dir = optarg;
+			break;
+		case 'c':
+			configs.push_back(optarg);
+			break;
+		case 'S':
+			settings.push_back(optarg);
+			break;
+		default:
+			if (opt == ':')
+				fprintf(stderr, "error: expected argument to option '%c'\n", optopt);
+			else
+				fprintf(stderr, "error: illegal option '%c'\n", optopt);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		fputs(bench_usage_string, stderr);
+		return 1;
+	}
+	if (configs.empty()) {
+		const std::string dir = dir_name(argv[0]);
+		for (const char *path : default_bench_configs)
+			default_configs.push_back(dir + path);
+		for (const std::string &path : default_configs)
+			configs.push_back(path.c_str());
+	}
+	if (make_dir(model_dir))
+		return 1;
+	show_progress = progress;
+#ifdef _OPENMP
+	fprintf(stderr, "OpenMP enabled (%d threads)\n", omp_get_max_threads());
+#endif
+
+	printf("%-10s %-14s %10s %14s\n", "model", "stage", "seconds", "rate");
+	for (size_t i = 0; i < LENGTH(bench_models); ++i) {
+		if (!model_selected(model_list, bench_models[i].name))
+			continue;
+		const std::string stl_path = std::string(model_dir) + "/bench_" + bench_models[i].name + ".stl";
+		const std::string gcode_path = std::string(model_dir) + "/bench_" + bench_models[i].name + ".gcode";
+		struct bench_mesh mesh;
+		if (progress)
+			fprintf(stderr, "generate %s...", bench_models[i].name);
+		bench_models[i].generate(&mesh);
+		if (write_binary_stl(&mesh, stl_path.c_str())) {
+			fprintf(stderr, "%serror: failed to write stl: %s: %s\n", (progress) ? "\n" : "", stl_path.c_str(), strerror(errno));
+			return 1;
+		}
+		if (progress)
+			fprintf(stderr, " done (%zu facets)\n", mesh.facets.size() / 9);
+		FREE_VECTOR(mesh.facets);
+
+		struct bench_result best = {};
+		for (int run = 0; run < runs; ++run) {
+			struct bench_result r;
+			if (load_bench_config(configs, bench_models[i].settings, settings))
+				return 1;
+			if (run_pipeline(stl_path.c_str(), gcode_path.c_str(), check_support, &r))
+				return 1;
+			if (run == 0)
+				best = r;
+			for (int s = 0; s < BENCH_STAGE_COUNT; ++s)
+				best.time[s] = MINIMUM(best.time[s], r.time[s]);
+		}
+		print_bench_result(bench_models[i].name, &best);
+		if (!keep_models)
+			remove(stl_path.c_str());
+	}
+
+	return 0;
+}